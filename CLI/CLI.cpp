@@ -30,6 +30,10 @@
 
 #include <UMTSConfig.h>
 #include <TransactionTable.h>
+#include <ControlCommon.h>
+#include <MediaEngine.h>
+#include <RTPPortAllocator.h>
+#include <SIPInterface.h>
 #include <UMTSLogicalChannel.h>
 #include <MemoryLeak.h>
 
@@ -45,6 +49,7 @@ using namespace CommandLine;
 namespace UMTS {
 	extern CommandLine::CLIStatus rrcTest(int argc, char **argv, std::ostream& os);
 	extern CommandLine::CLIStatus rlcTest(int argc, char **argv, std::ostream& os);
+	extern CommandLine::CLIStatus rlcStats(int argc, char **argv, std::ostream& os);
 };
 #if 0
 namespace SGSN {
@@ -1244,6 +1249,166 @@ static CLIStatus memStat(int argc, char **argv, ostream&os)
 }
 
 
+static CLIStatus transdb(int argc, char **argv, ostream&os)
+{
+	if (argc!=1) return BAD_NUM_ARGS;
+	gTransactionTable.DBWriterText(os);
+	return SUCCESS;
+}
+
+
+static CLIStatus media(int argc, char **argv, ostream&os)
+{
+	if (argc!=1) return BAD_NUM_ARGS;
+	gMediaEngine.text(os);
+	return SUCCESS;
+}
+
+
+static CLIStatus rtpports(int argc, char **argv, ostream&os)
+{
+	if (argc!=1) return BAD_NUM_ARGS;
+	gRTPPortAllocator.text(os);
+	return SUCCESS;
+}
+
+
+static CLIStatus sip(int argc, char **argv, ostream&os)
+{
+	if (argc!=1) return BAD_NUM_ARGS;
+	gSIPInterface.text(os);
+	return SUCCESS;
+}
+
+
+static CLIStatus dcch(int argc, char **argv, ostream&os)
+{
+	if (argc!=1) return BAD_NUM_ARGS;
+	Control::DCCHDispatcherText(os);
+	return SUCCESS;
+}
+
+
+/**
+	Time the indexed TransactionTable lookups with a large number of fake transactions in the table.
+	The transactions go in a private table on a scratch database, not gTransactionTable.
+	The table is made once and never deleted, because its database writer thread never exits.
+*/
+static CLIStatus transBench(int argc, char **argv, ostream&os)
+{
+	if (argc>2) return BAD_NUM_ARGS;
+	unsigned numTrans = argc==2 ? atoi(argv[1]) : 10000;
+	if (numTrans==0) return BAD_VALUE;
+	const unsigned reps = 10;
+	static string path = format("/tmp/OpenBTS-UMTS-transbench-%d.db",getpid());
+	static TransactionTable &table = *new TransactionTable(path.c_str());
+
+	Timeval start;
+	vector<TransactionEntry*> trans;
+	vector<GSM::L3MobileIdentity> ids;
+	vector<string> callIDs;
+	for (unsigned n = 0; n < numTrans; n++) {
+		string IMSI = format("00101%010u",n);
+		ids.push_back(GSM::L3MobileIdentity(IMSI.c_str()));
+		TransactionEntry *t = new TransactionEntry(gConfig.getStr("SIP.Proxy.SMS").c_str(),
+			ids[n], NULL, GSM::L3CMServiceType::UndefinedType, 0);
+		table.add(t);
+		t->SIPUser(IMSI.c_str());
+		callIDs.push_back(t->SIPCallID());
+		trans.push_back(t);
+	}
+	long addMs = start.elapsed();
+
+	unsigned found = 0;
+	unsigned rep;
+	start.now();
+	for (rep = 0; rep < reps || start.elapsed() < 1000; rep++) {
+		for (unsigned n = 0; n < numTrans; n++) { found += table.find(ids[n],GSM::MOCInitiated) == trans[n]; }
+	}
+	long stateMs = start.elapsed();
+	start.now();
+	for (unsigned rep = 0; rep < reps; rep++) {
+		for (unsigned n = 0; n < numTrans; n++) { found += table.find(ids[n],callIDs[n].c_str()) == trans[n]; }
+	}
+	long callIDMs = start.elapsed();
+	start.now();
+	for (unsigned rep = 0; rep < reps; rep++) {
+		for (unsigned n = 0; n < numTrans; n++) { found += table.findChannel(ids[n]) == NULL; }
+	}
+	long chanMs = start.elapsed();
+
+	start.now();
+	for (unsigned n = 0; n < numTrans; n++) { table.remove(trans[n]); }
+	long removeMs = start.elapsed();
+
+	double lookups = (double) reps * numTrans;
+	os << "transaction table benchmark with " << numTrans << " transactions, found " << found << " of " << (unsigned)(3*lookups) << endl;
+	os << format("  add:               %8.0f /sec", 1000.0 * numTrans / max(addMs,1L)) << endl;
+	os << format("  by ID and state:   %8.0f lookups/sec", 1000.0 * lookups / max(stateMs,1L)) << endl;
+	os << format("  by ID and call-ID: %8.0f lookups/sec", 1000.0 * lookups / max(callIDMs,1L)) << endl;
+	os << format("  findChannel:       %8.0f lookups/sec", 1000.0 * lookups / max(chanMs,1L)) << endl;
+	os << format("  remove:            %8.0f /sec", 1000.0 * numTrans / max(removeMs,1L)) << endl;
+	return SUCCESS;
+}
+
+
+/**
+	Run location-update style TMSI table traffic against a scratch table; return updates/sec.
+	The updates are repeated at least reps times and for at least a second,
+	so the cached rate is not taken from a run of a few ms.
+*/
+static double tmsiLoad(TMSITable &table, unsigned numSubs, unsigned reps, ostream &os)
+{
+	Timeval start;
+	for (unsigned n = 0; n < numSubs; n++) {
+		table.assign(format("00101%010u",n).c_str());
+	}
+	long assignUs = start.elapsedUsecs();
+
+	// A location update from a known subscriber: TMSI->IMSI, then IMSI->TMSI.
+	unsigned found = 0;
+	unsigned rep;
+	start.now();
+	for (rep = 0; rep < reps || start.elapsed() < 1000; rep++) {
+		for (unsigned n = 0; n < numSubs; n++) {
+			string IMSI = format("00101%010u",n);
+			unsigned TMSI = table.TMSI(IMSI.c_str());
+			char *IMSI2 = table.IMSI(TMSI);
+			if (IMSI2 && IMSI==IMSI2) found++;
+			free(IMSI2);
+			found += table.assign(IMSI.c_str()) == TMSI;
+		}
+	}
+	long luUs = start.elapsedUsecs();
+	double rate = 1e6 * rep * numSubs / max(luUs,1L);
+	os << format("  new subscribers %8.0f /sec, location updates %8.0f /sec, %u of %u lookups matched",
+		1e6 * numSubs / max(assignUs,1L), rate, found, 2*rep*numSubs) << endl;
+	return rate;
+}
+
+
+/** Compare the TMSI table with and without its in-memory cache, each on a scratch database. */
+static CLIStatus tmsiBench(int argc, char **argv, ostream&os)
+{
+	if (argc>2) return BAD_NUM_ARGS;
+	unsigned numSubs = argc==2 ? atoi(argv[1]) : 2000;
+	if (numSubs==0) return BAD_VALUE;
+	const unsigned reps = 5;
+	string path = format("/tmp/OpenBTS-UMTS-tmsibench-%d.db",getpid());
+	double rate[2];
+	for (unsigned cached = 0; cached < 2; cached++) {
+		unlink(path.c_str());
+		os << (cached ? "with cache:" : "without cache:") << endl;
+		TMSITable table(path.c_str());
+		table.cacheSize(cached ? numSubs : 0);
+		rate[cached] = tmsiLoad(table,numSubs,reps,os);
+	}
+	unlink(path.c_str());
+	os << format("  speedup %.1fx", rate[1] / max(rate[0],1.0)) << endl;
+	return SUCCESS;
+}
+
+
 static CLIStatus crashme(int argc, char** argv, ostream& os)
 {
 	char *nullp = 0x0;
@@ -1321,7 +1486,15 @@ void Parser::addCommands()
 	//addCommand("stats", stats,"[patt] OR clear -- print all, or selected, performance counters, OR clear all counters");
 	addCommand("rlctest", UMTS::rlcTest, "-- internal testing commands for UMTS");
 	addCommand("rrctest", UMTS::rrcTest, "-- internal testing commands for UMTS");
+	addCommand("rlcstat", UMTS::rlcStats, "[-t|-h] -- print RLC queue delay and AQM drop/mark counts for each UE radio bearer; -t as key=value telemetry for each user data RB, -h with the delay histograms");
 	addCommand("memstat", memStat, "-- internal testing command: print memory use stats");
+	addCommand("tmsibench", tmsiBench, "[n] -- internal testing command: location updates/sec for n subscribers, default 2000, with and without the TMSI cache, on a scratch database");
+	addCommand("transdb", transdb, "-- print the transaction table database writer queue depth and write latency");
+	addCommand("media", media, "-- print the media engine tick timing and the jitter and late frames of each call");
+	addCommand("rtpports", rtpports, "-- print RTP port pool occupancy and allocation counters");
+	addCommand("sip", sip, "-- print SIP interface receive batching and drop counters");
+	addCommand("dcch", dcch, "-- print the DCCH dispatcher threads and the DCCH FIFO queueing latency");
+	addCommand("transbench", transBench, "[n] -- internal testing command: time transaction table lookups with n fake transactions, default 10000");
 }
 
 
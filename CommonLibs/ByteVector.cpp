@@ -13,6 +13,9 @@
  */
 
 #include "ByteVector.h"
+#include "Threads.h"
+#include "Utils.h"
+#include <vector>
 
 // Set the char[2] array at ip to a 16-bit int value, swizzling bytes as needed for network order.
 void sethtons(ByteType *cp,unsigned value)
@@ -46,11 +49,102 @@ uint32_t getntohl(ByteType *cp)
 	return ntohl(tmp);
 }
 
+#if BYTEVECTOR_REFCNT
+// The packet pool: blocks of sPacketBlockBytes, big enough for an IP packet of the largest
+// GGSN.IP.MaxPacketSize plus some headroom, recycled through a free list so the
+// downlink does not go to the heap for every packet.
+static const unsigned sPacketBlockBytes = 2048;
+static const unsigned sPacketPoolMaxFree = 1024;	// Blocks beyond this are deleted when freed.
+static Mutex sPacketPoolLock;
+static std::vector<ByteType*> sPacketPoolFree;
+static unsigned long sPacketPoolAllocs = 0, sPacketPoolReuses = 0;
+static unsigned sPacketPoolInUse = 0, sPacketPoolMaxInUse = 0;
+
+void ByteVector::allocPacket(size_t headroom, size_t size)
+{
+	clear();
+	if (headroom + size > sPacketBlockBytes - mDataOffset) {
+		init(headroom + size);
+		setBlockKind(BlockPacketHeap);
+		trimLeft(headroom);
+		setAppendP(0);
+		return;
+	}
+	{
+		ScopedLock lock(sPacketPoolLock);
+		sPacketPoolAllocs++;
+		if (++sPacketPoolInUse > sPacketPoolMaxInUse) { sPacketPoolMaxInUse = sPacketPoolInUse; }
+		if (sPacketPoolFree.size()) {
+			sPacketPoolReuses++;
+			mData = sPacketPoolFree.back();
+			sPacketPoolFree.pop_back();
+		}
+	}
+	if (!mData) {
+		RN_MEMCHKNEW(ByteVectorData)
+		mData = new ByteType[sPacketBlockBytes];
+	}
+	setRefCnt(1);
+	setBlockKind(BlockPacketPool);
+	mStart = mData + mDataOffset + headroom;
+	mAllocEnd = mStart + size;
+	mSizeBits = 0;
+}
+
+static void packetPoolFree(ByteType *data)
+{
+	{
+		ScopedLock lock(sPacketPoolLock);
+		sPacketPoolInUse--;
+		if (sPacketPoolFree.size() < sPacketPoolMaxFree) {
+			sPacketPoolFree.push_back(data);
+			return;
+		}
+	}
+	delete[] data;
+	RN_MEMCHKDEL(ByteVectorData)
+}
+
+void ByteVector::packetPoolText(std::ostream &os)
+{
+	ScopedLock lock(sPacketPoolLock);
+	os << format("packet pool: %u blocks in use, max %u, %u free; %lu allocations, %lu from the free list\n",
+		sPacketPoolInUse,sPacketPoolMaxInUse,(unsigned)sPacketPoolFree.size(),sPacketPoolAllocs,sPacketPoolReuses);
+}
+#endif
+
+PacketStage *PacketStage::sStages = NULL;
+
+PacketStage::PacketStage(const char *wName)
+	: mName(wName), mByRef(0), mCopied(0), mCopies(0), mCopiedBytes(0), mNext(NULL)
+{
+	// Stages must be file scope statics: their constructors run one at a time before main,
+	// so this needs no lock.  A function local one would be built on a packet thread while
+	// text() may be walking the list.
+	PacketStage **pp = &sStages;
+	while (*pp) { pp = &(*pp)->mNext; }
+	*pp = this;
+}
+
+void PacketStage::text(std::ostream &os)
+{
+	for (PacketStage *sp = sStages; sp; sp = sp->mNext) {
+		os << format("  %-12s arrived by reference %lu, copied %lu; copies made here %lu, %lu bytes\n",
+			sp->mName,sp->mByRef,sp->mCopied,sp->mCopies,sp->mCopiedBytes);
+	}
+}
+
 void ByteVector::clear()
 {
 	if (mData) {
 #if BYTEVECTOR_REFCNT
-		if (decRefCnt() <= 0) { delete[] mData; RN_MEMCHKDEL(ByteVectorData) }
+		if (decRefCnt() <= 0) {
+			if (blockKind() == BlockPacketPool) {
+				packetPoolFree(mData);
+			} else {
+				delete[] mData; RN_MEMCHKDEL(ByteVectorData)
+			}
+		}
 #else
 		delete[] mData;
 #endif
@@ -69,6 +163,7 @@ void ByteVector::init(size_t size)
 		RN_MEMCHKNEW(ByteVectorData)
 		mData = new ByteType[size + mDataOffset];
 		setRefCnt(1);
+		setBlockKind(BlockHeap);
 		mStart = mData + mDataOffset;
 #else
 		mData = new ByteType[size];
@@ -88,11 +88,15 @@ class ByteVector : public ItemWithSize, public MemCheckByteVector
 
 #if BYTEVECTOR_REFCNT
 	// The first mDataOffset bytes of mData is a short reference count of the number
-	// of ByteVectors pointing at it.
-	static const int mDataOffset = sizeof(short);
+	// of ByteVectors pointing at it, and a short saying where the block came from, one of BlockKind.
+	// The count is changed atomically, because packets are passed between threads by reference.
+	static const int mDataOffset = 2*sizeof(short);
+	enum BlockKind { BlockHeap, BlockPacketPool, BlockPacketHeap };
 	int setRefCnt(int val) { return ((short*)mData)[0] = val; }
-	int decRefCnt() { return setRefCnt(((short*)mData)[0] - 1); }
-	void incRefCnt() { setRefCnt(((short*)mData)[0] + 1); }
+	int decRefCnt() { return __atomic_sub_fetch((short*)mData,1,__ATOMIC_ACQ_REL); }
+	void incRefCnt() { __atomic_add_fetch((short*)mData,1,__ATOMIC_RELAXED); }
+	BlockKind blockKind() const { return (BlockKind)((short*)mData)[1]; }
+	void setBlockKind(BlockKind kind) { ((short*)mData)[1] = kind; }
 #endif
 
 
@@ -111,6 +115,18 @@ class ByteVector : public ItemWithSize, public MemCheckByteVector
 
 	public:
 	void clear();	// Release the memory used by this ByteVector.
+#if BYTEVECTOR_REFCNT
+	// Make this an empty ByteVector with room for size bytes in a block from the packet pool,
+	// with headroom bytes free in front of it for growLeft.
+	// The block goes back to the pool when the last ByteVector using it is cleared.
+	// If headroom+size does not fit in a pool block it is allocated as usual.
+	void allocPacket(size_t headroom, size_t size);
+	// Is the data still in the block allocPacket put it in, or has it been copied?
+	bool isPacket() const { return mData && blockKind() != BlockHeap; }
+	// Bytes free in front of the data for growLeft; 0 for a segment that does not own its memory.
+	size_t headroom() const { return mData ? mStart - (mData + mDataOffset) : 0; }
+	static void packetPoolText(std::ostream &os);
+#endif
 	// clone semantics are weird: copies data from other to self.
 	void clone(const ByteVector& other); /** Copy data from another vector. */
 #if BYTEVECTOR_REFCNT
@@ -380,6 +396,34 @@ class ByteVectorTemp : public ByteVector
 	ByteVectorTemp(BitVector &) { assert(0); }
 };
 
+// One stage of a packet path, such as the downlink from the GGSN to RLC.
+// Each stage counts the packets that arrive still in the block they were read into
+// and the ones that arrive copied, plus any copies it makes itself,
+// so it can be seen which stages copy.  Stages are file scope static objects, listed in construction order.
+class PacketStage
+{
+	const char *mName;
+	unsigned long mByRef;		// Packets that arrived in their allocPacket block.
+	unsigned long mCopied;		// Packets that arrived in some other memory.
+	unsigned long mCopies;		// Copies made by this stage.
+	unsigned long mCopiedBytes;	// Bytes copied by this stage.
+	PacketStage *mNext;
+	static PacketStage *sStages;
+
+	public:
+	PacketStage(const char *wName);
+	// A packet arrives at this stage.
+	void arrive(const ByteVector &packet) {
+		__atomic_fetch_add(packet.isPacket() ? &mByRef : &mCopied,1,__ATOMIC_RELAXED);
+	}
+	// This stage copied bytes of a packet.
+	void copy(unsigned bytes) {
+		__atomic_fetch_add(&mCopies,1,__ATOMIC_RELAXED);
+		__atomic_fetch_add(&mCopiedBytes,bytes,__ATOMIC_RELAXED);
+	}
+	static void text(std::ostream &os);
+};
+
 // Warning: C++ prefers an operator<< that is const to one that is not.
 std::ostream& operator<<(std::ostream&os, const ByteVector&vec);
 #endif
@@ -53,6 +53,8 @@ float ConfigurationRecord::floatNumber() const
 
 
 ConfigurationTable::ConfigurationTable(const char* filename, const char *wCmdName, ConfigurationKeyMap wSchema)
+	:mDB(NULL),mSnapshot(new ConfigurationSnapshot),mStale(true),mNextCheck(0),mDataVersion(0),
+	mCrossCheck(NULL)
 {
 	gLogEarly(LOG_INFO, "opening configuration table from path %s", filename);
 	// (mike) disabled as it messes up auto-creation of example.sql files
@@ -71,6 +73,7 @@ ConfigurationTable::ConfigurationTable(const char* filename, const char *wCmdNam
 		mDB = NULL;
 		return;
 	}
+	sqlite3_busy_backoff(mDB);
 	// Create the table, if needed.
 	if (!sqlite3_command(mDB,createConfigTable)) {
 		gLogEarly(LOG_EMERG, "cannot create configuration table in database at %s, error message: %s", filename, sqlite3_errmsg(mDB));
@@ -141,9 +144,6 @@ ConfigurationTable::ConfigurationTable(const char* filename, const char *wCmdNam
 	// Add application specific schema
 	mSchema.insert(wSchema.begin(), wSchema.end());
 
-	// Init the cross checking callback to something predictable
-	mCrossCheck = NULL;
-
 #define DUMP_CONFIGURATION_TABLE 1
 #if DUMP_CONFIGURATION_TABLE
 	// (pat) Dump any non-default config variables...
@@ -300,8 +300,8 @@ string ConfigurationTable::getTeX(const std::string& program, const std::string&
 
 bool ConfigurationTable::defines(const string& key)
 {
+	EpochReader reader;
 	try {
-		ScopedLock lock(mLock);
 		return lookup(key).defined();
 	} catch (ConfigurationTableKeyNotFound) {
 		// TODO: re-enable once we figure out why this message is being sent to syslog regardless of log level
@@ -589,43 +589,162 @@ ConfigurationKeyMap ConfigurationTable::getSimilarKeys(const std::string& snippe
 	return tmp;
 }
 
-const ConfigurationRecord& ConfigurationTable::lookup(const string& key)
+ConfigurationRecord ConfigurationTable::load(const string& key)
 {
 	assert(mDB);
-	checkCacheAge();
-	// We assume the caller holds mLock.
-	// So it is OK to return a reference into the cache.
-
-	// Check the cache.
-	// This is cheap.
-	ConfigurationMap::const_iterator where = mCache.find(key);
-	if (where!=mCache.end()) {
-		if (where->second.defined()) return where->second;
-		throw ConfigurationTableKeyNotFound(key);
-	}
-
-	// Check the database.
-	// This is more expensive.
 	char *value = NULL;
 	sqlite3_single_lookup(mDB,"CONFIG",
 			"KEYSTRING",key.c_str(),"VALUESTRING",value);
-
-	// value found, cache the result
+	// value found
 	if (value) {
-		mCache[key] = ConfigurationRecord(value);
-	// key definition found, cache the default
-	} else if (keyDefinedInSchema(key)) {
-		mCache[key] = ConfigurationRecord(mSchema[key].getDefaultValue());
+		ConfigurationRecord rec(value);
+		free(value);
+		return rec;
+	}
+	// key definition found, use the default
+	if (keyDefinedInSchema(key)) return ConfigurationRecord(mSchema[key].getDefaultValue());
 	// total miss, cache the error
+	return ConfigurationRecord(false);
+}
+
+
+static void resolveSlots(ConfigurationSnapshot *snapshot, const vector<string>& keys)
+{
+	// Any key not already in the snapshot was missing from both the table and the schema.
+	snapshot->mSlots.clear();
+	for (unsigned i=0; i<keys.size(); i++) {
+		ConfigurationRecordMap::iterator where = snapshot->mRecords.find(keys[i]);
+		if (where==snapshot->mRecords.end()) {
+			where = snapshot->mRecords.insert(ConfigurationRecordMap::value_type(keys[i],ConfigurationRecord(false))).first;
+		}
+		snapshot->mSlots.push_back(&where->second);
+	}
+}
+
+
+void ConfigurationTable::publish(ConfigurationSnapshot* snapshot)
+{
+	// Readers take no lock, so the replaced snapshot is deleted only once every
+	// EpochReader that was open when it was swapped out has closed.
+	ConfigurationSnapshot *old = mSnapshot;
+	__atomic_store_n(&mSnapshot,snapshot,__ATOMIC_RELEASE);
+	mRetired.retire(old);
+}
+
+
+void ConfigurationTable::rebuild()
+{
+	// Caller holds mLock.
+	assert(mDB);
+	ConfigurationSnapshot *snapshot = new ConfigurationSnapshot;
+	sqlite3_stmt *stmt = sqlite3_cached_prepare(mDB,"SELECT KEYSTRING,VALUESTRING FROM CONFIG");
+	int src = SQLITE_ERROR;
+	if (stmt) {
+		while ((src = sqlite3_run_query(mDB,stmt))==SQLITE_ROW) {
+			const char* key = (const char*)sqlite3_column_text(stmt,0);
+			const char* value = (const char*)sqlite3_column_text(stmt,1);
+			// A NULL value falls back to the schema default, as in load().
+			if (key && value) snapshot->mRecords[key] = ConfigurationRecord(value);
+		}
+		sqlite3_cached_release(stmt);
+	}
+	if (src!=SQLITE_DONE) {
+		// Keep using the old snapshot, and try again on the next lookup.
+		gLogEarly(LOG_ERR, "cannot read configuration table: %s", sqlite3_errmsg(mDB));
+		delete snapshot;
+		return;
+	}
+	for (ConfigurationKeyMap::const_iterator mp = mSchema.begin(); mp != mSchema.end(); ++mp) {
+		// insert() leaves values from the table alone.
+		snapshot->mRecords.insert(ConfigurationRecordMap::value_type(mp->first,ConfigurationRecord(mp->second.getDefaultValue())));
+	}
+	resolveSlots(snapshot,mHandleKeys);
+	unsigned version;
+	if (sqlite3_single_lookup(mDB,"PRAGMA data_version",SqlArgs(),version)) mDataVersion = version;
+	publish(snapshot);
+	// Clear the flag only once the new snapshot is visible.
+	__atomic_store_n(&mStale,false,__ATOMIC_RELEASE);
+}
+
+
+const ConfigurationRecord* ConfigurationTable::addToSnapshot(const string& key)
+{
+	// Caller holds mLock.
+	// Another thread may have added the key while this one waited for the lock.
+	const ConfigurationSnapshot *old = current();
+	ConfigurationRecordMap::const_iterator where = old->mRecords.find(key);
+	if (where!=old->mRecords.end() && old->mSlots.size()==mHandleKeys.size()) return &where->second;
+
+	ConfigurationSnapshot *snapshot = new ConfigurationSnapshot(*old);
+	if (where==old->mRecords.end()) snapshot->mRecords[key] = load(key);
+	resolveSlots(snapshot,mHandleKeys);
+	publish(snapshot);
+	return &snapshot->mRecords[key];
+}
+
+
+const ConfigurationSnapshot* ConfigurationTable::current()
+{
+	// Each thread looks for outside changes every so often, rather than reading the clock on every lookup.
+	static __thread unsigned tLookups = 0;
+	if ((++tLookups & 0x3f)==0) checkCacheAge();
+	if (__atomic_load_n(&mStale,__ATOMIC_ACQUIRE)) {
+		ScopedLock lock(mLock);
+		if (mStale) rebuild();
+	}
+	return __atomic_load_n(&mSnapshot,__ATOMIC_ACQUIRE);
+}
+
+
+const ConfigurationRecord& ConfigurationTable::lookup(const string& key)
+{
+	// Check the snapshot.
+	// This is cheap.
+	const ConfigurationSnapshot *snapshot = current();
+	const ConfigurationRecord *rec;
+	ConfigurationRecordMap::const_iterator where = snapshot->mRecords.find(key);
+	if (where!=snapshot->mRecords.end()) {
+		rec = &where->second;
 	} else {
-		mCache[key] = ConfigurationRecord(false);
-		throw ConfigurationTableKeyNotFound(key);
+		// Check the database and add the result to a new snapshot.
+		// This is more expensive.
+		ScopedLock lock(mLock);
+		rec = addToSnapshot(key);
 	}
+	if (!rec->defined()) throw ConfigurationTableKeyNotFound(key);
+	return *rec;
+}
 
-	free(value);
 
-	// Leave mLock locked.  The caller holds it still.
-	return mCache[key];
+const ConfigurationRecord& ConfigurationTable::lookup(ConfigurationHandle& handle)
+{
+	const ConfigurationSnapshot *snapshot = current();
+	int slot = __atomic_load_n(&handle.mSlot,__ATOMIC_ACQUIRE);
+	const ConfigurationRecord *rec = NULL;
+	if (slot>=0 && (unsigned)slot<snapshot->mSlots.size()) rec = snapshot->mSlots[slot];
+	if (!rec) {
+		// First use of the handle, or of a slot registered since this snapshot was built.
+		ScopedLock lock(mLock);
+		if (handle.mSlot<0) {
+			mHandleKeys.push_back(handle.mKey);
+			__atomic_store_n(&handle.mSlot,(int)mHandleKeys.size()-1,__ATOMIC_RELEASE);
+		}
+		addToSnapshot(handle.mKey);
+		rec = mSnapshot->mSlots[handle.mSlot];
+	}
+	if (!rec->defined()) throw ConfigurationTableKeyNotFound(handle.mKey);
+	return *rec;
+}
+
+
+bool ConfigurationHandle::defined() const
+{
+	EpochReader reader;
+	try {
+		return record().defined();
+	} catch (ConfigurationTableKeyNotFound) {
+		return false;
+	}
 }
 
 
@@ -644,9 +763,9 @@ bool ConfigurationTable::isStatic(const string& key)
 
 string ConfigurationTable::getStr(const string& key)
 {
-	// We need the lock because rec is a reference into the cache.
+	// We need the reader because rec is a reference into the cache.
+	EpochReader reader;
 	try {
-		ScopedLock lock(mLock);
 		return lookup(key).value();
 	} catch (ConfigurationTableKeyNotFound) {
 		// Raise an alert and re-throw the exception.
@@ -670,9 +789,9 @@ bool ConfigurationTable::getBool(const string& key)
 
 long ConfigurationTable::getNum(const string& key)
 {
-	// We need the lock because rec is a reference into the cache.
+	// We need the reader because rec is a reference into the cache.
+	EpochReader reader;
 	try {
-		ScopedLock lock(mLock);
 		return lookup(key).number();
 	} catch (ConfigurationTableKeyNotFound) {
 		// Raise an alert and re-throw the exception.
@@ -684,8 +803,8 @@ long ConfigurationTable::getNum(const string& key)
 
 float ConfigurationTable::getFloat(const string& key)
 {
+	EpochReader reader;
 	try {
-		ScopedLock lock(mLock);
 		return lookup(key).floatNumber();
 	} catch (ConfigurationTableKeyNotFound) {
 		// Raise an alert and re-throw the exception.
@@ -699,7 +818,7 @@ std::vector<string> ConfigurationTable::getVectorOfStrings(const string& key)
 	// Look up the string.
 	char *line=NULL;
 	try {
-		ScopedLock lock(mLock);
+		EpochReader reader;
 		const ConfigurationRecord& rec = lookup(key);
 		line = strdup(rec.value().c_str());
 	} catch (ConfigurationTableKeyNotFound) {
@@ -730,7 +849,7 @@ std::vector<unsigned> ConfigurationTable::getVector(const string& key)
 	// Look up the string.
 	char *line=NULL;
 	try {
-		ScopedLock lock(mLock);
+		EpochReader reader;
 		const ConfigurationRecord& rec = lookup(key);
 		line = strdup(rec.value().c_str());
 	} catch (ConfigurationTableKeyNotFound) {
@@ -761,12 +880,10 @@ bool ConfigurationTable::remove(const string& key)
 	assert(mDB);
 
 	ScopedLock lock(mLock);
-	// Clear the cache entry and the database.
-	ConfigurationMap::iterator where = mCache.find(key);
-	if (where!=mCache.end()) mCache.erase(where);
-	// Really remove it.
-	string cmd = "DELETE FROM CONFIG WHERE KEYSTRING=='"+key+"'";
-	return sqlite3_command(mDB,cmd.c_str());
+	// Remove it from the database and rebuild the cache on the next lookup.
+	bool success = sqlite3_command(mDB,"DELETE FROM CONFIG WHERE KEYSTRING==?",SqlArgs(1,key));
+	purge();
+	return success;
 }
 
 
@@ -774,9 +891,10 @@ bool ConfigurationTable::remove(const string& key)
 void ConfigurationTable::find(const string& pat, ostream& os) const
 {
 	// Prepare the statement.
-	string cmd = "SELECT KEYSTRING,VALUESTRING FROM CONFIG WHERE KEYSTRING LIKE \"%" + pat + "%\"";
-	sqlite3_stmt *stmt;
-	if (sqlite3_prepare_statement(mDB,&stmt,cmd.c_str())) return;
+	sqlite3_stmt *stmt = sqlite3_cached_prepare(mDB,"SELECT KEYSTRING,VALUESTRING FROM CONFIG WHERE KEYSTRING LIKE ?");
+	if (!stmt) return;
+	string like = "%" + pat + "%";
+	sqlite3_bind_text(stmt,1,like.c_str(),like.size(),SQLITE_TRANSIENT);
 	// Read the result.
 	int src = sqlite3_run_query(mDB,stmt);
 	while (src==SQLITE_ROW) {
@@ -790,7 +908,7 @@ void ConfigurationTable::find(const string& pat, ostream& os) const
 		else os << "(disabled)" << endl;
 		src = sqlite3_run_query(mDB,stmt);
 	}
-	sqlite3_finalize(stmt);
+	sqlite3_cached_release(stmt);
 }
 
 
@@ -823,16 +941,19 @@ bool ConfigurationTable::set(const string& key, const string& value)
 {
 	assert(mDB);
 	ScopedLock lock(mLock);
-	string cmd;
+	SqlArgs args;
+	args.push_back(key);
+	args.push_back(value);
+	bool success;
 	if (keyDefinedInSchema(key)) {
-		cmd = "INSERT OR REPLACE INTO CONFIG (KEYSTRING,VALUESTRING,OPTIONAL,COMMENTS) VALUES (\"" + key + "\",\"" + value + "\",1,\'" + mSchema[key].getDescription() + "\')";
+		args.push_back(mSchema[key].getDescription());
+		success = sqlite3_command(mDB,"INSERT OR REPLACE INTO CONFIG (KEYSTRING,VALUESTRING,OPTIONAL,COMMENTS) VALUES (?,?,1,?)",args);
 	} else {
-		cmd = "INSERT OR REPLACE INTO CONFIG (KEYSTRING,VALUESTRING,OPTIONAL) VALUES (\"" + key + "\",\"" + value + "\",1)";
+		success = sqlite3_command(mDB,"INSERT OR REPLACE INTO CONFIG (KEYSTRING,VALUESTRING,OPTIONAL) VALUES (?,?,1)",args);
 	}
-	
-	bool success = sqlite3_command(mDB,cmd.c_str());
-	// Cache the result.
-	if (success) mCache[key] = ConfigurationRecord(value);
+
+	// Rebuild the cache on the next lookup.
+	if (success) purge();
 	return success;
 }
 
@@ -845,36 +966,29 @@ bool ConfigurationTable::set(const string& key, long value)
 
 void ConfigurationTable::checkCacheAge()
 {
-	// mLock is set by caller 
-	static time_t timeOfLastPurge = 0;
+	// Changes through this connection mark the cache stale directly, in set(), remove() and the update hook.
+	// Changes through other connections, like the sqlite3 shell, show up in data_version.
+	static const time_t sCheckInterval = 3;	// seconds
 	time_t now = time(NULL);
-	// purge every 3 seconds
-	// purge period cannot be configuration parameter
-	if (now - timeOfLastPurge < 3) return;
-	timeOfLastPurge = now;
-	// this is purge() without the lock
-	ConfigurationMap::iterator mp = mCache.begin();
-	while (mp != mCache.end()) {
-		ConfigurationMap::iterator prev = mp;
-		mp++;
-		mCache.erase(prev);
+	if (now < __atomic_load_n(&mNextCheck,__ATOMIC_RELAXED)) return;
+	// If another thread has the lock, it is either checking or changing the table already.
+	if (!mDB || !mLock.trylock()) return;
+	if (now >= mNextCheck) {
+		mNextCheck = now + sCheckInterval;
+		unsigned version;
+		if (sqlite3_single_lookup(mDB,"PRAGMA data_version",SqlArgs(),version) && (int)version!=mDataVersion) {
+			purge();
+		}
+		// Snapshots whose readers were still busy when they were replaced.
+		mRetired.reclaim();
 	}
+	mLock.unlock();
 }
 
-/**
- * 函数purge()的功能是清空缓存。
- * 在函数内部，它使用了一个 `ScopedLock` 对象来锁定 `mLock`，
- * 然后遍历 `mCache` 中的所有元素并将其删除。
- */
+
 void ConfigurationTable::purge()
 {
-	ScopedLock lock(mLock);
-	ConfigurationMap::iterator mp = mCache.begin();
-	while (mp != mCache.end()) {
-		ConfigurationMap::iterator prev = mp;
-		mp++;
-		mCache.erase(prev);
-	}
+	__atomic_store_n(&mStale,true,__ATOMIC_RELEASE);
 }
 
 
@@ -28,13 +28,16 @@
 #include <regex.h>
 
 #include <map>
+#include <list>
 #include <vector>
 #include <string>
 #include <sstream>
 #include <iostream>
 
 #include <Threads.h>
+#include <Epoch.h>
 #include <stdint.h>
+#include <time.h>
 
 
 /** A class for configuration file errors. */
@@ -164,6 +167,24 @@ typedef std::map<HashString, ConfigurationRecord> ConfigurationMap;
 class ConfigurationKey;
 typedef std::map<std::string, ConfigurationKey> ConfigurationKeyMap;
 ConfigurationKeyMap getConfigurationKeys();
+class ConfigurationHandle;
+
+
+/**
+	An immutable copy of the cached configuration.
+	Readers use the current snapshot without locking, inside an EpochReader.
+	Changes are made by building a new snapshot and swapping it in.
+*/
+class ConfigurationSnapshot {
+
+	public:
+
+	/** Every key looked up since the snapshot was built, including misses, which are not defined(). */
+	ConfigurationRecordMap mRecords;
+
+	/** Records for registered key handles, pointing into mRecords. */
+	std::vector<const ConfigurationRecord*> mSlots;
+};
 
 /**
 	A class for maintaining a configuration key-value table,
@@ -175,8 +196,13 @@ class ConfigurationTable {
 	private:
 
 	sqlite3* mDB;				///< database connection
-	ConfigurationMap mCache;	///< cache of recently access configuration values
-	mutable Mutex mLock;		///< control for multithreaded access to the cache
+	ConfigurationSnapshot *mSnapshot;	///< current cache of configuration values, swapped atomically
+	bool mStale;				///< mSnapshot must be rebuilt from the database before use
+	time_t mNextCheck;			///< next time to look for changes made by other database connections
+	int mDataVersion;			///< sqlite data_version at the last rebuild
+	RetiredList<ConfigurationSnapshot> mRetired;	///< replaced snapshots that readers may still be using
+	std::vector<std::string> mHandleKeys;	///< keys of registered handles, by slot
+	mutable Mutex mLock;		///< control for multithreaded changes to the cache
 	std::vector<std::string> (*mCrossCheck)(const std::string&);	///< cross check callback pointer
 
 	public:
@@ -278,10 +304,13 @@ class ConfigurationTable {
 	/** Execute the application specific value cross checking logic. */
 	std::vector<std::string> crossCheck(const std::string& key);
 
-	/** purege cache if it exceeds a certain age */
+	/** Rebuild the cache if another database connection has changed the table, and free old snapshots. */
 	void checkCacheAge();
 
-	/** Delete all records from the cache. */
+	/**
+		Delete all records from the cache.
+		This only marks the cache stale, so it is safe to call from the sqlite update hook.
+	*/
 	void purge();
 
 
@@ -290,10 +319,83 @@ class ConfigurationTable {
 	/**
 		Attempt to lookup a record, cache if needed.
 		Throw ConfigurationTableKeyNotFound if not found.
-		Caller should hold mLock because the returned reference points into the cache.
+		The returned reference points into a snapshot, so the caller must hold an EpochReader while using it.
 	*/
 	const ConfigurationRecord& lookup(const std::string& key);
 
+	/** Look up a handle's record by its slot, registering the handle first if needed. */
+	const ConfigurationRecord& lookup(ConfigurationHandle& handle);
+
+	/** Return the current snapshot, rebuilding it first if it is stale. */
+	const ConfigurationSnapshot* current();
+
+	/** Add a key to a copy of the current snapshot.  Caller holds mLock. */
+	const ConfigurationRecord* addToSnapshot(const std::string& key);
+
+	/** Rebuild the snapshot from the database and the schema.  Caller holds mLock. */
+	void rebuild();
+
+	/** Swap in a new snapshot and retire the old one until its readers are done.  Caller holds mLock. */
+	void publish(ConfigurationSnapshot* snapshot);
+
+	/** Read a key from the database or the schema, as an undefined record if neither has it.  Caller holds mLock. */
+	ConfigurationRecord load(const std::string& key);
+
+	friend class ConfigurationHandle;
+};
+
+
+/**
+	A pre-resolved configuration key, for values read on hot paths.
+	The first read registers the key with the table; after that a read is an index into
+	the current snapshot, without locking or comparing strings.
+	Safe to construct before the table, e.g. as a static.
+*/
+class ConfigurationHandle {
+
+	friend class ConfigurationTable;
+
+	protected:
+
+	ConfigurationTable& mTable;
+	std::string mKey;
+	int mSlot;			///< index into ConfigurationSnapshot::mSlots, -1 until registered
+
+	const ConfigurationRecord& record() const { return mTable.lookup(*const_cast<ConfigurationHandle*>(this)); }
+
+	public:
+
+	ConfigurationHandle(ConfigurationTable& wTable, const char* wKey)
+		:mTable(wTable),mKey(wKey),mSlot(-1)
+	{ }
+
+	const std::string& key() const { return mKey; }
+
+	/** Return true if the key has a value in the table or the schema. */
+	bool defined() const;
+};
+
+/** A numeric configuration value.  Throw ConfigurationTableKeyNotFound if not found. */
+class ConfigurationNum : public ConfigurationHandle {
+	public:
+	ConfigurationNum(ConfigurationTable& wTable, const char* wKey) :ConfigurationHandle(wTable,wKey) {}
+	long get() const { EpochReader reader; return record().number(); }
+	operator long() const { return get(); }
+};
+
+/** A boolean configuration value, false if 0.  Throw ConfigurationTableKeyNotFound if not found. */
+class ConfigurationBool : public ConfigurationHandle {
+	public:
+	ConfigurationBool(ConfigurationTable& wTable, const char* wKey) :ConfigurationHandle(wTable,wKey) {}
+	bool get() const { EpochReader reader; return record().number() != 0; }
+	operator bool() const { return get(); }
+};
+
+/** A string configuration value.  Throw ConfigurationTableKeyNotFound if not found. */
+class ConfigurationStr : public ConfigurationHandle {
+	public:
+	ConfigurationStr(ConfigurationTable& wTable, const char* wKey) :ConfigurationHandle(wTable,wKey) {}
+	std::string get() const { EpochReader reader; return record().value(); }
 };
 
 
@@ -105,6 +105,15 @@ int main(int argc, char *argv[])
 	} catch (ConfigurationTableKeyNotFound) {
 		cout << "ConfigurationTableKeyNotFound exception successfully caught." << endl;
 	}
+
+	ConfigurationNum key3(gConfig,"key3");
+	cout << "handle " << key3.key() << "=" << key3.get() << endl;
+	gConfig.set("key3",33);
+	cout << "handle " << key3.key() << "=" << key3.get() << endl;
+	ConfigurationBool boolHandle(gConfig,"booltest");
+	cout << "handle bool " << boolHandle.get() << endl;
+	ConfigurationStr missing(gConfig,"supposedtoabort");
+	cout << "handle defined " << missing.defined() << endl;
 }
 
 ConfigurationKeyMap getConfigurationKeys()
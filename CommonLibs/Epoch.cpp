@@ -0,0 +1,102 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#include <pthread.h>
+#include "Epoch.h"
+
+// A reading thread keeps the epoch it saw on entry in its slot, or 0 when it is not reading.
+// Slots are claimed on a thread's first read and given back when the thread exits.
+// Threads beyond sMaxReaders share a counter instead, and while any of them is reading
+// nothing is reclaimed.
+static const unsigned sMaxReaders = 128;
+
+struct EpochSlot {
+	uint64_t mEpoch;
+	int mOwned;
+} __attribute__((aligned(64)));
+
+static EpochSlot sSlots[sMaxReaders];
+static uint64_t sEpoch = 1;
+static unsigned sOverflowReaders = 0;
+
+static __thread int tSlot = -1;		// -1 before the first read, -2 if no slot was free
+static __thread unsigned tDepth = 0;
+
+static pthread_key_t sSlotKey;
+static pthread_once_t sSlotKeyOnce = PTHREAD_ONCE_INIT;
+
+static void releaseSlot(void *arg)
+{
+	// The key holds the slot index plus one, since a NULL value gets no destructor call.
+	__atomic_store_n(&sSlots[(intptr_t)arg - 1].mOwned,0,__ATOMIC_RELEASE);
+}
+
+static void makeSlotKey()
+{
+	pthread_key_create(&sSlotKey,releaseSlot);
+}
+
+static int claimSlot()
+{
+	pthread_once(&sSlotKeyOnce,makeSlotKey);
+	for (unsigned i=0; i<sMaxReaders; i++) {
+		int unowned = 0;
+		if (__atomic_compare_exchange_n(&sSlots[i].mOwned,&unowned,1,false,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED)) {
+			pthread_setspecific(sSlotKey,(void*)(intptr_t)(i+1));
+			return i;
+		}
+	}
+	return -2;
+}
+
+
+void EpochReader::enter()
+{
+	if (tDepth++) return;
+	if (tSlot == -1) tSlot = claimSlot();
+	// Acquire pairs with epochAdvance, so a reader that sees the new epoch also sees the new pointer.
+	if (tSlot >= 0) __atomic_store_n(&sSlots[tSlot].mEpoch,__atomic_load_n(&sEpoch,__ATOMIC_ACQUIRE),__ATOMIC_RELAXED);
+	else __atomic_fetch_add(&sOverflowReaders,1,__ATOMIC_RELAXED);
+	// The announcement must be visible to writers before this thread loads any protected pointer.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+void EpochReader::exit()
+{
+	if (--tDepth) return;
+	if (tSlot >= 0) __atomic_store_n(&sSlots[tSlot].mEpoch,0,__ATOMIC_RELEASE);
+	else __atomic_fetch_sub(&sOverflowReaders,1,__ATOMIC_RELEASE);
+}
+
+
+uint64_t epochAdvance()
+{
+	return __atomic_add_fetch(&sEpoch,1,__ATOMIC_SEQ_CST);
+}
+
+
+uint64_t epochOldestReader()
+{
+	// Pairs with the fence in enter: either this scan sees a reader's announcement,
+	// or that reader loads the pointer stored before the epoch was advanced.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sOverflowReaders,__ATOMIC_ACQUIRE)) return 0;
+	uint64_t oldest = ~(uint64_t)0;
+	for (unsigned i=0; i<sMaxReaders; i++) {
+		uint64_t epoch = __atomic_load_n(&sSlots[i].mEpoch,__ATOMIC_ACQUIRE);
+		if (epoch && epoch < oldest) oldest = epoch;
+	}
+	return oldest;
+}
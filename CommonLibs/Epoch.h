@@ -0,0 +1,95 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+#include <list>
+#include <utility>
+
+
+/**@name Epoch-based reclamation, for data that readers use without locking.
+	A writer swaps in a new version of the data with an atomic pointer store and hands the
+	old version to a RetiredList.  A reader holds an EpochReader from before it loads the
+	pointer until it is done with what the pointer points to.  Each reading thread announces
+	the global epoch in a slot of its own, so readers never write a shared cache line, and a
+	retired version is deleted only once every reader that could have loaded it has finished.
+*/
+//@{
+
+/**
+	Marks the current thread as reading for the lifetime of the object.
+	Readers may nest; only the outermost one announces anything.
+*/
+class EpochReader {
+	public:
+	EpochReader() { enter(); }
+	~EpochReader() { exit(); }
+	static void enter();
+	static void exit();
+};
+
+/**
+	Advance the global epoch and return the new value.
+	Call after the old version has been unlinked; a reader that announces the returned epoch
+	or a later one cannot have seen the old version.
+*/
+uint64_t epochAdvance();
+
+/** The oldest epoch announced by a thread that is reading now, or ~0 if none is. */
+uint64_t epochOldestReader();
+
+
+/**
+	Versions of some data that have been replaced, waiting for their readers to finish.
+	Not thread safe; callers hold whatever lock serializes their writers.
+*/
+template <class T>
+class RetiredList {
+
+	std::list<std::pair<uint64_t,T*> > mList;	///< (epoch it was retired in, object), oldest first
+
+	public:
+
+	~RetiredList()
+	{
+		// Whoever destroys the list has stopped the readers.
+		while (!mList.empty()) { delete mList.front().second; mList.pop_front(); }
+	}
+
+	/** Take an object that readers can no longer reach, and delete any that are now quiet. */
+	void retire(T* old)
+	{
+		mList.push_back(std::make_pair(epochAdvance(),old));
+		reclaim();
+	}
+
+	/** Delete the retired objects that no reader can still be using. */
+	void reclaim()
+	{
+		if (mList.empty()) return;
+		uint64_t oldest = epochOldestReader();
+		while (!mList.empty() && mList.front().first <= oldest) {
+			delete mList.front().second;
+			mList.pop_front();
+		}
+	}
+
+	unsigned size() const { return mList.size(); }
+};
+
+//@}
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+// Readers check a version that a writer keeps replacing.  A version that was deleted
+// under a reader has its values scribbled over and fails the check.
+
+#include "Epoch.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <iostream>
+
+using namespace std;
+
+struct Version {
+	unsigned mA, mB;	// always equal while the version is alive
+	Version(unsigned v) :mA(v),mB(v) {}
+	~Version() { mA = 1; mB = 2; }
+};
+
+static Version *sCurrent = new Version(0);
+static volatile bool sDone = false;
+static unsigned sBad = 0;
+
+static void *reader(void *)
+{
+	while (!sDone) {
+		EpochReader reader;
+		Version *v = __atomic_load_n(&sCurrent,__ATOMIC_ACQUIRE);
+		for (int i = 0; i < 100; i++) {
+			if (v->mA != v->mB) { __atomic_fetch_add(&sBad,1,__ATOMIC_RELAXED); break; }
+		}
+	}
+	return NULL;
+}
+
+static void *nested(void *)
+{
+	// A thread that is still reading holds back everything retired since it started.
+	EpochReader outer;
+	Version *v = __atomic_load_n(&sCurrent,__ATOMIC_ACQUIRE);
+	{ EpochReader inner; }
+	usleep(200000);
+	if (v->mA != v->mB) __atomic_fetch_add(&sBad,1,__ATOMIC_RELAXED);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int failures = 0;
+	RetiredList<Version> retired;
+
+	pthread_t threads[5];
+	for (int t = 0; t < 4; t++) { pthread_create(&threads[t],NULL,reader,NULL); }
+	pthread_create(&threads[4],NULL,nested,NULL);
+	for (unsigned v = 1; v <= 200000; v++) {
+		Version *old = sCurrent;
+		__atomic_store_n(&sCurrent,new Version(v),__ATOMIC_RELEASE);
+		retired.retire(old);
+	}
+	pthread_join(threads[4],NULL);
+	sDone = true;
+	for (int t = 0; t < 4; t++) { pthread_join(threads[t],NULL); }
+	if (sBad) {
+		cout << sBad << " reads of a deleted version" << endl;
+		failures++;
+	}
+
+	// With every reader gone, nothing is held back.
+	retired.reclaim();
+	if (retired.size() != 0) {
+		cout << retired.size() << " versions not reclaimed" << endl;
+		failures++;
+	}
+
+	// A reader on this thread holds back a version retired while it reads.
+	{
+		EpochReader reader;
+		Version *old = sCurrent;
+		__atomic_store_n(&sCurrent,new Version(0),__ATOMIC_RELEASE);
+		retired.retire(old);
+		if (retired.size() != 1) {
+			cout << "version reclaimed under a reader" << endl;
+			failures++;
+		}
+	}
+	retired.reclaim();
+	if (retired.size() != 0) {
+		cout << "version not reclaimed after the reader" << endl;
+		failures++;
+	}
+
+	cout << (failures ? "FAILED" : "ok") << endl;
+	return failures ? 1 : 0;
+}
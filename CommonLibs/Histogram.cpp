@@ -0,0 +1,99 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#include <string.h>
+#include "Histogram.h"
+
+static const unsigned sSub = 1 << LatencyHistogram::sSubBits;
+
+// Below 2*sSub the value is the bucket.  Above, with the top bit of the value at bit e,
+// the value shifted right by e-sSubBits is in [sSub,2*sSub), and the buckets for each e follow on.
+unsigned LatencyHistogram::bucket(uint64_t usecs)
+{
+	if (usecs < 2*sSub) { return usecs; }
+	unsigned e = 63 - __builtin_clzll(usecs);
+	unsigned shift = e - sSubBits;
+	unsigned b = sSub*shift + (unsigned)(usecs >> shift);
+	return b < sBuckets ? b : sBuckets - 1;
+}
+
+uint64_t LatencyHistogram::bucketLow(unsigned b)
+{
+	if (b < 2*sSub) { return b; }
+	unsigned shift = b / sSub - 1;
+	return (uint64_t)(b - sSub*shift) << shift;
+}
+
+void LatencyHistogram::record(uint64_t usecs)
+{
+	__atomic_fetch_add(&mCounts[bucket(usecs)],1,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&mCount,1,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&mSum,usecs,__ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&mMax,__ATOMIC_RELAXED);
+	while (usecs > max && !__atomic_compare_exchange_n(&mMax,&max,usecs,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) {}
+}
+
+void LatencyHistogram::clear()
+{
+	memset(this,0,sizeof(*this));
+}
+
+void LatencyHistogram::add(const LatencyHistogram &other)
+{
+	for (unsigned b = 0; b < sBuckets; b++) { mCounts[b] += other.mCounts[b]; }
+	mCount += other.mCount;
+	mSum += other.mSum;
+	if (other.mMax > mMax) { mMax = other.mMax; }
+}
+
+uint64_t LatencyHistogram::percentile(double pct) const
+{
+	// Sum the buckets rather than trust mCount, which a recording in progress may be ahead of.
+	uint64_t total = 0;
+	for (unsigned b = 0; b < sBuckets; b++) { total += mCounts[b]; }
+	if (total == 0) { return 0; }
+	uint64_t want = (uint64_t)(pct / 100.0 * total + 0.5);
+	if (want < 1) { want = 1; }
+	uint64_t seen = 0;
+	for (unsigned b = 0; b < sBuckets; b++) {
+		seen += mCounts[b];
+		if (seen >= want) {
+			uint64_t high = b + 1 < sBuckets ? bucketLow(b + 1) - 1 : mMax;
+			return high < mMax ? high : mMax;
+		}
+	}
+	return mMax;
+}
+
+void LatencyHistogram::text(std::ostream &os, const char *name) const
+{
+	os << " " << name << "_count=" << mCount;
+	os << " " << name << "_mean_us=" << (uint64_t)(mean() + 0.5);
+	os << " " << name << "_p50_us=" << percentile(50);
+	os << " " << name << "_p90_us=" << percentile(90);
+	os << " " << name << "_p99_us=" << percentile(99);
+	os << " " << name << "_max_us=" << mMax;
+}
+
+void LatencyHistogram::textBuckets(std::ostream &os) const
+{
+	bool any = false;
+	for (unsigned b = 0; b < sBuckets; b++) {
+		uint32_t n = mCounts[b];
+		if (n == 0) { continue; }
+		os << (any ? "," : "") << bucketLow(b) << ":" << n;
+		any = true;
+	}
+	if (!any) { os << "none"; }
+}
@@ -0,0 +1,61 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <iostream>
+
+/**
+	A histogram of latencies in usecs, laid out like an HdrHistogram: values below 32 us
+	have a bucket each, and above that each power of two is split into 16 buckets,
+	so a bucket is never wider than 1/16 of the values in it.  The range is 0 to 2^27 us,
+	about two minutes; longer values are counted in the last bucket.
+	Recording is a few instructions and relaxed atomic adds, so it can be done for every packet
+	from any thread; readers do not lock, and may see a recording half done.
+	It has no constructor and is empty when zeroed, so it may live in memory from calloc.
+*/
+struct LatencyHistogram {
+	static const unsigned sSubBits = 4;
+	static const unsigned sBuckets = (27 - sSubBits + 1) << sSubBits;	// 384
+
+	uint32_t mCounts[sBuckets];
+	uint64_t mCount;		///< values recorded
+	uint64_t mSum;			///< their total, usecs
+	uint64_t mMax;			///< the largest, usecs
+
+	/** The bucket a value goes in. */
+	static unsigned bucket(uint64_t usecs);
+	/** The smallest value in a bucket. */
+	static uint64_t bucketLow(unsigned b);
+
+	void record(uint64_t usecs);
+	void clear();
+	/** Add the counts of another histogram to this one. */
+	void add(const LatencyHistogram &other);
+
+	uint64_t count() const { return mCount; }
+	uint64_t max() const { return mMax; }
+	double mean() const { return mCount ? (double)mSum / mCount : 0.0; }
+	/** The largest value in the bucket where pct percent of the values are at or below, capped by max(). */
+	uint64_t percentile(double pct) const;
+
+	/** Print " name_count=N name_mean_us=N name_p50_us=N name_p90_us=N name_p99_us=N name_max_us=N". */
+	void text(std::ostream &os, const char *name) const;
+	/** Print the buckets that are not empty as "low:count,low:count...", or "none". */
+	void textBuckets(std::ostream &os) const;
+};
+
+#endif
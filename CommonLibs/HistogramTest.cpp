@@ -0,0 +1,89 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+
+#include "Histogram.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <iostream>
+
+using namespace std;
+
+static LatencyHistogram sShared;
+static const unsigned sPerThread = 1000000;
+
+static void *recorder(void *)
+{
+	for (unsigned i = 0; i < sPerThread; i++) { sShared.record(i % 5000); }
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int failures = 0;
+
+	// Every bucket holds the values from its low to the next one's, and no bucket is wider than 1/16 of its low.
+	for (unsigned b = 0; b + 1 < LatencyHistogram::sBuckets; b++) {
+		uint64_t low = LatencyHistogram::bucketLow(b), next = LatencyHistogram::bucketLow(b+1);
+		if (LatencyHistogram::bucket(low) != b || LatencyHistogram::bucket(next-1) != b || next <= low ||
+			(low >= 32 && (next - low) * 16 > low)) {
+			cout << "bucket " << b << " wrong: low " << low << " next " << next << endl;
+			failures++;
+		}
+	}
+	if (LatencyHistogram::bucket(1ULL<<40) != LatencyHistogram::sBuckets - 1) {
+		cout << "huge value not in the last bucket" << endl;
+		failures++;
+	}
+
+	// Uniform 1..10000 us: the percentiles must be within a bucket of the truth.
+	LatencyHistogram *h = (LatencyHistogram*)calloc(1,sizeof(LatencyHistogram));
+	for (unsigned v = 1; v <= 10000; v++) { h->record(v); }
+	double pcts[] = { 50, 90, 99, 100 };
+	for (unsigned i = 0; i < 4; i++) {
+		uint64_t got = h->percentile(pcts[i]), want = (uint64_t)(pcts[i] * 100);
+		if (got < want || got > want + want/16) {
+			cout << "p" << pcts[i] << " is " << got << ", want " << want << endl;
+			failures++;
+		}
+	}
+	if (h->count() != 10000 || h->max() != 10000 || h->mean() != 5000.5) {
+		cout << "count " << h->count() << " max " << h->max() << " mean " << h->mean() << endl;
+		failures++;
+	}
+	h->text(cout,"uniform");
+	cout << endl;
+
+	// Several threads into one histogram lose nothing.
+	pthread_t threads[4];
+	for (int t = 0; t < 4; t++) { pthread_create(&threads[t],NULL,recorder,NULL); }
+	for (int t = 0; t < 4; t++) { pthread_join(threads[t],NULL); }
+	uint64_t total = 0;
+	for (unsigned b = 0; b < LatencyHistogram::sBuckets; b++) { total += sShared.mCounts[b]; }
+	if (sShared.count() != 4*sPerThread || total != 4*sPerThread || sShared.max() != 4999) {
+		cout << "threads: count " << sShared.count() << " buckets " << total << " max " << sShared.max() << endl;
+		failures++;
+	}
+
+	LatencyHistogram small;
+	small.clear();
+	small.record(3); small.record(3); small.record(1000);
+	small.textBuckets(cout);
+	cout << endl;
+
+	cout << (failures ? "FAILED" : "ok") << endl;
+	free(h);
+	return failures ? 1 : 0;
+}
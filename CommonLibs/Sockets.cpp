@@ -165,6 +165,38 @@ int DatagramSocket::read(char* buffer)
 }
 
 
+int DatagramSocket::read(char* buffers[], int lengths[], struct sockaddr_storage sources[], unsigned count)
+{
+	assert(count && count<=MAX_UDP_BATCH);
+	struct mmsghdr msgs[MAX_UDP_BATCH];
+	struct iovec iovs[MAX_UDP_BATCH];
+	memset(msgs,0,count*sizeof(msgs[0]));
+	for (unsigned i=0; i<count; i++) {
+		iovs[i].iov_base = buffers[i];
+		iovs[i].iov_len = MAX_UDP_LENGTH;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &sources[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+	}
+	int numRead = recvmmsg(mSocketFD, msgs, count, MSG_WAITFORONE, NULL);
+	if ((numRead==-1) && (errno==ENOSYS)) {
+		// Kernel older than 2.6.33.
+		socklen_t temp_len = sizeof(sources[0]);
+		msgs[0].msg_len = recvfrom(mSocketFD, (void*)buffers[0], MAX_UDP_LENGTH, 0,
+			(struct sockaddr*)&sources[0], &temp_len);
+		numRead = ((int)msgs[0].msg_len==-1) ? -1 : 1;
+	}
+	if ((numRead==-1) && (errno!=EAGAIN)) {
+		perror("DatagramSocket::read() failed");
+		throw SocketError();
+	}
+	for (int i=0; i<numRead; i++) lengths[i] = msgs[i].msg_len;
+	if (numRead>0) memcpy(mSource,&sources[numRead-1],sizeof(sources[0])<sizeof(mSource) ? sizeof(sources[0]) : sizeof(mSource));
+	return numRead;
+}
+
+
 int DatagramSocket::read(char* buffer, unsigned timeout)
 {
 	fd_set fds;
@@ -33,6 +33,7 @@
 
 
 #define MAX_UDP_LENGTH 8000
+#define MAX_UDP_BATCH 64
 
 /** A function to resolve IP host names. */
 bool resolveAddress(struct sockaddr_in *address, const char *host, unsigned short port);
@@ -109,6 +110,17 @@ public:
 	*/
 	int read(char* buffer, unsigned timeout);
 
+	/**
+		Receive up to count packets with one system call, blocking until at least one arrives.
+		The source of the last packet becomes the return address, as with read().
+		@param buffers count buffers of MAX_UDP_LENGTH bytes procured by the caller.
+		@param lengths Set to the length of each packet received.
+		@param sources Set to the return address of each packet received.
+		@param count The number of buffers, at most MAX_UDP_BATCH.
+		@return The number of packets received or -1 on non-blocking pass.
+	*/
+	int read(char* buffers[], int lengths[], struct sockaddr_storage sources[], unsigned count);
+
 
 	/** Send a packet to a given destination, other than the default. */
 	int send(const struct sockaddr *dest, const char * buffer, size_t length);
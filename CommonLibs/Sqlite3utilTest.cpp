@@ -0,0 +1,139 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+// Lookups per second against scratch copies of the config, TMSI and transaction databases,
+// preparing each query from a formatted string as the helpers used to,
+// and through the prepared statement cache, with and without WAL.
+
+#include "sqlite3util.h"
+#include "Timeval.h"
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// We must have a gConfig now to include Logger.
+#include "Configuration.h"
+ConfigurationTable gConfig;
+
+using namespace std;
+
+struct BenchTable {
+	const char *name;
+	const char *create;
+	const char *insert;		// %u is the row number
+	const char *key;
+	const char *keyFormat;	// %u is the row number
+	const char *value;
+};
+
+static const BenchTable tables[] = {
+	{ "CONFIG",
+		"CREATE TABLE IF NOT EXISTS CONFIG (KEYSTRING TEXT UNIQUE NOT NULL, VALUESTRING TEXT, STATIC INTEGER DEFAULT 0, OPTIONAL INTEGER DEFAULT 0, COMMENTS TEXT DEFAULT '')",
+		"INSERT INTO CONFIG (KEYSTRING,VALUESTRING) VALUES ('Bench.Key.%u','%u')",
+		"KEYSTRING", "Bench.Key.%u", "VALUESTRING" },
+	{ "TMSI_TABLE",
+		"CREATE TABLE IF NOT EXISTS TMSI_TABLE (TMSI INTEGER PRIMARY KEY AUTOINCREMENT, CREATED INTEGER NOT NULL, ACCESSED INTEGER NOT NULL, IMSI TEXT UNIQUE NOT NULL, IMEI TEXT, L3TI INTEGER DEFAULT 0)",
+		"INSERT INTO TMSI_TABLE (CREATED,ACCESSED,IMSI) VALUES (0,0,'0010100000%05u')",
+		"IMSI", "0010100000%05u", "TMSI" },
+	{ "TRANSACTION_TABLE",
+		"CREATE TABLE IF NOT EXISTS TRANSACTION_TABLE (ID INTEGER PRIMARY KEY, CREATED INTEGER NOT NULL, CHANGED INTEGER NOT NULL, TYPE TEXT, SUBSCRIBER TEXT, L3TI INTEGER, SIP_CALLID TEXT, SIP_PROXY TEXT, CALLED TEXT, CALLING TEXT, GSMSTATE TEXT, SIPSTATE TEXT)",
+		"INSERT INTO TRANSACTION_TABLE (ID,CREATED,CHANGED,SUBSCRIBER,GSMSTATE) VALUES (%u,0,0,'IMSI001010000000001','active')",
+		"ID", "%u", "GSMSTATE" },
+};
+static const unsigned numTables = sizeof(tables)/sizeof(tables[0]);
+static const unsigned numRows = 1000;
+
+
+// The lookup as it was before the statement cache.
+static bool uncachedLookup(sqlite3 *DB, const BenchTable &table, const char *keyData)
+{
+	char query[200];
+	sprintf(query,"SELECT %s FROM %s WHERE %s == \"%s\"",table.value,table.name,table.key,keyData);
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_statement(DB,&stmt,query)) return false;
+	bool found = sqlite3_run_query(DB,stmt)==SQLITE_ROW;
+	sqlite3_finalize(stmt);
+	return found;
+}
+
+
+static double run(sqlite3 *DB, const BenchTable &table, unsigned lookups, bool cached)
+{
+	char keyData[50];
+	unsigned misses = 0;
+	Timeval start;
+	for (unsigned i=0; i<lookups; i++) {
+		sprintf(keyData,table.keyFormat,1+i%numRows);
+		bool found;
+		if (cached) {
+			char *value;
+			found = sqlite3_single_lookup(DB,table.name,table.key,keyData,table.value,value);
+			free(value);
+		} else {
+			found = uncachedLookup(DB,table,keyData);
+		}
+		if (!found) misses++;
+	}
+	long ms = start.elapsed();
+	if (misses) cout << "  " << misses << " lookups in " << table.name << " found nothing" << endl;
+	return ms ? 1000.0*lookups/ms : 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	unsigned lookups = argc>1 ? atoi(argv[1]) : 100000;
+
+	char path[100];
+	sprintf(path,"/tmp/Sqlite3utilTest-%d.db",getpid());
+	sqlite3 *DB;
+	if (sqlite3_open(path,&DB)) {
+		cout << "cannot open " << path << endl;
+		return 1;
+	}
+	sqlite3_busy_backoff(DB);
+
+	for (unsigned t=0; t<numTables; t++) {
+		sqlite3_command(DB,tables[t].create);
+		sqlite3_command(DB,"BEGIN TRANSACTION");
+		for (unsigned i=1; i<=numRows; i++) {
+			char query[300];
+			sprintf(query,tables[t].insert,i,i);
+			sqlite3_command(DB,query);
+		}
+		sqlite3_command(DB,"COMMIT TRANSACTION");
+	}
+
+	cout << lookups << " lookups per table, " << numRows << " rows" << endl;
+	for (int wal=0; wal<2; wal++) {
+		if (!sqlite3_set_wal(DB,wal)) cout << "cannot set journal mode" << endl;
+		for (unsigned t=0; t<numTables; t++) {
+			double before = run(DB,tables[t],lookups,false);
+			double after = run(DB,tables[t],lookups,true);
+			printf("%-18s %-8s prepared each time %8.0f/s, cached %8.0f/s, x%.1f\n",
+				tables[t].name,wal?"WAL":"rollback",before,after,before?after/before:0);
+		}
+	}
+
+	sqlite3_cached_finalize(DB);
+	sqlite3_close(DB);
+	unlink(path);
+	string wal = string(path) + "-wal";
+	string shm = string(path) + "-shm";
+	unlink(wal.c_str());
+	unlink(shm.c_str());
+	return 0;
+}
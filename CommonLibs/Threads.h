@@ -76,6 +76,9 @@ class Mutex {
 
 	void unlock() { pthread_mutex_unlock(&mMutex); }
 
+	/** Lock without waiting; return true if the lock was taken. */
+	bool trylock() { return pthread_mutex_trylock(&mMutex)==0; }
+
 	friend class Signal;
 
 };
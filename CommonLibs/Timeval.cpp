@@ -62,9 +62,18 @@ long Timeval::delta(const Timeval& other) const
 {
 	// 2^31 milliseconds is just over 4 years.
 	long deltaS = other.sec() - sec();
-	long deltaUs = other.usec() - usec();
+	// usec() is unsigned, so widen before subtracting or a negative difference wraps.
+	long deltaUs = (long)other.usec() - (long)usec();
 	return 1000*deltaS + deltaUs/1000;
 }
+
+long Timeval::deltaUsecs(const Timeval& other) const
+{
+	// 2^31 usecs is about 35 minutes; enough for a queueing delay.
+	long deltaS = other.sec() - sec();
+	long deltaUs = (long)other.usec() - (long)usec();
+	return 1000000*deltaS + deltaUs;
+}
 	
 
 
@@ -73,9 +73,15 @@ class Timeval {
 	/** Return differnce from other (other-self), in ms. */
 	long delta(const Timeval& other) const;
 
+	/** Return differnce from other (other-self), in usecs. */
+	long deltaUsecs(const Timeval& other) const;
+
 	/** Elapsed time in ms. */
 	long elapsed() const { return delta(Timeval()); }
 
+	/** Elapsed time in usecs. */
+	long elapsedUsecs() const { return deltaUsecs(Timeval()); }
+
 	/** Remaining time in ms. */
 	long remaining() const { return -elapsed(); }
 
@@ -16,10 +16,13 @@
 
 #include "sqlite3.h"
 #include "sqlite3util.h"
+#include "Threads.h"
 
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <map>
+#include <set>
 
 
 // Wrappers to sqlite operations.
@@ -29,15 +32,29 @@ const char* enableWAL = {
 	"PRAGMA journal_mode=WAL"
 };
 
+// Connections with the busyBackoff handler.  On those, SQLITE_BUSY means the handler
+// has already waited its 2 seconds, so the retry loops below do not wait again.
+// SQLITE_LOCKED does not go through the handler and is still retried.
+static Mutex& backoffLock() { static Mutex *lock = new Mutex; return *lock; }
+static std::set<sqlite3*>& backoffDBs() { static std::set<sqlite3*> *dbs = new std::set<sqlite3*>; return *dbs; }
+
+static bool hasBackoff(sqlite3* DB)
+{
+	ScopedLock lock(backoffLock());
+	return backoffDBs().count(DB)!=0;
+}
+
 int sqlite3_prepare_statement(sqlite3* DB, sqlite3_stmt **stmt, const char* query, unsigned retries)
 {
         int src = SQLITE_BUSY;
+	bool backoff = hasBackoff(DB);
 
 	for (unsigned i = 0; i < retries; i++) {
 		src = sqlite3_prepare_v2(DB,query,strlen(query),stmt,NULL);
 		if (src != SQLITE_BUSY && src != SQLITE_LOCKED) {
 			break;
 		}
+		if (src == SQLITE_BUSY && backoff) break;
 		usleep(200);
 	}
         if (src) {
@@ -50,12 +67,14 @@ int sqlite3_prepare_statement(sqlite3* DB, sqlite3_stmt **stmt, const char* quer
 int sqlite3_run_query(sqlite3* DB, sqlite3_stmt *stmt, unsigned retries)
 {
 	int src = SQLITE_BUSY;
+	bool backoff = hasBackoff(DB);
 
         for (unsigned i = 0; i < retries; i++) {
                 src = sqlite3_step(stmt);
 		if (src != SQLITE_BUSY && src != SQLITE_LOCKED) {
                         break;
                 }
+		if (src == SQLITE_BUSY && backoff) break;
                 usleep(200);
         }
 	if ((src!=SQLITE_DONE) && (src!=SQLITE_ROW)) {
@@ -65,20 +84,152 @@ int sqlite3_run_query(sqlite3* DB, sqlite3_stmt *stmt, unsigned retries)
 }
 
 
+// Idle prepared statements, by connection and then by SQL text.
+// A statement is checked out for the duration of one use, so threads sharing
+// a connection never step the same statement at once.
+typedef std::multimap<std::string,sqlite3_stmt*> StatementPool;
+typedef std::map<sqlite3*,StatementPool> StatementCache;
+
+// Constructed on first use, since the global ConfigurationTable does lookups during static initialization.
+static Mutex& statementCacheLock() { static Mutex *lock = new Mutex; return *lock; }
+static StatementCache& statementCache() { static StatementCache *cache = new StatementCache; return *cache; }
+
+// Bounds on what is kept idle, so a caller that builds many distinct query strings cannot grow the cache forever.
+static const unsigned sMaxIdlePerQuery = 4;
+static const unsigned sMaxIdlePerConnection = 256;
+
+
+sqlite3_stmt* sqlite3_cached_prepare(sqlite3* DB, const char* query, unsigned retries)
+{
+	{
+		ScopedLock lock(statementCacheLock());
+		StatementCache::iterator conn = statementCache().find(DB);
+		if (conn!=statementCache().end()) {
+			StatementPool::iterator itr = conn->second.find(query);
+			if (itr!=conn->second.end()) {
+				sqlite3_stmt *stmt = itr->second;
+				conn->second.erase(itr);
+				return stmt;
+			}
+		}
+	}
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_statement(DB,&stmt,query,retries)) return NULL;
+	return stmt;
+}
+
+
+void sqlite3_cached_release(sqlite3_stmt* stmt)
+{
+	if (!stmt) return;
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	ScopedLock lock(statementCacheLock());
+	StatementPool &pool = statementCache()[sqlite3_db_handle(stmt)];
+	std::string query = sqlite3_sql(stmt);
+	if (pool.size()>=sMaxIdlePerConnection || pool.count(query)>=sMaxIdlePerQuery) {
+		sqlite3_finalize(stmt);
+		return;
+	}
+	pool.insert(StatementPool::value_type(query,stmt));
+}
+
+
+void sqlite3_cached_finalize(sqlite3* DB)
+{
+	{
+		// The connection is about to close, and a new one may get its address.
+		ScopedLock lock(backoffLock());
+		backoffDBs().erase(DB);
+	}
+	ScopedLock lock(statementCacheLock());
+	StatementCache::iterator conn = statementCache().find(DB);
+	if (conn==statementCache().end()) return;
+	for (StatementPool::iterator itr = conn->second.begin(); itr!=conn->second.end(); ++itr) {
+		sqlite3_finalize(itr->second);
+	}
+	statementCache().erase(conn);
+}
+
+
+static bool bindArgs(sqlite3_stmt *stmt, const SqlArgs& args)
+{
+	for (unsigned i=0; i<args.size(); i++) {
+		if (sqlite3_bind_text(stmt,i+1,args[i].c_str(),args[i].size(),SQLITE_TRANSIENT)!=SQLITE_OK) {
+			fprintf(stderr,"cannot bind parameter %u of \"%s\"\n",i+1,sqlite3_sql(stmt));
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// Run a single-row query with bound arguments, leaving the statement positioned on the row.
+// Returns the prepared statement, to be released by the caller, or NULL if there is no row.
+static sqlite3_stmt* cachedRowQuery(sqlite3* DB, const char* query, const SqlArgs& args, unsigned retries)
+{
+	sqlite3_stmt *stmt = sqlite3_cached_prepare(DB,query,retries);
+	if (!stmt) return NULL;
+	if (!bindArgs(stmt,args) || sqlite3_run_query(DB,stmt,retries)!=SQLITE_ROW) {
+		sqlite3_cached_release(stmt);
+		return NULL;
+	}
+	return stmt;
+}
+
+
+bool sqlite3_single_lookup(sqlite3* DB, const char* query, const SqlArgs& args, unsigned &valueData, unsigned retries)
+{
+	sqlite3_stmt *stmt = cachedRowQuery(DB,query,args,retries);
+	if (!stmt) return false;
+	valueData = (unsigned)sqlite3_column_int64(stmt,0);
+	sqlite3_cached_release(stmt);
+	return true;
+}
+
+
+// This function returns an allocated string that must be free'd by the caller.
+bool sqlite3_single_lookup(sqlite3* DB, const char* query, const SqlArgs& args, char* &valueData, unsigned retries)
+{
+	valueData = NULL;
+	sqlite3_stmt *stmt = cachedRowQuery(DB,query,args,retries);
+	if (!stmt) return false;
+	const char* ptr = (const char*)sqlite3_column_text(stmt,0);
+	if (ptr) valueData = strdup(ptr);
+	sqlite3_cached_release(stmt);
+	return true;
+}
+
+
+bool sqlite3_command(sqlite3* DB, const char* query, const SqlArgs& args, unsigned retries)
+{
+	sqlite3_stmt *stmt = sqlite3_cached_prepare(DB,query,retries);
+	if (!stmt) return false;
+	int src = SQLITE_ERROR;
+	if (bindArgs(stmt,args)) src = sqlite3_run_query(DB,stmt,retries);
+	sqlite3_cached_release(stmt);
+	return (src==SQLITE_DONE || src==SQLITE_OK || src==SQLITE_ROW);
+}
+
+
+// The table, key and value names are identifiers from the code, not data,
+// so the query text depends only on them and the prepared statement can be reused.
+static std::string lookupQuery(const char* tableName, const char* keyName, const char* valueName)
+{
+	std::string query("SELECT ");
+	query.append(valueName).append(" FROM ").append(tableName).append(" WHERE ").append(keyName).append(" == ?");
+	return query;
+}
+
+
 bool sqlite3_exists(sqlite3* DB, const char *tableName,
 		const char* keyName, const char* keyData, unsigned retries)
 {
-	size_t stringSize = 100 + strlen(tableName) + strlen(keyName) + strlen(keyData);
-	char query[stringSize];
-	sprintf(query,"SELECT * FROM %s WHERE %s == \"%s\"",tableName,keyName,keyData);
-	// Prepare the statement.
-	sqlite3_stmt *stmt;
-	if (sqlite3_prepare_statement(DB,&stmt,query,retries)) return false;
-	// Read the result.
-	int src = sqlite3_run_query(DB,stmt,retries);
-	sqlite3_finalize(stmt);
-	// Anything there?
-	return (src == SQLITE_ROW);
+	std::string query = lookupQuery(tableName,keyName,"*");
+	sqlite3_stmt *stmt = cachedRowQuery(DB,query.c_str(),SqlArgs(1,keyData),retries);
+	if (!stmt) return false;
+	sqlite3_cached_release(stmt);
+	return true;
 }
 
 
@@ -87,21 +238,8 @@ bool sqlite3_single_lookup(sqlite3* DB, const char *tableName,
 		const char* keyName, const char* keyData,
 		const char* valueName, unsigned &valueData, unsigned retries)
 {
-	size_t stringSize = 100 + strlen(valueName) + strlen(tableName) + strlen(keyName) + strlen(keyData);
-	char query[stringSize];
-	sprintf(query,"SELECT %s FROM %s WHERE %s == \"%s\"",valueName,tableName,keyName,keyData);
-	// Prepare the statement.
-	sqlite3_stmt *stmt;
-	if (sqlite3_prepare_statement(DB,&stmt,query,retries)) return false;
-	// Read the result.
-	int src = sqlite3_run_query(DB,stmt,retries);
-	bool retVal = false;
-	if (src == SQLITE_ROW) {
-		valueData = (unsigned)sqlite3_column_int64(stmt,0);
-		retVal = true;
-	}
-	sqlite3_finalize(stmt);
-	return retVal;
+	std::string query = lookupQuery(tableName,keyName,valueName);
+	return sqlite3_single_lookup(DB,query.c_str(),SqlArgs(1,keyData),valueData,retries);
 }
 
 
@@ -110,23 +248,8 @@ bool sqlite3_single_lookup(sqlite3* DB, const char* tableName,
 		const char* keyName, const char* keyData,
 		const char* valueName, char* &valueData, unsigned retries)
 {
-	valueData=NULL;
-	size_t stringSize = 100 + strlen(valueName) + strlen(tableName) + strlen(keyName) + strlen(keyData);
-	char query[stringSize];
-	sprintf(query,"SELECT %s FROM %s WHERE %s == \"%s\"",valueName,tableName,keyName,keyData);
-	// Prepare the statement.
-	sqlite3_stmt *stmt;
-	if (sqlite3_prepare_statement(DB,&stmt,query,retries)) return false;
-	// Read the result.
-	int src = sqlite3_run_query(DB,stmt,retries);
-	bool retVal = false;
-	if (src == SQLITE_ROW) {
-		const char* ptr = (const char*)sqlite3_column_text(stmt,0);
-		if (ptr) valueData = strdup(ptr);
-		retVal = true;
-	}
-	sqlite3_finalize(stmt);
-	return retVal;
+	std::string query = lookupQuery(tableName,keyName,valueName);
+	return sqlite3_single_lookup(DB,query.c_str(),SqlArgs(1,keyData),valueData,retries);
 }
 
 
@@ -135,23 +258,10 @@ bool sqlite3_single_lookup(sqlite3* DB, const char* tableName,
 		const char* keyName, unsigned keyData,
 		const char* valueName, char* &valueData, unsigned retries)
 {
-	valueData=NULL;
-	size_t stringSize = 100 + strlen(valueName) + strlen(tableName) + strlen(keyName) + 20;
-	char query[stringSize];
-	sprintf(query,"SELECT %s FROM %s WHERE %s == %u",valueName,tableName,keyName,keyData);
-	// Prepare the statement.
-	sqlite3_stmt *stmt;
-	if (sqlite3_prepare_statement(DB,&stmt,query,retries)) return false;
-	// Read the result.
-	int src = sqlite3_run_query(DB,stmt,retries);
-	bool retVal = false;
-	if (src == SQLITE_ROW) {
-		const char* ptr = (const char*)sqlite3_column_text(stmt,0);
-		if (ptr) valueData = strdup(ptr);
-		retVal = true;
-	}
-	sqlite3_finalize(stmt);
-	return retVal;
+	std::string query = lookupQuery(tableName,keyName,valueName);
+	char keyString[20];
+	sprintf(keyString,"%u",keyData);
+	return sqlite3_single_lookup(DB,query.c_str(),SqlArgs(1,keyString),valueData,retries);
 }
 
 
@@ -170,3 +280,33 @@ bool sqlite3_command(sqlite3* DB, const char* query, unsigned retries)
 
 
 
+// Back off from 1 ms up to 32 ms per wait, for about 2 seconds in all.
+// The default handler, when one is set at all, polls at a fixed interval,
+// which either burns CPU or adds latency under contention.
+static int busyBackoff(void*, int count)
+{
+	static const int maxWaits = 70;
+	if (count>=maxWaits) return 0;
+	unsigned ms = count<5 ? (1<<count) : 32;
+	usleep(ms*1000);
+	return 1;
+}
+
+
+void sqlite3_busy_backoff(sqlite3* DB)
+{
+	sqlite3_busy_handler(DB,busyBackoff,NULL);
+	ScopedLock lock(backoffLock());
+	backoffDBs().insert(DB);
+}
+
+
+bool sqlite3_set_wal(sqlite3* DB, bool enable)
+{
+	// The journal mode is stored in the database file, so turning it off has to be explicit.
+	if (!sqlite3_command(DB,enable ? enableWAL : "PRAGMA journal_mode=DELETE")) return false;
+	// With WAL, NORMAL only risks the last transactions on power loss, never corruption.
+	if (enable) return sqlite3_command(DB,"PRAGMA synchronous=NORMAL");
+	return true;
+}
+
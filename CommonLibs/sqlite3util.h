@@ -16,6 +16,8 @@
 #define SQLITE3UTIL_H
 
 #include <sqlite3.h>
+#include <string>
+#include <vector>
 
 // (pat) Dont put statics in .h files - they generate a zillion g++ error messages.
 extern const char *enableWAL;
@@ -27,6 +29,29 @@ int sqlite3_prepare_statement(sqlite3* DB, sqlite3_stmt **stmt, const char* quer
 
 int sqlite3_run_query(sqlite3* DB, sqlite3_stmt *stmt, unsigned retries = 5);
 
+/**
+	Prepared statement cache.
+	sqlite3_cached_prepare returns an idle statement for this connection and query text,
+	or prepares a new one; NULL on failure.  sqlite3_cached_release resets the statement,
+	clears its bindings and returns it to the cache.  Call sqlite3_cached_finalize before
+	closing a connection that used the cache or sqlite3_busy_backoff.
+*/
+sqlite3_stmt* sqlite3_cached_prepare(sqlite3* DB, const char* query, unsigned retries = 5);
+void sqlite3_cached_release(sqlite3_stmt* stmt);
+void sqlite3_cached_finalize(sqlite3* DB);
+
+/** Values for the ? parameters of a query, bound in order as text. */
+typedef std::vector<std::string> SqlArgs;
+
+/** Run a cached query with bound parameters; return true if there was a row. */
+bool sqlite3_single_lookup(sqlite3* DB, const char* query, const SqlArgs& args, unsigned &valueData, unsigned retries = 5);
+
+// This function returns an allocated string that must be free'd by the caller.
+bool sqlite3_single_lookup(sqlite3* DB, const char* query, const SqlArgs& args, char* &valueData, unsigned retries = 5);
+
+/** Run a cached command with bound parameters, ignoring the result; return true on success. */
+bool sqlite3_command(sqlite3* DB, const char* query, const SqlArgs& args, unsigned retries = 5);
+
 bool sqlite3_single_lookup(sqlite3* DB, const char *tableName,
 		const char* keyName, const char* keyData,
 		const char* valueName, unsigned &valueData, unsigned retries = 5);
@@ -46,4 +71,14 @@ bool sqlite3_exists(sqlite3* DB, const char* tableName,
 /** Run a query, ignoring the result; return true on success. */
 bool sqlite3_command(sqlite3* DB, const char* query, unsigned retries = 5);
 
+/**
+	Install a busy handler that backs off exponentially, for about 2 seconds in all.
+	The retries arguments above then apply only to SQLITE_LOCKED, since a SQLITE_BUSY
+	result means the handler has already given up.
+*/
+void sqlite3_busy_backoff(sqlite3* DB);
+
+/** Switch the database to WAL journaling with synchronous=NORMAL, or back to a rollback journal. */
+bool sqlite3_set_wal(sqlite3* DB, bool enable);
+
 #endif
@@ -30,6 +30,7 @@
 
 #include "ControlCommon.h"
 #include "TransactionTable.h"
+#include "MediaEngine.h"
 #include "MobilityManagement.h"
 ////#include "SMSControl.h"
 #include "CallControl.h"
@@ -57,28 +58,6 @@ using namespace Control;
 
 
 
-/**
-	Return an even UDP port number for the RTP even/odd pair.
-*/
-unsigned allocateRTPPorts()
-{
-	// FIXME -- We need a real port allocator.
-	const unsigned base = gConfig.getNum("RTP.Start");
-	const unsigned range = gConfig.getNum("RTP.Range");
-	const unsigned top = base+range;
-	static Mutex lock;
-	// Pick a random starting point.
-	static unsigned port = base + 2*(random()%(range/2));
-	lock.lock();
-	unsigned retVal = port;
-	port += 2;
-	if (port>=top) port=base;
-	lock.unlock();
-	return retVal;
-}
-
-
-
 /**
 	Force clearing on the GSM side.
 	@param transaction The call transaction record.
@@ -411,46 +390,6 @@ bool callManagementDispatchGSM(TransactionEntry *transaction, UMTS::DTCHLogicalC
 
 
 
-
-
-/**
-	Update vocoder data transfers in both directions.
-	@param transaction The transaction object for this call.
-	@param TCH The traffic channel for this call.
-	@return True if anything was transferred.
-*/
-bool updateCallTraffic(TransactionEntry *transaction, UMTS::DTCHLogicalChannel *TCH)
-{
-	bool activity = false;
-
-	// Transfer in the downlink direction (RTP->GSM).
-	// Blocking call.  On average returns 1 time per 20 ms.
-	// Returns non-zero if anything really happened.
-	// Make the rxFrame buffer big enough for G.711.
-	unsigned char rxFrame[160];
-	if (transaction->rxFrame(rxFrame)) {
-		activity = true;
-		TCH->sendTCH(rxFrame);
-	}
-
-	// Transfer in the uplink direction (GSM->RTP).
-	// Flush FIFO to limit latency.
-	unsigned maxQ = gConfig.getNum("GSM.MaxSpeechLatency");
-	while (TCH->queueSize()>maxQ) delete[] TCH->recvTCH();
-	if (unsigned char *txFrame = TCH->recvTCH()) {
-		activity = true;
-		// Send on RTP.
-		transaction->txFrame(txFrame);
-		delete[] txFrame;
-	}
-
-	// Return a flag so the caller will know if anything transferred.
-	return activity;
-}
-
-
-
-
 /**
 	Check GSM signalling.
 	Can block for up to 52 GSM L1 frames (240 ms) because LCH::send is blocking.
@@ -577,11 +516,7 @@ bool pollInCall(TransactionEntry *transaction, UMTS::DTCHLogicalChannel *TCH)
 		return true;
 	}
 
-	// Transfer vocoder data.
-	// If anything happened, then the call is still up.
-	if (updateCallTraffic(transaction,TCH)) return false;
-
-	// If nothing happened, sleep so we don't burn up the CPU cycles.
+	// Vocoder data is moved by gMediaEngine, so this thread only paces its signalling checks.
 	msleep(50);
 	return false;
 }
@@ -617,8 +552,10 @@ bool waitInCall(TransactionEntry *transaction, UMTS::DTCHLogicalChannel *TCH, un
 void callManagementLoop(TransactionEntry *transaction, UMTS::DTCHLogicalChannel* TCH)
 {
 	LOG(INFO) << " call connected " << *transaction;
+	gMediaEngine.add(transaction,TCH);
 	// poll everything until the call is cleared
 	while (!pollInCall(transaction,TCH)) { }
+	gMediaEngine.remove(transaction);
 	gTransactionTable.remove(transaction);
 }
 
@@ -708,7 +645,12 @@ void Control::MOCStarter(const GSM::L3CMServiceRequest* req, UMTS::DTCHLogicalCh
 	// Engine methods will return their current state.	
 	// The remote party will start ringing soon.
 	LOG(DEBUG) << "starting SIP (INVITE) Calling "<<bcdDigits;
-	unsigned basePort = allocateRTPPorts();
+	unsigned basePort = transaction->allocateRTPPorts();
+	if (!basePort) {
+		delete msg_setup;
+		// Cause 0x22, "no circuit/channel available".
+		return abortAndRemoveCall(transaction,LCH,GSM::L3Cause(0x22));
+	}
 	transaction->MOCSendINVITE(bcdDigits,gConfig.getStr("SIP.Local.IP").c_str(),basePort,SIP::RTPGSM610);
 	LOG(DEBUG) << "transaction: " << *transaction;
 
@@ -970,7 +912,11 @@ void Control::MTCController(TransactionEntry *transaction, UMTS::DTCHLogicalChan
 
 	// FIXME -- We should also have a SIP.Timer.F timeout here.
 	LOG(INFO) << "allocating port and sending SIP OKAY";
-	unsigned RTPPorts = allocateRTPPorts();
+	unsigned RTPPorts = transaction->allocateRTPPorts();
+	if (!RTPPorts) {
+		// Cause 0x22, "no circuit/channel available".
+		return abortAndRemoveCall(transaction,TCH,GSM::L3Cause(0x22));
+	}
 	SIP::SIPState state = transaction->MTCSendOK(RTPPorts,SIP::RTPGSM610);
 	while (state!=SIP::Active) {
 		LOG(DEBUG) << "wait for SIP OKAY-ACK";
@@ -109,7 +109,12 @@ GSM::L3Message* getMessage(UMTS::LogicalChannel* LCH, unsigned SAPI=0);
 void FACCHDispatcher(UMTS::DTCHLogicalChannel *TCHFACCH);
 void SDCCHDispatcher(UMTS::DCCHLogicalChannel *SDCCH);
 //void DCCHDispatcher(UMTS::DCCHLogicalChannel *DCCH);
+/** The body of one DCCH dispatcher thread. */
 void DCCHDispatcher(void);
+/** Start the pool of Control.DCCH.Dispatchers dispatcher threads. */
+void DCCHDispatcherStart(void);
+/** Print the dispatcher pool and DCCH FIFO statistics. */
+void DCCHDispatcherText(std::ostream&);
 //@}
 
 
@@ -15,6 +15,8 @@
  * See the LEGAL file in the main directory for details.
  */
 
+#include <set>
+
 #include "ControlCommon.h"
 #include "TransactionTable.h"
 #include "RadioResource.h"
@@ -108,75 +110,172 @@ void DCCHDispatchMessage(const GSM::L3Message* msg, UMTS::DCCHLogicalChannel* DC
 
 DCCHLogicalChannelFIFO gDCCHLogicalChannelFIFO;
 
-/** Example of a closed-loop, persistent-thread control function for the DCCH. */
-//void Control::DCCHDispatcher(UMTS::DCCHLogicalChannel *DCCH)
+
+/**
+	Keeps track of which channels the dispatcher threads are working on.
+	A procedure on a channel reads the later frames from that channel itself,
+	so only one thread at a time may serve a given channel, which also serializes
+	all of the L3 procedures for each UE.
+	The global tables the procedures use, gTransactionTable and gTMSITable, do their own locking.
+*/
+class DCCHDispatcherPool {
+
+	private:
+
+	mutable Mutex mLock;
+	std::set<UMTS::DCCHLogicalChannel*> mBusy;	///< channels being served by some thread
+	unsigned mThreads;
+	unsigned mMaxBusy;
+	unsigned long mServed;			///< messages dispatched
+	unsigned long mOwned;			///< FIFO entries left to the thread already serving the channel
+	unsigned long mStale;			///< FIFO entries whose frame was already read by a procedure
+
+	public:
+
+	DCCHDispatcherPool()
+		:mThreads(0),mMaxBusy(0),mServed(0),mOwned(0),mStale(0)
+	{}
+
+	void threads(unsigned wThreads) { ScopedLock lock(mLock); mThreads = wThreads; }
+
+	/** Take ownership of a channel; return false if another thread has it or there is nothing to read. */
+	bool claim(UMTS::DCCHLogicalChannel *DCCH)
+	{
+		ScopedLock lock(mLock);
+		if (mBusy.count(DCCH)) { mOwned++; return false; }
+		// The frame for this entry may have been read by a procedure that has already finished.
+		if (DCCH->recvQSize()==0) { mStale++; return false; }
+		mBusy.insert(DCCH);
+		if (mBusy.size()>mMaxBusy) mMaxBusy = mBusy.size();
+		return true;
+	}
+
+	/**
+		Give up a channel; return false and keep it if there are more frames to dispatch.
+		Frames are queued on the channel before the channel goes into the FIFO,
+		so checking here under the lock means no frame is left behind.
+	*/
+	bool release(UMTS::DCCHLogicalChannel *DCCH)
+	{
+		ScopedLock lock(mLock);
+		mServed++;
+		if (DCCH->recvQSize()) return false;
+		mBusy.erase(DCCH);
+		return true;
+	}
+
+	void text(std::ostream& os) const
+	{
+		ScopedLock lock(mLock);
+		os << "DCCH dispatchers " << mThreads << ", busy " << mBusy.size() << ", max busy " << mMaxBusy << endl;
+		os << "  messages " << mServed << ", left to busy dispatcher " << mOwned << ", already read " << mStale << endl;
+	}
+};
+
+static DCCHDispatcherPool gDCCHDispatcherPool;
+
+
+/** Read the next message from a channel and run the procedure it starts. */
+static void DCCHDispatchChannel(UMTS::DCCHLogicalChannel *DCCH)
+{
+	try {
+		// Wait for a transaction to start.
+		LOG(DEBUG) << "waiting for " << *DCCH << " ESTABLISH";
+		DCCH->waitForPrimitive(GSM::ESTABLISH);
+		// Pull the first message and dispatch a new transaction.
+		const GSM::L3Message *message = getMessage(DCCH);
+		LOG(DEBUG) << *DCCH << " received " << *message;
+		DCCHDispatchMessage(message,DCCH);
+		delete message;
+	}
+
+	// Catch the various error cases.
+
+	catch (ChannelReadTimeout except) {
+		LOG(NOTICE) << "ChannelReadTimeout";
+		// Cause 0x03 means "abnormal release, timer expired".
+		DCCH->send(GSM::L3ChannelRelease(0x03));
+		gTransactionTable.remove(except.transactionID());
+	}
+	catch (UnexpectedPrimitive except) {
+		LOG(NOTICE) << "UnexpectedPrimitive";
+		// Cause 0x62 means "message type not not compatible with protocol state".
+		DCCH->send(GSM::L3ChannelRelease(0x62));
+		if (except.transactionID()) gTransactionTable.remove(except.transactionID());
+	}
+	catch (UnexpectedMessage except) {
+		LOG(NOTICE) << "UnexpectedMessage";
+		// Cause 0x62 means "message type not not compatible with protocol state".
+		DCCH->send(GSM::L3ChannelRelease(0x62));
+		if (except.transactionID()) gTransactionTable.remove(except.transactionID());
+	}
+	catch (UnsupportedMessage except) {
+		LOG(NOTICE) << "UnsupportedMessage";
+		// Cause 0x61 means "message type not implemented".
+		DCCH->send(GSM::L3ChannelRelease(0x61));
+		if (except.transactionID()) gTransactionTable.remove(except.transactionID());
+	}
+	catch (Q931TimerExpired except) {
+		LOG(NOTICE) << "Q.931 T3xx timer expired";
+		// Cause 0x03 means "abnormal release, timer expired".
+		// TODO -- Send diagnostics.
+		DCCH->send(GSM::L3ChannelRelease(0x03));
+		if (except.transactionID()) gTransactionTable.remove(except.transactionID());
+	}
+	catch (SIP::SIPTimeout except) {
+		// FIXME -- The transaction ID should be an argument here.
+		LOG(WARNING) << "Uncaught SIPTimeout, will leave a stray transcation";
+		// Cause 0x03 means "abnormal release, timer expired".
+		DCCH->send(GSM::L3ChannelRelease(0x03));
+		if (except.transactionID()) gTransactionTable.remove(except.transactionID());
+	}
+	catch (SIP::SIPError except) {
+		// FIXME -- The transaction ID should be an argument here.
+		LOG(WARNING) << "Uncaught SIPError, will leave a stray transcation";
+		// Cause 0x01 means "abnormal release, unspecified".
+		DCCH->send(GSM::L3ChannelRelease(0x01));
+		if (except.transactionID()) gTransactionTable.remove(except.transactionID());
+	}
+}
+
+
+/** The body of one dispatcher thread. */
 void Control::DCCHDispatcher()
 {
 	while (1) {
-                UMTS::DCCHLogicalChannel *DCCH = gDCCHLogicalChannelFIFO.read(20000);
-                if (DCCH==NULL) continue;
-		try {
-			// Wait for a transaction to start.
-			LOG(DEBUG) << "waiting for " << *DCCH << " ESTABLISH";
-			DCCH->waitForPrimitive(GSM::ESTABLISH);
-			// Pull the first message and dispatch a new transaction.
-			const GSM::L3Message *message = getMessage(DCCH);
-			LOG(DEBUG) << *DCCH << " received " << *message;
-			DCCHDispatchMessage(message,DCCH);
-			delete message;
-		}
-
-		// Catch the various error cases.
-
-		catch (ChannelReadTimeout except) {
-			LOG(NOTICE) << "ChannelReadTimeout";
-			// Cause 0x03 means "abnormal release, timer expired".
-			DCCH->send(GSM::L3ChannelRelease(0x03));
-			gTransactionTable.remove(except.transactionID());
-		}
-		catch (UnexpectedPrimitive except) {
-			LOG(NOTICE) << "UnexpectedPrimitive";
-			// Cause 0x62 means "message type not not compatible with protocol state".
-			DCCH->send(GSM::L3ChannelRelease(0x62));
-			if (except.transactionID()) gTransactionTable.remove(except.transactionID());
-		}
-		catch (UnexpectedMessage except) {
-			LOG(NOTICE) << "UnexpectedMessage";
-			// Cause 0x62 means "message type not not compatible with protocol state".
-			DCCH->send(GSM::L3ChannelRelease(0x62));
-			if (except.transactionID()) gTransactionTable.remove(except.transactionID());
-		}
-		catch (UnsupportedMessage except) {
-			LOG(NOTICE) << "UnsupportedMessage";
-			// Cause 0x61 means "message type not implemented".
-			DCCH->send(GSM::L3ChannelRelease(0x61));
-			if (except.transactionID()) gTransactionTable.remove(except.transactionID());
-		}
-		catch (Q931TimerExpired except) {
-			LOG(NOTICE) << "Q.931 T3xx timer expired";
-			// Cause 0x03 means "abnormal release, timer expired".
-			// TODO -- Send diagnostics.
-			DCCH->send(GSM::L3ChannelRelease(0x03));
-			if (except.transactionID()) gTransactionTable.remove(except.transactionID());
-		}
-		catch (SIP::SIPTimeout except) {
-			// FIXME -- The transaction ID should be an argument here.
-			LOG(WARNING) << "Uncaught SIPTimeout, will leave a stray transcation";
-			// Cause 0x03 means "abnormal release, timer expired".
-			DCCH->send(GSM::L3ChannelRelease(0x03));
-			if (except.transactionID()) gTransactionTable.remove(except.transactionID());
-		}
-		catch (SIP::SIPError except) {
-			// FIXME -- The transaction ID should be an argument here.
-			LOG(WARNING) << "Uncaught SIPError, will leave a stray transcation";
-			// Cause 0x01 means "abnormal release, unspecified".
-			DCCH->send(GSM::L3ChannelRelease(0x01));
-			if (except.transactionID()) gTransactionTable.remove(except.transactionID());
-		}
+		UMTS::DCCHLogicalChannel *DCCH = gDCCHLogicalChannelFIFO.read(20000);
+		if (DCCH==NULL) continue;
+		// If another thread is running a procedure on this channel, that procedure reads the frame.
+		if (!gDCCHDispatcherPool.claim(DCCH)) continue;
+		do {
+			DCCHDispatchChannel(DCCH);
+		} while (!gDCCHDispatcherPool.release(DCCH));
+	}
+}
+
+
+void Control::DCCHDispatcherStart()
+{
+	// With one thread, a slow HLR or SIP round trip in one procedure would hold up every other UE.
+	unsigned threads = gConfig.getNum("Control.DCCH.Dispatchers");
+	if (threads==0) threads = 1;
+	gDCCHDispatcherPool.threads(threads);
+	LOG(INFO) << "starting " << threads << " DCCH dispatcher threads";
+	for (unsigned i=0; i<threads; i++) {
+		// These run for the life of the process.
+		Thread *thread = new Thread;
+		thread->start((void *(*)(void *))Control::DCCHDispatcher, NULL);
 	}
 }
 
 
+void Control::DCCHDispatcherText(std::ostream& os)
+{
+	gDCCHDispatcherPool.text(os);
+	gDCCHLogicalChannelFIFO.text(os);
+}
+
+
 
 
 // vim: ts=4 sw=4
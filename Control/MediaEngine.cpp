@@ -0,0 +1,299 @@
+/**@file Speech path between RTP and the traffic channels for all calls. */
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+
+#include "MediaEngine.h"
+#include "TransactionTable.h"
+
+#include <UMTSLogicalChannel.h>
+#include <Configuration.h>
+#include <Logger.h>
+#undef WARNING
+
+
+using namespace std;
+using namespace Control;
+
+
+Control::MediaEngine gMediaEngine;
+
+
+// One vocoder frame.
+static const unsigned sTickMicroseconds = 20000;
+
+// RTP clock for GSM full rate, samples per ms.
+static const unsigned sSamplesPerMs = 8;
+
+// epoll data for the timer; transaction IDs are never 0.
+static const uint32_t sTimerKey = 0;
+
+static const unsigned sMaxEvents = 64;
+
+
+static void *MediaEngineServiceLoopAdapter(MediaEngine *engine)
+{
+	engine->serviceLoop();
+	return NULL;
+}
+
+
+MediaEngine::MediaEngine()
+	:mEpoll(-1),mTimer(-1),mStarted(false),
+	mTicks(0),mMissedTicks(0),mMaxTickTime(0),
+	mCallsDone(0),mTotalLate(0),mTotalDropped(0),mWorstJitter(0)
+{
+}
+
+
+void MediaEngine::start()
+{
+	// Caller holds mLock.
+	// This is deferred to the first call because the global engine is constructed before main.
+	mStarted = true;
+	mEpoll = epoll_create(sMaxEvents);
+	// Non-blocking, since remove() can stop the timer between epoll_wait and the read.
+	mTimer = timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK);
+	if (mEpoll<0 || mTimer<0) {
+		LOG(ALERT) << "cannot create media engine epoll or timer: " << strerror(errno);
+		return;
+	}
+	struct epoll_event ev;
+	memset(&ev,0,sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = sTimerKey;
+	if (epoll_ctl(mEpoll,EPOLL_CTL_ADD,mTimer,&ev)) {
+		LOG(ALERT) << "cannot add media engine timer to epoll set: " << strerror(errno);
+		return;
+	}
+	mThread.start((void*(*)(void*))MediaEngineServiceLoopAdapter,this);
+}
+
+
+void MediaEngine::armTimer(bool on)
+{
+	// Caller holds mLock.
+	// With no calls the timer is stopped so the engine thread sleeps.
+	struct itimerspec spec;
+	memset(&spec,0,sizeof(spec));
+	if (on) {
+		spec.it_interval.tv_nsec = sTickMicroseconds*1000;
+		spec.it_value.tv_nsec = sTickMicroseconds*1000;
+	}
+	if (timerfd_settime(mTimer,0,&spec,NULL)) LOG(ERR) << "cannot set media engine timer: " << strerror(errno);
+}
+
+
+void MediaEngine::add(TransactionEntry *transaction, UMTS::DTCHLogicalChannel *TCH)
+{
+	ScopedLock lock(mLock);
+	if (!mStarted) start();
+	if (mEpoll<0) {
+		LOG(ERR) << "no media engine, no speech for " << *transaction;
+		return;
+	}
+	unsigned ID = transaction->ID();
+	if (mCalls.count(ID)) return;
+
+	int socket = transaction->RTPSocket();
+	bool peekOffset = false;
+	if (socket>=0) {
+		// Edge triggered, so each packet is timed once and the tick does the reading.
+		// With a peek offset, each peek moves on to the next packet and RTP's reads move it back,
+		// so the engine can see every packet queued since the last edge without taking any.
+		int zero = 0;
+		peekOffset = setsockopt(socket,SOL_SOCKET,SO_PEEK_OFF,&zero,sizeof(zero))==0;
+		if (!peekOffset) LOG(INFO) << "no peek offset on RTP socket " << socket << ", jitter from the head packet only: " << strerror(errno);
+		struct epoll_event ev;
+		memset(&ev,0,sizeof(ev));
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.u32 = ID;
+		if (epoll_ctl(mEpoll,EPOLL_CTL_ADD,socket,&ev)) {
+			LOG(ERR) << "cannot add RTP socket " << socket << " to epoll set: " << strerror(errno);
+			socket = -1;
+		}
+	}
+	mCalls.insert(CallMap::value_type(ID,Call(transaction,TCH,socket,peekOffset)));
+	if (mCalls.size()==1) armTimer(true);
+	LOG(INFO) << "media for " << *transaction << ", " << mCalls.size() << " calls";
+}
+
+
+void MediaEngine::remove(TransactionEntry *transaction)
+{
+	ScopedLock lock(mLock);
+	CallMap::iterator itr = mCalls.find(transaction->ID());
+	if (itr==mCalls.end()) return;
+	if (itr->second.mSocket>=0) epoll_ctl(mEpoll,EPOLL_CTL_DEL,itr->second.mSocket,NULL);
+	retire(itr->second);
+	mCalls.erase(itr);
+	if (mCalls.empty()) armTimer(false);
+}
+
+
+void MediaEngine::retire(const Call& call)
+{
+	// Caller holds mLock.
+	mCallsDone++;
+	mTotalLate += call.mLate;
+	mTotalDropped += call.mDropped;
+	LOG(INFO) << "media for transaction " << call.mTransaction->ID() << " ended, downlink " << call.mDownlink
+		<< " uplink " << call.mUplink << " late " << call.mLate << " dropped " << call.mDropped << " busy " << call.mBusy
+		<< " max jitter " << call.mMaxJitter/sSamplesPerMs << " ms";
+}
+
+
+void MediaEngine::arrival(Call& call)
+{
+	// Caller holds mLock.
+	// An edge comes only with new packets, so peek until the socket is drained.
+	// A peek must take the whole packet to move the peek offset past it.
+	static unsigned char packet[65536];
+	while (true) {
+		ssize_t len = recv(call.mSocket,packet,sizeof(packet),MSG_PEEK|MSG_DONTWAIT);
+		if (len<0) return;		// EAGAIN, drained
+		if (len>=12) timePacket(call,packet);
+		if (!call.mPeekOffset) return;
+	}
+}
+
+
+void MediaEngine::timePacket(Call& call, const unsigned char *header)
+{
+	// Caller holds mLock.
+	uint32_t TS = (header[4]<<24) | (header[5]<<16) | (header[6]<<8) | header[7];
+	if (call.mHaveTransit && TS==call.mLastTS) return;
+
+	// RFC-3550 6.4.1, A.8.
+	uint32_t arrival = call.mStart.elapsed() * sSamplesPerMs;
+	int32_t transit = (int32_t)(arrival - TS);
+	if (call.mHaveTransit) {
+		int32_t d = transit - call.mTransit;
+		if (d<0) d = -d;
+		call.mJitter += (d - call.mJitter) / 16.0;
+		if (call.mJitter>call.mMaxJitter) call.mMaxJitter = call.mJitter;
+		if (call.mJitter>mWorstJitter) mWorstJitter = call.mJitter;
+	}
+	call.mTransit = transit;
+	call.mLastTS = TS;
+	call.mHaveTransit = true;
+}
+
+
+void MediaEngine::tick()
+{
+	// Caller holds mLock.
+	static const ConfigurationNum maxSpeechLatency(gConfig,"GSM.MaxSpeechLatency");
+	unsigned maxQ = maxSpeechLatency.get();
+
+	for (CallMap::iterator itr = mCalls.begin(); itr!=mCalls.end(); ++itr) {
+		Call &call = itr->second;
+		TransactionEntry *transaction = call.mTransaction;
+		UMTS::DTCHLogicalChannel *TCH = call.mTCH;
+
+		// The transaction lock keeps the call thread from changing the SIP state, starting DTMF
+		// or sending a BYE in the middle of a frame.  That thread also holds it while it waits
+		// for some SIP replies, so a busy call skips the tick instead of stalling the others.
+		if (!transaction->trylock()) {
+			call.mBusy++;
+			if (call.mReceiving) call.mLate++;
+			while (TCH->queueSize()>maxQ) {
+				delete[] TCH->recvTCH();
+				call.mDropped++;
+			}
+			continue;
+		}
+
+		// Downlink (RTP->GSM), one frame per tick.
+		// Make the rxFrame buffer big enough for G.711.
+		unsigned char rxFrame[160];
+		if (transaction->rxFrame(rxFrame)) {
+			call.mReceiving = true;
+			call.mDownlink++;
+			TCH->sendTCH(rxFrame);
+		} else if (call.mReceiving) {
+			call.mLate++;
+		}
+
+		// Uplink (GSM->RTP).
+		// Flush FIFO to limit latency.
+		while (TCH->queueSize()>maxQ) {
+			delete[] TCH->recvTCH();
+			call.mDropped++;
+		}
+		if (unsigned char *txFrame = TCH->recvTCH()) {
+			call.mUplink++;
+			transaction->txFrame(txFrame);
+			delete[] txFrame;
+		}
+		transaction->unlock();
+	}
+}
+
+
+void MediaEngine::serviceLoop()
+{
+	struct epoll_event events[sMaxEvents];
+	while (true) {
+		int n = epoll_wait(mEpoll,events,sMaxEvents,-1);
+		if (n<0) {
+			if (errno==EINTR) continue;
+			LOG(ALERT) << "media engine epoll_wait failed: " << strerror(errno);
+			return;
+		}
+		ScopedLock lock(mLock);
+		for (int i=0; i<n; i++) {
+			uint32_t key = events[i].data.u32;
+			if (key!=sTimerKey) {
+				CallMap::iterator itr = mCalls.find(key);
+				if (itr!=mCalls.end()) arrival(itr->second);
+				continue;
+			}
+			// EAGAIN if remove() stopped the timer after it fired: no tick.
+			uint64_t expirations;
+			if (read(mTimer,&expirations,sizeof(expirations))!=sizeof(expirations)) continue;
+			if (expirations>1) mMissedTicks += expirations-1;
+			mTicks++;
+			Timeval start;
+			tick();
+			long elapsed = start.elapsed();
+			if (elapsed>mMaxTickTime) mMaxTickTime = elapsed;
+		}
+	}
+}
+
+
+void MediaEngine::text(ostream& os) const
+{
+	ScopedLock lock(mLock);
+	os << "media engine: " << mCalls.size() << " calls, " << mCallsDone << " ended" << endl;
+	os << "  ticks " << mTicks << ", missed " << mMissedTicks << ", max tick time " << mMaxTickTime << " ms" << endl;
+	os << format("  ended calls: late frames %lu, dropped uplink frames %lu; worst jitter %.1f ms",
+		mTotalLate,mTotalDropped,mWorstJitter/sSamplesPerMs) << endl;
+	for (CallMap::const_iterator itr = mCalls.begin(); itr!=mCalls.end(); ++itr) {
+		const Call &call = itr->second;
+		os << format("  %u: downlink %lu uplink %lu late %lu dropped %lu busy %lu jitter %.1f ms max %.1f ms",
+			itr->first,call.mDownlink,call.mUplink,call.mLate,call.mDropped,call.mBusy,
+			call.mJitter/sSamplesPerMs,call.mMaxJitter/sSamplesPerMs) << endl;
+	}
+}
+
+
+// vim: ts=4 sw=4
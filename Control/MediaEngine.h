@@ -0,0 +1,132 @@
+/**@file Speech path between RTP and the traffic channels for all calls. */
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#ifndef MEDIAENGINE_H
+#define MEDIAENGINE_H
+
+#include <map>
+#include <iostream>
+#include <stdint.h>
+
+#include <Timeval.h>
+#include <Threads.h>
+
+
+namespace UMTS {
+class DTCHLogicalChannel;
+}
+
+
+namespace Control {
+
+class TransactionEntry;
+
+/**
+	Moves vocoder frames between RTP and the traffic channels of all active calls from one thread.
+	A timerfd ticks every 20 ms, and on each tick every call gets one downlink frame
+	from RTP and sends its newest uplink frame on RTP, as updateCallTraffic used to do
+	in each call's own thread.  The RTP sockets are in an epoll set with the timer
+	so the engine sees each packet arrive and can measure the RFC-3550 interarrival jitter.
+	The call control threads only handle signalling.
+*/
+class MediaEngine {
+
+	private:
+
+	struct Call {
+		TransactionEntry *mTransaction;
+		UMTS::DTCHLogicalChannel *mTCH;
+		int mSocket;				///< RTP socket, or -1 if not in the epoll set
+		bool mPeekOffset;			///< SO_PEEK_OFF is set, so peeks can walk the socket queue
+		Timeval mStart;				///< arrival times are measured from here
+		bool mReceiving;			///< a downlink frame has arrived
+		bool mHaveTransit;
+		uint32_t mLastTS;			///< RTP timestamp of the last packet timed
+		int32_t mTransit;			///< arrival time minus RTP timestamp, in 8 kHz samples
+		double mJitter;				///< RFC-3550 6.4.1 interarrival jitter, in 8 kHz samples
+		double mMaxJitter;
+		unsigned long mDownlink;	///< frames RTP->TCH
+		unsigned long mUplink;		///< frames TCH->RTP
+		unsigned long mLate;		///< ticks with no downlink frame after the first one arrived
+		unsigned long mDropped;		///< uplink frames flushed to limit latency
+		unsigned long mBusy;		///< ticks skipped because the call thread held the transaction lock
+
+		Call(TransactionEntry *wTransaction, UMTS::DTCHLogicalChannel *wTCH, int wSocket, bool wPeekOffset)
+			:mTransaction(wTransaction),mTCH(wTCH),mSocket(wSocket),mPeekOffset(wPeekOffset),
+			mReceiving(false),mHaveTransit(false),mLastTS(0),mTransit(0),mJitter(0),mMaxJitter(0),
+			mDownlink(0),mUplink(0),mLate(0),mDropped(0),mBusy(0)
+		{}
+	};
+
+	typedef std::map<unsigned,Call> CallMap;	///< by transaction ID
+
+	mutable Mutex mLock;		///< guards everything below; held while a tick runs
+	CallMap mCalls;
+	int mEpoll;
+	int mTimer;					///< the 20 ms tick, armed only while there are calls
+	bool mStarted;
+	Thread mThread;
+
+	/**@name Statistics. */
+	//@{
+	unsigned long mTicks;
+	unsigned long mMissedTicks;		///< timer expirations the engine was too late to see
+	long mMaxTickTime;				///< ms
+	unsigned long mCallsDone;
+	unsigned long mTotalLate;		///< late frames of calls that have ended
+	unsigned long mTotalDropped;	///< dropped frames of calls that have ended
+	double mWorstJitter;			///< highest jitter seen in any call, samples
+	//@}
+
+	void start();
+	void armTimer(bool on);
+
+	/** Move one frame each way for every call. */
+	void tick();
+
+	/** Time the packets that have arrived on a call's RTP socket, leaving them for RTP to read. */
+	void arrival(Call&);
+
+	/** Update a call's jitter from the RTP header of a packet that has just arrived. */
+	void timePacket(Call&, const unsigned char *header);
+
+	void retire(const Call&);
+
+	public:
+
+	MediaEngine();
+
+	/** Start moving speech for a connected call. */
+	void add(TransactionEntry *transaction, UMTS::DTCHLogicalChannel *TCH);
+
+	/** Stop moving speech for a call; after this returns the engine no longer uses the transaction. */
+	void remove(TransactionEntry *transaction);
+
+	/** The thread body. */
+	void serviceLoop();
+
+	/** Print tick timing and per-call jitter and late-frame counts. */
+	void text(std::ostream&) const;
+};
+
+}	// namespace Control
+
+
+extern Control::MediaEngine gMediaEngine;
+
+
+#endif
+
+// vim: ts=4 sw=4
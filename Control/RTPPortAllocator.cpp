@@ -0,0 +1,127 @@
+/**@file Allocation of the RTP/RTCP UDP port pairs used for speech. */
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#include <stdlib.h>
+
+#include "RTPPortAllocator.h"
+
+#include <Globals.h>
+#include <Logger.h>
+#undef WARNING
+
+
+using namespace std;
+using namespace Control;
+
+
+Control::RTPPortAllocator gRTPPortAllocator;
+
+
+// A pair reused sooner than this after its release may still get packets for the old call.
+static const time_t sQuickReuse = 2;
+
+
+RTPPortAllocator::RTPPortAllocator()
+	:mStarted(false),mBase(0),mPairs(0),mNext(0),
+	mCount(0),mMaxCount(0),mAllocations(0),mExhausted(0),mQuickReuse(0),mBadReleases(0)
+{
+}
+
+
+void RTPPortAllocator::start()
+{
+	// Caller holds mLock.
+	// This is deferred to the first call because the global allocator is constructed before main.
+	// RTP.Start and RTP.Range are static, so the pool never changes after this.
+	mStarted = true;
+	mBase = gConfig.getNum("RTP.Start") & ~1U;
+	mPairs = gConfig.getNum("RTP.Range") / 2;
+	mInUse.assign((mPairs+31)/32,0);
+	mReleased.assign(mPairs,0);
+	// Start at a random point, so a restart does not hand out the ports of the calls it just dropped.
+	if (mPairs) mNext = random() % mPairs;
+	LOG(INFO) << "RTP ports " << mBase << " to " << mBase+2*mPairs-1 << ", " << mPairs << " pairs";
+}
+
+
+unsigned RTPPortAllocator::allocate()
+{
+	ScopedLock lock(mLock);
+	if (!mStarted) start();
+	mAllocations++;
+	if (mCount>=mPairs) {
+		mExhausted++;
+		LOG(ALERT) << "all " << mPairs << " RTP port pairs in use";
+		return 0;
+	}
+
+	// Scan a word at a time from mNext, wrapping around once.
+	// The first word is masked so the search really starts at mNext,
+	// and the bits below mNext in it are looked at again at the end.
+	unsigned words = mInUse.size();
+	unsigned word = mNext / 32;
+	uint32_t skip = (1U << (mNext % 32)) - 1;
+	for (unsigned n=0; n<=words; n++) {
+		unsigned w = (word+n) % words;
+		uint32_t free = ~(mInUse[w] | (n==0 ? skip : 0));
+		// The bits past the last pair are never free.
+		if (w==words-1 && mPairs%32) free &= (1U << (mPairs%32)) - 1;
+		if (!free) continue;
+		unsigned pair = w*32 + __builtin_ctz(free);
+		mInUse[w] |= 1U << (pair%32);
+		mNext = (pair+1) % mPairs;
+		mCount++;
+		if (mCount>mMaxCount) mMaxCount = mCount;
+		if (mReleased[pair] && time(NULL)-mReleased[pair] < sQuickReuse) mQuickReuse++;
+		return mBase + 2*pair;
+	}
+	// Not reached while mCount is right.
+	LOG(ERR) << "RTP port bitmap inconsistent, " << mCount << " of " << mPairs << " in use";
+	mExhausted++;
+	return 0;
+}
+
+
+void RTPPortAllocator::release(unsigned port)
+{
+	if (!port) return;
+	ScopedLock lock(mLock);
+	unsigned pair = (port-mBase)/2;
+	if (!mStarted || port<mBase || (port-mBase)%2 || pair>=mPairs || !(mInUse[pair/32] & (1U << (pair%32)))) {
+		LOG(ERR) << "release of unallocated RTP port " << port;
+		mBadReleases++;
+		return;
+	}
+	mInUse[pair/32] &= ~(1U << (pair%32));
+	mReleased[pair] = time(NULL);
+	mCount--;
+}
+
+
+void RTPPortAllocator::text(ostream& os) const
+{
+	ScopedLock lock(mLock);
+	if (!mStarted) {
+		os << "RTP ports: none allocated yet" << endl;
+		return;
+	}
+	os << "RTP ports " << mBase << " to " << mBase+2*mPairs-1 << ": "
+		<< mCount << " of " << mPairs << " pairs in use, max " << mMaxCount << endl;
+	os << "  allocations " << mAllocations << ", exhausted " << mExhausted
+		<< ", reused within " << sQuickReuse << " s " << mQuickReuse << ", bad releases " << mBadReleases << endl;
+}
+
+
+// vim: ts=4 sw=4
@@ -0,0 +1,83 @@
+/**@file Allocation of the RTP/RTCP UDP port pairs used for speech. */
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#ifndef RTPPORTALLOCATOR_H
+#define RTPPORTALLOCATOR_H
+
+#include <vector>
+#include <iostream>
+#include <stdint.h>
+#include <time.h>
+
+#include <Threads.h>
+
+
+namespace Control {
+
+/**
+	Hands out the even/odd port pairs from RTP.Start to RTP.Start+RTP.Range-1
+	and tracks which are in use until they are released.
+	The pairs are kept as a bitmap, one bit per pair, set while in use.
+	The search for a free pair starts where the last one ended and skips
+	full 32-bit words, so a pair that was just released is the last to be reused,
+	giving late packets for an old call time to drain.
+*/
+class RTPPortAllocator {
+
+	private:
+
+	mutable Mutex mLock;
+	bool mStarted;
+	unsigned mBase;					///< first port, even
+	unsigned mPairs;				///< number of port pairs
+	std::vector<uint32_t> mInUse;	///< bitmap, one bit per pair
+	std::vector<time_t> mReleased;	///< when each pair was last released, 0 if never
+	unsigned mNext;					///< pair where the next search starts
+
+	/**@name Statistics. */
+	//@{
+	unsigned mCount;				///< pairs in use
+	unsigned mMaxCount;
+	unsigned long mAllocations;
+	unsigned long mExhausted;		///< allocations that found no free pair
+	unsigned long mQuickReuse;		///< pairs handed out within sQuickReuse seconds of their release
+	unsigned long mBadReleases;		///< releases of ports that were not allocated
+	//@}
+
+	void start();
+
+	public:
+
+	RTPPortAllocator();
+
+	/** Return the even port of a free pair and mark it in use, or 0 if all are in use. */
+	unsigned allocate();
+
+	/** Return a pair from allocate() to the pool. */
+	void release(unsigned port);
+
+	/** Print the pool occupancy and counters. */
+	void text(std::ostream&) const;
+};
+
+}	// namespace Control
+
+
+extern Control::RTPPortAllocator gRTPPortAllocator;
+
+
+#endif
+
+// vim: ts=4 sw=4
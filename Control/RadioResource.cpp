@@ -27,6 +27,9 @@
 #include <UMTSConfig.h>
 
 #include "TransactionTable.h"
+#include <Globals.h>
+#include <UMTSL1FEC.h>
+#include <URRCMessages.h>
 
 #include <Logger.h>
 #undef WARNING
@@ -40,28 +43,97 @@ using namespace Control;
 
 
 
+// 3GPP 25.304 8.3: the paging occasion is (IMSI div K) mod (DRX cycle length div PBP) * PBP,
+// with K the number of SCCPCHs carrying a PCH and PBP the paging block periodicity, both 1 here.
+// The cycle length is 2^k frames with k at most 9, so we keep IMSI mod 512 in each entry,
+// which gives the occasion for any cycle length without looking up the IMSI again.
+static const unsigned sMaxCycle = 512;
+
+// Transport block size of the PCH when there is no PCH to ask.
+static const unsigned sPchTBSize = 240;
+
+static unsigned pagingOccasion(const GSM::L3MobileIdentity& ID)
+{
+	const char *digits = NULL;
+	char *IMSI = NULL;
+	switch (ID.type()) {
+		case GSM::IMSIType: digits = ID.digits(); break;
+		case GSM::TMSIType: digits = IMSI = gTMSITable.IMSI(ID.TMSI()); break;
+		default: break;
+	}
+	// A phone we know only by an unassigned TMSI gets occasion 0, which may not be its own.
+	if (!digits) return 0;
+	unsigned occasion = 0;
+	for (const char *dp = digits; *dp; dp++) {
+		if (*dp<'0' || *dp>'9') continue;
+		occasion = (occasion*10 + (*dp-'0')) % sMaxCycle;
+	}
+	if (IMSI) free(IMSI);
+	return occasion;
+}
+
+
+unsigned Pager::resizeWheel()
+{
+	// Caller holds mLock.
+	static const ConfigurationNum cycleCoeff(gConfig,"UMTS.CN-DSI.CycleLengthCoeff");
+	long k = cycleCoeff;
+	if (k<6) k = 6;
+	if (k>9) k = 9;
+	unsigned cycle = 1 << k;
+	if (mWheel.size()==cycle) return cycle;
+
+	if (mWheel.size()) LOG(NOTICE) << "DRX cycle changed from " << mWheel.size() << " to " << cycle << " frames";
+	std::vector<PagingEntryList> wheel(cycle);
+	for (unsigned i=0; i<mWheel.size(); i++) {
+		PagingEntryList &slot = mWheel[i];
+		while (slot.size()) {
+			PagingEntryList &dest = wheel[slot.front().occasion() % cycle];
+			dest.splice(dest.end(),slot,slot.begin());
+		}
+	}
+	mWheel.swap(wheel);
+	return cycle;
+}
+
+
+bool Pager::find(const GSM::L3MobileIdentity& ID, PagingEntryList*& slot, PagingEntryList::iterator& lp)
+{
+	// Caller holds mLock.
+	// Use the occasion the entry was added with, not a new one from the TMSI table, which may have changed since.
+	std::map<GSM::L3MobileIdentity,unsigned>::const_iterator where = mOccasions.find(ID);
+	if (where==mOccasions.end()) return false;
+	slot = &mWheel[where->second % mWheel.size()];
+	for (lp = slot->begin(); lp != slot->end(); ++lp) {
+		if (lp->ID()==ID) return true;
+	}
+	LOG(ERR) << ID << " not in the slot of its paging occasion " << where->second;
+	return false;
+}
+
+
 void Pager::addID(const GSM::L3MobileIdentity& newID, UMTS::ChannelTypeL3 chanType,
 		TransactionEntry& transaction, unsigned wLife)
 {
 	transaction.GSMState(GSM::Paging);
 	transaction.setTimer("3113",wLife);
+	unsigned occasion = pagingOccasion(newID);
 	// Add a mobile ID to the paging list for a given lifetime.
 	ScopedLock lock(mLock);
+	unsigned cycle = resizeWheel();
 	// If this ID is already in the list, just reset its timer.
-	// Uhg, another linear time search.
-	// This would be faster if the paging list were ordered by ID.
-	// But the list should usually be short, so it may not be worth the effort.
-	for (PagingEntryList::iterator lp = mPageIDs.begin(); lp != mPageIDs.end(); ++lp) {
-		if (lp->ID()==newID) {
-			LOG(DEBUG) << newID << " already in table";
-			lp->renew(wLife);
-			mPageSignal.signal();
-			return;
-		}
+	PagingEntryList *slot;
+	PagingEntryList::iterator lp;
+	if (find(newID,slot,lp)) {
+		LOG(DEBUG) << newID << " already in table";
+		lp->renew(wLife);
+		mPageSignal.signal();
+		return;
 	}
 	// If this ID is new, put it in the list.
-	mPageIDs.push_back(PagingEntry(newID,chanType,transaction.ID(),wLife));
-	LOG(INFO) << newID << " added to table";
+	mWheel[occasion % cycle].push_back(PagingEntry(newID,chanType,transaction.ID(),wLife,occasion));
+	mOccasions[newID] = occasion;
+	LOG(INFO) << newID << " added to table, paging occasion " << occasion % cycle;
 	mPageSignal.signal();
 }
 
@@ -71,57 +143,82 @@ unsigned Pager::removeID(const GSM::L3MobileIdentity& delID)
 	// Return the associated transaction ID, or 0 if none found.
 	LOG(INFO) << delID;
 	ScopedLock lock(mLock);
-	for (PagingEntryList::iterator lp = mPageIDs.begin(); lp != mPageIDs.end(); ++lp) {
-		if (lp->ID()==delID) {
-			unsigned retVal = lp->transactionID();
-			mPageIDs.erase(lp);
-			return retVal;
-		}
-	}
-	return 0;
+	PagingEntryList *slot;
+	PagingEntryList::iterator lp;
+	if (!find(delID,slot,lp)) return 0;
+	unsigned retVal = lp->transactionID();
+	slot->erase(lp);
+	mOccasions.erase(delID);
+	return retVal;
 }
 
 
 
-unsigned Pager::pageAll()
+unsigned Pager::pageOccasion(int FN)
 {
-	// Traverse the full list and page all IDs.
+	// Page the IDs whose paging occasion is this frame.
 	// Remove expired IDs.
 	// Return the number of IDs paged.
-	// This is a linear time operation.
 
 	ScopedLock lock(mLock);
+	PagingEntryList &slot = mWheel[FN % mWheel.size()];
 
 	// Clear expired entries.
-	PagingEntryList::iterator lp = mPageIDs.begin();
-	while (lp != mPageIDs.end()) {
+	PagingEntryList::iterator lp = slot.begin();
+	while (lp != slot.end()) {
 		if (!lp->expired()) ++lp;
 		else {
 			LOG(INFO) << "erasing " << lp->ID();
 			// Non-responsive, dead transaction?
 			gTransactionTable.removePaging(lp->transactionID());
 			// remove from the list
-			lp=mPageIDs.erase(lp);
+			mOccasions.erase(lp->ID());
+			lp=slot.erase(lp);
 		}
 	}
+	if (slot.empty()) return 0;
 
-	LOG(INFO) << "paging " << mPageIDs.size() << " mobile(s)";
-
-	// Page remaining entries, two at a time if possible.
-	// These PCH send operations are non-blocking.
-	lp = mPageIDs.begin();
-	while (lp != mPageIDs.end()) {
-		// TODO UMTS -- This needs a rewrite for UMTS.
-		assert(0);
+	// Pack as many records as fit into one transport block.
+	// Whoever does not fit goes to the back of the slot and is paged first in the next cycle.
+	std::vector<PagingRecordInfo> pages;
+	for (lp = slot.begin(); lp != slot.end(); ++lp) {
+		pages.push_back(PagingRecordInfo(&lp->ID(),lp->type()==UMTS::DTCHType));
+	}
+	PCHFEC *pch = gNodeB.mPchFec;
+	unsigned tbSize = pch ? pch->l1GetDlTrBkSz() : sPchTBSize;
+	ByteVector msg(tbSize/8+32);
+	unsigned paged = encodePagingType1(pages,0,tbSize,msg);
+	if (paged==0) {
+		LOG(ERR) << "cannot encode paging record for " << slot.front().ID();
+		paged = 1;
+	} else {
+		TransportBlock tb(tbSize,UMTS::Time(FN));
+		tb.zero();
+		tb.segment(0,msg.sizeBits()).unpack(msg.begin());
+		tb.mDescr = "PagingType1";
+		if (pch) pch->l1WriteHighSide(tb);
+		else mStats.mUnsent++;
+
+		float fill = (float)msg.sizeBits() / tbSize;
+		mStats.mLastFill = fill;
+		mStats.mFill[fill>=1 ? 9 : (unsigned)(fill*10)]++;
+		mStats.mOccasions++;
+		mStats.mRecords += paged;
+		mStats.mBitsUsed += msg.sizeBits();
+		mStats.mDeferred += pages.size() - paged;
 	}
+	LOG(INFO) << "paging " << paged << " of " << pages.size() << " mobile(s) at FN " << FN;
+	lp = slot.begin();
+	for (unsigned n=0; n<paged; n++) ++lp;
+	slot.splice(slot.end(),slot,slot.begin(),lp);
 
-	return mPageIDs.size();
+	return paged;
 }
 
 size_t Pager::pagingEntryListSize()
 {
 	ScopedLock lock(mLock);
-	return mPageIDs.size();
+	return mOccasions.size();
 }
 
 void Pager::start()
@@ -145,18 +242,27 @@ void Pager::serviceLoop()
 
 		LOG(DEBUG) << "Pager blocking for signal";
 		mLock.lock();
-		while (mPageIDs.size()==0) mPageSignal.wait(mLock);
+		while (mOccasions.empty()) mPageSignal.wait(mLock);
+		unsigned cycle = resizeWheel();
+
+		// Start from the current frame on the first pass, or if we fell more than a cycle behind.
+		int now = gNodeB.clock().FN() % gHyperframe;
+		if (mNextFN<0 || FNDelta(now,mNextFN) > (int)cycle) mNextFN = now;
+
+		// Find the next paging occasion that has someone to page.
+		// The cycle divides the hyperframe, so the slot of a frame does not depend on the hyperframe wrap.
+		unsigned ahead = 0;
+		while (ahead<cycle && mWheel[(mNextFN+ahead) % cycle].empty()) ahead++;
+		int FN = (mNextFN+ahead) % gHyperframe;
+		int delay = FNDelta(FN,now);
+		if (delay>0) {
+			// Wait for it, or for a new ID that may have an earlier occasion.
+			mPageSignal.wait(mLock,delay*gFrameMicroseconds/1000);
+		} else {
+			pageOccasion(FN);
+			mNextFN = (FN+1) % gHyperframe;
+		}
 		mLock.unlock();
-
-		// page everything
-		pageAll();
-
-		// Wait for pending activity to clear the channel.
-		// TODO UMTS -- Needs to be written for UMTS.
-		// This wait is what causes PCH to have lower priority than AGCH.
-		//unsigned load = gNodeB.getPCH()->load();
-		//LOG(DEBUG) << "Pager waiting for " << load << " multiframes";
-		//if (load) usleep(UMTS::gFrameMicroseconds*load);
 	}
 }
 
@@ -165,10 +271,24 @@ void Pager::serviceLoop()
 void Pager::dump(ostream& os) const
 {
 	ScopedLock lock(mLock);
-	PagingEntryList::const_iterator lp = mPageIDs.begin();
-	while (lp != mPageIDs.end()) {
-		os << lp->ID() << " " << lp->type() << " " << lp->expired() << endl;
-		++lp;
+	for (unsigned i=0; i<mWheel.size(); i++) {
+		PagingEntryList::const_iterator lp = mWheel[i].begin();
+		while (lp != mWheel[i].end()) {
+			os << lp->ID() << " " << lp->type() << " " << lp->expired() << " occasion=" << i << endl;
+			++lp;
+		}
+	}
+	const PagingStats &s = mStats;
+	os << "DRX cycle " << mWheel.size() << " frames, " << mOccasions.size() << " mobile(s) waiting" << endl;
+	os << "occasions " << s.mOccasions << " records " << s.mRecords << " deferred " << s.mDeferred
+		<< " unsent blocks " << s.mUnsent << endl;
+	if (s.mOccasions) {
+		unsigned tbSize = gNodeB.mPchFec ? gNodeB.mPchFec->l1GetDlTrBkSz() : sPchTBSize;
+		os << format("fill mean %.0f%% last %.0f%% records/occasion %.2f",
+			100.0*s.mBitsUsed/(s.mOccasions*tbSize),100.0*s.mLastFill,(double)s.mRecords/s.mOccasions) << endl;
+		os << "fill histogram";
+		for (unsigned i=0; i<10; i++) os << " " << i*10 << "%:" << s.mFill[i];
+		os << endl;
 	}
 }
 
@@ -20,6 +20,9 @@
 #define RADIORESOURCE_H
 
 #include <list>
+#include <map>
+#include <vector>
+#include <string.h>
 
 #include <GSML3CommonElements.h>
 #include <UMTSCommon.h>
@@ -109,6 +112,7 @@ class PagingEntry {
 	UMTS::ChannelTypeL3 mType;		///< The needed channel type.
 	unsigned mTransactionID;		///< The associated transaction ID.
 	Timeval mExpiration;			///< The expiration time for this entry.
+	unsigned mOccasion;				///< The frame in the DRX cycle when the UE reads the PCH.
 
 	public:
 
@@ -116,10 +120,11 @@ class PagingEntry {
 		Create a new entry, with current timestamp.
 		@param wID The ID to be paged.
 		@param wLife The number of milliseconds to keep paging.
+		@param wOccasion The paging occasion of the UE.
 	*/
 	PagingEntry(const GSM::L3MobileIdentity& wID, UMTS::ChannelTypeL3 wType,
-			unsigned wTransactionID, unsigned wLife)
-		:mID(wID),mType(wType),mTransactionID(wTransactionID),mExpiration(wLife)
+			unsigned wTransactionID, unsigned wLife, unsigned wOccasion)
+		:mID(wID),mType(wType),mTransactionID(wTransactionID),mExpiration(wLife),mOccasion(wOccasion)
 	{}
 
 	/** Access the ID. */
@@ -136,23 +141,44 @@ class PagingEntry {
 	/** Returns true if the entry is expired. */
 	bool expired() const { return mExpiration.passed(); }
 
+	unsigned occasion() const { return mOccasion; }
+	void occasion(unsigned wOccasion) { mOccasion = wOccasion; }
+
 };
 
 typedef std::list<PagingEntry> PagingEntryList;
 
 
+/** Counters for the paging occasions served, to show how well the PCH transport blocks are used. */
+struct PagingStats {
+	unsigned long mOccasions;		///< occasions that had anyone to page
+	unsigned long mRecords;			///< paging records sent
+	unsigned long mDeferred;		///< records that did not fit and waited for the next cycle
+	unsigned long mBitsUsed;		///< message bits in the transport blocks
+	unsigned long mUnsent;			///< blocks built with no PCH to send them on
+	unsigned long mFill[10];		///< occasions by transport block fill ratio, in 10% steps
+	float mLastFill;				///< fill ratio of the most recent occasion
+
+	PagingStats() { memset(this,0,sizeof(*this)); }
+};
+
+
 /**
-	The pager is a global object that generates paging messages on the CCCH.
+	The pager is a global object that generates paging messages on the PCH.
 	To page a mobile, add the mobile ID to the pager.
 	The entry will be deleted automatically when it expires.
-	All pager operations are linear time.
-	Not much point in optimizing since the main operation is inherently linear.
+	Pending IDs are kept in a timing wheel with one slot per frame of the DRX cycle,
+	so each pass only looks at the IDs whose paging occasion has come up,
+	and all of those are packed into one Paging Type 1 message.
 */
 class Pager {
 
 	private:
 
-	PagingEntryList mPageIDs;				///< List of ID's to be paged.
+	std::vector<PagingEntryList> mWheel;	///< IDs to be paged, by paging occasion.
+	std::map<GSM::L3MobileIdentity,unsigned> mOccasions;	///< The paging occasion of each ID in mWheel.
+	int mNextFN;							///< Next frame to consider for paging, or -1.
+	PagingStats mStats;
 	mutable Mutex mLock;					///< Lock for thread-safe access.
 	Signal mPageSignal;						///< signal to wake the paging loop
 	Thread mPagingThread;					///< Thread for the paging loop.
@@ -161,7 +187,7 @@ class Pager {
 	public:
 
 	Pager()
-		:mRunning(false)
+		:mNextFN(-1),mRunning(false)
 	{}
 
 	/** Set the output FIFO and start the paging loop. */
@@ -190,13 +216,19 @@ class Pager {
 
 	private:
 
+	/** Rebucket the entries if the DRX cycle length has changed; return the cycle length.  Caller holds mLock. */
+	unsigned resizeWheel();
+
+	/** Find an entry by ID in the slot of the occasion it was added with, or return false.  Caller holds mLock. */
+	bool find(const GSM::L3MobileIdentity&, PagingEntryList*&, PagingEntryList::iterator&);
+
 	/**
-		Traverse the paging list, paging all IDs.
+		Page the IDs whose paging occasion falls in the given frame.
 		@return Number of IDs paged.
 	*/
-	unsigned pageAll();
+	unsigned pageOccasion(int FN);
 
-	/** A loop that repeatedly calls pageAll. */
+	/** A loop that calls pageOccasion for each occasion with IDs to page. */
 	void serviceLoop();
 
 	/** C-style adapter. */
@@ -207,7 +239,7 @@ public:
 	/** return size of PagingEntryList */
 	size_t pagingEntryListSize();
 
-	/** Dump the paging list to an ostream. */
+	/** Dump the paging list and the paging statistics to an ostream. */
 	void dump(std::ostream&) const;
 };
 
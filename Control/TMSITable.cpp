@@ -57,7 +57,19 @@ static const char* createTMSITable = {
 
 
 
+// How often the flush thread writes cached ACCESSED times, in seconds.
+static const unsigned sFlushInterval = 10;
+
+
+static void *TMSITableServiceLoopAdapter(const TMSITable *table)
+{
+	table->serviceLoop();
+	return NULL;
+}
+
+
 TMSITable::TMSITable(const char* wPath)
+	:mFlushDB(NULL),mLoaded(false),mCacheSize(-1),mHits(0),mMisses(0),mStopping(false)
 {
 	int rc = sqlite3_open(wPath,&mDB);
 	if (rc) {
@@ -68,16 +80,198 @@ TMSITable::TMSITable(const char* wPath)
 		mDB = NULL;
 		return;
 	}
+	sqlite3_busy_backoff(mDB);
 	if (!sqlite3_command(mDB,createTMSITable)) {
 		LOG(EMERG) << "Cannot create TMSI table";
 	}
+	if (!sqlite3_set_wal(mDB,gConfig.getBool("Control.Reporting.WAL"))) {
+		LOG(WARNING) << "cannot set journal mode of TMSI table: " << sqlite3_errmsg(mDB);
+	}
+	// A BEGIN on mDB would also take in the writes other threads make on it meanwhile.
+	if (sqlite3_open(wPath,&mFlushDB)) {
+		LOG(ALERT) << "Cannot open second TMSITable connection at " << wPath << ": " << sqlite3_errmsg(mFlushDB);
+		sqlite3_close(mFlushDB);
+		mFlushDB = NULL;
+		return;
+	}
+	sqlite3_busy_backoff(mFlushDB);
 }
 
 
 
 TMSITable::~TMSITable()
 {
-	if (mDB) sqlite3_close(mDB);
+	bool running;
+	{
+		ScopedLock lock(mLock);
+		running = mLoaded && mCacheSize>0;
+		mStopping = true;
+		mFlushSignal.signal();
+	}
+	if (running) {
+		mFlushThread.join();
+		flush();
+	}
+	if (mFlushDB) {
+		sqlite3_cached_finalize(mFlushDB);
+		sqlite3_close(mFlushDB);
+	}
+	if (!mDB) return;
+	sqlite3_cached_finalize(mDB);
+	sqlite3_close(mDB);
+}
+
+
+
+bool TMSITable::cacheStart() const
+{
+	// Caller holds mLock.
+	// This is deferred to the first lookup because the global table is constructed before main.
+	if (mLoaded) return mCacheSize>0;
+	mLoaded = true;
+	if (mCacheSize<0) mCacheSize = gConfig.getNum("Control.Reporting.TMSITable.CacheSize");
+	if (mCacheSize<=0 || !mDB) return false;
+
+	// Load the most recently seen subscribers.
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_statement(mDB,&stmt,"SELECT TMSI,IMSI,ACCESSED FROM TMSI_TABLE ORDER BY ACCESSED DESC LIMIT ?")) {
+		LOG(ERR) << "cannot load TMSI cache, disabling it";
+		mCacheSize = 0;
+		return false;
+	}
+	sqlite3_bind_int(stmt,1,mCacheSize);
+	while (sqlite3_run_query(mDB,stmt)==SQLITE_ROW) {
+		const char *IMSI = (const char*)sqlite3_column_text(stmt,1);
+		if (!IMSI) continue;
+		cacheAdd((unsigned)sqlite3_column_int64(stmt,0),IMSI,(unsigned)sqlite3_column_int64(stmt,2),false);
+	}
+	sqlite3_finalize(stmt);
+	// Rows arrived newest first, so reverse the LRU order.
+	mLRU.reverse();
+	LOG(INFO) << "loaded " << mByTMSI.size() << " TMSI table entries";
+
+	mFlushThread.start((void*(*)(void*))TMSITableServiceLoopAdapter,(void*)this);
+	return true;
+}
+
+
+void TMSITable::cacheAdd(unsigned TMSI, const std::string& IMSI, unsigned accessed, bool dirty) const
+{
+	// Caller holds mLock.
+	TMSIMap::iterator itr = mByTMSI.find(TMSI);
+	if (itr!=mByTMSI.end()) cacheRemove(itr);
+	IMSIMap::iterator old = mByIMSI.find(IMSI);
+	if (old!=mByIMSI.end()) cacheRemove(mByTMSI.find(old->second));
+
+	mLRU.push_front(TMSI);
+	CacheEntry &entry = mByTMSI[TMSI];
+	entry.mIMSI = IMSI;
+	entry.mAccessed = accessed;
+	entry.mDirty = dirty;
+	entry.mLRU = mLRU.begin();
+	mByIMSI[IMSI] = TMSI;
+	if (dirty) mDirty.push_back(TMSI);
+}
+
+
+void TMSITable::cacheTouch(TMSIMap::iterator itr) const
+{
+	// Caller holds mLock.
+	CacheEntry &entry = itr->second;
+	unsigned now = (unsigned)time(NULL);
+	if (entry.mAccessed!=now) {
+		entry.mAccessed = now;
+		if (!entry.mDirty) {
+			entry.mDirty = true;
+			mDirty.push_back(itr->first);
+		}
+	}
+	mLRU.splice(mLRU.begin(),mLRU,entry.mLRU);
+}
+
+
+void TMSITable::cacheRemove(TMSIMap::iterator itr) const
+{
+	// Caller holds mLock.
+	// A dirty entry stays in mDirty; flush skips TMSIs that are no longer cached.
+	mByIMSI.erase(itr->second.mIMSI);
+	mLRU.erase(itr->second.mLRU);
+	mByTMSI.erase(itr);
+}
+
+
+void TMSITable::flush() const
+{
+	typedef std::vector<std::pair<unsigned,unsigned> > UpdateList;
+	UpdateList updates;
+	ScopedLock flushLock(mFlushLock);
+	{
+		ScopedLock lock(mLock);
+		if (!mLoaded || mCacheSize<=0) return;
+		for (std::vector<unsigned>::const_iterator itr = mDirty.begin(); itr!=mDirty.end(); ++itr) {
+			TMSIMap::iterator entry = mByTMSI.find(*itr);
+			if (entry==mByTMSI.end() || !entry->second.mDirty) continue;
+			entry->second.mDirty = false;
+			updates.push_back(UpdateList::value_type(*itr,entry->second.mAccessed));
+		}
+		mDirty.clear();
+
+		// Evict from the cold end.  Nothing is dirty at this point.
+		unsigned oldest = (unsigned)time(NULL) - gConfig.getNum("Control.Reporting.TMSITable.CacheMaxAge");
+		while (mLRU.size()) {
+			TMSIMap::iterator entry = mByTMSI.find(mLRU.back());
+			if (mByTMSI.size()<=(unsigned)mCacheSize && entry->second.mAccessed>=oldest) break;
+			cacheRemove(entry);
+		}
+	}
+	if (updates.size()==0 || !mFlushDB) return;
+
+	// Other writers also set ACCESSED, so never move it backwards.
+	sqlite3_stmt *stmt = sqlite3_cached_prepare(mFlushDB,"UPDATE TMSI_TABLE SET ACCESSED=? WHERE TMSI=? AND ACCESSED<?");
+	if (!stmt) {
+		LOG(ALERT) << "cannot write to TMSI table";
+		return;
+	}
+	if (!sqlite3_command(mFlushDB,"BEGIN TRANSACTION")) {
+		LOG(ALERT) << "cannot write to TMSI table: " << sqlite3_errmsg(mFlushDB);
+		sqlite3_cached_release(stmt);
+		return;
+	}
+	for (UpdateList::const_iterator itr = updates.begin(); itr!=updates.end(); ++itr) {
+		sqlite3_bind_int64(stmt,1,itr->second);
+		sqlite3_bind_int64(stmt,2,itr->first);
+		sqlite3_bind_int64(stmt,3,itr->second);
+		sqlite3_run_query(mFlushDB,stmt);
+		sqlite3_reset(stmt);
+	}
+	sqlite3_cached_release(stmt);
+	if (!sqlite3_command(mFlushDB,"COMMIT TRANSACTION")) {
+		LOG(ALERT) << "cannot commit " << updates.size() << " TMSI table updates: " << sqlite3_errmsg(mFlushDB);
+		sqlite3_command(mFlushDB,"ROLLBACK TRANSACTION");
+	}
+}
+
+
+void TMSITable::serviceLoop() const
+{
+	while (true) {
+		{
+			ScopedLock lock(mLock);
+			if (!mStopping) mFlushSignal.wait(mLock,sFlushInterval*1000);
+			if (mStopping) return;
+		}
+		flush();
+	}
+}
+
+
+void TMSITable::cacheText(ostream& os) const
+{
+	ScopedLock lock(mLock);
+	if (!mLoaded) { os << "TMSI cache not loaded yet" << endl; return; }
+	if (mCacheSize<=0) { os << "TMSI cache disabled" << endl; return; }
+	os << "TMSI cache " << mByTMSI.size() << " of " << mCacheSize << " entries, "
+		<< mHits << " hits, " << mMisses << " misses, " << mDirty.size() << " pending ACCESSED updates" << endl;
 }
 
 
@@ -90,46 +284,59 @@ unsigned TMSITable::assign(const char* IMSI, const GSM::L3LocationUpdatingReques
 	assert(mDB);
 
 	LOG(DEBUG) << "IMSI=" << IMSI;
+	// Holding the lock throughout keeps two assigns for the same IMSI from racing.
+	ScopedLock lock(mLock);
+	bool cached = cacheStart();
+	if (cached) {
+		IMSIMap::iterator itr = mByIMSI.find(IMSI);
+		if (itr!=mByIMSI.end()) {
+			mHits++;
+			LOG(DEBUG) << "found TMSI " << itr->second;
+			cacheTouch(mByTMSI.find(itr->second));
+			return itr->second;
+		}
+		mMisses++;
+	}
+
 	// Is there already a record?
 	unsigned TMSI;
+	unsigned now = (unsigned)time(NULL);
 	if (sqlite3_single_lookup(mDB,"TMSI_TABLE","IMSI",IMSI,"TMSI",TMSI)) {
 		LOG(DEBUG) << "found TMSI " << TMSI;
-		touch(TMSI);
+		if (cached) cacheAdd(TMSI,IMSI,now,true);
+		else touch(TMSI);
 		return TMSI;
 	}
 
 	// Create a new record.
 	LOG(NOTICE) << "new entry for IMSI " << IMSI;
-	char query[1000];
-	unsigned now = (unsigned)time(NULL);
+	const char *query;
+	SqlArgs args;
+	args.push_back(IMSI);
+	args.push_back(format("%u",now));
+	args.push_back(format("%u",now));
 	if (!lur) {
-		sprintf(query,
-				"INSERT INTO TMSI_TABLE (IMSI,CREATED,ACCESSED) "
-				"VALUES ('%s',%u,%u)",
-				IMSI,now,now);
+		query = "INSERT INTO TMSI_TABLE (IMSI,CREATED,ACCESSED) VALUES (?,?,?)";
 	} else {
 		const GSM::L3LocationAreaIdentity &lai = lur->LAI();
 		const GSM::L3MobileIdentity &mid = lur->mobileID();
+		args.push_back(format("%u",lai.MCC()));
+		args.push_back(format("%u",lai.MNC()));
+		args.push_back(format("%u",lai.LAC()));
 		if (mid.type()==GSM::TMSIType) {
-			sprintf(query,
-					"INSERT INTO TMSI_TABLE (IMSI,CREATED,ACCESSED,PREV_MCC,PREV_MNC,PREV_LAC,OLD_TMSI) "
-					"VALUES ('%s',%u,%u,%u,%u,%u,%u)",
-					IMSI,now,now,lai.MCC(),lai.MNC(),lai.LAC(),mid.TMSI());
+			query = "INSERT INTO TMSI_TABLE (IMSI,CREATED,ACCESSED,PREV_MCC,PREV_MNC,PREV_LAC,OLD_TMSI) VALUES (?,?,?,?,?,?,?)";
+			args.push_back(format("%u",mid.TMSI()));
 		} else {
-			sprintf(query,
-					"INSERT INTO TMSI_TABLE (IMSI,CREATED,ACCESSED,PREV_MCC,PREV_MNC,PREV_LAC) "
-					"VALUES ('%s',%u,%u,%u,%u,%u)",
-					IMSI,now,now,lai.MCC(),lai.MNC(),lai.LAC());
+			query = "INSERT INTO TMSI_TABLE (IMSI,CREATED,ACCESSED,PREV_MCC,PREV_MNC,PREV_LAC) VALUES (?,?,?,?,?,?)";
 		}
 	}
-	if (!sqlite3_command(mDB,query)) {
+	if (!sqlite3_command(mDB,query,args)) {
 		LOG(ALERT) << "TMSI creation failed";
 		return 0;
 	}
-	if (!sqlite3_single_lookup(mDB,"TMSI_TABLE","IMSI",IMSI,"TMSI",TMSI)) {
-		LOG(ERR) << "TMSI database inconsistancy";
-		return 0;
-	}
+	// TMSI is the INTEGER PRIMARY KEY, so it is the rowid.
+	TMSI = (unsigned)sqlite3_last_insert_rowid(mDB);
+	if (cached) cacheAdd(TMSI,IMSI,now,false);
 	return TMSI;
 }
 	
@@ -138,10 +345,10 @@ unsigned TMSITable::assign(const char* IMSI, const GSM::L3LocationUpdatingReques
 void TMSITable::touch(unsigned TMSI) const
 {
 	// Update timestamp.
-	char query[100];
-	sprintf(query,"UPDATE TMSI_TABLE SET ACCESSED = %u WHERE TMSI == %u",
-		(unsigned)time(NULL),TMSI);
-	sqlite3_command(mDB,query);
+	SqlArgs args;
+	args.push_back(format("%u",(unsigned)time(NULL)));
+	args.push_back(format("%u",TMSI));
+	sqlite3_command(mDB,"UPDATE TMSI_TABLE SET ACCESSED = ? WHERE TMSI == ?",args);
 }
 
 
@@ -149,15 +356,55 @@ void TMSITable::touch(unsigned TMSI) const
 // Returned string must be free'd by the caller.
 char* TMSITable::IMSI(unsigned TMSI) const
 {
+	bool cached;
+	{
+		ScopedLock lock(mLock);
+		cached = cacheStart();
+		if (cached) {
+			TMSIMap::iterator itr = mByTMSI.find(TMSI);
+			if (itr!=mByTMSI.end()) {
+				mHits++;
+				cacheTouch(itr);
+				return strdup(itr->second.mIMSI.c_str());
+			}
+			mMisses++;
+		}
+	}
 	char* IMSI = NULL;
-	if (sqlite3_single_lookup(mDB,"TMSI_TABLE","TMSI",TMSI,"IMSI",IMSI)) touch(TMSI);
+	if (!sqlite3_single_lookup(mDB,"TMSI_TABLE","TMSI",TMSI,"IMSI",IMSI)) return NULL;
+	if (cached) {
+		ScopedLock lock(mLock);
+		cacheAdd(TMSI,IMSI,(unsigned)time(NULL),true);
+	} else {
+		touch(TMSI);
+	}
 	return IMSI;
 }
 
 unsigned TMSITable::TMSI(const char* IMSI) const
 {
+	bool cached;
+	{
+		ScopedLock lock(mLock);
+		cached = cacheStart();
+		if (cached) {
+			IMSIMap::iterator itr = mByIMSI.find(IMSI);
+			if (itr!=mByIMSI.end()) {
+				mHits++;
+				cacheTouch(mByTMSI.find(itr->second));
+				return itr->second;
+			}
+			mMisses++;
+		}
+	}
 	unsigned TMSI=0;
-	if (sqlite3_single_lookup(mDB,"TMSI_TABLE","IMSI",IMSI,"TMSI",TMSI)) touch(TMSI);
+	if (!sqlite3_single_lookup(mDB,"TMSI_TABLE","IMSI",IMSI,"TMSI",TMSI)) return 0;
+	if (cached) {
+		ScopedLock lock(mLock);
+		cacheAdd(TMSI,IMSI,(unsigned)time(NULL),true);
+	} else {
+		touch(TMSI);
+	}
 	return TMSI;
 }
 
@@ -187,6 +434,8 @@ void printAge(unsigned seconds, ostream& os)
 
 void TMSITable::dump(ostream& os) const
 {
+	// Bring the ACCESSED times up to date first.
+	flush();
 	sqlite3_stmt *stmt;
 	if (sqlite3_prepare_statement(mDB,&stmt,"SELECT TMSI,IMSI,CREATED,ACCESSED FROM TMSI_TABLE")) {
 		LOG(ERR) << "sqlite3_prepare_statement failed";
@@ -207,17 +456,23 @@ void TMSITable::dump(ostream& os) const
 
 void TMSITable::clear()
 {
+	ScopedLock lock(mLock);
 	sqlite3_command(mDB,"DELETE FROM TMSI_TABLE WHERE 1");
+	mByTMSI.clear();
+	mByIMSI.clear();
+	mLRU.clear();
+	mDirty.clear();
 }
 
 
 
 bool TMSITable::IMEI(const char* IMSI, const char *IMEI)
 {
-	char query[100];
-	sprintf(query,"UPDATE TMSI_TABLE SET IMEI=\"%s\",ACCESSED=%u WHERE IMSI=\"%s\"",
-		IMEI,(unsigned)time(NULL),IMSI);
-	return sqlite3_command(mDB,query);
+	SqlArgs args;
+	args.push_back(IMEI);
+	args.push_back(format("%u",(unsigned)time(NULL)));
+	args.push_back(IMSI);
+	return sqlite3_command(mDB,"UPDATE TMSI_TABLE SET IMEI=?,ACCESSED=? WHERE IMSI=?",args);
 }
 
 
@@ -225,21 +480,24 @@ bool TMSITable::IMEI(const char* IMSI, const char *IMEI)
 bool TMSITable::classmark(const char* IMSI, const GSM::L3MobileStationClassmark2& classmark)
 {
 	int A5Bits = (classmark.A5_1()<<2) + (classmark.A5_2()<<1) + classmark.A5_3();
-	char query[100];
-	sprintf(query,
-		"UPDATE TMSI_TABLE SET A5_SUPPORT=%u,ACCESSED=%u,POWER_CLASS=%u "
-		" WHERE IMSI=\"%s\"",
-		A5Bits,(unsigned)time(NULL),classmark.powerClass(),IMSI);
-	return sqlite3_command(mDB,query);
+	SqlArgs args;
+	args.push_back(format("%u",A5Bits));
+	args.push_back(format("%u",(unsigned)time(NULL)));
+	args.push_back(format("%u",classmark.powerClass()));
+	args.push_back(IMSI);
+	return sqlite3_command(mDB,"UPDATE TMSI_TABLE SET A5_SUPPORT=?,ACCESSED=?,POWER_CLASS=? WHERE IMSI=?",args);
 }
 
 
 void TMSITable::putAuthTokens(const char* IMSI, uint64_t upperRAND, uint64_t lowerRAND, uint32_t SRES)
 {
-	char query[300];
-	sprintf(query,"UPDATE TMSI_TABLE SET RANDUPPER=%llu,RANDLOWER=%llu,SRES=%u,ACCESSED=%u WHERE IMSI=\"%s\"",
-		upperRAND,lowerRAND,SRES,(unsigned)time(NULL),IMSI);
-	if (!sqlite3_command(mDB,query)) {
+	SqlArgs args;
+	args.push_back(format("%llu",(unsigned long long)upperRAND));
+	args.push_back(format("%llu",(unsigned long long)lowerRAND));
+	args.push_back(format("%u",SRES));
+	args.push_back(format("%u",(unsigned)time(NULL)));
+	args.push_back(IMSI);
+	if (!sqlite3_command(mDB,"UPDATE TMSI_TABLE SET RANDUPPER=?,RANDLOWER=?,SRES=?,ACCESSED=? WHERE IMSI=?",args)) {
 		LOG(ALERT) << "cannot write to TMSI table";
 	}
 }
@@ -248,22 +506,21 @@ void TMSITable::putAuthTokens(const char* IMSI, uint64_t upperRAND, uint64_t low
 
 bool TMSITable::getAuthTokens(const char* IMSI, uint64_t& upperRAND, uint64_t& lowerRAND, uint32_t& SRES)
 {
-	char query[200];
-	sprintf(query,"SELECT RANDUPPER,RANDLOWER,SRES FROM TMSI_TABLE WHERE IMSI=\"%s\"",IMSI);
-	sqlite3_stmt *stmt;
-	if (sqlite3_prepare_statement(mDB,&stmt,query)) {
-		LOG(ERR) << "sqlite3_prepare_statement failed for " << query;
+	sqlite3_stmt *stmt = sqlite3_cached_prepare(mDB,"SELECT RANDUPPER,RANDLOWER,SRES FROM TMSI_TABLE WHERE IMSI=?");
+	if (!stmt) {
+		LOG(ERR) << "sqlite3_cached_prepare failed for auth tokens of " << IMSI;
 		return false;
 	}
+	sqlite3_bind_text(stmt,1,IMSI,-1,SQLITE_TRANSIENT);
 	if (sqlite3_run_query(mDB,stmt)!=SQLITE_ROW) {
 		// Returning false here just means the IMSI is not there yet.
-		sqlite3_finalize(stmt);
+		sqlite3_cached_release(stmt);
 		return false;
 	}
 	upperRAND = sqlite3_column_int64(stmt,0);
 	lowerRAND = sqlite3_column_int64(stmt,1);
 	SRES = sqlite3_column_int(stmt,2);
-	sqlite3_finalize(stmt);
+	sqlite3_cached_release(stmt);
 	return true;
 }
 
@@ -271,9 +528,10 @@ bool TMSITable::getAuthTokens(const char* IMSI, uint64_t& upperRAND, uint64_t& l
 
 void TMSITable::putKc(const char* IMSI, string Kc)
 {
-	char query[300];
-	sprintf(query,"UPDATE TMSI_TABLE SET kc=\"%s\" WHERE IMSI=\"%s\"", Kc.c_str(), IMSI);
-	if (!sqlite3_command(mDB,query)) {
+	SqlArgs args;
+	args.push_back(Kc);
+	args.push_back(IMSI);
+	if (!sqlite3_command(mDB,"UPDATE TMSI_TABLE SET kc=? WHERE IMSI=?",args)) {
 		LOG(ALERT) << "cannot write Kc to TMSI table";
 	}
 }
@@ -306,10 +564,11 @@ unsigned TMSITable::nextL3TI(const char* IMSI)
 	}
 	// Note that TI=7 is a reserved value, so value values are 0-6.  See GSM 04.07 11.2.3.1.3.
 	unsigned next = (l3ti+1) % 7;
-	char query[200];
-	sprintf(query,"UPDATE TMSI_TABLE SET L3TI=%u,ACCESSED=%u WHERE IMSI='%s'",
-		next, (unsigned)time(NULL),IMSI);
-	if (!sqlite3_command(mDB,query)) {
+	SqlArgs args;
+	args.push_back(format("%u",next));
+	args.push_back(format("%u",(unsigned)time(NULL)));
+	args.push_back(IMSI);
+	if (!sqlite3_command(mDB,"UPDATE TMSI_TABLE SET L3TI=?,ACCESSED=? WHERE IMSI=?",args)) {
 		LOG(ALERT) << "cannot write L3TI to TMSI_TABLE";
 	}
 	return next;
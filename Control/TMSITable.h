@@ -18,6 +18,9 @@
 #define TMSITABLE_H
 
 #include <map>
+#include <list>
+#include <vector>
+#include <string>
 
 #include <Timeval.h>
 #include <Threads.h>
@@ -35,11 +38,49 @@ class L3MobileIdentity;
 
 namespace Control {
 
+/**
+	The TMSI_TABLE database, with the TMSI<->IMSI mapping of recently seen subscribers cached in memory.
+	Cached lookups do not touch the database; their ACCESSED times are written
+	in one SQL transaction every sFlushInterval seconds by a separate thread.
+	The cache holds at most Control.Reporting.TMSITable.CacheSize entries,
+	dropping the least recently used first and anything not seen for
+	Control.Reporting.TMSITable.CacheMaxAge seconds.  A miss falls back to the database.
+	Rows changed in the database by other programs may be shadowed by the cache
+	until they age out.
+*/
 class TMSITable {
 
 	private:
 
 	sqlite3 *mDB;			///< database connection
+	sqlite3 *mFlushDB;		///< flush's own connection, so its SQL transaction holds only its own writes
+
+	struct CacheEntry {
+		std::string mIMSI;
+		unsigned mAccessed;						///< Unix time of last encounter
+		bool mDirty;							///< mAccessed is newer than the database
+		std::list<unsigned>::iterator mLRU;		///< position in mLRU
+	};
+	typedef std::map<unsigned,CacheEntry> TMSIMap;
+	typedef std::map<std::string,unsigned> IMSIMap;
+
+	/**@name The cache.  All of it is guarded by mLock. */
+	//@{
+	mutable Mutex mLock;
+	mutable TMSIMap mByTMSI;
+	mutable IMSIMap mByIMSI;
+	mutable std::list<unsigned> mLRU;		///< cached TMSIs, most recently used first
+	mutable std::vector<unsigned> mDirty;	///< TMSIs whose mDirty is set
+	mutable bool mLoaded;					///< the cache has been loaded from the database
+	mutable int mCacheSize;					///< maximum entries, 0 disables the cache, -1 to read from the config
+	mutable unsigned long mHits;
+	mutable unsigned long mMisses;
+	mutable Thread mFlushThread;
+	mutable Signal mFlushSignal;			///< wakes the flush thread to exit
+	mutable bool mStopping;
+	//@}
+
+	mutable Mutex mFlushLock;				///< serializes flush on mFlushDB
 
 
 	public:
@@ -99,10 +140,40 @@ class TMSITable {
 	/** Get the next TI value to use for this IMSI or TMSI. */
 	unsigned nextL3TI(const char* IMSI);
 
+	/**
+		Set the maximum number of cached entries, 0 to disable the cache, overriding the configuration.
+		Takes effect only before the first lookup.
+	*/
+	void cacheSize(unsigned maxEntries) { ScopedLock lock(mLock); if (!mLoaded) mCacheSize = maxEntries; }
+
+	/** Write cached ACCESSED times to the database and evict old cache entries. */
+	void flush() const;
+
+	/** Cache statistics as text. */
+	void cacheText(std::ostream&) const;
+
+	/** The flush thread body. */
+	void serviceLoop() const;
+
 	private:
 
 	/** Update the "accessed" time on a record. */
 	void touch(unsigned TMSI) const;
+
+	/**
+		Load the cache and start the flush thread on the first call.
+		Return true if the cache is enabled.  The caller should hold mLock.
+	*/
+	bool cacheStart() const;
+
+	/** Add or replace a cache entry as the most recently used.  The caller should hold mLock. */
+	void cacheAdd(unsigned TMSI, const std::string& IMSI, unsigned accessed, bool dirty) const;
+
+	/** Mark a cache entry as seen now.  The caller should hold mLock. */
+	void cacheTouch(TMSIMap::iterator) const;
+
+	/** Remove a cache entry.  The caller should hold mLock. */
+	void cacheRemove(TMSIMap::iterator) const;
 };
 
 
@@ -20,6 +20,7 @@
 #include <UMTSLogicalChannel.h>
 #include "TransactionTable.h"
 #include "ControlCommon.h"
+#include "RTPPortAllocator.h"
 
 #include <GSML3Message.h>
 #include <GSML3CCMessages.h>
@@ -104,8 +105,11 @@ TransactionEntry::TransactionEntry(
 	mSIP(proxy,mSubscriber.digits()),
 	mGSMState(wState),
 	mNumSQLTries(gConfig.getNum("Control.NumSQLTries")),
+	mRTPPorts(0),
 	mChannel(wChannel),
-	mTerminationRequested(false)
+	mTerminationRequested(false),
+	mIndexedChannel(NULL),
+	mTransactionTable(&gTransactionTable)
 {
 	if (wMessage) mMessage.assign(wMessage); //strncpy(mMessage,wMessage,160);
 	else mMessage.assign(""); //mMessage[0]='\0';
@@ -127,8 +131,11 @@ TransactionEntry::TransactionEntry(
 	mSIP(proxy,mSubscriber.digits()),
 	mGSMState(GSM::MOCInitiated),
 	mNumSQLTries(gConfig.getNum("Control.NumSQLTries")),
+	mRTPPorts(0),
 	mChannel(wChannel),
-	mTerminationRequested(false)
+	mTerminationRequested(false),
+	mIndexedChannel(NULL),
+	mTransactionTable(&gTransactionTable)
 {
 	assert(mSubscriber.type()==GSM::IMSIType);
 	mMessage.assign(""); //mMessage[0]='\0';
@@ -149,8 +156,11 @@ TransactionEntry::TransactionEntry(
 	mSIP(proxy,mSubscriber.digits()),
 	mGSMState(GSM::MOCInitiated),
 	mNumSQLTries(2*gConfig.getNum("Control.NumSQLTries")),
+	mRTPPorts(0),
 	mChannel(wChannel),
-	mTerminationRequested(false)
+	mTerminationRequested(false),
+	mIndexedChannel(NULL),
+	mTransactionTable(&gTransactionTable)
 {
 	mMessage.assign(""); //mMessage[0]='\0';
 	initTimers();
@@ -171,8 +181,11 @@ TransactionEntry::TransactionEntry(
 	mSIP(proxy,mSubscriber.digits()),
 	mGSMState(GSM::SMSSubmitting),
 	mNumSQLTries(gConfig.getNum("Control.NumSQLTries")),
+	mRTPPorts(0),
 	mChannel(wChannel),
-	mTerminationRequested(false)
+	mTerminationRequested(false),
+	mIndexedChannel(NULL),
+	mTransactionTable(&gTransactionTable)
 {
 	assert(mSubscriber.type()==GSM::IMSIType);
 	if (wMessage!=NULL) mMessage.assign(wMessage); //strncpy(mMessage,wMessage,160);
@@ -192,8 +205,11 @@ TransactionEntry::TransactionEntry(
 	mSIP(proxy,mSubscriber.digits()),
 	mGSMState(GSM::SMSSubmitting),
 	mNumSQLTries(gConfig.getNum("Control.NumSQLTries")),
+	mRTPPorts(0),
 	mChannel(wChannel),
-	mTerminationRequested(false)
+	mTerminationRequested(false),
+	mIndexedChannel(NULL),
+	mTransactionTable(&gTransactionTable)
 {
 	assert(mSubscriber.type()==GSM::IMSIType);
 	mMessage[0]='\0';
@@ -207,9 +223,11 @@ TransactionEntry::~TransactionEntry()
 	ScopedLock lock(mLock);
 
 	// Delete the SQL table entry.
-	char query[100];
-	sprintf(query,"DELETE FROM TRANSACTION_TABLE WHERE ID=%u",mID);
-	runQuery(query);
+	mTransactionTable->DBWriter().remove(mID,mNumSQLTries);
+
+	// Close the RTP socket before its ports can be handed out again.
+	mSIP.closeRTP();
+	gRTPPortAllocator.release(mRTPPorts);
 
 }
 
@@ -319,19 +337,16 @@ void TransactionEntry::messageType(const char *wContentType)
 
 
 
-void TransactionEntry::runQuery(const char* query) const
+void TransactionEntry::updateDatabase(const TransactionDBRow& row) const
 {
-	for (unsigned i=0; i<mNumSQLTries; i++) {
-		if (sqlite3_command(gTransactionTable.DB(),query)) return;
-	}
-	LOG(ALERT) << "transaction table access failed after " << mNumSQLTries << "attempts. query:" << query << " error: " << sqlite3_errmsg(gTransactionTable.DB());
+	mTransactionTable->DBWriter().update(mID,row,mNumSQLTries);
 }
 
 
 
 void TransactionEntry::insertIntoDatabase()
 {
-	// This should be called only from gTransactionTable::add.
+	// This should be called only from TransactionTable::add.
 
 	ostringstream serviceTypeSS;
 	serviceTypeSS << mService;
@@ -353,48 +368,40 @@ void TransactionEntry::insertIntoDatabase()
 	const char* stateString = GSM::CallStateString(mGSMState);
 	assert(stateString);
 
-	char query[500];
 	unsigned now = (unsigned)time(NULL);
-	sprintf(query,"INSERT INTO TRANSACTION_TABLE "
-		        "(ID,CREATED,CHANGED,TYPE,SUBSCRIBER,L3TI,CALLED,CALLING,GSMSTATE,SIPSTATE,SIP_CALLID,SIP_PROXY) "
-		"VALUES  (%u,%u,     %u,     '%s','%s',      %u,'%s',  '%s',   '%s',    '%s',      '%s',      '%s')",
-		mID,now,now,
-		serviceTypeSS.str().c_str(),
-		subscriber,
-		mL3TI,
-		mCalled.digits(),
-		mCalling.digits(),
-		stateString,
-		sipStateSS.str().c_str(),
-		mSIP.callID().c_str(),
-		mSIP.proxyIP().c_str()
-	);
-
-	runQuery(query);
-
-	if (!mChannel) return;
-	sprintf(query,"UPDATE TRANSACTION_TABLE SET CHANNEL='%s' WHERE ID=%u",
-			mChannel->descriptiveString(), mID);
-	runQuery(query);
+	TransactionDBRow row;
+	row["CREATED"] = now;
+	row["CHANGED"] = now;
+	row["TYPE"] = serviceTypeSS.str();
+	row["SUBSCRIBER"] = subscriber;
+	row["L3TI"] = mL3TI;
+	row["CALLED"] = mCalled.digits();
+	row["CALLING"] = mCalling.digits();
+	row["GSMSTATE"] = stateString;
+	row["SIPSTATE"] = sipStateSS.str();
+	row["SIP_CALLID"] = mSIP.callID();
+	row["SIP_PROXY"] = mSIP.proxyIP();
+	if (mChannel) row["CHANNEL"] = mChannel->descriptiveString();
+
+	mTransactionTable->DBWriter().insert(mID,row,mNumSQLTries);
 }
 
 
 
 void TransactionEntry::channel(UMTS::LogicalChannel* wChannel)
 {
-	ScopedLock lock(mLock);
-	mChannel = wChannel;
-
-	char query[500];
-	if (mChannel) {
-		sprintf(query,"UPDATE TRANSACTION_TABLE SET CHANGED=%u,CHANNEL='%s' WHERE ID=%u",
-				(unsigned)time(NULL), mChannel->descriptiveString(), mID);
-	} else {
-		sprintf(query,"UPDATE TRANSACTION_TABLE SET CHANGED=%u,CHANNEL=NULL WHERE ID=%u",
-				(unsigned)time(NULL), mID);
+	{
+		ScopedLock lock(mLock);
+		mChannel = wChannel;
+
+		TransactionDBRow row;
+		row["CHANGED"] = (unsigned)time(NULL);
+		if (mChannel) row["CHANNEL"] = mChannel->descriptiveString();
+		else row["CHANNEL"] = TransactionDBValue();
+		updateDatabase(row);
 	}
-
-	runQuery(query);
+	// Not under mLock; see TransactionTable::reindex.
+	mTransactionTable->reindex(this);
 }
 
 
@@ -408,11 +415,10 @@ void TransactionEntry::GSMState(GSM::CallState wState)
 	const char* stateString = GSM::CallStateString(wState);
 	assert(stateString);
 
-	char query[150];
-	sprintf(query,
-		"UPDATE TRANSACTION_TABLE SET GSMSTATE='%s',CHANGED=%u WHERE ID=%u",
-		stateString,now, mID);
-	runQuery(query);
+	TransactionDBRow row;
+	row["GSMSTATE"] = stateString;
+	row["CHANGED"] = now;
+	updateDatabase(row);
 }
 
 
@@ -427,11 +433,10 @@ SIP::SIPState TransactionEntry::echoSIPState(SIP::SIPState state) const
 
 	unsigned now = time(NULL);
 
-	char query[150];
-	sprintf(query,
-		"UPDATE TRANSACTION_TABLE SET SIPSTATE='%s',CHANGED=%u WHERE ID=%u",
-		stateString,now,mID);
-	runQuery(query);
+	TransactionDBRow row;
+	row["SIPSTATE"] = stateString;
+	row["CHANGED"] = now;
+	updateDatabase(row);
 
 	return state;
 }
@@ -505,6 +510,14 @@ SIP::SIPState TransactionEntry::MTCCheckForCancel()
 }
 
 
+unsigned TransactionEntry::allocateRTPPorts()
+{
+	ScopedLock lock(mLock);
+	if (!mRTPPorts) mRTPPorts = gRTPPortAllocator.allocate();
+	return mRTPPorts;
+}
+
+
 SIP::SIPState TransactionEntry::MTCSendOK(short rtpPort, unsigned codec)
 {
 	ScopedLock lock(mLock);
@@ -585,14 +598,21 @@ bool TransactionEntry::sendINFOAndWaitForOK(unsigned info)
 
 void TransactionEntry::SIPUser(const char* IMSI)
 {
-	ScopedLock lock(mLock);
-	mSIP.user(IMSI);
+	{
+		ScopedLock lock(mLock);
+		mSIP.user(IMSI);
+	}
+	// This assigns a new call ID.
+	mTransactionTable->reindex(this);
 }
 
 void TransactionEntry::SIPUser(const char* callID, const char *IMSI , const char *origID, const char *origHost)
 {
-	ScopedLock lock(mLock);
-	mSIP.user(callID,IMSI,origID,origHost);
+	{
+		ScopedLock lock(mLock);
+		mSIP.user(callID,IMSI,origID,origHost);
+	}
+	mTransactionTable->reindex(this);
 }
 
 void TransactionEntry::called(const GSM::L3CalledPartyBCDNumber& wCalled)
@@ -600,11 +620,9 @@ void TransactionEntry::called(const GSM::L3CalledPartyBCDNumber& wCalled)
 	ScopedLock lock(mLock);
 	mCalled = wCalled;
 
-	char query[151];
-	snprintf(query,150,
-		"UPDATE TRANSACTION_TABLE SET CALLED='%s' WHERE ID=%u",
-		mCalled.digits(), mID);
-	runQuery(query);
+	TransactionDBRow row;
+	row["CALLED"] = mCalled.digits();
+	updateDatabase(row);
 }
 
 
@@ -613,11 +631,9 @@ void TransactionEntry::L3TI(unsigned wL3TI)
 	ScopedLock lock(mLock);
 	mL3TI = wL3TI;
 
-	char query[151];
-	snprintf(query,150,
-		"UPDATE TRANSACTION_TABLE SET L3TI=%u WHERE ID=%u",
-		mL3TI, mID);
-	runQuery(query);
+	TransactionDBRow row;
+	row["L3TI"] = mL3TI;
+	updateDatabase(row);
 }
 
 
@@ -631,6 +647,271 @@ bool TransactionEntry::terminationRequested()
 
 
 
+// Columns written by TransactionDBWriter's INSERT, in placeholder order.
+static const char* sTransactionColumns[] = {
+	"CHANNEL", "CREATED", "CHANGED", "TYPE", "SUBSCRIBER", "L3TI",
+	"SIP_CALLID", "SIP_PROXY", "CALLED", "CALLING", "GSMSTATE", "SIPSTATE",
+	NULL
+};
+
+static const char* insertTransaction = {
+	"INSERT INTO TRANSACTION_TABLE "
+		"(ID,CHANNEL,CREATED,CHANGED,TYPE,SUBSCRIBER,L3TI,SIP_CALLID,SIP_PROXY,CALLED,CALLING,GSMSTATE,SIPSTATE) "
+		"VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?)"
+};
+
+static const char* deleteTransaction = {
+	"DELETE FROM TRANSACTION_TABLE WHERE ID=?"
+};
+
+
+// Maximum number of transactions with queued writes; past this, writers wait for the thread.
+static const unsigned sMaxPendingRows = 1024;
+
+// How long the thread lets writes accumulate after the first one arrives, in ms.
+static const unsigned sBatchInterval = 100;
+
+
+static void *TransactionDBWriterServiceLoopAdapter(TransactionDBWriter *writer)
+{
+	writer->serviceLoop();
+	return NULL;
+}
+
+
+TransactionDBWriter::TransactionDBWriter()
+	:mDB(NULL),
+	mStarted(false),mAsync(false),mRetries(1),
+	mInsertStmt(NULL),mDeleteStmt(NULL),
+	mMaxDepth(0),mBatches(0),mRows(0),mMerged(0),mWaits(0),mFailures(0),
+	mTotalLatency(0),mMaxLatency(0),mLastBatchTime(0),mMaxBatchTime(0)
+{
+}
+
+
+void TransactionDBWriter::start()
+{
+	// Caller holds mLock.
+	// This is deferred to the first write because the global table is constructed before main.
+	mStarted = true;
+	mAsync = gConfig.getBool("Control.Reporting.TransactionTable.WriteBehind");
+	mRetries = gConfig.getNum("Control.NumSQLTries");
+	if (!mAsync || !mDB) return;
+	mThread.start((void*(*)(void*))TransactionDBWriterServiceLoopAdapter,this);
+}
+
+
+void TransactionDBWriter::enqueue(unsigned ID, const TransactionDBRow* row, bool insert, bool remove, unsigned retries)
+{
+	if (!mDB) return;
+	ScopedLock lock(mLock);
+	if (!mStarted) start();
+
+	if (!mAsync) {
+		PendingMap now;
+		PendingRow &pending = now[ID];
+		pending.mInsert = insert;
+		pending.mDelete = remove;
+		if (row) pending.mRow = *row;
+		// Synchronous mode: mLock keeps the writes in call order.
+		writeRows(now,retries);
+		return;
+	}
+
+	PendingMap::iterator itr = mPending.find(ID);
+	if (itr==mPending.end()) {
+		while (mPending.size()>=sMaxPendingRows) {
+			mWaits++;
+			mSpace.wait(mLock);
+		}
+		itr = mPending.insert(PendingMap::value_type(ID,PendingRow())).first;
+		if (mPending.size()==1) mWork.signal();
+		if (mPending.size()>mMaxDepth) mMaxDepth = mPending.size();
+	} else {
+		mMerged++;
+	}
+
+	PendingRow &pending = itr->second;
+	if (remove) {
+		if (pending.mInsert && !pending.mDelete) {
+			// The row was never written, so there is nothing to do.
+			mPending.erase(itr);
+			return;
+		}
+		pending.mDelete = true;
+		pending.mInsert = false;
+		pending.mRow.clear();
+		return;
+	}
+	if (insert) {
+		pending.mInsert = true;
+		pending.mRow = *row;
+		return;
+	}
+	for (TransactionDBRow::const_iterator col = row->begin(); col!=row->end(); ++col) {
+		pending.mRow[col->first] = col->second;
+	}
+}
+
+
+void TransactionDBWriter::serviceLoop()
+{
+	while (true) {
+		PendingMap batch;
+		{
+			ScopedLock lock(mLock);
+			while (mPending.size()==0) mWork.wait(mLock);
+			// Let the first write of a burst pick up the ones right behind it.
+			if (mPending.size()<sMaxPendingRows/2) mWork.wait(mLock,sBatchInterval);
+			batch.swap(mPending);
+			mSpace.broadcast();
+		}
+
+		Timeval start;
+		bool ok = writeRows(batch,mRetries);
+		long batchTime = start.elapsed();
+
+		ScopedLock lock(mLock);
+		mBatches++;
+		if (!ok) mFailures++;
+		mRows += batch.size();
+		mLastBatchTime = batchTime;
+		if (batchTime>mMaxBatchTime) mMaxBatchTime = batchTime;
+		for (PendingMap::const_iterator itr = batch.begin(); itr!=batch.end(); ++itr) {
+			long latency = itr->second.mQueued.elapsed();
+			mTotalLatency += latency;
+			if (latency>mMaxLatency) mMaxLatency = latency;
+		}
+	}
+}
+
+
+sqlite3_stmt* TransactionDBWriter::updateStmt(const std::string& column)
+{
+	// Caller holds mDBLock.
+	std::map<std::string,sqlite3_stmt*>::iterator itr = mUpdateStmts.find(column);
+	if (itr!=mUpdateStmts.end()) return itr->second;
+	sqlite3_stmt *stmt;
+	string query = format("UPDATE TRANSACTION_TABLE SET %s=? WHERE ID=?",column.c_str());
+	if (sqlite3_prepare_statement(mDB,&stmt,query.c_str())) return NULL;
+	mUpdateStmts[column] = stmt;
+	return stmt;
+}
+
+
+static void bindValue(sqlite3_stmt *stmt, int index, const TransactionDBValue& value)
+{
+	if (value.mNull) sqlite3_bind_null(stmt,index);
+	else sqlite3_bind_text(stmt,index,value.mText.c_str(),value.mText.size(),SQLITE_TRANSIENT);
+}
+
+
+static bool runStmt(sqlite3 *DB, sqlite3_stmt *stmt, unsigned retries)
+{
+	int src = sqlite3_run_query(DB,stmt,retries);
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return src==SQLITE_DONE;
+}
+
+
+bool TransactionDBWriter::writeRow(unsigned ID, const PendingRow& row, unsigned retries)
+{
+	// Caller holds mDBLock.
+	bool ok = true;
+	if (row.mDelete) {
+		sqlite3_bind_int64(mDeleteStmt,1,ID);
+		ok &= runStmt(mDB,mDeleteStmt,retries);
+	}
+	if (row.mInsert) {
+		sqlite3_bind_int64(mInsertStmt,1,ID);
+		for (unsigned i=0; sTransactionColumns[i]; i++) {
+			TransactionDBRow::const_iterator col = row.mRow.find(sTransactionColumns[i]);
+			if (col==row.mRow.end()) sqlite3_bind_null(mInsertStmt,i+2);
+			else bindValue(mInsertStmt,i+2,col->second);
+		}
+		return ok && runStmt(mDB,mInsertStmt,retries);
+	}
+	for (TransactionDBRow::const_iterator col = row.mRow.begin(); col!=row.mRow.end(); ++col) {
+		sqlite3_stmt *stmt = updateStmt(col->first);
+		if (!stmt) { ok = false; continue; }
+		bindValue(stmt,1,col->second);
+		sqlite3_bind_int64(stmt,2,ID);
+		ok &= runStmt(mDB,stmt,retries);
+	}
+	return ok;
+}
+
+
+bool TransactionDBWriter::writeRows(const PendingMap& rows, unsigned retries)
+{
+	ScopedLock lock(mDBLock);
+	if (!mDB) return false;		// closed
+	if (!mInsertStmt) {
+		if (sqlite3_prepare_statement(mDB,&mInsertStmt,insertTransaction)
+		 || sqlite3_prepare_statement(mDB,&mDeleteStmt,deleteTransaction)) {
+			LOG(ALERT) << "cannot prepare transaction table statements: " << sqlite3_errmsg(mDB);
+			mInsertStmt = NULL;
+			return false;
+		}
+	}
+	if (!sqlite3_command(mDB,"BEGIN TRANSACTION",retries)) {
+		LOG(ALERT) << "transaction table access failed after " << retries << " attempts, error: " << sqlite3_errmsg(mDB);
+		return false;
+	}
+	bool ok = true;
+	for (PendingMap::const_iterator itr = rows.begin(); itr!=rows.end(); ++itr) {
+		if (!writeRow(itr->first,itr->second,retries)) {
+			LOG(ERR) << "transaction table write failed for ID " << itr->first << ": " << sqlite3_errmsg(mDB);
+			ok = false;
+		}
+	}
+	if (!sqlite3_command(mDB,"COMMIT TRANSACTION",retries)) {
+		LOG(ALERT) << "transaction table commit of " << rows.size() << " rows failed after " << retries << " attempts, error: " << sqlite3_errmsg(mDB);
+		sqlite3_command(mDB,"ROLLBACK TRANSACTION");
+		return false;
+	}
+	return ok;
+}
+
+
+void TransactionDBWriter::close()
+{
+	// sqlite3_close fails with SQLITE_BUSY while any statement is unfinalized.
+	// The write-behind thread may still be running, so it is locked out and then sees mDB is gone.
+	ScopedLock lock(mDBLock);
+	sqlite3_finalize(mInsertStmt);
+	sqlite3_finalize(mDeleteStmt);
+	mInsertStmt = mDeleteStmt = NULL;
+	for (std::map<std::string,sqlite3_stmt*>::iterator itr = mUpdateStmts.begin(); itr!=mUpdateStmts.end(); ++itr) {
+		sqlite3_finalize(itr->second);
+	}
+	mUpdateStmts.clear();
+	mDB = NULL;
+}
+
+
+void TransactionDBWriter::text(ostream& os) const
+{
+	ScopedLock lock(mLock);
+	if (!mStarted) {
+		os << "transaction table writer: no writes yet" << endl;
+		return;
+	}
+	if (!mAsync) {
+		os << "transaction table writer: synchronous" << endl;
+		return;
+	}
+	os << "transaction table writer: write-behind" << endl;
+	os << "  queue depth " << mPending.size() << ", max " << mMaxDepth << ", limit " << sMaxPendingRows << endl;
+	os << "  batches " << mBatches << ", failed " << mFailures << ", rows " << mRows
+		<< ", merged writes " << mMerged << ", waits for queue space " << mWaits << endl;
+	os << format("  row latency avg %.1f ms, max %ld ms", mRows ? (double)mTotalLatency/mRows : 0.0, mMaxLatency) << endl;
+	os << "  batch write time last " << mLastBatchTime << " ms, max " << mMaxBatchTime << " ms" << endl;
+}
+
+
+
 TransactionTable::TransactionTable(const char* path)
 	// This assumes the main application uses sdevrandom.
 	:mIDCounter(random())
@@ -643,13 +924,18 @@ TransactionTable::TransactionTable(const char* path)
 		mDB = NULL;
 		return;
 	}
+	sqlite3_busy_backoff(mDB);
 	// Create a new table, if needed.
 	if (!sqlite3_command(mDB,createTransactionTable)) {
 		LOG(ALERT) << "Cannot create Transaction Table";
 	}
+	if (!sqlite3_set_wal(mDB,gConfig.getBool("Control.Reporting.WAL"))) {
+		LOG(WARNING) << "cannot set journal mode of Transaction Table: " << sqlite3_errmsg(mDB);
+	}
 	// Clear any previous entires.
-	if (!sqlite3_command(gTransactionTable.DB(),"DELETE FROM TRANSACTION_TABLE"))
+	if (!sqlite3_command(mDB,"DELETE FROM TRANSACTION_TABLE"))
 		LOG(WARNING) << "cannot clear previous transaction table";
+	mDBWriter.DB(mDB);
 }
 
 
@@ -658,7 +944,10 @@ TransactionTable::~TransactionTable()
 {
 	// Don't bother disposing of the memory,
 	// since this is only invoked when the application exits.
-	if (mDB) sqlite3_close(mDB);
+	if (!mDB) return;
+	mDBWriter.close();
+	sqlite3_cached_finalize(mDB);
+	sqlite3_close(mDB);
 }
 
 
@@ -675,7 +964,16 @@ void TransactionTable::add(TransactionEntry* value)
 {
 	LOG(INFO) << "new transaction " << *value;
 	ScopedLock lock(mLock);
+	sweepDeadEntries();
+	TransactionMap::iterator itr = mTable.find(value->ID());
+	if (itr!=mTable.end()) {
+		// Not expected, but keep the indexes consistent with mTable if it happens.
+		LOG(ERR) << "replacing transaction with duplicate ID " << *(itr->second);
+		indexRemove(itr->second);
+	}
 	mTable[value->ID()]=value;
+	value->mTransactionTable = this;
+	indexAdd(value);
 	value->insertIntoDatabase();
 }
 
@@ -689,6 +987,13 @@ TransactionEntry* TransactionTable::find(unsigned key)
 	LOG(DEBUG) << "by key: " << key;
 	assert(key);
 	ScopedLock lock(mLock);
+	return live(key);
+}
+
+
+TransactionEntry* TransactionTable::live(unsigned key)
+{
+	// Caller should hold mLock.
 	TransactionMap::iterator itr = mTable.find(key);
 	if (itr==mTable.end()) return NULL;
 	if (itr->second->dead()) {
@@ -699,10 +1004,44 @@ TransactionEntry* TransactionTable::find(unsigned key)
 }
 
 
+void TransactionTable::indexAdd(TransactionEntry* entry)
+{
+	// Caller should hold mLock.
+	// The subscriber is fixed in the TransactionEntry constructor, so it is indexed once.
+	unsigned ID = entry->ID();
+	entry->mIndexedChannel = entry->channel();
+	entry->mIndexedCallID = entry->SIPCallID();
+	mByChannel.insert(TransactionChannelIndex::value_type(entry->mIndexedChannel,ID));
+	mBySubscriber.insert(TransactionSubscriberIndex::value_type(entry->subscriber(),ID));
+	mByCallID.insert(TransactionCallIDIndex::value_type(entry->mIndexedCallID,ID));
+}
+
+
+void TransactionTable::indexRemove(TransactionEntry* entry)
+{
+	// Caller should hold mLock.
+	unsigned ID = entry->ID();
+	mByChannel.erase(TransactionChannelIndex::value_type(entry->mIndexedChannel,ID));
+	mBySubscriber.erase(TransactionSubscriberIndex::value_type(entry->subscriber(),ID));
+	mByCallID.erase(TransactionCallIDIndex::value_type(entry->mIndexedCallID,ID));
+}
+
+
+void TransactionTable::reindex(TransactionEntry* entry)
+{
+	ScopedLock lock(mLock);
+	TransactionMap::iterator itr = mTable.find(entry->ID());
+	if (itr==mTable.end() || itr->second!=entry) return;
+	indexRemove(entry);
+	indexAdd(entry);
+}
+
+
 void TransactionTable::innerRemove(TransactionMap::iterator itr)
 {
 	LOG(DEBUG) << "removing transaction: " << *(itr->second);
 	gSIPInterface.removeCall(itr->second->SIPCallID());
+	indexRemove(itr->second);
 	delete itr->second;
 	mTable.erase(itr);
 }
@@ -754,24 +1093,33 @@ void TransactionTable::clearDeadEntries()
 }
 
 
+void TransactionTable::sweepDeadEntries()
+{
+	// Caller should hold mLock.
+	// Lookups never return dead entries, so this only bounds how long
+	// an expired paging transaction that nobody asks about stays in the table.
+	static const unsigned sSweepInterval = 1000;	// ms
+	if (!mNextSweep.passed()) return;
+	clearDeadEntries();
+	mNextSweep.future(sSweepInterval);
+}
+
+
 
 
 TransactionEntry* TransactionTable::find(const UMTS::LogicalChannel *chan)
 {
 	LOG(DEBUG) << "by channel: " << *chan << " (" << chan << ")";
 
-	// Yes, it's linear time.
-	// Since clearDeadEntries is also linear, do that here, too.
-	clearDeadEntries();
-
-	// Brute force search.
 	ScopedLock lock(mLock);
-	for (TransactionMap::iterator itr = mTable.begin(); itr!=mTable.end(); ++itr) {
-		const UMTS::LogicalChannel* thisChan = itr->second->channel();
-		//LOG(DEBUG) << "looking for " << *chan << " (" << chan << ")" << ", found " << *(thisChan) << " (" << thisChan << ")";
-		if ((void*)thisChan == (void*)chan) return itr->second;
+	sweepDeadEntries();
+	TransactionChannelIndex::iterator itr = mByChannel.lower_bound(TransactionChannelIndex::value_type(chan,0));
+	while (itr!=mByChannel.end() && itr->first==chan) {
+		// Step past this element before live() can erase it.
+		unsigned ID = (itr++)->second;
+		TransactionEntry* entry = live(ID);
+		if (entry) return entry;
 	}
-	//LOG(DEBUG) << "no match for " << *chan << " (" << chan << ")";
 	return NULL;
 }
 
@@ -780,15 +1128,13 @@ TransactionEntry* TransactionTable::find(const GSM::L3MobileIdentity& mobileID,
 {
 	LOG(DEBUG) << "by ID and state: " << mobileID << " in " << state;
 
-	// Yes, it's linear time.
-	// Since clearDeadEntries is also linear, do that here, too.
-	clearDeadEntries();
-
-	// Brtue force search.
 	ScopedLock lock(mLock);
-	for (TransactionMap::iterator itr = mTable.begin(); itr!=mTable.end(); ++itr) {
-		if (itr->second->GSMState() != state) continue;
-		if (itr->second->subscriber() == mobileID) return itr->second;
+	sweepDeadEntries();
+	TransactionSubscriberIndex::iterator itr = mBySubscriber.lower_bound(TransactionSubscriberIndex::value_type(mobileID,0));
+	while (itr!=mBySubscriber.end() && itr->first==mobileID) {
+		unsigned ID = (itr++)->second;
+		TransactionEntry* entry = live(ID);
+		if (entry && entry->GSMState()==state) return entry;
 	}
 	return NULL;
 }
@@ -800,15 +1146,13 @@ TransactionEntry* TransactionTable::find(const GSM::L3MobileIdentity& mobileID,
 	LOG(DEBUG) << "by ID and call-ID: " << mobileID << ", call " << callID;
 
 	string callIDString = string(callID);
-	// Yes, it's linear time.
-	// Since clearDeadEntries is also linear, do that here, too.
-	clearDeadEntries();
-
-	// Brtue force search.
 	ScopedLock lock(mLock);
-	for (TransactionMap::iterator itr = mTable.begin(); itr!=mTable.end(); ++itr) {
-		if (itr->second->mSIP.callID() != callIDString) continue;
-		if (itr->second->subscriber() == mobileID) return itr->second;
+	sweepDeadEntries();
+	TransactionCallIDIndex::iterator itr = mByCallID.lower_bound(TransactionCallIDIndex::value_type(callIDString,0));
+	while (itr!=mByCallID.end() && itr->first==callIDString) {
+		unsigned ID = (itr++)->second;
+		TransactionEntry* entry = live(ID);
+		if (entry && entry->subscriber()==mobileID) return entry;
 	}
 	return NULL;
 }
@@ -816,22 +1160,18 @@ TransactionEntry* TransactionTable::find(const GSM::L3MobileIdentity& mobileID,
 
 TransactionEntry* TransactionTable::answeredPaging(const GSM::L3MobileIdentity& mobileID)
 {
-	// Yes, it's linear time.
-	// Even in a 6-ARFCN system, it should rarely be more than a dozen entries.
-
-	// Since clearDeadEntries is also linear, do that here, too.
-	clearDeadEntries();
-
-	// Brtue force search.
 	ScopedLock lock(mLock);
-	for (TransactionMap::iterator itr = mTable.begin(); itr!=mTable.end(); ++itr) {
-		if (itr->second->GSMState() != GSM::Paging) continue;
-		if (itr->second->subscriber() == mobileID) {
-			// Stop T3113 and change the state.
-			itr->second->GSMState(GSM::AnsweredPaging);
-			itr->second->resetTimer("3113");
-			return itr->second;
-		}
+	sweepDeadEntries();
+	TransactionSubscriberIndex::iterator itr = mBySubscriber.lower_bound(TransactionSubscriberIndex::value_type(mobileID,0));
+	while (itr!=mBySubscriber.end() && itr->first==mobileID) {
+		unsigned ID = (itr++)->second;
+		TransactionEntry* entry = live(ID);
+		if (!entry) continue;
+		if (entry->GSMState() != GSM::Paging) continue;
+		// Stop T3113 and change the state.
+		entry->GSMState(GSM::AnsweredPaging);
+		entry->resetTimer("3113");
+		return entry;
 	}
 	return NULL;
 }
@@ -839,17 +1179,14 @@ TransactionEntry* TransactionTable::answeredPaging(const GSM::L3MobileIdentity&
 
 UMTS::LogicalChannel* TransactionTable::findChannel(const GSM::L3MobileIdentity& mobileID)
 {
-	// Yes, it's linear time.
-	// Even in a 6-ARFCN system, it should rarely be more than a dozen entries.
-
-	// Since clearDeadEntries is also linear, do that here, too.
-	clearDeadEntries();
-
-	// Brtue force search.
 	ScopedLock lock(mLock);
-	for (TransactionMap::iterator itr = mTable.begin(); itr!=mTable.end(); ++itr) {
-		if (itr->second->subscriber() != mobileID) continue;
-		UMTS::LogicalChannel* chan = itr->second->channel();
+	sweepDeadEntries();
+	TransactionSubscriberIndex::iterator itr = mBySubscriber.lower_bound(TransactionSubscriberIndex::value_type(mobileID,0));
+	while (itr!=mBySubscriber.end() && itr->first==mobileID) {
+		unsigned ID = (itr++)->second;
+		TransactionEntry* entry = live(ID);
+		if (!entry) continue;
+		UMTS::LogicalChannel* chan = entry->channel();
 		if (!chan) continue;
 		if (chan->type() == UMTS::DTCHType) return chan;
 		if (chan->type() == UMTS::DCCHType) return chan;
@@ -861,10 +1198,12 @@ UMTS::LogicalChannel* TransactionTable::findChannel(const GSM::L3MobileIdentity&
 unsigned TransactionTable::countChan(const UMTS::LogicalChannel* chan)
 {
 	ScopedLock lock(mLock);
-	clearDeadEntries();
+	sweepDeadEntries();
 	unsigned count = 0;
-	for (TransactionMap::iterator itr = mTable.begin(); itr!=mTable.end(); ++itr) {
-		if (itr->second->channel() == chan) count++;
+	TransactionChannelIndex::iterator itr = mByChannel.lower_bound(TransactionChannelIndex::value_type(chan,0));
+	while (itr!=mByChannel.end() && itr->first==chan) {
+		unsigned ID = (itr++)->second;
+		if (live(ID)) count++;
 	}
 	return count;
 }
@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <list>
+#include <set>
 
 #include <Logger.h>
 #include <Interthread.h>
@@ -41,6 +42,7 @@ class LogicalChannel;
 
 
 struct sqlite3;
+struct sqlite3_stmt;
 
 
 /**@namespace Control This namepace is for use by the control layer. */
@@ -49,6 +51,106 @@ namespace Control {
 typedef std::map<std::string, GSM::Z100Timer> TimerTable;
 
 
+/** A TRANSACTION_TABLE column value; default constructed is SQL NULL. */
+struct TransactionDBValue {
+	bool mNull;
+	std::string mText;		///< integers are stored as text, the column affinity converts them back
+	TransactionDBValue() :mNull(true) {}
+	TransactionDBValue(const std::string& wText) :mNull(false),mText(wText) {}
+	TransactionDBValue(const char* wText) :mNull(false),mText(wText) {}
+	TransactionDBValue(unsigned wNum) :mNull(false),mText(format("%u",wNum)) {}
+};
+
+/** Some of the columns of one TRANSACTION_TABLE row, keyed by column name. */
+typedef std::map<std::string,TransactionDBValue> TransactionDBRow;
+
+class TransactionTable;
+
+/**
+	Mirrors TransactionEntry state into the TRANSACTION_TABLE database.
+	With Control.Reporting.TransactionTable.WriteBehind set, writes are queued and a
+	separate thread applies them, so call control never waits on the disk.
+	Updates to a transaction that is still queued are merged into the queued row,
+	and each pass of the thread writes everything queued in one SQL transaction.
+	Otherwise each write is applied before the call returns, as it used to be.
+	The database is for reporting only; nothing in OpenBTS reads it back.
+*/
+class TransactionDBWriter {
+
+	private:
+
+	struct PendingRow {
+		bool mDelete;			///< delete any existing row first
+		bool mInsert;			///< mRow is a whole new row
+		TransactionDBRow mRow;
+		Timeval mQueued;		///< time of the first write merged into this row
+		PendingRow() :mDelete(false),mInsert(false) {}
+	};
+	typedef std::map<unsigned,PendingRow> PendingMap;
+
+	sqlite3 *mDB;
+
+	mutable Mutex mLock;		///< guards the queue and the statistics
+	Signal mWork;				///< signalled when the queue becomes non-empty
+	Signal mSpace;				///< signalled when the thread empties the queue
+	PendingMap mPending;
+	bool mStarted;
+	bool mAsync;
+	unsigned mRetries;
+	Thread mThread;
+
+	Mutex mDBLock;				///< serializes use of mDB and the prepared statements
+	sqlite3_stmt *mInsertStmt;
+	sqlite3_stmt *mDeleteStmt;
+	std::map<std::string,sqlite3_stmt*> mUpdateStmts;	///< one per column
+
+	/**@name Statistics, guarded by mLock. */
+	//@{
+	unsigned mMaxDepth;
+	unsigned long mBatches;
+	unsigned long mRows;
+	unsigned long mMerged;		///< writes merged into an already queued row
+	unsigned long mWaits;		///< writes that waited for space in the queue
+	unsigned long mFailures;	///< batches that could not be committed
+	unsigned long mTotalLatency;	///< sum over rows of queue-to-commit time, ms
+	long mMaxLatency;
+	long mLastBatchTime;		///< time to write the last batch, ms
+	long mMaxBatchTime;
+	//@}
+
+	void start();
+	void enqueue(unsigned ID, const TransactionDBRow* row, bool insert, bool remove, unsigned retries);
+
+	/** Write rows in one SQL transaction; return false if it could not be committed. */
+	bool writeRows(const PendingMap& rows, unsigned retries);
+	bool writeRow(unsigned ID, const PendingRow& row, unsigned retries);
+	sqlite3_stmt* updateStmt(const std::string& column);
+
+	public:
+
+	TransactionDBWriter();
+
+	void DB(sqlite3* wDB) { mDB = wDB; }
+
+	/** Finalize the prepared statements and stop writing; call before closing the database. */
+	void close();
+
+	/**@name Row operations; retries is the SQLite busy retry count for a synchronous write. */
+	//@{
+	void insert(unsigned ID, const TransactionDBRow& row, unsigned retries) { enqueue(ID,&row,true,false,retries); }
+	void update(unsigned ID, const TransactionDBRow& row, unsigned retries) { enqueue(ID,&row,false,false,retries); }
+	void remove(unsigned ID, unsigned retries) { enqueue(ID,NULL,false,true,retries); }
+	//@}
+
+	/** The thread body. */
+	void serviceLoop();
+
+	/** Print queue depth, write latency and counters. */
+	void text(std::ostream&) const;
+};
+
+
+
 
 
 /**
@@ -87,10 +189,20 @@ class TransactionEntry {
 
 	unsigned mNumSQLTries;					///< number of SQL tries for DB operations
 
+	unsigned mRTPPorts;						///< RTP port pair from gRTPPortAllocator, or 0
+
 	UMTS::LogicalChannel *mChannel;			///< current channel of the transaction
 
 	bool mTerminationRequested;
 
+	/**@name Keys under which mTransactionTable has indexed this entry, guarded by the table's lock. */
+	//@{
+	const UMTS::LogicalChannel *mIndexedChannel;
+	std::string mIndexedCallID;
+	//@}
+
+	TransactionTable *mTransactionTable;	///< the table that indexes and writes this entry, set by add
+
 	public:
 
 	/** This form is used for MTC or MT-SMS with TI generated by the network. */
@@ -191,6 +303,9 @@ class TransactionEntry {
 	SIP::SIPState MTCWaitForACK();
 	SIP::SIPState MTCCheckForCancel();
 	SIP::SIPState MTCSendOK(short rtpPort, unsigned codec);
+
+	/** Allocate the RTP port pair for this call if it has none; return the even port, or 0 if none is free. */
+	unsigned allocateRTPPorts();
 	void MTCInitRTP() { ScopedLock lock(mLock); mSIP.MTCInitRTP(); }
 
 	SIP::SIPState MODSendBYE();
@@ -208,10 +323,17 @@ class TransactionEntry {
 
 	bool sendINFOAndWaitForOK(unsigned info);
 
-	void txFrame(unsigned char* frame) { return mSIP.txFrame(frame); }
-	int rxFrame(unsigned char* frame) { return mSIP.rxFrame(frame); }
-	bool startDTMF(char key) { return mSIP.startDTMF(key); }
-	void stopDTMF() { mSIP.stopDTMF(); }
+	/**@name Media, from the media engine thread, locked against the call thread's SIP state changes. */
+	//@{
+	void txFrame(unsigned char* frame) { ScopedLock lock(mLock); return mSIP.txFrame(frame); }
+	int rxFrame(unsigned char* frame) { ScopedLock lock(mLock); return mSIP.rxFrame(frame); }
+	int RTPSocket() const { ScopedLock lock(mLock); return mSIP.RTPSocket(); }
+	/** Take the lock only if it is free, for the media engine, which must not wait while a call thread waits for a SIP reply. */
+	bool trylock() const { return mLock.trylock(); }
+	void unlock() const { mLock.unlock(); }
+	//@}
+	bool startDTMF(char key) { ScopedLock lock(mLock); return mSIP.startDTMF(key); }
+	void stopDTMF() { ScopedLock lock(mLock); mSIP.stopDTMF(); }
 
 	void SIPUser(const std::string& IMSI) { SIPUser(IMSI.c_str()); }
 	void SIPUser(const char* IMSI);
@@ -271,8 +393,8 @@ class TransactionEntry {
 	/** Set up a new entry in gTransactionTable's sqlite3 database. */
 	void insertIntoDatabase();
 
-	/** Run a database query. */
-	void runQuery(const char* query) const;
+	/** Mirror some columns of this entry into the database. */
+	void updateDatabase(const TransactionDBRow& row) const;
 
 	/** Echo latest SIPSTATE to the database. */
 	SIP::SIPState echoSIPState(SIP::SIPState state) const;
@@ -285,6 +407,15 @@ std::ostream& operator<<(std::ostream& os, const TransactionEntry&);
 /** A map of transactions keyed by ID. */
 class TransactionMap : public std::map<unsigned,TransactionEntry*> {};
 
+/**
+	Secondary indexes into a TransactionMap.
+	Each element pairs a key with a transaction ID, so all the transactions
+	for a key are adjacent and in ID order, the same order as a TransactionMap scan.
+*/
+typedef std::set<std::pair<const UMTS::LogicalChannel*,unsigned> > TransactionChannelIndex;
+typedef std::set<std::pair<GSM::L3MobileIdentity,unsigned> > TransactionSubscriberIndex;
+typedef std::set<std::pair<std::string,unsigned> > TransactionCallIDIndex;
+
 /**
 	A table for tracking the states of active transactions.
 */
@@ -295,8 +426,13 @@ class TransactionTable {
 	sqlite3 *mDB;			///< database connection
 
 	TransactionMap mTable;
+	TransactionChannelIndex mByChannel;		///< index by current channel
+	TransactionSubscriberIndex mBySubscriber;	///< index by subscriber identity
+	TransactionCallIDIndex mByCallID;		///< index by SIP call ID
 	mutable Mutex mLock;
 	unsigned mIDCounter;
+	Timeval mNextSweep;						///< time of the next clearDeadEntries pass
+	TransactionDBWriter mDBWriter;			///< writes mDB on behalf of the entries
 
 	public:
 
@@ -349,7 +485,7 @@ class TransactionTable {
 
 	/**
 		Find an entry by its channel pointer.
-		Also clears dead entries during search.
+		Dead entries are not returned.
 		@param chan The channel pointer to the first record found.
 		@return pointer to entry or NULL if no active match
 	*/
@@ -357,7 +493,7 @@ class TransactionTable {
 
 	/**
 		Find an entry in the given state by its mobile ID.
-		Also clears dead entries during search.
+		Dead entries are not returned.
 		@param mobileID The mobile to search for.
 		@return pointer to entry or NULL if no match
 	*/
@@ -369,7 +505,7 @@ class TransactionTable {
 
 	/**
 		Find an entry in the Paging state by its mobile ID, change state to AnsweredPaging and reset T3113.
-		Also clears dead entries during search.
+		Dead entries are not returned.
 		@param mobileID The mobile to search for.
 		@return pointer to entry or NULL if no match
 	*/
@@ -390,13 +526,16 @@ class TransactionTable {
 
 	size_t dump(std::ostream& os) const;
 
+	/** Print the database writer statistics. */
+	void DBWriterText(std::ostream& os) const { mDBWriter.text(os); }
+
 
 	private:
 
 	friend class TransactionEntry;
 
-	/** Accessor to database connection. */
-	sqlite3* DB() { return mDB; }
+	/** Accessor to the database writer. */
+	TransactionDBWriter& DBWriter() { return mDBWriter; }
 
 	/**
 		Remove "dead" entries from the table.
@@ -405,11 +544,39 @@ class TransactionTable {
 	*/
 	void clearDeadEntries();
 
+	/**
+		Run clearDeadEntries if it has not been run in the last sSweepInterval ms.
+		Lookups go through the indexes, so this is the only full scan of the table.
+		The caller should hold mLock.
+	*/
+	void sweepDeadEntries();
+
+	/**
+		Return the entry with this ID, or NULL if it is not in the table.
+		A dead entry is removed and NULL returned.
+		This does not invalidate index iterators other than those for this ID.
+		The caller should hold mLock.
+	*/
+	TransactionEntry* live(unsigned wID);
+
 	/**
 		Remove and entry from the table and from gSIPInterface.
 	*/
 	void innerRemove(TransactionMap::iterator);
 
+	/**@name Secondary index maintenance; the caller should hold mLock. */
+	//@{
+	void indexAdd(TransactionEntry*);
+	void indexRemove(TransactionEntry*);
+	//@}
+
+	/**
+		Bring the channel and call ID indexes up to date for an entry whose
+		channel or SIP call ID changed.  Does nothing if the entry is not in the table.
+		Called by TransactionEntry without its own lock held, so the lock order is always table then entry.
+	*/
+	void reindex(TransactionEntry*);
+
 };
 
 
@@ -59,6 +59,7 @@ PhysicalStatus::PhysicalStatus(const char* wPath)
 		mDB = NULL;
 		return;
 	}
+	sqlite3_busy_backoff(mDB);
 	if (!sqlite3_command(mDB, createPhysicalStatus)) {
 		LOG(EMERG) << "Cannot create TMSI table";
 	}
@@ -66,7 +67,9 @@ PhysicalStatus::PhysicalStatus(const char* wPath)
 
 PhysicalStatus::~PhysicalStatus()
 {
-	if (mDB) sqlite3_close(mDB);
+	if (!mDB) return;
+	sqlite3_cached_finalize(mDB);
+	sqlite3_close(mDB);
 }
 
 bool PhysicalStatus::createEntry(const LogicalChannel* chan)
@@ -0,0 +1,225 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+// Checks ip_checksum against the 16 bit loop it replaced, on buffers of every alignment,
+// checks the RFC 1624 updates and the TCP MSS clamp against a full checksum,
+// and reports the throughput of each.
+// Usage: ChecksumBench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <vector>
+
+#include "miniggsn.h"
+
+// We must have a gConfig now to include Logger.
+#include "Configuration.h"
+ConfigurationTable gConfig;
+
+// iputils logs here.
+namespace SGSN { FILE *mg_log_fp = NULL; }
+
+using namespace SGSN;
+
+static uint64_t nowns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// The checksum as it was, a word at a time.
+static unsigned int oldChecksum(void *ptr, unsigned len)
+{
+	uint32_t sum = 0;
+	uint16_t w;
+	unsigned char *cp = (unsigned char*)ptr;
+	while (len > 1) { memcpy(&w,cp,2); sum += w; cp += 2; len -= 2; }
+	if (len == 1) { w = 0; *(unsigned char*)&w = *cp; sum += w; }
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+	return 0xffff & ~sum;
+}
+
+static void randomFill(unsigned char *cp, unsigned len)
+{
+	for (unsigned i = 0; i < len; i++) { cp[i] = random(); }
+}
+
+static void put16(unsigned char *cp, unsigned value) { cp[0] = value >> 8; cp[1] = value; }
+
+// The TCP checksum over the pseudo header and segment; 0 if the segment's checksum is right.
+static unsigned tcpCheck(unsigned char *packet, unsigned len)
+{
+	unsigned char pseudo[12];
+	memcpy(pseudo,packet+12,8);
+	pseudo[8] = 0;
+	pseudo[9] = IPPROTO_TCP;
+	put16(pseudo+10,len - 20);
+	return ip_checksum(packet+20,len-20,pseudo);
+}
+
+// A SYN with the MSS option at an odd offset, behind a no-op, as some stacks send it.
+static unsigned makeSyn(unsigned char *packet, unsigned mss, bool odd)
+{
+	unsigned len = 20 + 20 + 8;
+	memset(packet,0,len);
+	packet[0] = 0x45;
+	put16(packet+2,len);
+	packet[8] = 64;
+	packet[9] = IPPROTO_TCP;
+	randomFill(packet+12,8);
+	unsigned char *tcp = packet + 20;
+	randomFill(tcp,8);
+	tcp[12] = (28/4) << 4;
+	tcp[13] = 0x02;
+	put16(tcp+14,65535);
+	unsigned char *opt = tcp + 20;
+	unsigned i = 0;
+	if (odd) { opt[i++] = 1; }
+	opt[i++] = 2; opt[i++] = 4;
+	put16(opt+i,mss); i += 2;
+	while (i < 8) { opt[i++] = 1; }
+	uint16_t check = tcpCheck(packet,len);
+	memcpy(tcp+16,&check,2);
+	return len;
+}
+
+static int checkCorrectness()
+{
+	int failures = 0;
+	std::vector<unsigned char> buf(70000);
+	// Every length to 300 and some long ones, at every alignment.
+	for (unsigned len = 0; len < 66000; len += len < 300 ? 1 : 4099) {
+		for (unsigned align = 0; align < 8; align++) {
+			unsigned char *cp = &buf[align];
+			randomFill(cp,len);
+			if (ip_checksum(cp,len,NULL) != oldChecksum(cp,len)) {
+				printf("ip_checksum wrong, length %u alignment %u\n",len,align);
+				failures++;
+			}
+		}
+	}
+	// All ones fills the vector lanes fastest; the buffer is long enough to empty them several times.
+	// The sum of 0xffff words is 0xffff, so the checksum is 0.  (oldChecksum would overflow here.)
+	std::vector<unsigned char> ones(4<<20,0xff);
+	if (ip_checksum(&ones[0],ones.size(),NULL) != 0) {
+		printf("ip_checksum wrong on %u bytes of ones\n",(unsigned)ones.size());
+		failures++;
+	}
+	// Change one field of a good header, update the checksum, and see that the header still checks.
+	for (int n = 0; n < 100000; n++) {
+		unsigned char header[20];
+		randomFill(header,20);
+		header[10] = header[11] = 0;
+		uint16_t check = ip_checksum(header,20,NULL);
+		memcpy(header+10,&check,2);
+		if (n & 1) {
+			unsigned off = 2 * (random() % 4);		// A word before the checksum.
+			uint16_t from, to = random();
+			memcpy(&from,header+off,2);
+			memcpy(header+off,&to,2);
+			check = ip_csum_replace2(check,from,to);
+		} else {
+			unsigned off = 12 + 4 * (random() % 2);	// An address.
+			uint32_t from, to = random();
+			memcpy(&from,header+off,4);
+			memcpy(header+off,&to,4);
+			check = ip_csum_replace4(check,from,to);
+		}
+		memcpy(header+10,&check,2);
+		if (ip_checksum(header,20,NULL) != 0) {
+			if (failures++ < 10) printf("incremental update wrong, pass %d\n",n);
+		}
+	}
+	// The clamp, with the option word aligned and not.
+	for (int n = 0; n < 10000; n++) {
+		unsigned char packet[64];
+		bool odd = n & 1;
+		unsigned mss = 500 + random() % 1000;
+		unsigned len = makeSyn(packet,mss,odd);
+		int clamped = ip_tcp_clamp_mss(packet,len,1000);
+		unsigned optMss = packet[40 + 2 + odd] << 8 | packet[40 + 3 + odd];
+		if (clamped != (mss > 1000) || optMss != (mss > 1000 ? 1000 : mss) || tcpCheck(packet,len) != 0) {
+			if (failures++ < 10) printf("mss clamp wrong, mss %u odd %d\n",mss,odd);
+		}
+	}
+	return failures;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+	srandom(1);
+	int failures = checkCorrectness();
+	printf("correctness: %s\n",failures ? "FAILED" : "ok");
+
+	std::vector<unsigned char> buf(65536+8);
+	randomFill(&buf[0],buf.size());
+	unsigned sizes[] = { 20, 40, 576, 1500, 65536 };
+	volatile unsigned sink = 0;
+	printf("%8s %12s %12s %8s\n","bytes","old MB/s","new MB/s","speedup");
+	for (unsigned s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+		unsigned len = sizes[s];
+		// About the same number of bytes at each size.
+		unsigned long n = iterations * 40 / len + 1;
+		unsigned char *cp = &buf[1];	// As a packet read after a one byte header would be.
+		uint64_t t0 = nowns();
+		for (unsigned long i = 0; i < n; i++) { sink += oldChecksum(cp,len); cp[0] = i; }
+		uint64_t t1 = nowns();
+		for (unsigned long i = 0; i < n; i++) { sink += ip_checksum(cp,len,NULL); cp[0] = i; }
+		uint64_t t2 = nowns();
+		double oldRate = (double)n * len / 1e6 / ((t1 - t0) / 1e9), newRate = (double)n * len / 1e6 / ((t2 - t1) / 1e9);
+		printf("%8u %12.0f %12.0f %8.1f\n",len,oldRate,newRate,newRate / oldRate);
+	}
+
+	// The TTL decrement in the uplink: the whole header summed again, or the one word updated.
+	unsigned char header[20];
+	randomFill(header,20);
+	uint64_t t0 = nowns();
+	for (unsigned long i = 0; i < iterations; i++) {
+		header[8] = i;
+		header[10] = header[11] = 0;
+		uint16_t check = ip_checksum(header,20,NULL);
+		memcpy(header+10,&check,2);
+	}
+	uint64_t t1 = nowns();
+	for (unsigned long i = 0; i < iterations; i++) {
+		uint16_t from, to, check;
+		memcpy(&from,header+8,2);
+		header[8] = i;
+		memcpy(&to,header+8,2);
+		memcpy(&check,header+10,2);
+		check = ip_csum_replace2(check,from,to);
+		memcpy(header+10,&check,2);
+	}
+	uint64_t t2 = nowns();
+	printf("ttl rewrite: full header %.1f ns, RFC 1624 update %.1f ns\n",
+		(double)(t1 - t0) / iterations,(double)(t2 - t1) / iterations);
+
+	unsigned char packet[64];
+	unsigned len = makeSyn(packet,1460,true);
+	t0 = nowns();
+	for (unsigned long i = 0; i < iterations; i++) {
+		put16(packet+40+3,1460);	// Undo the last clamp; the checksum is not checked here.
+		sink += ip_tcp_clamp_mss(packet,len,1360);
+	}
+	t1 = nowns();
+	printf("mss clamp: %.1f ns per SYN\n",(double)(t1 - t0) / iterations);
+	return failures ? 1 : 0;
+}
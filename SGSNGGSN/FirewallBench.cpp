@@ -0,0 +1,152 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+// Lookups per second of the GGSN firewall, compiled into GgsnFirewall,
+// against the walk of a list of base/mask pairs it used to be.
+// The rule sets are the GGSN.Firewall.Enable=2 ranges plus a block list of random ranges
+// with prefix lengths spread roughly as in a real block list: mostly /24, some /16 to /23 and /32.
+// Every lookup is checked against the list.
+// Usage: FirewallBench [lookups]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "GgsnFirewall.h"
+#include <Timeval.h>
+
+// We must have a gConfig now to include Logger.
+#include "Configuration.h"
+ConfigurationTable gConfig;
+
+using namespace SGSN;
+
+struct ListRule {
+	uint32_t basenl, masknl;
+};
+
+// The lookup as it was, except that it finds the longest match so the hits can be compared.
+static int listMatch(const std::vector<ListRule> &rules, uint32_t addrnl)
+{
+	int best = -1;
+	for (unsigned i = 0; i < rules.size(); i++) {
+		if ((addrnl & rules[i].masknl) == (rules[i].basenl & rules[i].masknl)) {
+			if (best < 0 || ntohl(rules[i].masknl) > ntohl(rules[best].masknl)) best = i;
+		}
+	}
+	return best;
+}
+
+// Whether it blocks at all, which is all the old walk did, stopping at the first match.
+static bool listBlocks(const std::vector<ListRule> &rules, uint32_t addrnl)
+{
+	for (unsigned i = 0; i < rules.size(); i++) {
+		if ((addrnl & rules[i].masknl) == (rules[i].basenl & rules[i].masknl)) return true;
+	}
+	return false;
+}
+
+static unsigned randomLength()
+{
+	unsigned r = random() % 100;
+	if (r < 60) return 24;
+	if (r < 80) return 17 + random() % 7;
+	if (r < 90) return 32;
+	if (r < 97) return 16;
+	return 25 + random() % 7;
+}
+
+static void add(GgsnFirewall &firewall, std::vector<ListRule> &list, const char *range)
+{
+	ListRule rule;
+	char buf[40];
+	snprintf(buf,sizeof(buf),"%s",range);
+	char *slash = strchr(buf,'/');
+	unsigned length = 32;
+	if (slash) { *slash = 0; length = atoi(slash+1); }
+	rule.basenl = inet_addr(buf);
+	rule.masknl = htonl(length ? ~0u << (32 - length) : 0);
+	list.push_back(rule);
+	firewall.add(rule.basenl,rule.masknl,range);
+}
+
+static double rate(unsigned long n, long ms) { return 1000.0*n/(ms ? ms : 1); }
+
+static bool run(unsigned blocklist, unsigned long lookups)
+{
+	GgsnFirewall firewall;
+	std::vector<ListRule> list;
+	add(firewall,list,"10.128.0.0/16");		// MS addresses
+	add(firewall,list,"127.0.0.0/24");
+	add(firewall,list,"192.0.2.10/32");		// this host
+	add(firewall,list,"192.168.0.0/16");
+	add(firewall,list,"172.16.0.0/12");
+	add(firewall,list,"10.0.0.0/8");
+	for (unsigned i = 0; i < blocklist; i++) {
+		char range[40];
+		uint32_t addr = (uint32_t)random() << 1 ^ random();
+		snprintf(range,sizeof(range),"%u.%u.%u.%u/%u",addr>>24,(addr>>16)&255,(addr>>8)&255,addr&255,randomLength());
+		add(firewall,list,range);
+	}
+	Timeval start;
+	firewall.compile();
+	long compileMs = start.elapsed();
+
+	// Half the destinations fall in a listed range, as when an MS keeps retrying a blocked server.
+	std::vector<uint32_t> addrs(4096);
+	for (unsigned i = 0; i < addrs.size(); i++) {
+		const ListRule &rule = list[random() % list.size()];
+		uint32_t addr = (uint32_t)random() << 1 ^ random();
+		if (i & 1) addr = ntohl(rule.basenl & rule.masknl) | (addr & ~ntohl(rule.masknl));
+		addrs[i] = htonl(addr);
+	}
+
+	unsigned long mismatches = 0, listBlocked = 0, trieBlocked = 0;
+	for (unsigned i = 0; i < addrs.size(); i++) {
+		int a = listMatch(list,addrs[i]), b = firewall.match(addrs[i]);
+		// Duplicate ranges may resolve to either copy.
+		if (a != b && (a < 0 || b < 0 || list[a].masknl != list[b].masknl)) mismatches++;
+	}
+
+	unsigned long listLookups = lookups / (list.size() > 100 ? 100 : 1);
+	start.now();
+	for (unsigned long n = 0; n < listLookups; n++) {
+		if (listBlocks(list,addrs[n % addrs.size()])) listBlocked++;
+	}
+	double before = rate(listLookups,start.elapsed());
+	start.now();
+	for (unsigned long n = 0; n < lookups; n++) {
+		if (firewall.blocks(addrs[n % addrs.size()])) trieBlocked++;
+	}
+	double after = rate(lookups,start.elapsed());
+	// The counts are printed so that the compiler cannot drop either loop.
+	printf("%6u ranges, compiled in %ld ms, tables %lu KB: list %.0f/s, trie %.0f/s, x%.1f; blocked %.0f%%, %.0f%%\n",
+		firewall.size(),compileMs,(unsigned long)firewall.tableBytes()/1024,before,after,after/before,
+		100.0*listBlocked/listLookups,100.0*trieBlocked/lookups);
+	if (mismatches) printf("%lu of %u lookups disagree with the list\n",mismatches,(unsigned)addrs.size());
+	return mismatches == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long lookups = argc>1 ? atol(argv[1]) : 10000000;
+	srandom(1);
+	bool ok = true;
+	unsigned sizes[] = { 0, 10, 100, 1000, 10000 };
+	for (unsigned i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		ok = run(sizes[i],lookups) && ok;
+	}
+	return ok ? 0 : 1;
+}
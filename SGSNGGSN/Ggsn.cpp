@@ -105,24 +105,26 @@ static void sethighpri()
 }
 
 
+// One of these runs for each tunnel queue; arg is the queue number.
 void *miniGgsnReadServiceLoop(void *arg)
 {
-	Ggsn *ggsn = (Ggsn*)arg;
+	Ggsn *ggsn = &gGgsn;
+	int queue = (int)(intptr_t)arg;
 	sethighpri();
 	while (ggsn->active()) {
 		struct pollfd fds[1];
-		fds[0].fd = tun_fd;
+		fds[0].fd = miniggsn_tun_fd(queue);
 		fds[0].events = POLLIN;
 		fds[0].revents = 0;		// being cautious
 		// We time out occassionally to check if the user wants to shut the sgsn down.
-                MGINFO("ggsn: polling at %s",timestr().c_str());
+		if (MGTRACING()) { MGINFO("ggsn: polling at %s",timestr().c_str()); }
 		if (-1 == poll(fds,1,ggsn->mStopTimeout)) {
 			SGSNERROR("ggsn: poll failure");
 			return 0;
 		}
-                MGINFO("ggsn: polling %0x at %s",fds[0].revents,timestr().c_str());
+		if (MGTRACING()) { MGINFO("ggsn: polling %0x at %s",fds[0].revents,timestr().c_str()); }
 		if (fds[0].revents & POLLIN) {
-			miniggsn_handle_read();
+			miniggsn_handle_read(queue);
 		}
 	}
 	return 0;
@@ -134,13 +136,19 @@ void *miniGgsnWriteServiceLoop(void *arg)
 	Ggsn *ggsn = (Ggsn*)arg;
 	while (ggsn->active()) {
 		// 8-6-2012 This interthreadqueue is clumping things up.  Try taking out the timeout.
-		//PdpPdu *npdu = ggsn->mTxQ.read(ggsn->mStopTimeout);
-		PdpPdu *npdu = ggsn->mTxQ.read();
-        	SGSNLOG("Got pdu to send: " << npdu->mpdu);
-		if (npdu) {
-			miniggsn_snd_npdu_by_mgc(npdu->mgp, npdu->mpdu.begin(), npdu->mpdu.size());
-			delete npdu;
-		}
+		// The uplink queues are signalled on every packet, so the timeout does not delay them.
+		miniggsn_handle_uplink(ggsn->mStopTimeout);
+	}
+	return 0;
+}
+
+// Sends the queued downlink packets when GGSN.Shaping.Enable is set.
+static void *miniGgsnDownlinkServiceLoop(void *arg)
+{
+	sethighpri();
+	Ggsn *ggsn = (Ggsn*)arg;
+	while (ggsn->active()) {
+		miniggsn_handle_downlink(ggsn->mStopTimeout);
 	}
 	return 0;
 }
@@ -188,8 +196,15 @@ bool Ggsn::start()
 {
 	if (gGgsn.mActive) { return false; }
 	if (!miniggsn_init()) { return false; }
-	gGgsn.mGgsnRecvThread.start(miniGgsnReadServiceLoop,&gGgsn);
+	for (int q = 0; q < miniggsn_tun_queues(); q++) {
+		Thread *reader = new Thread();
+		reader->start(miniGgsnReadServiceLoop,(void*)(intptr_t)q);
+		gGgsn.mGgsnRecvThreads.push_back(reader);
+	}
 	gGgsn.mGgsnSendThread.start(miniGgsnWriteServiceLoop,&gGgsn);
+	if (miniggsn_shaping()) {
+		gGgsn.mGgsnDownlinkThread.start(miniGgsnDownlinkServiceLoop,&gGgsn);
+	}
 	if (gConfig.getStr("GGSN.ShellScript").size() > 1) {
 		gGgsn.mGgsnShellThread.start(miniGgsnShellServiceLoop,&gGgsn);
 		gGgsn.mShellThreadActive = true;
@@ -206,8 +221,13 @@ bool Ggsn::start()
 void Ggsn::stop()
 {
 	if (!gGgsn.mActive) {return;}
-	gGgsn.mGgsnRecvThread.join();
+	for (unsigned q = 0; q < gGgsn.mGgsnRecvThreads.size(); q++) {
+		gGgsn.mGgsnRecvThreads[q]->join();
+		delete gGgsn.mGgsnRecvThreads[q];
+	}
+	gGgsn.mGgsnRecvThreads.clear();
 	gGgsn.mGgsnSendThread.join();
+	if (miniggsn_shaping()) { gGgsn.mGgsnDownlinkThread.join(); }
 	if (gGgsn.mShellThreadActive) {
 		gGgsn.mGgsnShellThread.join();
 		gGgsn.mShellThreadActive = false;
@@ -384,6 +404,10 @@ void sendPdpContextAccept(SgsnInfo *si, PdpContext *pdp)
 	SmQoS resultQoS(12); // The full 12 byte QoS works.
 	resultQoS.defaultPS(pdp->mRabStatus.mRateDownlink,pdp->mRabStatus.mRateUplink);
 	pdpa.mQoS = resultQoS;
+	// Hold the PDP context to the peak throughput we just gave it, if the GGSN shapes traffic.
+	if (pdp->mgp) {
+		miniggsn_set_rates(pdp->mgp,1000*pdp->mRabStatus.mRateDownlink,1000*pdp->mRabStatus.mRateUplink);
+	}
 
 	pdpa.mRadioPriority = 2;	// 2 is a medium priority. Why do we pass this to the MS at all?
 	setPco(pdpa.mPco,pdp->mPcoReq, pdp->mgp);
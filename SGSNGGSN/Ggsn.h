@@ -14,6 +14,7 @@
 
 #ifndef GGSN_H
 #define GGSN_H
+#include <vector>
 #include <Interthread.h>
 #include <LinkedLists.h>
 #include <ByteVector.h>
@@ -37,11 +38,17 @@ struct PdpPdu : SingleLinkListNode {
 	ByteVector mpdu;
 	//PdpContext *mpdp;
 	mg_con_t *mgp;
+	Timeval mQueued;	// When it was made, for the shaper queue delay.
 	public:
 	//PdpPdu *next() { return mNext; }
 	//void setNext(PdpPdu*wNext) { mNext = wNext; }
 	PdpPdu(ByteVector wpdu,mg_con_t *wmgp) : mpdu(wpdu), mgp(wmgp) { RN_MEMCHKNEW(PdpPdu) }
 	~PdpPdu() { RN_MEMCHKDEL(PdpPdu) }
+	unsigned size() { return mpdu.size(); }	// For the queue byte counts.
+	// There is one of these per packet each way, so they are recycled; see miniggsn.cpp.
+	static void *operator new(size_t size);
+	static void operator delete(void *ptr);
+	static void poolText(std::ostream &os);
 };
 
 
@@ -61,13 +68,14 @@ class Ggsn {
 	// secondary pdp contexts, which we dont support yet.
 	// It is conceivable that the PdpContext can be deleted while there
 	bool mActive;
-	Thread mGgsnRecvThread;
+	std::vector<Thread*> mGgsnRecvThreads;	// One per tunnel queue.
 	Thread mGgsnSendThread;
+	Thread mGgsnDownlinkThread;		// Only if the downlink is shaped.
 	Thread mGgsnShellThread;
 	Bool_z mShellThreadActive;
 	public:
 	static const unsigned mStopTimeout = 3000;	// How often the service loops check for active.
-	InterthreadQueue<PdpPdu,SingleLinkList<> > mTxQ;
+	// The uplink packets wait in per-connection queues in the miniggsn, see miniggsn_queue_npdu.
 	InterthreadQueue<ShellRequest> mShellQ;
 
 	public:
@@ -136,7 +144,7 @@ class PdpContext
 #endif
 
 	void pdpWriteLowSide(ByteVector &payload);
-	void pdpWriteHighSide(unsigned char *packet, unsigned packetlen);
+	void pdpWriteHighSide(ByteVector &packet);
 
 	// Once the connection is set up we dont care about this stuff any more,
 	// but we have to cache it for UMTS because the PdpContextAccept message is not sent out instantly.
@@ -237,18 +245,16 @@ class PdpContext
 
 	void PdpContext::pdpWriteLowSide(ByteVector &payload) {
 		SNDCPDEBUG("pdpWriteLowSide"<<LOGVAR2("packetlen",payload.size()));
-		PdpPdu *newpdu = new PdpPdu(payload,this->mgp);
-		gGgsn.mTxQ.write(newpdu);
+		miniggsn_queue_npdu(this->mgp,payload);
 	}
-	void PdpContext::pdpWriteHighSide(unsigned char *packet, unsigned packetlen) {
-		SNDCPDEBUG("pdpWriteHighSide"<<LOGVAR2("packetlen",packetlen));
+	void PdpContext::pdpWriteHighSide(ByteVector &packet) {
+		SNDCPDEBUG("pdpWriteHighSide"<<LOGVAR2("packetlen",packet.size()));
 		// pat 12-17:  Dont use a ByteVectorTemp until the implementation is fixed: if you accidentally
 		// dup the resulting ByteVectorTemp havoc ensues.
-		// If you change this back to ByteVector, make SURE you restore the clone in rlcWriteHighSide().
-		//ByteVectorTemp sdu(packet,packetlen);
-		ByteVector sdu(packet,packetlen);
-		//mpdpDownstream->snWriteHighSide(sdu);
-		mpcGmm->getSI()->sgsnWriteHighSide(sdu,mNSapi);
+		// The packet is the packet pool block the GGSN read it into, and goes on down by reference;
+		// the RLC SDU keeps its own reference after the GGSN reader lets go of it.
+		//mpdpDownstream->snWriteHighSide(packet);
+		mpcGmm->getSI()->sgsnWriteHighSide(packet,mNSapi);
 	}
 #endif
 
@@ -0,0 +1,106 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#include <algorithm>
+#include <arpa/inet.h>
+
+#include "GgsnFirewall.h"
+#include <Utils.h>
+
+namespace SGSN {
+
+// Orders rule indices by prefix length, shortest first.
+struct GgsnFirewallByLength {
+	const std::vector<GgsnFirewall::Rule> &mRules;
+	GgsnFirewallByLength(const std::vector<GgsnFirewall::Rule> &rules) :mRules(rules) {}
+	bool operator()(unsigned a, unsigned b) const { return mRules[a].mLength < mRules[b].mLength; }
+};
+
+
+bool GgsnFirewall::add(uint32_t basenl, uint32_t masknl, const std::string &why)
+{
+	uint32_t mask = ntohl(masknl);
+	unsigned length = 0;
+	while (length < 32 && (mask & (0x80000000u >> length))) { length++; }
+	uint32_t prefix = length ? ~0u << (32 - length) : 0;
+	mRules.push_back(Rule(ntohl(basenl) & prefix, length, why));
+	return mask == prefix;
+}
+
+
+uint32_t GgsnFirewall::newChunk(uint32_t fill)
+{
+	uint32_t chunk = mChunks.size() / 256;
+	mChunks.resize(mChunks.size() + 256, fill);
+	return sChunk | chunk;
+}
+
+
+void GgsnFirewall::insert(const Rule &rule, uint32_t value)
+{
+	// Rules go in shortest first, so a range never covers a chunk made for a longer one,
+	// and the entries it overwrites are all for shorter ranges it is more specific than.
+	uint32_t base = rule.mBase;
+	if (rule.mLength <= 16) {
+		unsigned first = base >> 16, count = 1u << (16 - rule.mLength);
+		std::fill(mTop.begin() + first, mTop.begin() + first + count, value);
+		return;
+	}
+	unsigned top = base >> 16;
+	if (!(mTop[top] & sChunk)) {
+		uint32_t chunk = newChunk(mTop[top]);
+		mTop[top] = chunk;
+	}
+	unsigned level1 = ((mTop[top] & ~sChunk) << 8) + ((base >> 8) & 0xff);
+	if (rule.mLength <= 24) {
+		unsigned count = 1u << (24 - rule.mLength);
+		std::fill(mChunks.begin() + level1, mChunks.begin() + level1 + count, value);
+		return;
+	}
+	if (!(mChunks[level1] & sChunk)) {
+		uint32_t chunk = newChunk(mChunks[level1]);	// May move mChunks.
+		mChunks[level1] = chunk;
+	}
+	unsigned level2 = ((mChunks[level1] & ~sChunk) << 8) + (base & 0xff);
+	unsigned count = 1u << (32 - rule.mLength);
+	std::fill(mChunks.begin() + level2, mChunks.begin() + level2 + count, value);
+}
+
+
+void GgsnFirewall::compile()
+{
+	std::vector<unsigned> order(mRules.size());
+	for (unsigned i = 0; i < order.size(); i++) { order[i] = i; }
+	std::stable_sort(order.begin(), order.end(), GgsnFirewallByLength(mRules));
+	mTop.assign(65536, 0);
+	mChunks.clear();
+	for (unsigned i = 0; i < order.size(); i++) {
+		insert(mRules[order[i]], order[i] + 1);
+	}
+}
+
+
+void GgsnFirewall::text(std::ostream &os) const
+{
+	os << "GGSN firewall: " << mRules.size() << " ranges, tables " << tableBytes() / 1024 << " KB\n";
+	for (unsigned i = 0; i < mRules.size(); i++) {
+		const Rule &rule = mRules[i];
+		uint32_t basenl = htonl(rule.mBase);
+		const unsigned char *b = (const unsigned char*)&basenl;
+		os << format("  %u.%u.%u.%u/%u hits %lu (%s)\n",
+			b[0],b[1],b[2],b[3],rule.mLength,__atomic_load_n(&rule.mHits,__ATOMIC_RELAXED),rule.mWhy.c_str());
+	}
+}
+
+};	// namespace
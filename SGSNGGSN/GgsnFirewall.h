@@ -0,0 +1,107 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#ifndef _GGSNFIREWALL_H_
+#define _GGSNFIREWALL_H_
+
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <iostream>
+
+namespace SGSN {
+
+/**
+	The destination ranges an MS may not send to, compiled into a three level
+	multibit trie (16, 8 and 8 bits of the address, as in DIR-24-8), so a lookup
+	is at most three array reads however many ranges there are.
+	Each entry is 0 for no range, the index of the matching range plus 1,
+	or sChunk plus the number of a 256 entry table for the next 8 bits.
+	Ranges are added and then compiled once; the compiled firewall is not changed
+	after that, except for the hit counters, and is replaced whole to change the rules.
+*/
+class GgsnFirewall {
+
+	public:
+
+	struct Rule {
+		uint32_t mBase;			///< host order, masked
+		unsigned mLength;		///< prefix length
+		std::string mWhy;		///< where the range came from, for the CLI
+		unsigned long mHits;	///< packets discarded by this range, where it was the longest match
+		Rule(uint32_t base, unsigned length, const std::string &why)
+			:mBase(base),mLength(length),mWhy(why),mHits(0) {}
+	};
+
+	private:
+
+	static const uint32_t sChunk = 0x80000000;
+
+	std::vector<Rule> mRules;
+	std::vector<uint32_t> mTop;			///< 65536 entries, by the top 16 bits of the address
+	std::vector<uint32_t> mChunks;		///< 256 entry tables, one after another
+
+	uint32_t newChunk(uint32_t fill);
+	void insert(const Rule &rule, uint32_t value);
+
+	public:
+
+	GgsnFirewall() {}
+
+	/**
+		Add a range, in network order as from ip_addr_crack.
+		Return false if the mask is not a prefix mask, in which case the range is
+		widened to the leading ones of the mask.
+	*/
+	bool add(uint32_t basenl, uint32_t masknl, const std::string &why);
+
+	/** Build the lookup tables.  No more ranges may be added after this. */
+	void compile();
+
+	/** Return the index of the longest range containing an address in network order, or -1. */
+	int match(uint32_t addrnl) const
+	{
+		uint32_t addr = ntohl(addrnl);
+		uint32_t entry = mTop[addr >> 16];
+		if (entry & sChunk) {
+			entry = mChunks[((entry & ~sChunk) << 8) | ((addr >> 8) & 0xff)];
+			if (entry & sChunk) {
+				entry = mChunks[((entry & ~sChunk) << 8) | (addr & 0xff)];
+			}
+		}
+		return (int)entry - 1;
+	}
+
+	/** Return true, and count the hit, if an address in network order is blocked. */
+	bool blocks(uint32_t addrnl)
+	{
+		int r = match(addrnl);
+		if (r < 0) return false;
+		__atomic_fetch_add(&mRules[r].mHits,1,__ATOMIC_RELAXED);
+		return true;
+	}
+
+	unsigned size() const { return mRules.size(); }
+	const Rule &rule(unsigned i) const { return mRules[i]; }
+
+	/** Bytes taken by the lookup tables. */
+	size_t tableBytes() const { return (mTop.size() + mChunks.size()) * sizeof(uint32_t); }
+
+	/** Print the ranges and their hit counts. */
+	void text(std::ostream &os) const;
+};
+
+};	// namespace
+#endif
@@ -0,0 +1,181 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#include <time.h>
+#include <algorithm>
+
+#include "GgsnShaper.h"
+#include <Utils.h>
+
+namespace SGSN {
+
+uint64_t GgsnShaper::nowUsecs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+void GgsnShaper::init(unsigned nflows, unsigned quantum, unsigned queueLimit, unsigned burstMs)
+{
+	ScopedLock lock(mLock);
+	assert(mActive.empty());
+	mFlows.assign(nflows,Flow());
+	mQuantum = quantum;
+	mQueueLimit = queueLimit;
+	mBurstMs = burstMs;
+}
+
+void GgsnShaper::setRate(unsigned flow, unsigned bytesPerSec, uint64_t now)
+{
+	ScopedLock lock(mLock);
+	Flow &fl = mFlows[flow];
+	fl.mRate = bytesPerSec;
+	// The bucket must hold at least one packet of the largest size, or that packet would never go.
+	fl.mDepth = std::max((double)bytesPerSec * mBurstMs / 1000,(double)mQuantum);
+	fl.mTokens = fl.mDepth;
+	fl.mStamp = now;
+}
+
+void GgsnShaper::refill(Flow &fl, uint64_t now)
+{
+	if (now <= fl.mStamp) { return; }
+	fl.mTokens = std::min(fl.mDepth,fl.mTokens + (double)(now - fl.mStamp) * fl.mRate / 1000000);
+	fl.mStamp = now;
+}
+
+bool GgsnShaper::enqueue(unsigned flow, SingleLinkListNode *pdu)
+{
+	ScopedLock lock(mLock);
+	Flow &fl = mFlows[flow];
+	unsigned size = pdu->size();
+	// A packet always fits in an empty queue, so a small limit cannot shut a connection off.
+	if (fl.mQ.size() && fl.mQ.totalSize() + size > mQueueLimit) {
+		fl.mDrops++;
+		fl.mDropBytes += size;
+		return false;
+	}
+	fl.mQ.push_back(pdu);
+	if (fl.mQ.totalSize() > fl.mMaxQueue) { fl.mMaxQueue = fl.mQ.totalSize(); }
+	if (!fl.mActive) {
+		fl.mActive = true;
+		mActive.push_back(flow);
+	}
+	mReady.signal();
+	return true;
+}
+
+// Each connection in turn gets mQuantum more bytes of deficit and sends packets while they fit in it.
+// The connection at the head of mActive is in the middle of its turn.
+SingleLinkListNode *GgsnShaper::next(unsigned *flow, uint64_t now, uint64_t *wake)
+{
+	*wake = 0;
+	// A connection whose turn is over gets the quantum on its next visit, which is enough for a packet,
+	// so the loop ends with a packet or when every connection has been held back by its bucket.
+	for (unsigned held = 0; held < mActive.size(); ) {
+		unsigned f = mActive.front();
+		Flow &fl = mFlows[f];
+		SingleLinkListNode *pdu = fl.mQ.front();
+		unsigned size = pdu->size();
+		if (!fl.mInTurn) {
+			fl.mDeficit += mQuantum;
+			fl.mInTurn = true;
+		}
+		if (size > fl.mDeficit) {
+			// Its turn is over.
+			fl.mInTurn = false;
+			mActive.pop_front();
+			mActive.push_back(f);
+			continue;
+		}
+		if (fl.mRate) {
+			refill(fl,now);
+			if (fl.mTokens < size) {
+				// Let the others go, but keep the deficit; the turn resumes when the tokens are there.
+				if (!fl.mHeld) { fl.mHeld = true; fl.mDelayed++; }
+				uint64_t ready = now + (uint64_t)((size - fl.mTokens) * 1000000 / fl.mRate) + 1;
+				if (*wake == 0 || ready < *wake) { *wake = ready; }
+				held++;
+				mActive.pop_front();
+				mActive.push_back(f);
+				continue;
+			}
+			fl.mTokens -= size;
+		}
+		fl.mQ.pop_front();
+		fl.mHeld = false;
+		fl.mDeficit -= size;
+		fl.mPackets++;
+		fl.mBytes += size;
+		if (fl.mQ.size() == 0) {
+			// An idle connection does not save up its deficit.
+			mActive.pop_front();
+			fl.mActive = false;
+			fl.mInTurn = false;
+			fl.mDeficit = 0;
+		}
+		*flow = f;
+		return pdu;
+	}
+	return NULL;
+}
+
+SingleLinkListNode *GgsnShaper::read(unsigned *flow, unsigned timeoutMs)
+{
+	ScopedLock lock(mLock);
+	uint64_t wake, now = nowUsecs();
+	SingleLinkListNode *pdu = next(flow,now,&wake);
+	if (pdu) { return pdu; }
+	// Sleep until a held packet may go, or a new one arrives.
+	unsigned waitMs = timeoutMs;
+	if (wake) { waitMs = std::min(waitMs,(unsigned)((wake - now + 999) / 1000)); }
+	mReady.wait(mLock,waitMs);
+	return next(flow,nowUsecs(),&wake);
+}
+
+unsigned GgsnShaper::read(SingleLinkListNode **pdus, unsigned *flows, unsigned max, unsigned timeoutMs)
+{
+	ScopedLock lock(mLock);
+	uint64_t wake, now = nowUsecs();
+	unsigned n = 0;
+	while (n < max && (pdus[n] = next(&flows[n],now,&wake))) { n++; }
+	if (n) { return n; }
+	unsigned waitMs = timeoutMs;
+	if (wake) { waitMs = std::min(waitMs,(unsigned)((wake - now + 999) / 1000)); }
+	mReady.wait(mLock,waitMs);
+	now = nowUsecs();
+	while (n < max && (pdus[n] = next(&flows[n],now,&wake))) { n++; }
+	return n;
+}
+
+void GgsnShaper::text(std::ostream &os) const
+{
+	unsigned long packets = 0, bytes = 0, drops = 0, dropBytes = 0, delayed = 0;
+	unsigned limited = 0;
+	for (unsigned i = 0; i < mFlows.size(); i++) {
+		const Flow &fl = mFlows[i];
+		packets += fl.mPackets;
+		bytes += fl.mBytes;
+		drops += fl.mDrops;
+		dropBytes += fl.mDropBytes;
+		delayed += fl.mDelayed;
+		if (fl.mRate) { limited++; }
+	}
+	os << format("GGSN %s: %u connections, %u rate limited, quantum %u, queue limit %u bytes, burst %u ms\n",
+		mName,(unsigned)mFlows.size(),limited,mQuantum,mQueueLimit,mBurstMs);
+	os << format("  sent %lu packets %lu bytes, dropped %lu packets %lu bytes, held by rate %lu\n",
+		packets,bytes,drops,dropBytes,delayed);
+}
+
+};	// namespace
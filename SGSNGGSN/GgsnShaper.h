@@ -0,0 +1,114 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#ifndef _GGSNSHAPER_H_
+#define _GGSNSHAPER_H_
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <iostream>
+#include <LinkedLists.h>
+#include <Threads.h>
+
+namespace SGSN {
+
+/**
+	The packets going one way through the GGSN, queued per IP connection
+	and sent by deficit round robin, so a connection with a full queue gets its turn
+	and no more while the others wait.  Each connection may also have a token bucket
+	that holds its packets to a rate, normally the peak throughput of its PDP context.
+	A connection whose bucket is empty gives up its turn without losing its place.
+	The queued items are SingleLinkListNodes whose size() is the packet length;
+	the caller allocates them and deletes them after read() or when enqueue() refuses them.
+*/
+class GgsnShaper {
+
+	public:
+
+	struct Flow {
+		SingleLinkList<> mQ;
+		unsigned mRate;				///< bytes per second, 0 for no limit
+		double mTokens;				///< bytes the bucket holds
+		double mDepth;				///< bytes the bucket can hold
+		uint64_t mStamp;			///< when mTokens was last brought up to date, usecs
+		unsigned mDeficit;			///< bytes this connection may still send in its turn
+		bool mInTurn;				///< mDeficit has been given the quantum for this turn
+		bool mActive;				///< on the round robin list
+		bool mHeld;					///< the bucket has held back the packet at the head
+		// Statistics, which are read without the lock.
+		unsigned long mPackets, mBytes;			///< sent
+		unsigned long mDrops, mDropBytes;		///< refused because the queue was full
+		unsigned long mDelayed;					///< packets held back by the bucket
+		unsigned mMaxQueue;						///< most bytes queued
+		Flow() : mRate(0), mTokens(0), mDepth(0), mStamp(0), mDeficit(0), mInTurn(false),
+			mActive(false), mHeld(false), mPackets(0), mBytes(0), mDrops(0), mDropBytes(0),
+			mDelayed(0), mMaxQueue(0) {}
+	};
+
+	private:
+
+	const char *mName;
+	Mutex mLock;
+	Signal mReady;
+	std::vector<Flow> mFlows;
+	std::deque<unsigned> mActive;	///< the connections with packets queued, in round robin order
+	unsigned mQuantum;				///< bytes added to the deficit each turn, at least the largest packet
+	unsigned mQueueLimit;			///< bytes queued per connection before packets are refused
+	unsigned mBurstMs;				///< bucket depth, as time at the rate
+
+	void refill(Flow &flow, uint64_t now);
+
+	public:
+
+	GgsnShaper(const char *name) : mName(name), mQuantum(1520), mQueueLimit(65536), mBurstMs(100) {}
+
+	/** Set up nflows connections, all without a rate limit.  Not while packets are queued. */
+	void init(unsigned nflows, unsigned quantum, unsigned queueLimit, unsigned burstMs);
+
+	/** Limit a connection to bytesPerSec, or 0 for no limit.  The bucket starts full. */
+	void setRate(unsigned flow, unsigned bytesPerSec, uint64_t now = nowUsecs());
+
+	/** Queue a packet.  Return false, and count it, if the connection's queue is full. */
+	bool enqueue(unsigned flow, SingleLinkListNode *pdu);
+
+	/**
+		Take the next packet allowed out at time now, or return NULL.
+		On NULL, *wake is when a held packet may go, or 0 if nothing is queued.
+		The caller holds the lock; this is the scheduler itself, for read() and the benchmark.
+	*/
+	SingleLinkListNode *next(unsigned *flow, uint64_t now, uint64_t *wake);
+
+	/** Wait up to timeoutMs for the next packet, or return NULL. */
+	SingleLinkListNode *read(unsigned *flow, unsigned timeoutMs);
+
+	/**
+		Wait up to timeoutMs for a packet, then take every packet allowed out now, up to max,
+		in the order read() would give them.  Return how many are in pdus and flows.
+	*/
+	unsigned read(SingleLinkListNode **pdus, unsigned *flows, unsigned max, unsigned timeoutMs);
+
+	Mutex &lock() { return mLock; }
+	unsigned size() const { return mFlows.size(); }
+	const Flow &flow(unsigned i) const { return mFlows[i]; }
+	const char *name() const { return mName; }
+
+	/** Print the totals over all connections. */
+	void text(std::ostream &os) const;
+
+	static uint64_t nowUsecs();
+};
+
+};	// namespace
+#endif
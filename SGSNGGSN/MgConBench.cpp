@@ -0,0 +1,134 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+// Lookups per second of the miniggsn IP connection table at a large connection count:
+// the downlink lookup by IP address, against the linear scan it used to be,
+// and PDP context activation/deactivation through mg_con_find_free, mg_con_open and mg_con_close.
+// Usage: MgConBench [connections [lookups]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "miniggsn.h"
+#include "Ggsn.h"
+#include <Timeval.h>
+
+// We must have a gConfig now to include Logger.
+#include "Configuration.h"
+ConfigurationTable gConfig;
+
+using namespace SGSN;
+
+// Nothing is delivered here.
+void PdpContext::pdpWriteHighSide(ByteVector &packet) {}
+
+
+// The lookup as it was, a scan of every connection.
+static mg_con_t *scanByIp(mg_con_t *cons, int count, uint32_t addr)
+{
+	for (int i = 0; i < count; i++) {
+		if (cons[i].mg_ip == addr) { return &cons[i]; }
+	}
+	return NULL;
+}
+
+// Rounds a time under 1 ms up to 1 ms.
+static double rate(unsigned long n, long ms) { return 1000.0*n/(ms ? ms : 1); }
+
+int main(int argc, char *argv[])
+{
+	int connections = argc>1 ? atoi(argv[1]) : 10000;
+	unsigned long lookups = argc>2 ? atol(argv[2]) : 1000000;
+
+	gConfig.set("GGSN.IP.ReuseTimeout",0L);
+	gConfig.set("GGSN.IP.MaxPacketSize",1520L);
+	gConfig.set("GGSN.MS.IP.MaxCount",(long)connections);
+	gConfig.set("GGSN.IP.TossDuplicatePackets",0L);
+	gConfig.set("GGSN.IP.DuplicateHistory",1024L);
+	gConfig.set("GGSN.IP.DuplicateTimeout",500L);
+	gConfig.set("GGSN.TunQueues",1L);
+	gConfig.set("GGSN.TunWriteBatch",1L);
+	gConfig.set("GGSN.Shaping.Enable",0L);
+	gConfig.set("GGSN.IP.ClampTcpMss",0L);
+	gConfig.set("GGSN.Shaping.QueueBytes",65536L);
+	gConfig.set("GGSN.Shaping.BurstTime",100L);
+	gConfig.set("GGSN.Logfile.Name","");
+	gConfig.set("GGSN.MS.IP.Base","10.128.0.1");
+	gConfig.set("GGSN.MS.IP.Route","10.128.0.0/16");
+	gConfig.set("GGSN.Firewall.Enable",0L);
+	gConfig.set("GGSN.TunName","mgconbench");
+	gConfig.set("GGSN.DNS","127.0.0.1");
+	// Skip opening the tunnel.
+	tun_fd = open("/dev/null",O_RDWR);
+	if (!miniggsn_init()) {
+		printf("miniggsn_init failed\n");
+		return 1;
+	}
+
+	uint32_t base = ntohl(inet_addr("10.128.0.1"));
+	mg_con_t *cons = mg_con_find_by_ip(htonl(base));
+	PdpContext *pdp = (PdpContext*)cons;	// Never dereferenced, just not NULL.
+	srandom(1);
+
+	// Every connection in use, as in a full cell.
+	Timeval start;
+	for (int i = 0; i < connections; i++) {
+		mg_con_t *mgp = mg_con_find_free(1000+i,5);
+		if (!mgp) { printf("only %d connections\n",i); return 1; }
+		mg_con_open(mgp,pdp);
+	}
+	long ms = start.elapsed();
+	printf("%d connections, activated at %.0f/s\n",connections,rate(connections,ms));
+
+	unsigned long misses = 0;
+	unsigned long scanLookups = lookups / 100 + 1;	// The scan is too slow to do them all.
+	start.now();
+	for (unsigned long n = 0; n < scanLookups; n++) {
+		uint32_t addr = htonl(base + random() % connections);
+		if (!scanByIp(cons,connections,addr)) misses++;
+	}
+	double before = rate(scanLookups,start.elapsed());
+	start.now();
+	for (unsigned long n = 0; n < lookups; n++) {
+		uint32_t addr = htonl(base + random() % connections);
+		mg_con_t *mgp = mg_con_find_by_ip(addr);
+		if (!mgp || mgp->mg_ip != addr) misses++;
+	}
+	double after = rate(lookups,start.elapsed());
+	printf("lookup by IP: scan %.0f/s, direct %.0f/s, x%.0f\n",before,after,after/before);
+
+	// Deactivate and reactivate at random: the MS gets its old address back,
+	// and a new MS gets the connection idle longest.
+	unsigned long churn = lookups / 10;
+	unsigned long reused = 0;
+	start.now();
+	for (unsigned long n = 0; n < churn; n++) {
+		int i = random() % connections;
+		mg_con_t *old = &cons[i];
+		uint32_t ptmsi = old->mg_ptmsi;
+		mg_con_close(old);
+		// Every other time it is a different MS.
+		mg_con_t *mgp = mg_con_find_free((n & 1) ? ptmsi : 1000000+n,5);
+		if (!mgp) { misses++; continue; }
+		if (mgp == old) reused++;
+		mg_con_open(mgp,pdp);
+	}
+	ms = start.elapsed();
+	printf("deactivate+activate: %.0f/s, %lu of %lu got the same connection\n",rate(churn,ms),reused,churn);
+	if (misses) printf("%lu lookups failed\n",misses);
+	return misses ? 1 : 0;
+}
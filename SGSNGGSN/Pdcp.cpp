@@ -0,0 +1,451 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include "Pdcp.h"
+#include "miniggsn.h"	// For ip_checksum
+#include <Utils.h>
+
+namespace SGSN {
+
+// The flags octet of an RFC 2507 COMPRESSED_TCP header.
+enum {
+	HcFlagU = 0x01,		// urgent pointer present
+	HcFlagW = 0x02,		// window delta present
+	HcFlagA = 0x04,		// ack delta present
+	HcFlagS = 0x08,		// sequence delta present
+	HcFlagP = 0x10,		// the TCP PSH flag
+	HcFlagI = 0x20,		// IP ID delta present, otherwise the ID went up by one
+	HcFlagO = 0x40,		// TCP options present
+	HcFlagR = 0x80		// R-octet present
+};
+
+// TCP flags.
+enum { TcpFin = 0x01, TcpSyn = 0x02, TcpRst = 0x04, TcpPsh = 0x08, TcpAck = 0x10, TcpUrg = 0x20, TcpEcn = 0xc0 };
+
+static unsigned get16(const unsigned char *cp) { return (cp[0] << 8) | cp[1]; }
+static void put16(unsigned char *cp, unsigned value) { cp[0] = value >> 8; cp[1] = value; }
+static uint32_t get32(const unsigned char *cp) { return ((uint32_t)cp[0] << 24) | (cp[1] << 16) | (cp[2] << 8) | cp[3]; }
+static void put32(unsigned char *cp, uint32_t value) { put16(cp,value >> 16); put16(cp+2,value); }
+
+// RFC 2507 delta coding, as in RFC 1144: 1 to 255 in one octet, anything else to 65535 as 0 and two octets.
+static unsigned char *putDelta(unsigned char *cp, unsigned delta)
+{
+	if (delta >= 1 && delta <= 255) {
+		*cp++ = delta;
+	} else {
+		*cp++ = 0;
+		put16(cp,delta);
+		cp += 2;
+	}
+	return cp;
+}
+
+static bool getDelta(const unsigned char *&cp, const unsigned char *end, unsigned *delta)
+{
+	if (cp >= end) return false;
+	if (*cp) {
+		*delta = *cp++;
+		return true;
+	}
+	if (end - cp < 3) return false;
+	*delta = get16(cp+1);
+	cp += 3;
+	return true;
+}
+
+// The decompressor rebuilds the IP length, so the checksum has to be redone.
+static void setIpLength(unsigned char *packet, unsigned len)
+{
+	put16(packet+2,len);
+	put16(packet+10,0);
+	uint16_t check = ip_checksum(packet,20,NULL);	// In network order already.
+	memcpy(packet+10,&check,2);		// The uplink packet need not be aligned.
+}
+
+
+void Rfc2507Compressor::reset(const PdcpConfig &config)
+{
+	mConfig = config;
+	mUses = 0;
+	TcpContext tcp;
+	memset(&tcp,0,sizeof(tcp));
+	mTcp.assign(config.mTcpSpace+1,tcp);
+	NonTcpContext nonTcp;
+	memset(&nonTcp,0,sizeof(nonTcp));
+	mNonTcp.assign(config.mNonTcpSpace+1,nonTcp);
+}
+
+
+unsigned Rfc2507Compressor::compress(unsigned char *packet, unsigned len, unsigned char *hc, unsigned *hcLen, unsigned *consumed)
+{
+	*hcLen = *consumed = 0;
+	if (!mConfig.mRfc2507) return PdcpPidNone;
+	// IPv4 without options and not a fragment.  The length must be right, because the decompressor
+	// makes it from the PDU size.
+	if (len < 20 || packet[0] != 0x45 || get16(packet+2) != len || (get16(packet+6) & 0x3fff)) {
+		return PdcpPidNone;
+	}
+	mUses++;
+	switch (packet[9]) {
+		case IPPROTO_TCP: return compressTcp(packet,len,hc,hcLen,consumed);
+		case IPPROTO_UDP: return len < 28 ? (unsigned)PdcpPidNone : compressUdp(packet,hc,hcLen,consumed);
+		default: return PdcpPidNone;
+	}
+}
+
+
+unsigned Rfc2507Compressor::compressTcp(unsigned char *packet, unsigned len, unsigned char *hc, unsigned *hcLen, unsigned *consumed)
+{
+	if (len < 40) return PdcpPidNone;
+	unsigned char *tcp = packet + 20;
+	unsigned hlen = 20 + 4*(tcp[12] >> 4);
+	if (hlen < 40 || hlen > len || hlen > sHcMaxHeader || hlen > mConfig.mMaxHeader) return PdcpPidNone;
+
+	// Find the connection, or else the context to start it in: a free one or the least recently used.
+	TcpContext *ctx = NULL, *lru = &mTcp[0];
+	for (unsigned cid = 0; cid < mTcp.size(); cid++) {
+		TcpContext &c = mTcp[cid];
+		if (c.mUsed && !memcmp(c.mHeader+12,packet+12,8) && !memcmp(c.mHeader+20,tcp,4)) { ctx = &c; break; }
+		if (lru->mUsed && (!c.mUsed || c.mLastUse < lru->mLastUse)) { lru = &c; }
+	}
+
+	// Only the fields that change in the body of a connection are delta coded;
+	// anything else, including SYN, FIN, RST and URG, goes in a full header.
+	unsigned flags = tcp[13];
+	bool full = !ctx;
+	uint32_t dseq = 0, dack = 0;
+	if (ctx) {
+		const unsigned char *old = ctx->mHeader, *otcp = old + 20;
+		dseq = get32(tcp+4) - get32(otcp+4);
+		dack = get32(tcp+8) - get32(otcp+8);
+		full = ctx->mHeaderLen != hlen
+			|| packet[1] != old[1] || packet[6] != old[6] || packet[8] != old[8]	// TOS, DF and TTL
+			|| tcp[12] != otcp[12]
+			|| (flags & ~(TcpPsh|TcpEcn)) != TcpAck || (flags & TcpEcn) != (otcp[13] & TcpEcn)
+			|| get16(tcp+18) != get16(otcp+18)
+			|| dseq > 0xffff || dack > 0xffff;
+	}
+	if (full) {
+		TcpContext &c = ctx ? *ctx : *lru;
+		c.mUsed = true;
+		c.mHeaderLen = hlen;
+		c.mLastUse = mUses;
+		memcpy(c.mHeader,packet,hlen);
+		// The CID goes in the IP length field.
+		packet[2] = 0;
+		packet[3] = &c - &mTcp[0];
+		return PdcpPidFullHeader;
+	}
+
+	const unsigned char *old = ctx->mHeader, *otcp = old + 20;
+	unsigned char *cp = hc;
+	*cp++ = ctx - &mTcp[0];
+	unsigned char *hcflags = cp++;
+	*hcflags = (flags & TcpPsh) ? HcFlagP : 0;
+	*cp++ = tcp[16];	// The TCP checksum is always sent.
+	*cp++ = tcp[17];
+	unsigned dwin = (get16(tcp+14) - get16(otcp+14)) & 0xffff;
+	if (dwin) { *hcflags |= HcFlagW; cp = putDelta(cp,dwin); }
+	if (dack) { *hcflags |= HcFlagA; cp = putDelta(cp,dack); }
+	if (dseq) { *hcflags |= HcFlagS; cp = putDelta(cp,dseq); }
+	unsigned did = (get16(packet+4) - get16(old+4)) & 0xffff;
+	if (did != 1) { *hcflags |= HcFlagI; cp = putDelta(cp,did); }
+	if (hlen > 40 && memcmp(tcp+20,otcp+20,hlen-40)) {
+		*hcflags |= HcFlagO;
+		memcpy(cp,tcp+20,hlen-40);
+		cp += hlen-40;
+	}
+	*hcLen = cp - hc;
+	*consumed = hlen;
+	memcpy(ctx->mHeader,packet,hlen);
+	ctx->mLastUse = mUses;
+	return PdcpPidCompressedTcp;
+}
+
+
+unsigned Rfc2507Compressor::compressUdp(unsigned char *packet, unsigned char *hc, unsigned *hcLen, unsigned *consumed)
+{
+	const unsigned char *udp = packet + 20;
+	NonTcpContext *ctx = NULL, *lru = &mNonTcp[0];
+	for (unsigned cid = 0; cid < mNonTcp.size(); cid++) {
+		NonTcpContext &c = mNonTcp[cid];
+		if (c.mUsed && !memcmp(c.mHeader+12,packet+12,8) && !memcmp(c.mHeader+20,udp,4)) { ctx = &c; break; }
+		if (lru->mUsed && (!c.mUsed || c.mLastUse < lru->mLastUse)) { lru = &c; }
+	}
+
+	// A change in a field that is not sent starts a new generation of the context.
+	NonTcpContext &c = ctx ? *ctx : *lru;
+	const unsigned char *old = c.mHeader;
+	bool changed = !ctx
+		|| packet[1] != old[1] || packet[6] != old[6] || packet[8] != old[8]	// TOS, DF and TTL
+		|| !get16(udp+6) != !get16(old+26);		// whether there is a UDP checksum
+	if (changed) { c.mGeneration = (c.mGeneration + 1) & 0x3f; }
+	c.mLastUse = mUses;
+	unsigned cid = &c - &mNonTcp[0];
+	time_t now = time(NULL);
+	if (changed || c.mSinceFull >= mConfig.mFMaxPeriod || now - c.mFullTime >= (time_t)mConfig.mFMaxTime) {
+		c.mUsed = true;
+		c.mSinceFull = 0;
+		c.mFullTime = now;
+		memcpy(c.mHeader,packet,28);
+		// The generation and CID go in the IP length field.
+		packet[2] = c.mGeneration;
+		packet[3] = cid;
+		return PdcpPidFullHeader;
+	}
+	c.mSinceFull++;
+
+	unsigned char *cp = hc;
+	*cp++ = cid;
+	*cp++ = c.mGeneration;
+	*cp++ = packet[4];	// IP ID
+	*cp++ = packet[5];
+	if (get16(udp+6)) {
+		*cp++ = udp[6];
+		*cp++ = udp[7];
+	}
+	*hcLen = cp - hc;
+	*consumed = 28;
+	return PdcpPidCompressedNonTcp;
+}
+
+
+void Rfc2507Decompressor::reset(const PdcpConfig &config)
+{
+	mConfig = config;
+	Context context;
+	memset(&context,0,sizeof(context));
+	mTcp.assign(config.mTcpSpace+1,context);
+	mNonTcp.assign(config.mNonTcpSpace+1,context);
+}
+
+
+int Rfc2507Decompressor::decompress(unsigned pid, unsigned char *data, unsigned len, unsigned char *header, unsigned *consumed)
+{
+	*consumed = 0;
+	switch (pid) {
+	case PdcpPidFullHeader: {
+		if (len < 20 || data[0] != 0x45) return -1;
+		unsigned cid = data[3];
+		if (data[9] == IPPROTO_TCP) {
+			if (len < 40) return -1;
+			unsigned hlen = 20 + 4*(data[32] >> 4);
+			if (hlen < 40 || hlen > len || hlen > sHcMaxHeader || cid >= mTcp.size() || data[2]) return -1;
+			setIpLength(data,len);
+			Context &c = mTcp[cid];
+			c.mUsed = true;
+			c.mHeaderLen = hlen;
+			memcpy(c.mHeader,data,hlen);
+			return 0;
+		}
+		if (data[9] == IPPROTO_UDP) {
+			if (len < 28 || cid >= mNonTcp.size() || (data[2] & 0xc0)) return -1;
+			Context &c = mNonTcp[cid];
+			c.mUsed = true;
+			c.mGeneration = data[2];
+			c.mHeaderLen = 28;
+			setIpLength(data,len);
+			memcpy(c.mHeader,data,28);
+			return 0;
+		}
+		return -1;
+	}
+
+	case PdcpPidCompressedTcp: {
+		if (len < 4 || data[0] >= mTcp.size() || !mTcp[data[0]].mUsed) return -1;
+		Context &c = mTcp[data[0]];
+		unsigned hcflags = data[1];
+		if (hcflags & HcFlagR) return -1;
+		const unsigned char *cp = data + 4, *end = data + len;
+		unsigned hlen = c.mHeaderLen;
+		memcpy(header,c.mHeader,hlen);
+		unsigned char *tcp = header + 20;
+		tcp[16] = data[2];
+		tcp[17] = data[3];
+		unsigned flags = (tcp[13] & TcpEcn) | TcpAck | ((hcflags & HcFlagP) ? TcpPsh : 0);
+		unsigned delta;
+		if (hcflags & HcFlagU) {
+			if (end - cp < 2) return -1;
+			flags |= TcpUrg;
+			tcp[18] = *cp++;
+			tcp[19] = *cp++;
+		}
+		if (hcflags & HcFlagW) {
+			if (!getDelta(cp,end,&delta)) return -1;
+			put16(tcp+14,get16(tcp+14) + delta);
+		}
+		if (hcflags & HcFlagA) {
+			if (!getDelta(cp,end,&delta)) return -1;
+			put32(tcp+8,get32(tcp+8) + delta);
+		}
+		if (hcflags & HcFlagS) {
+			if (!getDelta(cp,end,&delta)) return -1;
+			put32(tcp+4,get32(tcp+4) + delta);
+		}
+		delta = 1;
+		if ((hcflags & HcFlagI) && !getDelta(cp,end,&delta)) return -1;
+		put16(header+4,get16(header+4) + delta);
+		if (hcflags & HcFlagO) {
+			if ((unsigned)(end - cp) < hlen - 40) return -1;
+			memcpy(tcp+20,cp,hlen-40);
+			cp += hlen-40;
+		}
+		tcp[13] = flags;
+		*consumed = cp - data;
+		setIpLength(header,hlen + len - *consumed);
+		memcpy(c.mHeader,header,hlen);
+		return hlen;
+	}
+
+	case PdcpPidCompressedNonTcp: {
+		if (len < 2 || data[0] >= mNonTcp.size()) return -1;
+		Context &c = mNonTcp[data[0]];
+		// A generation we do not have means the full header was lost; the packet is useless until the next one.
+		if (!c.mUsed || data[1] != c.mGeneration) return -1;
+		unsigned need = get16(c.mHeader+26) ? 6 : 4;
+		if (len < need) return -1;
+		memcpy(header,c.mHeader,28);
+		header[4] = data[2];
+		header[5] = data[3];
+		if (need == 6) {
+			header[26] = data[4];
+			header[27] = data[5];
+		}
+		*consumed = need;
+		unsigned total = 28 + len - need;
+		put16(header+24,total - 20);	// UDP length
+		setIpLength(header,total);
+		return 28;
+	}
+
+	default:
+		// We never send COMPRESSED_TCP_NODELTA or CONTEXT_STATE, which are for lossy links,
+		// so a UE has no reason to send them either.
+		return -1;
+	}
+}
+
+
+PdcpEntity::PdcpEntity(unsigned rbid, const PdcpConfig &config)
+	: mRbId(rbid),
+	mDlBytesIn(0), mDlBytesOut(0), mUlBytesIn(0), mUlBytesOut(0), mDlCopies(0), mUlDiscards(0)
+{
+	memset(mDlPid,0,sizeof(mDlPid));
+	memset(mUlPid,0,sizeof(mUlPid));
+	configure(config);
+}
+
+
+void PdcpEntity::configure(const PdcpConfig &config)
+{
+	ScopedLock lock(mLock);
+	mConfig = config;
+	mCompressor.reset(config);
+	mDecompressor.reset(config);
+}
+
+
+void PdcpEntity::pdcpWriteHighSide(ByteVector &sdu)
+{
+	ScopedLock lock(mLock);
+	if (!mConfig.mPduHeader) return;	// PDCP-No-Header PDU
+	unsigned len = sdu.size();
+	unsigned char hc[sHcMaxCompressed];
+	unsigned hcLen, consumed;
+	unsigned pid = mCompressor.compress(sdu.begin(),len,hc,&hcLen,&consumed);
+	ByteType header = (sPdcpDataPdu << 5) | pid;
+	if (consumed) {
+		// The PDCP header and compressed header go at the end of the space the IP header took.
+		unsigned skip = consumed - hcLen - 1;
+		ByteType *pdu = sdu.begin() + skip;
+		pdu[0] = header;
+		memcpy(pdu+1,hc,hcLen);
+		sdu.trimLeft(skip);
+	} else if (sdu.headroom()) {
+		*sdu.growLeft(1) = header;
+	} else {
+		ByteVector pdu;
+		pdu.allocPacket(0,len+1);
+		pdu.appendByte(header);
+		pdu.append(sdu);
+		sdu = pdu;
+		mDlCopies++;
+	}
+	mDlPid[pid]++;
+	mDlBytesIn += len;
+	mDlBytesOut += sdu.size();
+}
+
+
+bool PdcpEntity::pdcpWriteLowSide(ByteVector &pdu)
+{
+	ScopedLock lock(mLock);
+	if (!mConfig.mPduHeader) return true;
+	unsigned len = pdu.size();
+	unsigned pid = len ? pdu.getByte(0) & 0x1f : 0;
+	if (len < 2 || (pdu.getByte(0) >> 5) != sPdcpDataPdu || pid >= PdcpPidMax || (pid && !mConfig.mRfc2507)) {
+		mUlDiscards++;
+		return false;
+	}
+	mUlPid[pid]++;
+	mUlBytesIn += len;
+	pdu.trimLeft(1);
+	if (pid != PdcpPidNone) {
+		unsigned char header[sHcMaxHeader];
+		unsigned consumed;
+		int hlen = mDecompressor.decompress(pid,pdu.begin(),pdu.size(),header,&consumed);
+		if (hlen < 0) {
+			mUlDiscards++;
+			return false;
+		}
+		if (hlen) {
+			unsigned payload = pdu.size() - consumed;
+			ByteVector packet(hlen + payload);
+			memcpy(packet.begin(),header,hlen);
+			memcpy(packet.begin()+hlen,pdu.begin()+consumed,payload);
+			pdu = packet;
+		}
+	}
+	mUlBytesOut += pdu.size();
+	return true;
+}
+
+
+void PdcpEntity::text(std::ostream &os) const
+{
+	ScopedLock lock(mLock);
+	os << format("PDCP rb%u",mRbId);
+	if (!mConfig.mPduHeader) {
+		os << " transparent\n";
+		return;
+	}
+	if (mConfig.mRfc2507) {
+		os << format(" RFC 2507 tcp_space=%u non_tcp_space=%u max_header=%u f_max_period=%u f_max_time=%u\n",
+			mConfig.mTcpSpace,mConfig.mNonTcpSpace,mConfig.mMaxHeader,mConfig.mFMaxPeriod,mConfig.mFMaxTime);
+	} else {
+		os << " no header compression\n";
+	}
+	os << format("  down: %lu to %lu bytes, full %lu tcp %lu non-tcp %lu uncompressed %lu, copied %lu\n",
+		mDlBytesIn,mDlBytesOut,mDlPid[PdcpPidFullHeader],mDlPid[PdcpPidCompressedTcp],
+		mDlPid[PdcpPidCompressedNonTcp],mDlPid[PdcpPidNone],mDlCopies);
+	os << format("  up: %lu to %lu bytes, full %lu tcp %lu non-tcp %lu uncompressed %lu, discarded %lu\n",
+		mUlBytesIn,mUlBytesOut,mUlPid[PdcpPidFullHeader],mUlPid[PdcpPidCompressedTcp],
+		mUlPid[PdcpPidCompressedNonTcp],mUlPid[PdcpPidNone],mUlDiscards);
+}
+
+};	// namespace
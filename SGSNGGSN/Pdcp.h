@@ -0,0 +1,152 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#ifndef _PDCP_H_
+#define _PDCP_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <iostream>
+#include <vector>
+#include <ByteVector.h>
+#include <Threads.h>
+#include "SgsnExport.h"	// For PdcpConfig
+
+namespace SGSN {
+
+// 25.323 5.1.1: the PIDs for RFC 2507 are numbered from 1 in the order of its packet types.
+// PID 0 is an uncompressed packet.
+enum PdcpPid {
+	PdcpPidNone = 0,
+	PdcpPidFullHeader = 1,
+	PdcpPidCompressedTcp = 2,
+	PdcpPidCompressedTcpNoDelta = 3,
+	PdcpPidCompressedNonTcp = 4,
+	PdcpPidContextState = 5,
+	PdcpPidMax = 6
+};
+
+// 25.323 8.3.1: the first 3 bits of the PDCP PDU header; we only send and accept PDCP-Data.
+const unsigned sPdcpDataPdu = 0;
+
+// Largest IPv4+TCP header we compress: no IP options, up to 40 bytes of TCP options.
+const unsigned sHcMaxHeader = 80;
+// Largest compressed header: CID, flags, checksum, four 3 byte deltas and the TCP options.
+const unsigned sHcMaxCompressed = 4 + 4*3 + 40;
+
+/**
+	The compressor half of RFC 2507 for IPv4 TCP and UDP, 8 bit CIDs.
+	This is the subset needed over RLC-AM, which delivers in order without loss:
+	TCP headers are delta coded against the previous header of the connection,
+	and UDP headers are sent as the fields that change every packet,
+	with a full header to start each context and then every F_MAX_PERIOD packets or F_MAX_TIME seconds.
+	Packets with IP options or fragments, and other protocols, are not compressed.
+	TCP options are sent whole when they change, rather than with the RFC 2507 option list coding.
+*/
+class Rfc2507Compressor {
+	struct TcpContext {
+		bool mUsed;
+		unsigned mHeaderLen;
+		unsigned long mLastUse;
+		unsigned char mHeader[sHcMaxHeader];
+	};
+	struct NonTcpContext {
+		bool mUsed;
+		unsigned mGeneration;
+		unsigned mSinceFull;		// Compressed packets since the last full header.
+		time_t mFullTime;			// When the last full header was sent.
+		unsigned long mLastUse;
+		unsigned char mHeader[28];
+	};
+	PdcpConfig mConfig;
+	unsigned long mUses;			// Packets seen, the clock for finding the least recently used context.
+	std::vector<TcpContext> mTcp;		// by CID, TCP_SPACE+1 of them
+	std::vector<NonTcpContext> mNonTcp;	// by CID, NON_TCP_SPACE+1 of them
+
+	unsigned compressTcp(unsigned char *packet, unsigned len, unsigned char *hc, unsigned *hcLen, unsigned *consumed);
+	unsigned compressUdp(unsigned char *packet, unsigned char *hc, unsigned *hcLen, unsigned *consumed);
+
+	public:
+	Rfc2507Compressor() { reset(PdcpConfig()); }
+	void reset(const PdcpConfig &config);
+
+	/**
+		Compress the packet header and return the PID.
+		For a compressed packet the compressed header is put in hc, and the first consumed bytes
+		of the packet are the header it replaces.
+		For a full header the length field of the packet is rewritten in place to carry the CID,
+		and for PdcpPidNone the packet is untouched; in both cases consumed is 0.
+	*/
+	unsigned compress(unsigned char *packet, unsigned len, unsigned char *hc, unsigned *hcLen, unsigned *consumed);
+};
+
+/** The decompressor half of RFC 2507, for what Rfc2507Compressor sends. */
+class Rfc2507Decompressor {
+	struct Context {
+		bool mUsed;
+		unsigned mGeneration;		// Non-TCP only.
+		unsigned mHeaderLen;
+		unsigned char mHeader[sHcMaxHeader];
+	};
+	PdcpConfig mConfig;
+	std::vector<Context> mTcp;
+	std::vector<Context> mNonTcp;
+
+	public:
+	Rfc2507Decompressor() { reset(PdcpConfig()); }
+	void reset(const PdcpConfig &config);
+
+	/**
+		Rebuild a header.  For PdcpPidFullHeader the packet is repaired in place and 0 is returned.
+		For the compressed types the rebuilt header is put in header, its length returned,
+		and the first consumed bytes of data are the compressed header it replaces.
+		Return -1 if the packet cannot be decompressed and must be discarded.
+	*/
+	int decompress(unsigned pid, unsigned char *data, unsigned len, unsigned char *header, unsigned *consumed);
+};
+
+/**
+	25.323 PDCP entity for one PS radio bearer.
+	Without a PDCP PDU header the PDCP is transparent.  With one, downlink IP packets
+	get the header and, if RFC 2507 was negotiated with the UE in the radio bearer setup,
+	header compression; uplink PDUs are the reverse.
+*/
+class PdcpEntity {
+	mutable Mutex mLock;			// The downlink comes from several GGSN reader threads.
+	unsigned mRbId;
+	PdcpConfig mConfig;
+	Rfc2507Compressor mCompressor;		// downlink
+	Rfc2507Decompressor mDecompressor;	// uplink
+
+	unsigned long mDlPid[PdcpPidMax], mUlPid[PdcpPidMax];
+	unsigned long mDlBytesIn, mDlBytesOut, mUlBytesIn, mUlBytesOut;
+	unsigned long mDlCopies;		// Packets without headroom for the PDCP header.
+	unsigned long mUlDiscards;
+
+	public:
+	PdcpEntity(unsigned rbid, const PdcpConfig &config);
+
+	/** Change the configuration, as for a new radio bearer setup.  All contexts are forgotten. */
+	void configure(const PdcpConfig &config);
+
+	/** Make a downlink IP packet into a PDCP PDU in place. */
+	void pdcpWriteHighSide(ByteVector &sdu);
+	/** Make an uplink PDCP PDU into an IP packet in place; return false if it must be discarded. */
+	bool pdcpWriteLowSide(ByteVector &pdu);
+
+	void text(std::ostream &os) const;
+};
+
+};	// namespace
+#endif
@@ -0,0 +1,238 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+// PDCP header compression in loopback: downlink packets go through the network PDCP entity
+// and the PDCP PDUs through a second entity standing in for the UE, which must give back the same packets.
+// The packets are a made up session (a TCP download, the ACKs of a TCP upload, and a UDP voice stream)
+// or the IPv4 packets of a pcap file.
+// Reports the bytes on the radio bearer with and without compression, and the CPU time per packet.
+// Usage: PdcpBench [packets | file.pcap]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <vector>
+
+#include "Pdcp.h"
+#include "miniggsn.h"
+
+// We must have a gConfig now to include Logger.
+#include "Configuration.h"
+ConfigurationTable gConfig;
+
+// iputils logs here.
+namespace SGSN { FILE *mg_log_fp = NULL; }
+
+using namespace SGSN;
+
+static const unsigned sHeadroom = 16;	// As the GGSN reads them.
+
+struct BenchPacket {
+	std::vector<unsigned char> mData;
+	unsigned mHeaderLen;	// IP + TCP/UDP
+};
+
+static uint64_t nowns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void put16(unsigned char *cp, unsigned value) { cp[0] = value >> 8; cp[1] = value; }
+static void put32(unsigned char *cp, uint32_t value) { put16(cp,value >> 16); put16(cp+2,value); }
+
+static void ipHeader(unsigned char *p, unsigned len, unsigned proto, uint32_t src, uint32_t dst, unsigned id)
+{
+	p[0] = 0x45; p[1] = 0;
+	put16(p+2,len);
+	put16(p+4,id);
+	put16(p+6,0x4000);	// DF
+	p[8] = 64; p[9] = proto;
+	put32(p+12,src);
+	put32(p+16,dst);
+	struct iphdr *iph = (struct iphdr*)p;
+	iph->check = 0;
+	iph->check = ip_checksum(iph,20,NULL);
+}
+
+// A TCP segment with the timestamp option, as Linux sends them.
+static void tcpPacket(BenchPacket &pkt, uint32_t src, uint32_t dst, unsigned sport, unsigned dport, unsigned id,
+	uint32_t seq, uint32_t ack, unsigned flags, unsigned window, uint32_t tsval, uint32_t tsecr, unsigned payload)
+{
+	pkt.mHeaderLen = 20 + 32;
+	pkt.mData.assign(pkt.mHeaderLen + payload,0);
+	unsigned char *p = &pkt.mData[0], *tcp = p + 20;
+	ipHeader(p,pkt.mData.size(),IPPROTO_TCP,src,dst,id);
+	put16(tcp,sport);
+	put16(tcp+2,dport);
+	put32(tcp+4,seq);
+	put32(tcp+8,ack);
+	tcp[12] = 8 << 4;
+	tcp[13] = flags;
+	put16(tcp+14,window);
+	put16(tcp+16,random());		// The checksum is just carried through.
+	tcp[20] = 1; tcp[21] = 1; tcp[22] = 8; tcp[23] = 10;
+	put32(tcp+24,tsval);
+	put32(tcp+28,tsecr);
+	for (unsigned i = 0; i < payload; i++) { p[pkt.mHeaderLen+i] = random(); }
+}
+
+static void udpPacket(BenchPacket &pkt, uint32_t src, uint32_t dst, unsigned sport, unsigned dport, unsigned id, unsigned payload)
+{
+	pkt.mHeaderLen = 28;
+	pkt.mData.assign(28 + payload,0);
+	unsigned char *p = &pkt.mData[0];
+	ipHeader(p,pkt.mData.size(),IPPROTO_UDP,src,dst,id);
+	put16(p+20,sport);
+	put16(p+22,dport);
+	put16(p+24,8 + payload);
+	put16(p+26,random() | 1);
+	for (unsigned i = 0; i < payload; i++) { p[28+i] = random(); }
+}
+
+// A download, the ACKs for an upload and a voice call, interleaved as they would be on one PDP context.
+static void makeSession(std::vector<BenchPacket> &packets, unsigned count)
+{
+	const uint32_t server = 0x5db8d822, ue = 0x0a800001;
+	uint32_t dlSeq = 1000000, dlAck = 5000, ulAck = 70000, ts = 100000;
+	unsigned dlId = 1, ulId = 9000, voiceId = 30000, window = 29200;
+	packets.resize(count);
+	for (unsigned n = 0; n < count; n++) {
+		BenchPacket &pkt = packets[n];
+		if (n % 5 == 4) {
+			udpPacket(pkt,0x5db8d900,ue,16384,40000,voiceId++,160);
+		} else if (n % 5 == 3) {
+			// ACK of two upload segments, with a window update now and then.
+			ulAck += 2*1448;
+			if (n % 40 == 3) window += 1448;
+			tcpPacket(pkt,server,ue,443,51000,ulId++,7000,ulAck,0x10,window,ts,ts-30,0);
+		} else if (n == 0) {
+			tcpPacket(pkt,server,ue,80,52000,dlId++,dlSeq++,dlAck,0x12,window,ts,0,0);
+		} else {
+			tcpPacket(pkt,server,ue,80,52000,dlId++,dlSeq,dlAck,(n % 4) ? 0x10 : 0x18,window,ts,ts-30,1388);
+			dlSeq += 1388;
+		}
+		if (n % 8 == 0) ts++;
+	}
+}
+
+// Read the IPv4 packets from an Ethernet, Linux cooked or raw IP pcap file.
+static bool readPcap(const char *name, std::vector<BenchPacket> &packets)
+{
+	FILE *fp = fopen(name,"rb");
+	if (!fp) { perror(name); return false; }
+	unsigned char header[24];
+	if (fread(header,1,24,fp) != 24) { fclose(fp); return false; }
+	uint32_t magic, linktype;
+	memcpy(&magic,header,4);
+	memcpy(&linktype,header+20,4);
+	if (magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) {
+		printf("%s: not a native byte order pcap file\n",name);
+		fclose(fp);
+		return false;
+	}
+	unsigned skip;
+	switch (linktype) {
+		case 1: skip = 14; break;		// Ethernet
+		case 113: skip = 16; break;		// Linux cooked
+		case 101: case 228: skip = 0; break;	// raw IP, raw IPv4
+		default: printf("%s: link type %u not supported\n",name,linktype); fclose(fp); return false;
+	}
+	unsigned char record[16];
+	std::vector<unsigned char> frame;
+	while (fread(record,1,16,fp) == 16) {
+		uint32_t caplen, origlen;
+		memcpy(&caplen,record+8,4);
+		memcpy(&origlen,record+12,4);
+		frame.resize(caplen);
+		if (caplen && fread(&frame[0],1,caplen,fp) != caplen) break;
+		if (caplen != origlen || caplen < skip + 20) continue;	// Truncated captures cannot be sent.
+		if (skip && (frame[skip-2] != 0x08 || frame[skip-1] != 0x00)) continue;	// Not IPv4.
+		const unsigned char *ip = &frame[skip];
+		if ((ip[0] >> 4) != 4) continue;
+		BenchPacket pkt;
+		pkt.mData.assign(ip,ip + caplen - skip);
+		unsigned ihl = 4*(ip[0] & 0xf);
+		pkt.mHeaderLen = ihl;
+		if (ip[9] == IPPROTO_TCP && pkt.mData.size() >= ihl + 20) pkt.mHeaderLen += 4*(ip[ihl+12] >> 4);
+		if (ip[9] == IPPROTO_UDP) pkt.mHeaderLen += 8;
+		packets.push_back(pkt);
+	}
+	fclose(fp);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<BenchPacket> packets;
+	srandom(1);
+	if (argc > 1 && strstr(argv[1],".pcap")) {
+		if (!readPcap(argv[1],packets)) return 1;
+		printf("%u IPv4 packets from %s\n",(unsigned)packets.size(),argv[1]);
+	} else {
+		makeSession(packets,argc > 1 ? atoi(argv[1]) : 20000);
+		printf("%u packets: TCP download, TCP upload ACKs and UDP voice\n",(unsigned)packets.size());
+	}
+	if (packets.empty()) return 1;
+
+	PdcpConfig config;
+	config.mPduHeader = config.mRfc2507 = true;
+	config.mMaxHeader = 80;
+	PdcpEntity network(5,config), ue(5,config);
+
+	// The PDCP works in place, so give it the packets the way the GGSN does, with headroom.
+	unsigned count = packets.size();
+	std::vector<ByteVector> pdus(count);
+	unsigned long bytes = 0, headerBytes = 0;
+	for (unsigned n = 0; n < count; n++) {
+		pdus[n].allocPacket(sHeadroom,packets[n].mData.size());
+		pdus[n].append(&packets[n].mData[0],packets[n].mData.size());
+		bytes += packets[n].mData.size();
+		headerBytes += packets[n].mHeaderLen;
+	}
+
+	uint64_t start = nowns();
+	for (unsigned n = 0; n < count; n++) { network.pdcpWriteHighSide(pdus[n]); }
+	uint64_t compressNs = nowns() - start;
+	unsigned long pduBytes = 0;
+	for (unsigned n = 0; n < count; n++) { pduBytes += pdus[n].size(); }
+
+	start = nowns();
+	unsigned discarded = 0;
+	for (unsigned n = 0; n < count; n++) {
+		if (!ue.pdcpWriteLowSide(pdus[n])) discarded++;
+	}
+	uint64_t decompressNs = nowns() - start;
+
+	unsigned mismatches = 0;
+	for (unsigned n = 0; n < count; n++) {
+		const std::vector<unsigned char> &orig = packets[n].mData;
+		if (pdus[n].size() != orig.size() || memcmp(pdus[n].begin(),&orig[0],orig.size())) mismatches++;
+	}
+
+	long pduHeaderBytes = (long)headerBytes - ((long)bytes - (long)pduBytes);
+	printf("IP bytes %lu, PDCP bytes %lu, %.1f%% saved\n",bytes,pduBytes,100.0*(bytes - (double)pduBytes)/bytes);
+	printf("headers: %.1f bytes per packet, %.1f compressed with the PDCP header, ratio %.1f\n",
+		(double)headerBytes/count,(double)pduHeaderBytes/count,pduHeaderBytes ? (double)headerBytes/pduHeaderBytes : 0);
+	printf("compress %.0f ns per packet, decompress %.0f ns per packet\n",(double)compressNs/count,(double)decompressNs/count);
+	network.text(std::cout);
+	ue.text(std::cout);
+	if (discarded || mismatches) printf("%u discarded, %u not the same after decompression\n",discarded,mismatches);
+	return discarded || mismatches ? 1 : 0;
+}
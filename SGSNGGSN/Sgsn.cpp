@@ -27,6 +27,7 @@
 #include "Globals.h"
 //#include "MAC.h"
 #include "miniggsn.h"
+#include "Pdcp.h"
 using namespace Utils;
 #define CASENAME(x) case x: return #x;
 #define SRB3 3
@@ -39,6 +40,7 @@ static SgsnInfoList_t sSgsnInfoList;
 typedef std::list<GmmInfo*> GmmInfoList_t;
 static GmmInfoList_t sGmmInfoList;
 static Mutex sSgsnListMutex;	// One lock sufficient for all lists maintained by SGSN.
+static PacketStage sSgsnStage("sgsn");
 static void dumpGmmInfo();
 #if RN_UMTS
 static void sendAuthenticationRequest(SgsnInfo *si, GmmInfo::SecurityState secState);
@@ -111,6 +113,8 @@ SgsnInfo::SgsnInfo(uint32_t wMsHandle) :
 	time(&mLastUseTime);
 #if RN_UMTS == 0
 	mLlcEngine = new LlcEngine(this);
+#else
+	memset(mPdcp,0,sizeof(mPdcp));
 #endif
 	sSgsnInfoList.push_back(this);
 }
@@ -118,8 +122,24 @@ SgsnInfo::SgsnInfo(uint32_t wMsHandle) :
 SgsnInfo::~SgsnInfo()
 {
 	if (mLlcEngine) {delete mLlcEngine;}
+#if RN_UMTS
+	for (unsigned rbid = 0; rbid < GmmInfo::sNumPdps; rbid++) { delete mPdcp[rbid]; }
+#endif
 }
 
+#if RN_UMTS
+// A new RAB starts with new PDCP contexts, as the UE's do.
+void SgsnInfo::setPdcp(unsigned rbid, const PdcpConfig &config)
+{
+	if (rbid >= GmmInfo::sNumPdps) { return; }
+	if (mPdcp[rbid]) {
+		mPdcp[rbid]->configure(config);
+	} else {
+		__atomic_store_n(&mPdcp[rbid],new PdcpEntity(rbid,config),__ATOMIC_RELEASE);
+	}
+}
+#endif
+
 void SgsnInfo::sirm()
 {
 	std::ostringstream ss;
@@ -416,8 +436,10 @@ void SgsnInfo::sgsnWriteHighSideMsg(L3GprsDlMsg &msg)
 // Incoming packets on a PdpContext come here.
 void SgsnInfo::sgsnWriteHighSide(ByteVector &sdu,int nsapi)
 {
+		sSgsnStage.arrive(sdu);
 #if RN_UMTS
-		// The PDCP is a complete no-op.
+		// The rbid is the nsapi.
+		if (PdcpEntity *pdcp = getPdcp(nsapi)) { pdcp->pdcpWriteHighSide(sdu); }
 		sgsnSend2MsHighSide(sdu,"userdata",nsapi);
 #else
 		mLlcEngine->llcWriteHighSide(sdu,nsapi);
@@ -1300,7 +1322,8 @@ void MSUEAdapter::sgsnWriteLowSide(ByteVector &payload, uint32_t handle, unsigne
 {
 	SgsnInfo *si = sgsnGetSgsnInfoByHandle(handle,true);	// Create if necessary.
 #if RN_UMTS
-	// No Pdcp, so just send it off.
+	PdcpEntity *pdcp = si->getPdcp(rbid);
+	if (pdcp && !pdcp->pdcpWriteLowSide(payload)) { return; }
 	si->sgsnSend2PdpLowSide(rbid, payload);
 #else
 	si->mLlcEngine->llcWriteLowSide(payload,si);
@@ -1514,11 +1537,18 @@ void MSUEAdapter::sgsnHandleRabSetupResponse(unsigned rabId, bool success)
 	if (success) {
 		PdpContext *pdp = si->getPdp(rabId);
 		if (pdp==NULL) return; // FIXME: Not sure what to do here
+		PdcpConfig pdcpConfig;
+		msGetPdcpConfig(rabId,pdcpConfig);
+		si->setPdcp(rabId,pdcpConfig);
 		if (pdp->mUmtsStatePending) {
 			pdp->update(pdp->mPendingPdpr);
 			pdp->mUmtsStatePending = false;
                         pdp->mRabStatus.mStatus = RabStatus::RabAllocated;
-                        pdp->mRabStatus.mRateUplink = pdp->mRabStatus.mRateDownlink = 9999;
+			// If the GGSN shapes traffic, keep the rates the RAB was allocated with: they are the QoS
+			// we accept the PDP context with and the rate it is held to.  Otherwise advertise 9999 as always.
+			if (!miniggsn_shaping() || pdp->mRabStatus.mRateDownlink == 0) {
+				pdp->mRabStatus.mRateUplink = pdp->mRabStatus.mRateDownlink = 9999;
+			}
 	                sendPdpContextAccept(si,pdp);
 		}
 		if (pdp->mServiceRequestPending) {
@@ -1561,6 +1591,11 @@ void sgsnInfoDump(SgsnInfo *si,std::ostream&os)
 		if (ati->mPrevRaId.valid()) { os << " prev:"; ati->mPrevRaId.text(os); }
 	if (!si->getGmm()) { os << " no gmm"; }
 	os << endl;
+#if RN_UMTS
+	for (unsigned rbid = 0; rbid < GmmInfo::sNumPdps; rbid++) {
+		if (PdcpEntity *pdcp = si->getPdcp(rbid)) { pdcp->text(os); }
+	}
+#endif
 }
 
 void gmmInfoDump(GmmInfo *gmm,std::ostream&os,int options)
@@ -1644,6 +1679,41 @@ void gmmDump(std::ostream &os)
 	}
 }
 
+// One line of key=value pairs for each active PDP context, for scripts; the 'sgsn telemetry' command.
+// With GGSN.Shaping.Enable the shaper queue delay is added as ggsn_queue_*, and if buckets,
+// the non-empty buckets of its histogram as ggsn_queue_us=low:count,...
+void gmmTelemetry(std::ostream &os, bool buckets)
+{
+	ScopedLock lock(sSgsnListMutex);
+	GmmInfo *gmm;
+	RN_FOR_ALL(GmmInfoList_t,sGmmInfoList,gmm) {
+		for (unsigned nsapi = 0; nsapi < GmmInfo::sNumPdps; nsapi++) {
+			if (! gmm->isNSapiActive(nsapi)) { continue; }
+			// As in gmmInfoDump, the pdp is not locked, but the mgp is immortal.
+			PdpContext *pdp = gmm->getPdp(nsapi);
+			mg_con_t *mgp;
+			if (!pdp || !(mgp=pdp->mgp)) { continue; }
+			char buf[30];
+			os << "pdp" << LOGVAR2("imsi",gmm->mImsi.hexstr()) << LOGVAR(nsapi) << LOGVAR2("ip",ip_ntoa(mgp->mg_ip,buf));
+			os << LOGVAR2("dl_packets",__atomic_load_n(&mgp->mg_dl_packets,__ATOMIC_RELAXED))
+				<< LOGVAR2("dl_bytes",__atomic_load_n(&mgp->mg_dl_bytes,__ATOMIC_RELAXED))
+				<< LOGVAR2("dl_drops",__atomic_load_n(&mgp->mg_dl_drops,__ATOMIC_RELAXED));
+			os << LOGVAR2("ul_packets",__atomic_load_n(&mgp->mg_ul_packets,__ATOMIC_RELAXED))
+				<< LOGVAR2("ul_bytes",__atomic_load_n(&mgp->mg_ul_bytes,__ATOMIC_RELAXED))
+				<< LOGVAR2("ul_drops",__atomic_load_n(&mgp->mg_ul_drops,__ATOMIC_RELAXED));
+			const LatencyHistogram *delay = __atomic_load_n(&mgp->mg_dl_delay,__ATOMIC_ACQUIRE);
+			if (delay) {
+				delay->text(os,"ggsn_queue");
+				if (buckets) {
+					os << " ggsn_queue_us=";
+					delay->textBuckets(os);
+				}
+			}
+			os << "\n";
+		}
+	}
+}
+
 void dumpGmmInfo()
 {
 	if (sgsnDebug()) {
@@ -43,6 +43,7 @@ enum AttachType {
 	AttachTypeGprs = 1, AttachTypeGprsWhileImsiAttached = 2, AttachTypeCombined = 3
 };
 class SgsnInfo;
+class PdcpEntity;
 
 const static uint32_t sLocalTlliMask = 0xc0000000;
 
@@ -149,7 +150,7 @@ class GmmInfo
 
 // The data path through SGSN is different for GPRS and UMTS.
 // For GPRS it includes LLC, LLE, and SNDCP.
-// For UMTS it includes PDCP, which is a no-op, so it is nearly empty.
+// For UMTS it includes PDCP, which is transparent unless header compression was negotiated with the UE.
 // Uplink Data Path:
 //		GPRS and UMTS have significantly different uplink paradigms in that:
 //		GPRS sends all packets to a single entry point in LLC, whence packets are
@@ -230,7 +231,7 @@ class SgsnInfo
 	friend class MSUEAdapter;
 
 	// The LlcEngine is used only by GPRS.
-	// UMTS uses PDCP, but it is a complete no-op, so is not represented here at all.
+	// UMTS uses PDCP, which is in the mPdcp entities below.
 	// The LLC sits between GPRS and SGSN and could have been combined with GPRS instead
 	// of being in the SGSN at all.   Here, it is encapsulated entirely within this object.
 	// I left the LLC component in the SGSN for several reasons:
@@ -245,6 +246,17 @@ class SgsnInfo
 	LlcEngine *mLlcEngine;
 	time_t mLastUseTime;
 
+#if RN_UMTS
+	// The PDCP entity of each PS radio bearer, by rbid, made when the RAB is set up.
+	// An entity is kept until the SgsnInfo is deleted, even if the RAB is released,
+	// because the GGSN reader threads may be in the middle of using it.
+	PdcpEntity *mPdcp[GmmInfo::sNumPdps];
+	PdcpEntity *getPdcp(unsigned rbid) const {
+		return rbid < GmmInfo::sNumPdps ? __atomic_load_n(&mPdcp[rbid],__ATOMIC_ACQUIRE) : 0;
+	}
+	void setPdcp(unsigned rbid, const PdcpConfig &config);
+#endif
+
 	//GmmMobileIdentityIE mAttachMobileId;
 
 	// For the local SGSN, this is the P-TMSI/TLLI that we [are attempting to]
@@ -337,6 +349,7 @@ std::ostream& operator<<(std::ostream& os, const SgsnInfo*si);
 
 void handleL3Msg(SgsnInfo *si, ByteVector &payload);
 void gmmDump(std::ostream&os);
+void gmmTelemetry(std::ostream&os, bool buckets);
 void sgsnInfoDump(SgsnInfo *si,std::ostream&os);
 void gmmInfoDump(GmmInfo *si,std::ostream&os,int options);
 SgsnInfo *findSgsnInfoByHandle(uint32_t handle,bool create);
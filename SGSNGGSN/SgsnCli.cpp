@@ -111,6 +111,33 @@ static void sgsnCliFree(int argc, char **argv, int argi, ostream&os)
 	}
 }
 
+static void sgsnCliGgsn(int argc, char **argv, int argi, ostream&os)
+{
+	miniggsn_dump(os);
+}
+
+static void sgsnCliTelemetry(int argc, char **argv, int argi, ostream&os)
+{
+	bool buckets = RN_CMD_OPTION("-h");
+	if (argi < argc) throw CliError(format("unrecognized argument: %s",argv[argi]));
+	gmmTelemetry(os,buckets);
+}
+
+static void sgsnCliShaping(int argc, char **argv, int argi, ostream&os)
+{
+	miniggsn_shaper_dump(os);
+}
+
+static void sgsnCliFirewall(int argc, char **argv, int argi, ostream&os)
+{
+	char *what = RN_CMD_ARG;
+	if (what) {
+		if (strcmp(what,"reload")) throw CliError(format("unrecognized argument: %s",what));
+		miniggsn_firewall_reload();
+	}
+	miniggsn_firewall_dump(os);
+}
+
 static void sgsnCliHelp(int argc, char **argv, int argi, ostream&os);
 static struct SgsnSubCmds {
 	const char *name;
@@ -119,6 +146,10 @@ static struct SgsnSubCmds {
 } sgsnSubCmds[] = {
 	{ "list",sgsnCliList, "list  [(imsi|tlli) id]  # list all or specified MS" },
 	{ "free",sgsnCliFree, "free (imsi|tlli) id     # Delete something" },
+	{ "ggsn",sgsnCliGgsn, "ggsn                  # GGSN tunnel reader and duplicate packet counters" },
+	{ "shaping",sgsnCliShaping, "shaping               # per-PDP queue, rate and drop counters in each direction" },
+	{ "telemetry",sgsnCliTelemetry, "telemetry [-h]        # per-PDP packet, byte, drop and queue delay counters as key=value; -h adds histograms" },
+	{ "firewall",sgsnCliFirewall, "firewall [reload]     # list firewall ranges and hits, or rebuild them from the config" },
 	{ "help",sgsnCliHelp, "help                  # print this help" },
 	//{ "stat",gprsStats, "stat  # Show GPRS statistics" },
 	//{ "debug",gprsDebug,	"debug [level]  # Set debug level; 0 turns off" },
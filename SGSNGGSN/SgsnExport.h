@@ -17,6 +17,7 @@
 #include <string>
 #include <Defines.h>	// For RN_UMTS
 #include "ByteVector.h"
+#include "Timeval.h"
 #include "SgsnBase.h"	// For SmCause
 #include "LinkedLists.h"
 #include "MemoryLeak.h"
@@ -79,6 +80,21 @@ struct UmtsSgsnDownlinkPdu : public SgsnDownlinkMsg
 		{}
 };
 
+// 25.331 10.3.4.2 PDCP info of a PS radio bearer, as sent to the UE in the radio bearer setup,
+// so the SGSN PDCP entity for the RB does what the UE expects.
+// The only header compression algorithm is RFC 2507; the numbers are its 10.3.4.2 parameters.
+struct PdcpConfig {
+	bool mPduHeader;		// PDCP PDU header present; required to carry the header compression PID.
+	bool mRfc2507;
+	unsigned mFMaxPeriod;	// Most compressed non-TCP packets between full headers.
+	unsigned mFMaxTime;		// Most seconds between non-TCP full headers.
+	unsigned mMaxHeader;	// Largest header that may be compressed.
+	unsigned mTcpSpace;		// Largest TCP CID.
+	unsigned mNonTcpSpace;	// Largest non-TCP CID.
+	PdcpConfig() : mPduHeader(false), mRfc2507(false),
+		mFMaxPeriod(256), mFMaxTime(5), mMaxHeader(168), mTcpSpace(15), mNonTcpSpace(15) {}
+};
+
 // This class is inherited by the MSInfo struct in GPRS and the UEInfo struct in UMTS
 // to provide the necessary Sgsn linkage.
 // The SgsnInfo class has the L3 information for the MS/UE and corresponds
@@ -123,6 +139,8 @@ class MSUEAdapter {
 	void sgsnHandleRabSetupResponse(unsigned RabId,bool success);
 	// Deactivate all the rabs specified by rabMask.
 	virtual void msDeactivateRabs(unsigned rabMask) = 0;
+	// The PDCP configuration the RRC gave the UE for this rbid, for the SGSN PDCP entity.
+	virtual void msGetPdcpConfig(unsigned rbid, PdcpConfig &config) = 0;
 	// This is only externally visible for UMTS because in GPRS we have
 	// to send messages through LLC first, so this call is made by LLC to the SGSN.
 	void sgsnHandleL3Msg(uint32_t handle, ByteVector &msgFrame);
@@ -149,9 +167,9 @@ struct RabStatus {
 	SmCauseType mFailCode;
 	unsigned mRateDownlink;	// peak KByte/sec downlink of allocated channel
 	unsigned mRateUplink;	// peak KByte/sec uplink of allocated channel
-	RabStatus(): mStatus(RabIdle), mFailCode((SmCauseType)0) {}
-	RabStatus(SmCauseType wFailCode): mStatus(RabFailure), mFailCode(wFailCode) {}
-	RabStatus(Status wStatus,SmCauseType wFailCode): mStatus(wStatus), mFailCode(wFailCode) {}
+	RabStatus(): mStatus(RabIdle), mFailCode((SmCauseType)0), mRateDownlink(0), mRateUplink(0) {}
+	RabStatus(SmCauseType wFailCode): mStatus(RabFailure), mFailCode(wFailCode), mRateDownlink(0), mRateUplink(0) {}
+	RabStatus(Status wStatus,SmCauseType wFailCode): mStatus(wStatus), mFailCode(wFailCode), mRateDownlink(0), mRateUplink(0) {}
 	//void scheduleDeactivation() {
 	//	mStatus = RabDeactPending;
 	//	mDeactivationTime.future(gConfig.getNum("UMTS.Rab.DeactivationDelay",5000));
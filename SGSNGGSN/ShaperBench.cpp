@@ -0,0 +1,136 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+// The GGSN shaper on a simulated clock: PDP contexts share a link of fixed rate,
+// two with bulk downloads, one bulk download held to a QoS rate, and a voice call.
+// Each bulk source keeps a window of packets queued, as TCP would.
+// Runs the same traffic through one FIFO, as the GGSN queue was, and through the
+// per-connection queues, and reports each source's throughput and the voice packet delay.
+// Usage: ShaperBench [seconds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdint.h>
+#include <vector>
+
+#include "GgsnShaper.h"
+
+// We must have a gConfig now to include Logger.
+#include "Configuration.h"
+ConfigurationTable gConfig;
+
+using namespace SGSN;
+
+static const unsigned sLinkRate = 250000;		// bytes/sec the radio takes
+static const unsigned sWindow = 32;				// packets each bulk source keeps queued
+static const unsigned sLimitedRate = 40000;		// bytes/sec QoS of the limited source
+static const unsigned sVoicePeriod = 20000;		// usecs
+static const unsigned sVoiceSize = 200;
+
+enum { Bulk1, Bulk2, Limited, Voice, NumSources };
+static const char *sSourceName[NumSources] = { "bulk", "bulk", "bulk at QoS rate", "voice" };
+
+struct BenchPdu : SingleLinkListNode {
+	unsigned mLen;
+	unsigned mSource;
+	uint64_t mArrival;
+	BenchPdu(unsigned len, unsigned source, uint64_t arrival) : mLen(len), mSource(source), mArrival(arrival) {}
+	unsigned size() { return mLen; }
+};
+
+struct SourceStats {
+	unsigned mQueued;
+	unsigned long mBytes;
+	unsigned long mPackets;
+	uint64_t mDelaySum, mDelayMax;
+};
+
+static uint64_t nowns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void run(bool fair, unsigned seconds)
+{
+	GgsnShaper shaper(fair ? "per-connection" : "fifo");
+	shaper.init(NumSources,1520,fair ? 65536 : 1<<30,100);
+	if (fair) { shaper.setRate(Limited,sLimitedRate,0); }
+	ScopedLock lock(shaper.lock());
+
+	SourceStats stats[NumSources] = {};
+	uint64_t end = (uint64_t)seconds * 1000000, t = 0, linkFree = 0, nextVoice = 0;
+	unsigned long packets = 0;
+	uint64_t start = nowns();
+	while (t < end) {
+		for (unsigned s = Bulk1; s <= Limited; s++) {
+			while (stats[s].mQueued < sWindow) {
+				shaper.enqueue(fair ? s : 0,new BenchPdu(1500,s,t));
+				stats[s].mQueued++;
+			}
+		}
+		if (t >= nextVoice) {
+			shaper.enqueue(fair ? Voice : 0,new BenchPdu(sVoiceSize,Voice,t));
+			stats[Voice].mQueued++;
+			nextVoice += sVoicePeriod;
+		}
+		uint64_t wake = 0;
+		if (t >= linkFree) {
+			unsigned flow;
+			BenchPdu *pdu = static_cast<BenchPdu*>(shaper.next(&flow,t,&wake));
+			if (pdu) {
+				SourceStats &st = stats[pdu->mSource];
+				st.mQueued--;
+				st.mBytes += pdu->mLen;
+				st.mPackets++;
+				uint64_t delay = t - pdu->mArrival;
+				st.mDelaySum += delay;
+				if (delay > st.mDelayMax) { st.mDelayMax = delay; }
+				linkFree = t + (uint64_t)pdu->mLen * 1000000 / sLinkRate;
+				packets++;
+				delete pdu;
+				continue;
+			}
+		}
+		// Nothing can go now; move the clock to the next thing that can happen.
+		uint64_t later = nextVoice;
+		if (linkFree > t && linkFree < later) { later = linkFree; }
+		if (wake && wake < later) { later = wake; }
+		t = later;
+	}
+	uint64_t elapsed = nowns() - start;
+
+	printf("%s, %u s at %u bytes/s:\n",shaper.name(),seconds,sLinkRate);
+	for (unsigned s = 0; s < NumSources; s++) {
+		const SourceStats &st = stats[s];
+		printf("  %-16s %7.0f bytes/s, delay avg %4.0f ms max %4.0f ms\n",sSourceName[s],(double)st.mBytes/seconds,
+			st.mPackets ? st.mDelaySum/1000.0/st.mPackets : 0.0,st.mDelayMax/1000.0);
+	}
+	printf("  %lu packets, %.0f ns per packet queued and scheduled\n",packets,packets ? (double)elapsed/packets : 0.0);
+	// Free what is left.
+	unsigned flow;
+	uint64_t wake;
+	shaper.setRate(Limited,0,0);
+	while (SingleLinkListNode *pdu = shaper.next(&flow,end,&wake)) { delete pdu; }
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned seconds = argc > 1 ? atoi(argv[1]) : 60;
+	run(false,seconds);
+	run(true,seconds);
+	return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+// Downlink packet blast through a tunnel set up the way miniggsn does it.
+// UDP packets to a scratch MS address range are routed into the tunnel and drained
+// by one reader per queue with ip_tun_read_batch, once with a single queue and once multi-queue.
+// Reports packets per second, packets lost in the tunnel, and the latency from send to read.
+// Must run as root.
+// Usage: TunBench [queues [packets]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+
+#include "miniggsn.h"
+
+// We must have a gConfig now to include Logger.
+#include "Configuration.h"
+ConfigurationTable gConfig;
+
+// iputils logs here; miniggsn opens it from GGSN.Logfile.Name.
+namespace SGSN { FILE *mg_log_fp = NULL; }
+
+using namespace SGSN;
+
+static const char *sTunName = "tunbench";
+static const char *sRoute = "10.254.77.0/24";
+static const int sMaxQueues = 16;
+static const int sBatch = 32;
+static const unsigned sBufSize = 1522;
+static const int sLatencyBuckets = 5;		// <10us, <100us, <1ms, <10ms, more
+
+struct BenchPayload {
+	uint64_t sent;		// CLOCK_MONOTONIC ns
+	uint32_t seq;
+	char pad[20];
+};
+
+struct BenchReader {
+	int fd;
+	volatile bool *done;
+	unsigned long packets;
+	unsigned long batches;
+	uint64_t totalLatency;	// ns
+	uint64_t maxLatency;
+	uint64_t lastRead;
+	unsigned long histogram[sLatencyBuckets];
+};
+
+struct BenchSender {
+	int index;
+	unsigned packets;
+	uint64_t firstSent;
+};
+
+static uint64_t nowns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void *readerLoop(void *arg)
+{
+	BenchReader *rd = (BenchReader*)arg;
+	unsigned char *block = (unsigned char*)malloc(sBatch*sBufSize);
+	unsigned char *buffers[sBatch];
+	for (int i = 0; i < sBatch; i++) { buffers[i] = block + i*sBufSize; }
+	int lens[sBatch];
+	while (!*rd->done) {
+		struct pollfd pfd;
+		pfd.fd = rd->fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd,1,100) <= 0) continue;
+		int n = ip_tun_read_batch(rd->fd,buffers,sBufSize,lens,sBatch);
+		if (n == 0) continue;
+		uint64_t now = nowns();
+		rd->batches++;
+		for (int i = 0; i < n; i++) {
+			unsigned char *packet = buffers[i];
+			struct iphdr *iph = (struct iphdr*)packet;
+			unsigned offset = 4*iph->ihl + 8;	// UDP header
+			if (iph->protocol != IPPROTO_UDP || lens[i] < (int)(offset+sizeof(BenchPayload))) continue;
+			BenchPayload payload;
+			memcpy(&payload,packet+offset,sizeof(payload));
+			uint64_t latency = now - payload.sent;
+			rd->packets++;
+			rd->totalLatency += latency;
+			if (latency > rd->maxLatency) rd->maxLatency = latency;
+			int bucket = 0;
+			for (uint64_t limit = 10000; bucket < sLatencyBuckets-1 && latency >= limit; limit *= 10) bucket++;
+			rd->histogram[bucket]++;
+		}
+		rd->lastRead = now;
+	}
+	free(block);
+	return NULL;
+}
+
+static void *senderLoop(void *arg)
+{
+	BenchSender *snd = (BenchSender*)arg;
+	int sock = socket(AF_INET,SOCK_DGRAM,0);
+	struct sockaddr_in dest;
+	memset(&dest,0,sizeof(dest));
+	dest.sin_family = AF_INET;
+	BenchPayload payload;
+	memset(&payload,0,sizeof(payload));
+	snd->firstSent = nowns();
+	for (unsigned i = 0; i < snd->packets; i++) {
+		// Many flows, so the kernel spreads them over the queues.
+		dest.sin_addr.s_addr = htonl(0x0afe4d01 + (i % 200));
+		dest.sin_port = htons(20000 + snd->index*64 + (i % 64));
+		payload.seq = i;
+		payload.sent = nowns();
+		while (sendto(sock,&payload,sizeof(payload),0,(struct sockaddr*)&dest,sizeof(dest)) < 0) {
+			if (errno != ENOBUFS && errno != EAGAIN) { perror("sendto"); close(sock); return NULL; }
+			usleep(10);
+		}
+	}
+	close(sock);
+	return NULL;
+}
+
+static bool run(int queues, unsigned packets)
+{
+	int fds[sMaxQueues];
+	int nopen = ip_tun_open(sTunName,sRoute,fds,queues);
+	if (nopen <= 0) {
+		printf("cannot open tunnel %s; TunBench must run as root\n",sTunName);
+		return false;
+	}
+
+	volatile bool done = false;
+	BenchReader readers[sMaxQueues];
+	pthread_t readerThreads[sMaxQueues];
+	memset(readers,0,sizeof(readers));
+	for (int q = 0; q < nopen; q++) {
+		readers[q].fd = fds[q];
+		readers[q].done = &done;
+		pthread_create(&readerThreads[q],NULL,readerLoop,&readers[q]);
+	}
+
+	BenchSender senders[sMaxQueues];
+	pthread_t senderThreads[sMaxQueues];
+	for (int s = 0; s < nopen; s++) {
+		senders[s].index = s;
+		senders[s].packets = packets / nopen;
+		pthread_create(&senderThreads[s],NULL,senderLoop,&senders[s]);
+	}
+	for (int s = 0; s < nopen; s++) pthread_join(senderThreads[s],NULL);
+	unsigned sent = (packets / nopen) * nopen;
+
+	// Let the readers finish the backlog.
+	unsigned long received = 0;
+	for (int tries = 0; tries < 20; tries++) {
+		usleep(50000);
+		received = 0;
+		for (int q = 0; q < nopen; q++) received += readers[q].packets;
+		if (received >= sent) break;
+	}
+	done = true;
+	for (int q = 0; q < nopen; q++) pthread_join(readerThreads[q],NULL);
+
+	uint64_t start = senders[0].firstSent, end = 0;
+	unsigned long batches = 0;
+	uint64_t totalLatency = 0, maxLatency = 0;
+	unsigned long histogram[sLatencyBuckets] = {0};
+	for (int q = 0; q < nopen; q++) {
+		if (senders[q].firstSent < start) start = senders[q].firstSent;
+		if (readers[q].lastRead > end) end = readers[q].lastRead;
+		batches += readers[q].batches;
+		totalLatency += readers[q].totalLatency;
+		if (readers[q].maxLatency > maxLatency) maxLatency = readers[q].maxLatency;
+		for (int b = 0; b < sLatencyBuckets; b++) histogram[b] += readers[q].histogram[b];
+	}
+	double seconds = end > start ? (end - start) / 1e9 : 0;
+	printf("%2d queue%s: %8.0f packets/s, %lu of %u lost, %.1f per read, latency mean %.1f us max %.1f us\n",
+		nopen, nopen==1 ? " " : "s",
+		seconds ? received/seconds : 0, sent > received ? sent-received : 0UL, sent,
+		batches ? (double)received/batches : 0,
+		received ? totalLatency/1e3/received : 0, maxLatency/1e3);
+	printf("           latency <10us %lu, <100us %lu, <1ms %lu, <10ms %lu, more %lu\n",
+		histogram[0],histogram[1],histogram[2],histogram[3],histogram[4]);
+	for (int q = 0; q < nopen; q++) {
+		printf("           queue %d: %lu packets\n",q,readers[q].packets);
+	}
+
+	// Remove the tunnel, so the next run can open it with a different number of queues.
+	ioctl(fds[0],TUNSETPERSIST,0);
+	for (int q = 0; q < nopen; q++) close(fds[q]);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	int queues = argc>1 ? atoi(argv[1]) : 4;
+	unsigned packets = argc>2 ? atoi(argv[2]) : 200000;
+	if (queues < 1) queues = 1;
+	if (queues > sMaxQueues) queues = sMaxQueues;
+
+	printf("%u %d-byte UDP packets through tunnel %s, route %s\n",packets,(int)sizeof(BenchPayload),sTunName,sRoute);
+	if (!run(1,packets)) return 1;
+	if (queues > 1) run(queues,packets);
+	return 0;
+}
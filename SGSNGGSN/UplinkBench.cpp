@@ -0,0 +1,201 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+// Uplink packet blast through the miniggsn: UDP packets from several MS addresses are queued
+// with miniggsn_queue_npdu in bursts and written to a real tunnel by miniggsn_handle_uplink,
+// once a packet at a time (GGSN.TunWriteBatch 1) and once in batches.
+// Each run is in a child process of its own, because miniggsn_init only sets up once.
+// The packets are addressed to this host, and a socket counts the ones that come out of the tunnel.
+// Reports packets per second and the writer statistics, with the system calls per packet.
+// Must run as root.
+// Usage: UplinkBench [packets [burst]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+#include "miniggsn.h"
+#include "Ggsn.h"
+
+// We must have a gConfig now to include Logger.
+#include "Configuration.h"
+ConfigurationTable gConfig;
+
+using namespace SGSN;
+
+// Nothing is delivered here.
+void PdpContext::pdpWriteHighSide(ByteVector &packet) {}
+
+static const int sConnections = 16;
+static const unsigned sPort = 47999;
+static const unsigned sPayload = 100;
+
+static uint64_t nowns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void put16(unsigned char *cp, unsigned value) { cp[0] = value >> 8; cp[1] = value; }
+
+// An address of this host that is not loopback, in network order, or 0.
+static uint32_t localAddress()
+{
+	struct ifaddrs *ifs;
+	if (getifaddrs(&ifs) < 0) return 0;
+	uint32_t addr = 0;
+	for (struct ifaddrs *ifa = ifs; ifa && !addr; ifa = ifa->ifa_next) {
+		if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET || (ifa->ifa_flags & IFF_LOOPBACK)) continue;
+		addr = ((struct sockaddr_in*)ifa->ifa_addr)->sin_addr.s_addr;
+	}
+	freeifaddrs(ifs);
+	return addr;
+}
+
+static void udpPacket(ByteVector &pkt, uint32_t src, uint32_t dst, unsigned id)
+{
+	unsigned len = 28 + sPayload;
+	pkt.allocPacket(16,len);
+	unsigned char p[28 + sPayload];
+	memset(p,0,len);
+	p[0] = 0x45;
+	put16(p+2,len);
+	put16(p+4,id);
+	p[8] = 64; p[9] = IPPROTO_UDP;
+	memcpy(p+12,&src,4);
+	memcpy(p+16,&dst,4);
+	uint16_t check = ip_checksum(p,20,NULL);
+	memcpy(p+10,&check,2);
+	put16(p+20,40000 + id % 64);
+	put16(p+22,sPort);
+	put16(p+24,8 + sPayload);		// No UDP checksum.
+	pkt.append(p,len);
+}
+
+static unsigned drain(int sock)
+{
+	char buf[2000];
+	unsigned n = 0;
+	while (recv(sock,buf,sizeof(buf),MSG_DONTWAIT) > 0) n++;
+	return n;
+}
+
+// The miniggsn is set up once per process, so each run is in a child of its own.
+static int run(unsigned batch, unsigned packets, unsigned burst)
+{
+	gConfig.set("GGSN.IP.ReuseTimeout",0L);
+	gConfig.set("GGSN.IP.MaxPacketSize",1520L);
+	gConfig.set("GGSN.MS.IP.MaxCount",(long)sConnections);
+	gConfig.set("GGSN.IP.TossDuplicatePackets",0L);
+	gConfig.set("GGSN.IP.DuplicateHistory",1024L);
+	gConfig.set("GGSN.IP.DuplicateTimeout",500L);
+	gConfig.set("GGSN.TunQueues",1L);
+	gConfig.set("GGSN.TunWriteBatch",(long)batch);
+	gConfig.set("GGSN.Shaping.Enable",0L);
+	gConfig.set("GGSN.IP.ClampTcpMss",0L);
+	gConfig.set("GGSN.Shaping.QueueBytes",65536L);
+	gConfig.set("GGSN.Shaping.BurstTime",100L);
+	gConfig.set("GGSN.Logfile.Name","");
+	gConfig.set("GGSN.MS.IP.Base","10.254.78.1");
+	gConfig.set("GGSN.MS.IP.Route","10.254.78.0/24");
+	gConfig.set("GGSN.Firewall.Enable",0L);
+	gConfig.set("GGSN.TunName","uplinkbench");
+	gConfig.set("GGSN.DNS","127.0.0.1");
+	if (!miniggsn_init()) {
+		printf("cannot open tunnel; UplinkBench must run as root\n");
+		return 1;
+	}
+	mg_con_t *cons[sConnections];
+	for (int i = 0; i < sConnections; i++) { cons[i] = mg_con_find_free(1000+i,5); }
+
+	uint32_t dst = localAddress();
+	if (!dst) { printf("no local address to send to\n"); return 1; }
+	int sock = socket(AF_INET,SOCK_DGRAM,0);
+	struct sockaddr_in addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(sPort);
+	int rcvbuf = 8<<20;
+	setsockopt(sock,SOL_SOCKET,SO_RCVBUFFORCE,&rcvbuf,sizeof(rcvbuf));
+	if (bind(sock,(struct sockaddr*)&addr,sizeof(addr)) < 0) { perror("bind"); return 1; }
+
+	unsigned received = 0;
+	uint64_t elapsed = 0;
+	for (unsigned sent = 0; sent < packets; ) {
+		// A burst arrives from the radio while the writer is busy, then it catches up.
+		unsigned n = std::min(burst,packets - sent);
+		std::vector<ByteVector> pkts(n);
+		for (unsigned i = 0; i < n; i++) {
+			mg_con_t *mgp = cons[(sent + i) % sConnections];
+			udpPacket(pkts[i],mgp->mg_ip,dst,sent + i);
+		}
+		uint64_t start = nowns();
+		for (unsigned i = 0; i < n; i++) { miniggsn_queue_npdu(cons[(sent + i) % sConnections],pkts[i]); }
+		for (unsigned done = 0; done < n; done += batch) { miniggsn_handle_uplink(0); }
+		elapsed += nowns() - start;
+		sent += n;
+		received += drain(sock);
+	}
+	usleep(20000);
+	received += drain(sock);
+	close(sock);
+
+	char buf[40];
+	printf("GGSN.TunWriteBatch %u, to %s: %.0f packets/s, %.0f ns per packet, %u of %u received\n",
+		batch,ip_ntoa(dst,buf),packets * 1e9 / elapsed,(double)elapsed / packets,received,packets);
+	// The writer section of the GGSN dump.
+	std::ostringstream ss;
+	miniggsn_dump(ss);
+	std::istringstream lines(ss.str());
+	std::string line;
+	bool writer = false;
+	while (std::getline(lines,line)) {
+		if (line.compare(0,18,"GGSN uplink writes") == 0) writer = true;
+		else if (writer && line[0] != ' ' && line.compare(0,8,"PDU pool") != 0) break;
+		if (writer) printf("  %s\n",line.c_str());
+	}
+	return received == packets ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned packets = argc > 1 ? atoi(argv[1]) : 200000;
+	unsigned burst = argc > 2 ? atoi(argv[2]) : 32;
+	printf("%u packets of %u bytes from %d MS addresses, in bursts of %u\n",packets,28+sPayload,sConnections,burst);
+	fflush(stdout);
+	unsigned batches[] = { 1, 32 };
+	int failures = 0;
+	for (unsigned b = 0; b < sizeof(batches)/sizeof(batches[0]); b++) {
+		pid_t pid = fork();
+		if (pid == 0) { exit(run(batches[b],packets,burst)); }
+		int status = 1;
+		waitpid(pid,&status,0);
+		if (status) failures++;
+	}
+	return failures ? 1 : 0;
+}
@@ -41,6 +41,25 @@
 #include <sys/types.h>
 #include <wait.h>
 #include <ctype.h>
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+#if __AVX2__
+#include <immintrin.h>
+#endif
+#include <sys/uio.h>
+#include <algorithm>
+// io_uring is used through the system calls; the kernel headers are all it needs.
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define IP_HAVE_IO_URING 1
+#endif
+#endif
+#endif
 #include "miniggsn.h"
 #include <Globals.h>		// for gConfig
 #include <Utils.h>
@@ -138,31 +157,198 @@ EXPORT const char *ip_proto_name(int ipproto)
 	}
 }
 
+// Fold a ones complement sum down to 16 bits.
+static inline uint16_t ip_fold(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (sum & 0xffff) + (sum >> 16);
+}
+
+// The ones complement sum is the same whether it is taken 16, 32 or 64 bits at a time,
+// because 2^16 is 1 modulo 0xffff, and the same in either byte order, as long as the words
+// are loaded and stored the same way; so the words are summed as they lie in memory and the
+// result goes straight back into the packet.
+// The loads are memcpy because the packets need not be aligned.
+#if __SSE2__
+// Sum 16 byte blocks into four 32 bit lanes, 32 bytes at a time.
+// A lane gets four words, at most 4*0xffff, per pass, so the lanes are emptied every
+// 16K passes, before they can pass 2^32.
+static const unsigned sIpSumMaxPasses = 16384;
+static uint64_t ip_sum_sse2(const unsigned char *cp, unsigned nblocks)
+{
+	const __m128i zero = _mm_setzero_si128();
+	uint64_t sum = 0;
+	while (nblocks) {
+		unsigned n = nblocks < sIpSumMaxPasses ? nblocks : sIpSumMaxPasses;
+		nblocks -= n;
+		__m128i acc = zero;
+		for (; n; n--, cp += 32) {
+			__m128i a = _mm_loadu_si128((const __m128i*)cp);
+			__m128i b = _mm_loadu_si128((const __m128i*)(cp+16));
+			acc = _mm_add_epi32(acc,_mm_unpacklo_epi16(a,zero));
+			acc = _mm_add_epi32(acc,_mm_unpackhi_epi16(a,zero));
+			acc = _mm_add_epi32(acc,_mm_unpacklo_epi16(b,zero));
+			acc = _mm_add_epi32(acc,_mm_unpackhi_epi16(b,zero));
+		}
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i*)lanes,acc);
+		sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+	return sum;
+}
+#endif
+
+#if __AVX2__
+// As above with 32 byte registers, 64 bytes at a time.
+static uint64_t ip_sum_avx2(const unsigned char *cp, unsigned nblocks)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	uint64_t sum = 0;
+	while (nblocks) {
+		unsigned n = nblocks < sIpSumMaxPasses ? nblocks : sIpSumMaxPasses;
+		nblocks -= n;
+		__m256i acc = zero;
+		for (; n; n--, cp += 64) {
+			__m256i a = _mm256_loadu_si256((const __m256i*)cp);
+			__m256i b = _mm256_loadu_si256((const __m256i*)(cp+32));
+			acc = _mm256_add_epi32(acc,_mm256_unpacklo_epi16(a,zero));
+			acc = _mm256_add_epi32(acc,_mm256_unpackhi_epi16(a,zero));
+			acc = _mm256_add_epi32(acc,_mm256_unpacklo_epi16(b,zero));
+			acc = _mm256_add_epi32(acc,_mm256_unpackhi_epi16(b,zero));
+		}
+		uint32_t lanes[8];
+		_mm256_storeu_si256((__m256i*)lanes,acc);
+		for (int i = 0; i < 8; i++) { sum += lanes[i]; }
+	}
+	return sum;
+}
+#endif
+
+// Add len bytes to a ones complement sum and return the 16 bit sum, not complemented.
+// An odd last byte counts as the first byte of a word, so only the last of several pieces may be odd.
+EXPORT uint16_t ip_sum(const void *ptr, unsigned len, uint32_t initial)
+{
+	const unsigned char *cp = (const unsigned char*)ptr;
+	uint64_t sum = initial;
+	// The vector loops only pay for their setup on payloads; headers go through the scalar loop.
+#if __AVX2__
+	if (len >= 256) {
+		sum += ip_sum_avx2(cp,len/64);
+		cp += len & ~63u;
+		len &= 63;
+	}
+#endif
+#if __SSE2__
+	if (len >= 128) {
+		sum += ip_sum_sse2(cp,len/32);
+		cp += len & ~31u;
+		len &= 31;
+	}
+#endif
+	// Four words at a time; a packet header is a few passes of this.
+	while (len >= 16) {
+		uint32_t w[4];
+		memcpy(w,cp,16);
+		sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+		cp += 16;
+		len -= 16;
+	}
+	while (len >= 4) {
+		uint32_t w;
+		memcpy(&w,cp,4);
+		sum += w;
+		cp += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		uint16_t w;
+		memcpy(&w,cp,2);
+		sum += w;
+		cp += 2;
+		len -= 2;
+	}
+	if (len == 1) {
+		uint16_t w = 0;
+		*(unsigned char*)&w = *cp;
+		sum += w;
+	}
+	return ip_fold(sum);
+}
+
 // IP standard checksum, see wikipedia "IPv4 Header"
 // len is in bytes, will normally be 20 == sizeof(struct iphdr).
 EXPORT unsigned int ip_checksum(void *ptr, unsigned len, void *dummyhdr)
 {
 	//if (len != 20) printf("WARNING: unexpected header length in ip_checksum\n");
-    uint32_t i, sum = 0;
-    uint16_t *pp = (uint16_t*)ptr;
-	while (len > 1) { sum += *pp++; len -= 2; }
-	if (len == 1) {
-		uint16_t foo = 0;
-		unsigned char *cp = (unsigned char*)&foo;
-		*cp = *(unsigned char *)pp;
-		sum += foo;
-	}
+	uint16_t sum = ip_sum(ptr,len,0);
 	if (dummyhdr) {	// For TCP and UDP the dummy header is 3 words = 6 shorts.
-		pp = (uint16_t*)dummyhdr;
-		for (i = 0; i < 6; i++) { sum += pp[i]; }
+		sum = ip_sum(dummyhdr,12,sum);
+	}
+	// Convert from 2s complement to 1s complement:
+	return 0xffff & ~sum;
+}
+
+// RFC 1624 eqn 3: update a checksum for a 16 bit word of the data changing from 'from' to 'to',
+// without summing the data again: HC' = ~(~HC + ~m + m').
+// All three are as stored in the packet.
+EXPORT uint16_t ip_csum_replace2(uint16_t check, uint16_t from, uint16_t to)
+{
+	uint32_t sum = (uint16_t)~check + (uint16_t)~from + (uint32_t)to;
+	return 0xffff & ~ip_fold(sum);
+}
+
+// The same for a 32 bit field, such as an address.
+EXPORT uint16_t ip_csum_replace4(uint16_t check, uint32_t from, uint32_t to)
+{
+	uint64_t sum = (uint16_t)~check + (uint64_t)(~from & 0xffffffff) + to;
+	return 0xffff & ~ip_fold(sum);
+}
+
+// If this is a TCP SYN with an MSS option larger than mss, lower the option to mss and fix the
+// TCP checksum, so the other end sends segments that fit without IP fragmentation.
+// Return 1 if the packet was changed.
+EXPORT int ip_tcp_clamp_mss(unsigned char *packet, unsigned len, unsigned mss)
+{
+	if (len < 20 || (packet[0] >> 4) != 4 || packet[9] != IPPROTO_TCP) { return 0; }
+	unsigned ihl = 4 * (packet[0] & 0xf);
+	if (ihl < 20 || ((packet[6] << 8 | packet[7]) & 0x3fff)) { return 0; }	// Fragments are left alone.
+	if (len < ihl + 20) { return 0; }
+	unsigned char *tcp = packet + ihl;
+	if (!(tcp[13] & 0x02)) { return 0; }	// Only SYN and SYN-ACK carry the MSS.
+	unsigned doff = 4 * (tcp[12] >> 4);
+	if (doff < 20 || len < ihl + doff) { return 0; }
+	for (unsigned i = 20; i < doff; ) {
+		unsigned kind = tcp[i];
+		if (kind == 0) { break; }				// End of options.
+		if (kind == 1) { i++; continue; }		// No-op.
+		if (i + 1 >= doff) { break; }
+		unsigned olen = tcp[i+1];
+		if (olen < 2 || i + olen > doff) { break; }	// Malformed; leave it to the end host.
+		if (kind == 2 && olen == 4) {
+			if ((unsigned)(tcp[i+2] << 8 | tcp[i+3]) <= mss) { return 0; }
+			// The value need not be word aligned in the header, so update each word it touches.
+			unsigned first = (i + 2) & ~1u, end = (i + 5) & ~1u;
+			unsigned char old[6];
+			memcpy(old,tcp + first,end - first);
+			tcp[i+2] = mss >> 8;
+			tcp[i+3] = mss;
+			uint16_t check;
+			memcpy(&check,tcp + 16,2);
+			for (unsigned w = first; w < end; w += 2) {
+				uint16_t from, to;
+				memcpy(&from,old + w - first,2);
+				memcpy(&to,tcp + w,2);
+				check = ip_csum_replace2(check,from,to);
+			}
+			memcpy(tcp + 16,&check,2);
+			return 1;
+		}
+		i += olen;
 	}
-	//printf("intermediate sum=0x%x\n",sum);
-    // Convert from 2s complement to 1s complement:
-	//sum = ((sum >> 16)&0xffff) + (sum & 0xffff); /* add hi 16 to low 16 */
-	sum = ((sum >> 16)) + (sum & 0xffff); /* add hi 16 to low 16 */
-	sum += (sum >> 16);         /* add carry */
-	//printf("intermediate sum16=0x%x result=0x%x\n",sum,~sum);
-    return 0xffff & ~sum;
+	return 0;
 }
 
 #if 0
@@ -284,7 +470,9 @@ EXPORT int runcmd(const char *path, ...)
 
 
 // The addrstr is the tunnel address and must include the mask, eg: "192.168.2.0/24"
-EXPORT int ip_tun_open(const char *tname, const char *addrstr) // int32_t ipaddr, int maskbits)
+// Open one file descriptor on the tunnel, creating the tunnel if needed.
+// With IFF_MULTI_QUEUE each call adds another queue to the same tunnel.
+static int ip_tun_attach(const char *tname, short flags, bool quiet)
 {
 	struct ifreq ifr;
 	int fd;
@@ -304,12 +492,46 @@ EXPORT int ip_tun_open(const char *tname, const char *addrstr) // int32_t ipaddr
 	// of the magic TUNSETPERSIST flag.
 	memset(&ifr,0,sizeof(ifr));
 	strcpy(ifr.ifr_name,tname);
-	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;	// Disable packet info.
+	ifr.ifr_flags = flags;
 	if (ioctl(fd,TUNSETIFF,&ifr) < 0) {
-		MGERROR("could not create tunnel %s: ioctl error: %s\n",tname,strerror(errno));
+		if (!quiet) MGERROR("could not create tunnel %s: ioctl error: %s\n",tname,strerror(errno));
+		close(fd);
 		return -1;
 	}
-	if (ioctl(fd,TUNSETPERSIST,1) < 0) {
+	return fd;
+}
+
+// Open the tunnel with nqueues queues, each with its own file descriptor returned in fds,
+// so each can be read by its own thread; the kernel spreads the flows over the queues.
+// The descriptors are non-blocking; read them with ip_tun_read_batch.
+// If the tunnel can not be opened multi-queue, because the kernel predates IFF_MULTI_QUEUE
+// or the persistent tunnel was created single-queue, it is opened with one queue.
+// Return the number of queues opened, or -1 on failure.
+EXPORT int ip_tun_open(const char *tname, const char *addrstr, int *fds, int nqueues)
+{
+	int nopen = 0;
+	if (nqueues > 1) {
+		for ( ; nopen < nqueues; nopen++) {
+			int fd = ip_tun_attach(tname,IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE,nopen==0);
+			if (fd < 0) break;
+			fds[nopen] = fd;
+		}
+		if (nopen == 0) {
+			MGWARN("tunnel %s can not be opened multi-queue, using one queue",tname);
+		} else if (nopen < nqueues) {
+			MGWARN("tunnel %s opened with %d of %d queues",tname,nopen,nqueues);
+		}
+	}
+	if (nopen == 0) {
+		int fd = ip_tun_attach(tname,IFF_TUN | IFF_NO_PI,false);	// Disable packet info.
+		if (fd < 0) return -1;
+		fds[nopen++] = fd;
+	}
+	for (int q = 0; q < nopen; q++) {
+		int flags = fcntl(fds[q],F_GETFL,0);
+		fcntl(fds[q],F_SETFL,flags | O_NONBLOCK);
+	}
+	if (ioctl(fds[0],TUNSETPERSIST,1) < 0) {
 		MGERROR("could not setpersist tunnel %s: ioctl error: %s\n",tname,strerror(errno));
 	}
 
@@ -350,7 +572,202 @@ EXPORT int ip_tun_open(const char *tname, const char *addrstr) // int32_t ipaddr
 	*/
 	// We wont set a broadcast address using SIOCSIFBRDADDR
 
-	return fd;
+	return nopen;
+}
+
+// Read up to maxpackets packets from a non-blocking tunnel queue, stopping early when it is empty,
+// into the buffers of bufsize bytes.  Each packet is zero terminated, so it may use
+// at most bufsize-1 bytes.  Return the number of packets read, with their lengths in lens.
+EXPORT int ip_tun_read_batch(int fd, unsigned char **buffers, unsigned bufsize, int *lens, int maxpackets)
+{
+	int n;
+	for (n = 0; n < maxpackets; n++) {
+		unsigned char *buf = buffers[n];
+		int ret = read(fd,buf,bufsize-1);
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				MGERROR("ggsn: error: reading from tunnel: %s", strerror(errno));
+			}
+			break;
+		}
+		if (ret == 0) {
+			MGERROR("ggsn: error: zero bytes reading from tunnel");
+			break;
+		}
+		// Zero terminate for the convenience of the pinger.
+		buf[ret] = 0;
+		lens[n] = ret;
+	}
+	return n;
+}
+
+// The submission and completion rings of an io_uring, mapped from the kernel.
+struct ip_uring {
+	int fd;
+	unsigned entries;
+	bool usable;			// Cleared if writes through it fail, as they would on a kernel that cannot.
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+#if IP_HAVE_IO_URING
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+#endif
+	void *sqRing, *cqRing;
+	size_t sqRingLen, cqRingLen, sqesLen;
+	struct iovec *iovs;		// One per entry, for the writes in flight.
+};
+
+// Open an io_uring with room for at least entries writes at once, or return NULL
+// if the kernel does not have it or it is turned off, in which case write() will do.
+EXPORT ip_uring *ip_uring_open(unsigned entries)
+{
+#if IP_HAVE_IO_URING
+	struct io_uring_params params;
+	memset(&params,0,sizeof(params));
+	int fd = syscall(__NR_io_uring_setup,entries,&params);
+	if (fd < 0) {
+		MGINFO("ggsn: io_uring not available: %s",strerror(errno));
+		return NULL;
+	}
+	ip_uring *ring = (ip_uring*)calloc(1,sizeof(ip_uring));
+	ring->fd = fd;
+	ring->entries = params.sq_entries;
+	ring->sqRingLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqRingLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single) { ring->sqRingLen = ring->cqRingLen = std::max(ring->sqRingLen,ring->cqRingLen); }
+	ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqRing = mmap(0,ring->sqRingLen,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+	ring->cqRing = single ? ring->sqRing :
+		mmap(0,ring->cqRingLen,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+	void *sqes = mmap(0,ring->sqesLen,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+	if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+		MGERROR("ggsn: error: io_uring mmap failed: %s",strerror(errno));
+		if (ring->sqRing != MAP_FAILED) { munmap(ring->sqRing,ring->sqRingLen); }
+		if (!single && ring->cqRing != MAP_FAILED) { munmap(ring->cqRing,ring->cqRingLen); }
+		if (sqes != MAP_FAILED) { munmap(sqes,ring->sqesLen); }
+		close(fd);
+		free(ring);
+		return NULL;
+	}
+	char *sq = (char*)ring->sqRing, *cq = (char*)ring->cqRing;
+	ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+	ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+	ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+	ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	ring->sqes = (struct io_uring_sqe*)sqes;
+	ring->iovs = (struct iovec*)calloc(ring->entries,sizeof(struct iovec));
+	ring->usable = true;
+	return ring;
+#else
+	return NULL;
+#endif
+}
+
+EXPORT void ip_uring_close(ip_uring *ring)
+{
+	if (ring == NULL) { return; }
+#if IP_HAVE_IO_URING
+	munmap(ring->sqes,ring->sqesLen);
+	if (ring->cqRing != ring->sqRing) { munmap(ring->cqRing,ring->cqRingLen); }
+	munmap(ring->sqRing,ring->sqRingLen);
+	close(ring->fd);
+	free(ring->iovs);
+	free(ring);
+#endif
+}
+
+// Write one packet with write(), as the uplink always did.
+static bool ip_tun_write1(int fd, unsigned char *packet, unsigned len)
+{
+	int result = write(fd,packet,len);
+	if (result != (int) len) {
+		MGERROR("ggsn: error: write(tun_fd,%d) result=%d %s",len,result,strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+#if IP_HAVE_IO_URING
+// Submit up to ring->entries writes and wait for them all, with as few io_uring_enter calls as it takes,
+// normally one.  The tunnel never makes a write wait, so each is done during the submission, in order.
+// Return the number the kernel took, and add the number written to *written.  If the ring fails part way,
+// it is marked unusable and never entered again, so the packets it did not take are left to the caller.
+static int ip_uring_write(ip_uring *ring, int fd, unsigned char **packets, const unsigned *lens, int npackets, int *written, unsigned *syscalls)
+{
+	unsigned tail = *ring->sqTail;		// Only we write the tail.
+	for (int i = 0; i < npackets; i++) {
+		unsigned index = (tail + i) & *ring->sqMask;
+		struct io_uring_sqe *sqe = &ring->sqes[index];
+		memset(sqe,0,sizeof(*sqe));
+		ring->iovs[i].iov_base = packets[i];
+		ring->iovs[i].iov_len = lens[i];
+		sqe->opcode = IORING_OP_WRITEV;		// Rather than IORING_OP_WRITE, which needs Linux 5.6.
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)&ring->iovs[i];
+		sqe->len = 1;
+		sqe->user_data = i;
+		ring->sqArray[index] = index;
+	}
+	__atomic_store_n(ring->sqTail,tail + npackets,__ATOMIC_RELEASE);
+
+	int submitted = 0, completed = 0;
+	while (submitted < npackets || completed < submitted) {
+		int ret = syscall(__NR_io_uring_enter,ring->fd,npackets - submitted,npackets - completed,IORING_ENTER_GETEVENTS,NULL,0);
+		(*syscalls)++;
+		if (ret < 0) {
+			if (errno == EINTR) { continue; }
+			MGERROR("ggsn: error: io_uring_enter: %s, using write()",strerror(errno));
+			ring->usable = false;
+		} else {
+			submitted += ret;
+		}
+		// Count whatever has completed, even after a failure, so the caller knows what was written.
+		unsigned head = *ring->cqHead;
+		unsigned cqtail = __atomic_load_n(ring->cqTail,__ATOMIC_ACQUIRE);
+		for ( ; head != cqtail; head++) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+			int i = cqe->user_data;
+			completed++;
+			if (cqe->res == (int) lens[i]) { (*written)++; continue; }
+			// If write() can send it, the ring does not work for this device.
+			(*syscalls)++;
+			if (ip_tun_write1(fd,packets[i],lens[i])) {
+				MGWARN("ggsn: io_uring write to the tunnel failed: %s, using write()",strerror(-cqe->res));
+				ring->usable = false;
+				(*written)++;
+			}
+		}
+		__atomic_store_n(ring->cqHead,head,__ATOMIC_RELEASE);
+		if (ret < 0) { break; }
+	}
+	return submitted;
+}
+#endif
+
+// Write npackets to the tunnel, each a packet of its own; a tunnel takes one packet per write,
+// so writev() would run them together.  With a ring, the packets are submitted together.
+// The ring is not thread safe; it belongs to the one thread that writes with it.
+// Return the number of packets written, and add the system calls used to *syscalls.
+EXPORT int ip_tun_write_batch(int fd, ip_uring *ring, unsigned char **packets, const unsigned *lens, int npackets, unsigned *syscalls)
+{
+	int written = 0, done = 0;
+#if IP_HAVE_IO_URING
+	while (ring && ring->usable && done < npackets) {
+		int n = std::min(npackets - done,(int)ring->entries);
+		done += ip_uring_write(ring,fd,packets + done,lens + done,n,&written,syscalls);
+	}
+#endif
+	// Whatever the ring did not take, if it failed or there is none.
+	for ( ; done < npackets; done++) {
+		(*syscalls)++;
+		if (ip_tun_write1(fd,packets[done],lens[done])) { written++; }
+	}
+	return written;
 }
 
 static int setprocoption(const char *procfn)
@@ -102,10 +102,17 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <wait.h>
+#include <map>
+#include <list>
+#include <vector>
+#include <sstream>
 #include "miniggsn.h"
+#include "GgsnFirewall.h"
+#include "GgsnShaper.h"
 #undef NCC	// Make sure.  This is defined in ioctl.h, but used as a name in GSMConfig.h.
 #include "Ggsn.h"
 #include <Configuration.h>
+#include <Epoch.h>
 
 // A mini-GGSN included inside the SGSN.
 // Each MS will be assigned a dynamic IP address.
@@ -137,24 +144,132 @@ static struct GgsnConfig {
 								// the maximum number of simultaneous MS allowed.
 	unsigned mgIpTimeout;	// Dont reuse a connection for this many seconds.
 	unsigned mgIpTossDup;	// Toss duplicate packets.
+	unsigned mgDupBuckets;	// Buckets in each connection's duplicate table, a power of 2.
+	unsigned mgDupTimeout;	// Milliseconds a tcp packet is remembered.
+	bool mgShaping;			// Queue downlink packets and hold each PDP context to its rate.
+	unsigned mgClampMss;	// Largest TCP MSS let through in a SYN, or 0 to leave them alone.
+	unsigned mgWriteBatch;	// Most uplink packets written to the tunnel at once.
 
 } ggConfig;
 
-// Mini-Firewall rules
-struct GgsnFirewallRule {
-	GgsnFirewallRule *next;
-	uint32_t ipBasenl;
-	uint32_t ipMasknl;
-	GgsnFirewallRule(GgsnFirewallRule *wnext,uint32_t wipbasenl, uint32_t wmasknl) :
-		next(wnext),ipBasenl(wipbasenl),ipMasknl(wmasknl) {}
-};
-GgsnFirewallRule *gFirewallRules = NULL;
-void addFirewallRule(uint32_t ipbasenl,uint32_t masknl) {
-	gFirewallRules = new GgsnFirewallRule(gFirewallRules,ipbasenl,masknl);
-}
+// Mini-Firewall.  The uplink writer reads mg_firewall without a lock, inside an EpochReader;
+// a reload builds a new one, swaps it in, and retires the old one until no check is using it.
+static GgsnFirewall *mg_firewall = NULL;	// NULL if disabled.
+static Mutex mg_firewall_lock;			// Serializes reloads, and guards mg_firewall_retired.
+static RetiredList<GgsnFirewall> mg_firewall_retired;
+static unsigned mg_firewall_pending = 0;	// mg_firewall_retired.size(), read by the writer without the lock.
+static uint32_t mg_route_basenl, mg_route_masknl;	// The MS address range, blocked by the firewall.
 
 
 static mg_con_t *mg_cons = 0;
+static uint32_t mg_base_iphl = 0;	// The IP address of mg_cons[0], in host order; the rest follow it.
+// One per mg_cons entry, held while a packet for it is checked and delivered,
+// because the tunnel readers may have packets for the same MS at once.
+static Mutex *mg_con_locks = 0;
+
+// The duplicate table of each connection is set associative:
+// a hash of the packet picks a bucket of sMgDupWays slots, and the rest of the hash is the tag.
+// A packet is a duplicate if its tag is in its bucket and was first seen less than mgDupTimeout ago;
+// otherwise it replaces the empty, expired or oldest slot there.  A hit does not renew the slot, and the
+// timeout is short: a segment lost after the GGSN, by the RLC or the shaper, is sent again by the
+// server, and that retransmission must get through.
+static const unsigned sMgDupWays = 4;
+
+static const int sMgMaxTunQueues = 16;	// Limit on GGSN.TunQueues
+static const int sMgReadBatch = 32;		// Most packets a reader drains before delivering them.
+static const int sMgHeadroom = 16;		// Room left in front of each packet for headers added on the way down.
+static PacketStage sGgsnStage("ggsn");
+
+// The packets waiting for their turn, by connection.  Uplink packets always go through mg_uplink,
+// which replaces a single FIFO; downlink packets only if GGSN.Shaping.Enable, and otherwise go
+// straight from the tunnel reader to the PDP context.
+static GgsnShaper mg_downlink("downlink");
+static GgsnShaper mg_uplink("uplink");
+
+// TCP SYNs whose MSS was lowered to GGSN.IP.ClampTcpMss, downlink and uplink.
+static unsigned long mg_mss_clamped[2];
+
+// The uplink writer takes every packet allowed out, up to GGSN.TunWriteBatch, checks them,
+// and writes the ones that pass together, through an io_uring if the kernel has one.
+static const unsigned sMgMaxWriteBatch = 256;	// Limit on GGSN.TunWriteBatch
+static ip_uring *mg_uring = NULL;		// NULL if there is none; then it is a write() per packet.
+// Updated only by the uplink writer thread and read without a lock; they are only statistics.
+static struct MgWriterStats {
+	unsigned long mBatches;		// Times the writer found packets.
+	unsigned long mPackets;		// Packets taken from the queues.
+	unsigned long mDiscarded;	// Failed the checks or the firewall.
+	unsigned long mWritten;		// Written to the tunnel.
+	unsigned long mSyscalls;	// System calls used for the writes.
+	unsigned mMaxBatch;
+} mg_writer;
+static bool mg_check_npdu(mg_con_t *mgp,unsigned char *npdu, unsigned len);
+static void mg_firewall_reclaim();
+
+// The PdpPdu free list.  Like the packet pool in ByteVector, it is only kept to a limit.
+static const unsigned sPduPoolMaxFree = 4096;
+static Mutex sPduPoolLock;
+static std::vector<void*> sPduPoolFree;
+static unsigned long sPduPoolAllocs = 0, sPduPoolReuses = 0;
+static unsigned sPduPoolInUse = 0, sPduPoolMaxInUse = 0;
+
+void *PdpPdu::operator new(size_t size)
+{
+	assert(size == sizeof(PdpPdu));
+	{
+		ScopedLock lock(sPduPoolLock);
+		sPduPoolAllocs++;
+		if (++sPduPoolInUse > sPduPoolMaxInUse) { sPduPoolMaxInUse = sPduPoolInUse; }
+		if (sPduPoolFree.size()) {
+			sPduPoolReuses++;
+			void *ptr = sPduPoolFree.back();
+			sPduPoolFree.pop_back();
+			return ptr;
+		}
+	}
+	return ::operator new(size);
+}
+
+void PdpPdu::operator delete(void *ptr)
+{
+	if (ptr == NULL) { return; }
+	{
+		ScopedLock lock(sPduPoolLock);
+		sPduPoolInUse--;
+		if (sPduPoolFree.size() < sPduPoolMaxFree) {
+			sPduPoolFree.push_back(ptr);
+			return;
+		}
+	}
+	::operator delete(ptr);
+}
+
+void PdpPdu::poolText(std::ostream &os)
+{
+	ScopedLock lock(sPduPoolLock);
+	os << format("PDU pool: in use %u max %u, free %u, allocations %lu, reused %lu\n",
+		sPduPoolInUse,sPduPoolMaxInUse,(unsigned)sPduPoolFree.size(),sPduPoolAllocs,sPduPoolReuses);
+}
+
+// Indexes into mg_cons used to allocate connections, guarded by mg_con_index_lock.
+static Mutex mg_con_index_lock;
+// The connection each ptmsi+nsapi was last given, so an MS gets its old IP address back.
+typedef std::map<uint64_t,int> MgConKeyMap;
+static MgConKeyMap mg_con_by_key;
+// The connections with no PdpContext that have not been handed out again, in the order
+// they were closed, so the head has been idle the longest.  Never used ones come first.
+static std::list<int> mg_con_free;
+static std::vector<std::list<int>::iterator> mg_con_free_pos;	// Where each is in mg_con_free, or end().
+
+static uint64_t mg_con_key(uint32_t ptmsi, int nsapi) { return ((uint64_t)ptmsi << 32) | (uint32_t)nsapi; }
+
+// Take connection i off the free list, if it is there.  Caller holds mg_con_index_lock.
+static void mg_con_unfree(int i)
+{
+	if (mg_con_free_pos[i] != mg_con_free.end()) {
+		mg_con_free.erase(mg_con_free_pos[i]);
+		mg_con_free_pos[i] = mg_con_free.end();
+	}
+}
 
 
 // Now in Utils.cpp
@@ -181,65 +296,87 @@ static mg_con_t *mg_cons = 0;
 // until the BTS is power cycled.  The ptmsi is a unique id associated with the imsi.
 mg_con_t *mg_con_find_free(uint32_t ptmsi, int nsapi)
 {
+	ScopedLock lock(mg_con_index_lock);
+
 	// Start by looking for this specific old connection:
-	// TODO: This should use a map for efficiency.
-	int i;
-	mg_con_t *mgp = &mg_cons[0];
-	for (i=0; i < ggConfig.mgMaxConnections; i++, mgp++) {
-		if (mgp->mg_ptmsi == ptmsi && mgp->mg_nsapi == nsapi) {
-			return mgp;
-		}
+	uint64_t key = mg_con_key(ptmsi,nsapi);
+	MgConKeyMap::iterator it = mg_con_by_key.find(key);
+	if (it != mg_con_by_key.end()) {
+		mg_con_unfree(it->second);
+		return &mg_cons[it->second];
 	}
 
 	// Look for an unused IP address.
-	double now = pat_timef();
-	static int mgnextindex = 0;
-	for (i=0; i < ggConfig.mgMaxConnections; i++) {
-		mgp = &mg_cons[mgnextindex];
-		if (++mgnextindex == ggConfig.mgMaxConnections) { mgnextindex = 0; }
-		if (mgp->mg_pdp == NULL) {
-			// Dont reuse an ip address for mg_ip_timeout.
-			// TCP packets will continue to arrive for an IP address
-			// for quite some time after it becomes inactive.
-			if (mgp->mg_time_last_close && mgp->mg_time_last_close + ggConfig.mgIpTimeout > now) continue;
-			//mgp->mg_pdp = pctx;
-			mgp->mg_ptmsi = ptmsi;
-			mgp->mg_nsapi = nsapi;
-			return mgp;
-		}
-	}
-	return NULL;
+	if (mg_con_free.empty()) { return NULL; }
+	int i = mg_con_free.front();
+	mg_con_t *mgp = &mg_cons[i];
+	// Dont reuse an ip address for mg_ip_timeout.
+	// TCP packets will continue to arrive for an IP address
+	// for quite some time after it becomes inactive.
+	// The others were closed after this one, so if it is too recent, so are they.
+	if (mgp->mg_time_last_close && mgp->mg_time_last_close + ggConfig.mgIpTimeout > pat_timef()) { return NULL; }
+	mg_con_unfree(i);
+	// The MS that had it last gets a new one next time.
+	it = mg_con_by_key.find(mg_con_key(mgp->mg_ptmsi,mgp->mg_nsapi));
+	if (it != mg_con_by_key.end() && it->second == i) { mg_con_by_key.erase(it); }
+	//mgp->mg_pdp = pctx;
+	mgp->mg_ptmsi = ptmsi;
+	mgp->mg_nsapi = nsapi;
+	mg_con_by_key[key] = i;
+	return mgp;
 }
 
+// The connection lock is taken before mg_con_index_lock, and keeps a tunnel reader or the downlink
+// writer that is delivering a packet from seeing a half-opened connection or a PdpContext being deleted.
 void mg_con_open(mg_con_t *mgp,PdpContext *pdp)
 {
+	ScopedLock conLock(mg_con_locks[mgp - mg_cons]);
+	ScopedLock lock(mg_con_index_lock);
 	mgp->mg_pdp = pdp;
+	mgp->mg_dl_packets = mgp->mg_dl_bytes = mgp->mg_dl_drops = 0;
+	mgp->mg_ul_packets = mgp->mg_ul_bytes = mgp->mg_ul_drops = 0;
+	// The histogram is 1.5KB, too much to keep for every possible connection, and is only recorded
+	// by the shaper; so it is allocated at the first open with shaping on, and reused after that.
+	if (mgp->mg_dl_delay) {
+		mgp->mg_dl_delay->clear();
+	} else if (ggConfig.mgShaping) {
+		// calloc leaves it empty.  The telemetry reads the pointer without the connection lock.
+		__atomic_store_n(&mgp->mg_dl_delay,(LatencyHistogram*)calloc(1,sizeof(LatencyHistogram)),__ATOMIC_RELEASE);
+	}
+	// A reused connection must not toss the new MS's packets as duplicates of the last one's.
+	if (mgp->mg_dups) { memset(mgp->mg_dups,0,ggConfig.mgDupBuckets*sMgDupWays*sizeof(struct mg_dup_slot)); }
+	mgp->mg_dup_checked = mgp->mg_dup_hits = mgp->mg_dup_bytes = 0;
+	mg_con_unfree(mgp - mg_cons);
 }
 
 void mg_con_close(mg_con_t *mgp)
 {
+	// Once this has the lock, nobody is inside pdpWriteHighSide for the closing context,
+	// and nobody gets in after it, because they check mg_pdp again under the same lock.
+	ScopedLock conLock(mg_con_locks[mgp - mg_cons]);
+	ScopedLock lock(mg_con_index_lock);
 	mgp->mg_pdp = NULL;
 	mgp->mg_time_last_close = pat_timef();
+	int i = mgp - mg_cons;
+	if (mg_con_free_pos[i] == mg_con_free.end()) {
+		mg_con_free_pos[i] = mg_con_free.insert(mg_con_free.end(),i);
+	}
 }
 
 #if 0
 static mg_con_t *mg_con_find_by_ctx(PdpContext *pctx)
 {
-	int i; mg_con_t *mgp = mg_cons;
-	for (i=0; i < ggConfig.mgMaxConnections; i++, mgp++) {
-		if (mgp->mg_pdp == pctx) { return mgp; }
-	}
-	return NULL;
+	// The PdpContext points to its connection; there is nothing to search.
+	return pctx->mgp;
 }
 #endif
 
-static mg_con_t *mg_con_find_by_ip(uint32_t addr)
+// The addresses are consecutive from mg_cons[0], so this is a subtraction, not a search.
+mg_con_t *mg_con_find_by_ip(uint32_t addr)
 {
-	int i; mg_con_t *mgp = mg_cons;
-	for (i=0; i < ggConfig.mgMaxConnections; i++, mgp++) {
-		if (mgp->mg_ip == addr) { return mgp; }
-	}
-	return NULL;
+	uint32_t i = ntohl(addr) - mg_base_iphl;
+	if (i >= (uint32_t)ggConfig.mgMaxConnections) { return NULL; }
+	return &mg_cons[i];
 }
 
 static bool verbose = true;
@@ -265,54 +402,26 @@ static char *packettoa(char *result,unsigned char *packet, int len)
 }
 
 
-unsigned char *miniggsn_rcv_npdu(int *plen, uint32_t *dstaddr)
-{
-	static unsigned char *recvbuf = NULL;
-
-	if (recvbuf == NULL) {
-		recvbuf = (unsigned char*)malloc(ggConfig.mgMaxPduSize+2);
-		if (!recvbuf) { /**error = -ENOMEM;*/ return NULL; }
-	}
-
-	// The O_NONBLOCK was set by default!  Is not happening any more.
-	{
-		int flags = fcntl(tun_fd,F_GETFL,0);
-		if (flags & O_NONBLOCK) {
-			//MGDEBUG(4,"O_NONBLOCK = %d",O_NONBLOCK & flags);
-			flags &= ~O_NONBLOCK;	// Want Blocking!
-			int fcntlstat = fcntl(tun_fd,F_SETFL,flags);
-			MGWARN("ggsn: WARNING: Turning off tun_fd blocking flag, fcntl=%d",fcntlstat);
-		}
-	}
-
-	// We can just read from the tunnel.
-	int ret = read(tun_fd,recvbuf,ggConfig.mgMaxPduSize);
-	if (ret < 0) {
-		MGERROR("ggsn: error: reading from tunnel: %s", strerror(errno));
-		//*error = ret;
-		return NULL;
-	} else if (ret == 0) {
-		MGERROR("ggsn: error: zero bytes reading from tunnel: %s", strerror(errno));
-		//*error = ret;	// huh?
-		return NULL;
-	} else {
-		struct iphdr *iph = (struct iphdr*)recvbuf;
-		{
-			char infobuf[200];
-			MGINFO("ggsn: received %s at %s",packettoa(infobuf,recvbuf,ret), timestr().c_str());
-			//MGLOGF("ggsn: received proto=%s %d byte npdu from %s for %s at %s",
-				//ip_proto_name(iph->protocol), ret,
-				//ip_ntoa(iph->saddr,nbuf),
-				//ip_ntoa(iph->daddr,NULL), timestr());
-		}
+// The packets one reader thread drains from its tunnel queue.
+// Each reader has its own buffers and counters, so the readers share nothing here.
+// The packets are read straight into packet pool blocks, which are passed down to RLC by reference.
+struct MgReader {
+	int mFd;
+	ByteVector *mBlocks;		// sMgReadBatch blocks for the next read, mgMaxPduSize+2 bytes each.
+	int mLens[sMgReadBatch];
+	unsigned long mPackets;
+	unsigned long mBatches;		// Reads that returned packets.
+	int mMaxBatch;
+};
+static MgReader mg_readers[sMgMaxTunQueues];
+static int mg_nreaders = 0;
 
-		*dstaddr = iph->daddr;
-		// TODO: Do we have to allocate a new buffer?
-		*plen = ret;
-		// Zero terminate for the convenience of the pinger.
-		recvbuf[ret] = 0;
-		return recvbuf;
-	}
+static uint64_t mg_dup_mix(uint64_t h)
+{
+	// The splitmix64 finalizer.
+	h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
 }
 
 // If this is a duplicate TCP packet, throw it away.
@@ -320,76 +429,285 @@ unsigned char *miniggsn_rcv_npdu(int *plen, uint32_t *dstaddr)
 // which are unnecessary because we have reliable communication between here
 // and the MS, so just toss them.
 // Update 3-2012: Always do the check to print messages for dup packets even if not discarded.
+// Caller holds the connection lock.
 static int mg_toss_dup_packet(mg_con_t*mgp,unsigned char *packet, int packetlen)
 {
 	struct iphdr *iph = (struct iphdr*)packet;
 	if (iph->protocol != IPPROTO_TCP) { return 0; }
 	struct tcphdr *tcph = (struct tcphdr*) (packet + 4 * iph->ihl);
 	if (tcph->rst | tcph->urg) { return 0; }
-	int i;
-	for (i = 0; i < MG_PACKET_HISTORY; i++) {
-		// 3-2012: Jpegs are not going through the system properly.
-		// I am adding some more checks here to see if we are tossing packets inappropriately.
-		// The tot_len includes headers, but if they are not the same in the duplicate packet, oh well.
-		// TODO: If the connection is reset we should zero out our history.
-		if (mgp->mg_packets[i].saddr == iph->saddr &&
-		    mgp->mg_packets[i].daddr == iph->daddr &&
-		    mgp->mg_packets[i].totlen == iph->tot_len &&
-		    //mgp->mg_packets[i].ipfragoff == iph->frag_off &&
-		    //mgp->mg_packets[i].ipid == iph->id &&
-		    mgp->mg_packets[i].seq == tcph->seq &&
-		    mgp->mg_packets[i].source == tcph->source &&
-		    mgp->mg_packets[i].dest == tcph->dest
-			) {
+	if (mgp->mg_dups == NULL) {
+		mgp->mg_dups = (struct mg_dup_slot*)calloc(ggConfig.mgDupBuckets*sMgDupWays,sizeof(struct mg_dup_slot));
+		if (mgp->mg_dups == NULL) { return 0; }
+	}
+	// 3-2012: Jpegs are not going through the system properly.
+	// I am adding some more checks here to see if we are tossing packets inappropriately.
+	// The tot_len includes headers, but if they are not the same in the duplicate packet, oh well.
+	// TODO: If the connection is reset we should zero out our history.
+	uint64_t h = mg_dup_mix(((uint64_t)iph->saddr << 32) | iph->daddr);
+	h = mg_dup_mix(h ^ (((uint64_t)tcph->source << 48) | ((uint64_t)tcph->dest << 32) | tcph->seq));
+	h = mg_dup_mix(h ^ iph->tot_len);
+	uint32_t tag = (uint32_t)(h >> 32);
+	if (tag == 0) { tag = 1; }
+	struct mg_dup_slot *bucket = &mgp->mg_dups[(h & (ggConfig.mgDupBuckets-1)) * sMgDupWays];
+	// Milliseconds, wrapping; only differences are used.
+	uint32_t now = (uint32_t)(GgsnShaper::nowUsecs() / 1000);
+	mgp->mg_dup_checked++;
+
+	struct mg_dup_slot *victim = &bucket[0];
+	for (unsigned i = 0; i < sMgDupWays; i++) {
+		struct mg_dup_slot *slot = &bucket[i];
+		if (slot->tag == tag && now - slot->when < ggConfig.mgDupTimeout) {
+			mgp->mg_dup_hits++;
+			mgp->mg_dup_bytes += packetlen;
+			if (MGTRACING()) {
 				const char *what = ggConfig.mgIpTossDup ? "discarding " : "";
 				char buf1[40],buf2[40];
 				MGINFO("ggsn: %sduplicate %d byte packet seq=%d frag=%d id=%d src=%s:%d dst=%s:%d",what,
 					packetlen,tcph->seq,iph->frag_off,iph->id,
 					ip_ntoa(iph->saddr,buf1),tcph->source,
 					ip_ntoa(iph->daddr,buf2),tcph->dest);
-				return ggConfig.mgIpTossDup;	// Toss duplicate tcp packet if option set.
 			}
+			return ggConfig.mgIpTossDup;	// Toss duplicate tcp packet if option set.
+		}
+		// An empty slot, else the oldest.
+		if (victim->tag && (slot->tag == 0 || now - slot->when > now - victim->when)) { victim = slot; }
 	}
-	i = mgp->mg_oldest_packet;
-	if (++mgp->mg_oldest_packet >= MG_PACKET_HISTORY) { mgp->mg_oldest_packet = 0; }
-	mgp->mg_packets[i].saddr = iph->saddr;
-	mgp->mg_packets[i].daddr = iph->daddr;
-	mgp->mg_packets[i].totlen = iph->tot_len;
-	//mgp->mg_packets[i].ipfragoff = iph->frag_off;
-	//mgp->mg_packets[i].ipid = iph->id;
-	mgp->mg_packets[i].seq = tcph->seq;
-	mgp->mg_packets[i].source = tcph->source;
-	mgp->mg_packets[i].dest = tcph->dest;
+	victim->tag = tag;
+	victim->when = now;
 	return 0;	// Do not toss.
 }
 
-// There is data available on the socket.  Go get it.
-// see handle_nsip_read()
-void miniggsn_handle_read()
+static void mg_count(uint64_t *packets, uint64_t *bytes, unsigned len)
 {
-	int packetlen;
-	uint32_t dstaddr;
-	unsigned char *packet = miniggsn_rcv_npdu(&packetlen, &dstaddr);
-	if (!packet) { return; }
+	__atomic_fetch_add(packets,1,__ATOMIC_RELAXED);
+	__atomic_fetch_add(bytes,len,__ATOMIC_RELAXED);
+}
+
+// Send one packet from the tunnel down to the MS it is addressed to.
+static void miniggsn_deliver(ByteVector &pkt)
+{
+	unsigned char *packet = pkt.begin();
+	int packetlen = pkt.size();
+	struct iphdr *iph = (struct iphdr*)packet;
+	if (MGTRACING()) {
+		char infobuf[200];
+		MGINFO("ggsn: received %s at %s",packettoa(infobuf,packet,packetlen), timestr().c_str());
+	}
+	uint32_t dstaddr = iph->daddr;
 
 	// We need to reassociate the packet with the PdpContext to which it belongs.
 	mg_con_t *mgp = mg_con_find_by_ip(dstaddr);
 	if (mgp == NULL || mgp->mg_pdp == NULL) {
+		char ipaddrbuf[40];
 		MGERROR("ggsn: error: cannot find PDP context for incoming packet for IP dstaddr=%s",
-			ip_ntoa(dstaddr,NULL));
+			ip_ntoa(dstaddr,ipaddrbuf));
 		return;	// -1;
 	}
 
-	if (mg_toss_dup_packet(mgp,packet,packetlen)) { return; }
+	ScopedLock lock(mg_con_locks[mgp - mg_cons]);
+	if (mg_toss_dup_packet(mgp,packet,packetlen)) {
+		__atomic_fetch_add(&mgp->mg_dl_drops,1,__ATOMIC_RELAXED);
+		return;
+	}
+	if (ggConfig.mgClampMss && ip_tcp_clamp_mss(packet,packetlen,ggConfig.mgClampMss)) {
+		__atomic_fetch_add(&mg_mss_clamped[0],1,__ATOMIC_RELAXED);
+	}
 
 	PdpContext *pdp = mgp->mg_pdp;
+	if (pdp == NULL) { return; }	// Closed while we waited for the lock.
 	//MGDEBUG(2,"miniggsn_handle_read pdp=%p",pdp);
-	pdp->pdpWriteHighSide(packet,packetlen);
+	sGgsnStage.arrive(pkt);
+	if (ggConfig.mgShaping) {
+		// The queue keeps a reference to the packet pool block.
+		PdpPdu *pdu = new PdpPdu(pkt,mgp);
+		if (!mg_downlink.enqueue(mgp - mg_cons,pdu)) {
+			__atomic_fetch_add(&mgp->mg_dl_drops,1,__ATOMIC_RELAXED);
+			delete pdu;
+		}
+		return;
+	}
+	mg_count(&mgp->mg_dl_packets,&mgp->mg_dl_bytes,packetlen);
+	pdp->pdpWriteHighSide(pkt);
 }
 
+// Send the next downlink packet whose turn it is, waiting up to timeoutMs for one.
+void miniggsn_handle_downlink(unsigned timeoutMs)
+{
+	unsigned i;
+	PdpPdu *pdu = static_cast<PdpPdu*>(mg_downlink.read(&i,timeoutMs));
+	if (pdu == NULL) { return; }
+	{
+		ScopedLock lock(mg_con_locks[i]);
+		mg_con_t *mgp = &mg_cons[i];
+		PdpContext *pdp = mgp->mg_pdp;
+		if (pdp) {	// else closed while it was queued.
+			long delay = pdu->mQueued.elapsedUsecs();
+			if (mgp->mg_dl_delay) { mgp->mg_dl_delay->record(delay > 0 ? delay : 0); }
+			mg_count(&mgp->mg_dl_packets,&mgp->mg_dl_bytes,pdu->mpdu.size());
+			pdp->pdpWriteHighSide(pdu->mpdu);
+		}
+	}
+	delete pdu;
+}
 
-// The npdu is a raw packet including the ip header.
-int miniggsn_snd_npdu_by_mgc(mg_con_t *mgp,unsigned char *npdu, unsigned len)
+// Queue an uplink packet from the MS for the internet.
+void miniggsn_queue_npdu(mg_con_t *mgp, ByteVector &npdu)
+{
+	PdpPdu *pdu = new PdpPdu(npdu,mgp);
+	if (!mg_uplink.enqueue(mgp - mg_cons,pdu)) {
+		__atomic_fetch_add(&mgp->mg_ul_drops,1,__ATOMIC_RELAXED);
+		delete pdu;
+	}
+}
+
+// Send the uplink packets whose turn it is, waiting up to timeoutMs for one.
+// All those allowed out now, up to GGSN.TunWriteBatch, are checked and then written together.
+void miniggsn_handle_uplink(unsigned timeoutMs)
+{
+	SingleLinkListNode *pdus[sMgMaxWriteBatch];
+	unsigned flows[sMgMaxWriteBatch];
+	unsigned char *packets[sMgMaxWriteBatch];
+	unsigned lens[sMgMaxWriteBatch];
+	unsigned npdus = mg_uplink.read(pdus,flows,ggConfig.mgWriteBatch,timeoutMs);
+	if (npdus == 0) { return; }
+	int npackets = 0;
+	for (unsigned i = 0; i < npdus; i++) {
+		PdpPdu *pdu = static_cast<PdpPdu*>(pdus[i]);
+		if (mg_check_npdu(pdu->mgp,pdu->mpdu.begin(),pdu->mpdu.size())) {
+			packets[npackets] = pdu->mpdu.begin();
+			lens[npackets++] = pdu->mpdu.size();
+			mg_count(&pdu->mgp->mg_ul_packets,&pdu->mgp->mg_ul_bytes,pdu->mpdu.size());
+		} else {
+			__atomic_fetch_add(&pdu->mgp->mg_ul_drops,1,__ATOMIC_RELAXED);
+		}
+	}
+	unsigned syscalls = 0;
+	int written = npackets ? ip_tun_write_batch(tun_fd,mg_uring,packets,lens,npackets,&syscalls) : 0;
+	for (unsigned i = 0; i < npdus; i++) { delete pdus[i]; }
+
+	mg_writer.mBatches++;
+	mg_writer.mPackets += npdus;
+	mg_writer.mDiscarded += npdus - npackets;
+	mg_writer.mWritten += written;
+	mg_writer.mSyscalls += syscalls;
+	if (npdus > mg_writer.mMaxBatch) { mg_writer.mMaxBatch = npdus; }
+	mg_firewall_reclaim();
+}
+
+bool miniggsn_shaping() { return ggConfig.mgShaping; }
+
+// Hold a connection to the rates of its PDP context, in bytes per second; 0 is no limit.
+void miniggsn_set_rates(mg_con_t *mgp, unsigned downlink, unsigned uplink)
+{
+	if (!ggConfig.mgShaping) { return; }
+	mg_downlink.setRate(mgp - mg_cons,downlink);
+	mg_uplink.setRate(mgp - mg_cons,uplink);
+}
+
+void miniggsn_shaper_dump(std::ostream &os)
+{
+	if (ggConfig.mgShaping) { mg_downlink.text(os); }
+	mg_uplink.text(os);
+	// The counters are read without the locks; they are only statistics.
+	for (int i = 0; i < ggConfig.mgMaxConnections && mg_cons; i++) {
+		const GgsnShaper::Flow &down = mg_downlink.flow(i), &up = mg_uplink.flow(i);
+		if (down.mPackets + down.mDrops + up.mPackets + up.mDrops == 0) { continue; }
+		char buf[40];
+		os << format("  %s ptmsi=0x%x nsapi=%d%s\n",ip_ntoa(mg_cons[i].mg_ip,buf),
+			mg_cons[i].mg_ptmsi,mg_cons[i].mg_nsapi,mg_cons[i].mg_pdp ? "" : " closed");
+		const GgsnShaper::Flow *flows[2] = { &down, &up };
+		for (int d = 0; d < 2; d++) {
+			const GgsnShaper::Flow &fl = *flows[d];
+			if (fl.mPackets + fl.mDrops == 0) { continue; }
+			os << format("    %s: rate %u B/s, sent %lu packets %lu bytes, dropped %lu packets %lu bytes, "
+				"held by rate %lu, queued %u max %u bytes\n",
+				d ? "up" : "down",fl.mRate,fl.mPackets,fl.mBytes,fl.mDrops,fl.mDropBytes,
+				fl.mDelayed,fl.mQ.totalSize(),fl.mMaxQueue);
+		}
+	}
+}
+
+// There is data available on tunnel queue number queue.  Go get it.
+// The queue is drained into this reader's buffers first, so the delivery
+// of a burst does not alternate with system calls.
+// see handle_nsip_read()
+void miniggsn_handle_read(int queue)
+{
+	MgReader &rd = mg_readers[queue];
+	unsigned bufsize = ggConfig.mgMaxPduSize+2;
+	unsigned char *buffers[sMgReadBatch];
+	for (int i = 0; i < sMgReadBatch; i++) {
+		// The blocks delivered last time belong to their SDUs now.
+		if (!rd.mBlocks[i].isPacket()) { rd.mBlocks[i].allocPacket(sMgHeadroom,bufsize); }
+		buffers[i] = rd.mBlocks[i].begin();
+	}
+	int npackets = ip_tun_read_batch(rd.mFd,buffers,bufsize,rd.mLens,sMgReadBatch);
+	if (npackets == 0) { return; }
+	rd.mBatches++;
+	rd.mPackets += npackets;
+	if (npackets > rd.mMaxBatch) { rd.mMaxBatch = npackets; }
+	for (int i = 0; i < npackets; i++) {
+		rd.mBlocks[i].setAppendP(rd.mLens[i]);
+		miniggsn_deliver(rd.mBlocks[i]);
+		rd.mBlocks[i].clear();
+	}
+}
+
+int miniggsn_tun_queues() { return mg_nreaders; }
+int miniggsn_tun_fd(int queue) { return mg_readers[queue].mFd; }
+
+void miniggsn_dump(std::ostream &os)
+{
+	os << "GGSN tunnel queues: " << mg_nreaders << "\n";
+	for (int q = 0; q < mg_nreaders; q++) {
+		const MgReader &rd = mg_readers[q];
+		os << format("  queue %d: packets %lu in %lu reads, %.1f per read, max %d\n",
+			q,rd.mPackets,rd.mBatches,rd.mBatches ? (double)rd.mPackets/rd.mBatches : 0.0,rd.mMaxBatch);
+	}
+
+	os << format("GGSN uplink writes: %s, batches of up to %u\n",mg_uring ? "io_uring" : "write()",ggConfig.mgWriteBatch);
+	os << format("  packets %lu in %lu batches, %.1f per batch, max %u; discarded %lu, written %lu\n",
+		mg_writer.mPackets,mg_writer.mBatches,mg_writer.mBatches ? (double)mg_writer.mPackets/mg_writer.mBatches : 0.0,
+		mg_writer.mMaxBatch,mg_writer.mDiscarded,mg_writer.mWritten);
+	os << format("  system calls %lu, %.3f per packet written\n",
+		mg_writer.mSyscalls,mg_writer.mWritten ? (double)mg_writer.mSyscalls/mg_writer.mWritten : 0.0);
+	PdpPdu::poolText(os);
+
+	ByteVector::packetPoolText(os);
+	os << "downlink packet stages:\n";
+	PacketStage::text(os);
+
+	// The counters are read without the connection locks; they are only statistics.
+	unsigned long checked = 0, hits = 0, bytes = 0;
+	int tables = 0;
+	for (int i = 0; i < ggConfig.mgMaxConnections && mg_cons; i++) {
+		checked += mg_cons[i].mg_dup_checked;
+		hits += mg_cons[i].mg_dup_hits;
+		bytes += mg_cons[i].mg_dup_bytes;
+		if (mg_cons[i].mg_dups) { tables++; }
+	}
+	if (ggConfig.mgClampMss) {
+		os << format("GGSN TCP MSS clamped to %u: %lu downlink SYNs, %lu uplink SYNs\n",ggConfig.mgClampMss,
+			__atomic_load_n(&mg_mss_clamped[0],__ATOMIC_RELAXED),__atomic_load_n(&mg_mss_clamped[1],__ATOMIC_RELAXED));
+	}
+	os << format("GGSN duplicate tcp packets: %s, %u remembered for %u ms per connection, %d tables\n",
+		ggConfig.mgIpTossDup ? "tossed" : "counted only",ggConfig.mgDupBuckets*sMgDupWays,ggConfig.mgDupTimeout,tables);
+	os << format("  checked %lu, duplicates %lu (%.1f%%), %lu bytes%s\n",
+		checked,hits,checked ? 100.0*hits/checked : 0.0,bytes,ggConfig.mgIpTossDup ? " kept off the radio" : "");
+	for (int i = 0; i < ggConfig.mgMaxConnections && mg_cons; i++) {
+		const mg_con_t &con = mg_cons[i];
+		if (con.mg_dup_hits == 0) { continue; }
+		char buf[40];
+		os << format("  %s: checked %lu, duplicates %lu, %lu bytes\n",
+			ip_ntoa(con.mg_ip,buf),con.mg_dup_checked,con.mg_dup_hits,con.mg_dup_bytes);
+	}
+}
+
+
+// Check an uplink packet from the MS, and get it ready to go out: clamp the TCP MSS and decrement the ttl.
+// The npdu is a raw packet including the ip header.  Return false if it may not go.
+static bool mg_check_npdu(mg_con_t *mgp,unsigned char *npdu, unsigned len)
 {
     // Verify the IP header.
     struct iphdr *ipheader = (struct iphdr*)npdu;
@@ -398,21 +716,24 @@ int miniggsn_snd_npdu_by_mgc(mg_con_t *mgp,unsigned char *npdu, unsigned len)
     uint32_t packet_source_ip_addr = ipheader->saddr;
     uint32_t packet_dest_ip_addr = ipheader->daddr;
 
-	char infobuf[200];
-	MGINFO("ggsn: writing %s at %s",packettoa(infobuf,npdu,len),timestr().c_str());
+	if (MGTRACING()) {
+		char infobuf[200];
+		MGINFO("ggsn: writing %s at %s",packettoa(infobuf,npdu,len),timestr().c_str());
+	}
 	//MGLOGF("ggsn: writing proto=%s %d byte npdu to %s from %s at %s",
 		//ip_proto_name(ipheader->protocol),
 		//len,ip_ntoa(packet_dest_ip_addr,NULL),
 		//ip_ntoa(packet_source_ip_addr,nbuf), timestr().c_str());
 
 #define MUST_HAVE(assertion) \
-    if (! (assertion)) { MGERROR("ggsn: Packet failed test, discarded: %s",#assertion); return -1; }
+    if (! (assertion)) { MGERROR("ggsn: Packet failed test, discarded: %s",#assertion); return false; }
 
     if (mg_debug_level > 2) ip_hdr_dump(npdu,"npdu");
     MUST_HAVE(ipheader->version == 4);	// 4 as in IPv4
     MUST_HAVE(ipheader->ihl >= 5);		// Minimum header length is 5 words.
+    MUST_HAVE(len >= 4u * ipheader->ihl);
 
-    int checksum = ip_checksum(ipheader,sizeof(*ipheader),NULL);
+    int checksum = ip_checksum(ipheader,4 * ipheader->ihl,NULL);	// Including any options.
     MUST_HAVE(checksum == 0);				// If fails, packet is bad.
 
     MUST_HAVE(ipheader->ttl > 0);		// Time to live - how many hops allowed.
@@ -435,28 +756,47 @@ int miniggsn_snd_npdu_by_mgc(mg_con_t *mgp,unsigned char *npdu, unsigned len)
     MUST_HAVE((packet_dest_ip_addr & net_mask) != (local_ip_addr & net_mask));
 #endif
 
-	for (GgsnFirewallRule *rp = gFirewallRules; rp; rp = rp->next) {
+	bool blocked;
+	{
+		EpochReader reader;
+		GgsnFirewall *firewall = __atomic_load_n(&mg_firewall,__ATOMIC_ACQUIRE);
+		blocked = firewall && firewall->blocks(packet_dest_ip_addr);
+	}
+	if (blocked) {
 		// 12-17: Change the message to indicate that this was a firewall rule violation.
-		//MUST_HAVE((packet_dest_ip_addr & rp->ipMasknl) != (rp->ipBasenl & rp->ipMasknl));
-		if (! ((packet_dest_ip_addr & rp->ipMasknl) != (rp->ipBasenl & rp->ipMasknl)) ) {
-			char ipaddrbuf[50]; ip_ntoa(packet_dest_ip_addr,ipaddrbuf);
-			MGERROR("ggsn: Packet wth dest ip = %s discarded by firewall",ipaddrbuf);
-			return -1;
-		}
+		char ipaddrbuf[50]; ip_ntoa(packet_dest_ip_addr,ipaddrbuf);
+		MGERROR("ggsn: Packet wth dest ip = %s discarded by firewall",ipaddrbuf);
+		return false;
 	}
 
-    // Decrement ttl and recompute checksum.  We are doing this in place.
+	if (ggConfig.mgClampMss && ip_tcp_clamp_mss(npdu,len,ggConfig.mgClampMss)) {
+		__atomic_fetch_add(&mg_mss_clamped[1],1,__ATOMIC_RELAXED);
+	}
+
+    // Decrement ttl and update the checksum for it.  We are doing this in place.
+	// The ttl shares a 16 bit word with the protocol, and only that word changed.
+	uint16_t ttlword;
+	memcpy(&ttlword,npdu + 8,2);
     ipheader->ttl--;
-    ipheader->check = 0;
     //ipheader->check = htons(ip_checksum(ipheader,sizeof(*ipheader),NULL));
-    ipheader->check = ip_checksum(ipheader,sizeof(*ipheader),NULL);
-
-	// Just write to the MS-side tunnel device.
+	uint16_t newttlword;
+	memcpy(&newttlword,npdu + 8,2);
+    ipheader->check = ip_csum_replace2(ipheader->check,ttlword,newttlword);
+	return true;
+}
 
-	int result = write(tun_fd,npdu,len);
-	if (result != (int) len) {
-		MGERROR("ggsn: error: write(tun_fd,%d) result=%d %s",len,result,strerror(errno));
+// The npdu is a raw packet including the ip header.
+int miniggsn_snd_npdu_by_mgc(mg_con_t *mgp,unsigned char *npdu, unsigned len)
+{
+	if (!mg_check_npdu(mgp,npdu,len)) {
+		__atomic_fetch_add(&mgp->mg_ul_drops,1,__ATOMIC_RELAXED);
+		return -1;
 	}
+	mg_count(&mgp->mg_ul_packets,&mgp->mg_ul_bytes,len);
+
+	// Just write to the MS-side tunnel device.
+	unsigned syscalls = 0;
+	ip_tun_write_batch(tun_fd,NULL,&npdu,&len,1,&syscalls);
     return 0;
 }
 
@@ -472,6 +812,84 @@ int miniggsn_snd_npdu(PdpContext *pctx,unsigned char *npdu, unsigned len)
 }
 #endif
 
+// Build the firewall from GGSN.Firewall.Enable and GGSN.Firewall.Block and swap it in.
+// Called from miniggsn_init and again from the CLI when the rules change.
+// Return the GGSN.Firewall.Enable level.
+int miniggsn_firewall_reload()
+{
+	ScopedLock lock(mg_firewall_lock);
+	int firewall_enable = gConfig.getNum("GGSN.Firewall.Enable");
+	GgsnFirewall *firewall = NULL;
+	if (firewall_enable) {
+		firewall = new GgsnFirewall;
+		// Block anything in the routed range:
+		firewall->add(mg_route_basenl,mg_route_masknl,"MS addresses");
+		// Block local loopback:
+		uint32_t tmp_basenl,tmp_masknl;
+		if (ip_addr_crack("127.0.0.1/24",&tmp_basenl,&tmp_masknl)) {
+			firewall->add(tmp_basenl,tmp_masknl,"loopback");
+		}
+		// Block the OpenBTS station itself:
+		uint32_t *myaddrs = ip_findmyaddr();
+		for ( ; *myaddrs != (unsigned)-1; myaddrs++) {
+			firewall->add(*myaddrs,0xffffffff,"this host");
+		}
+		if (firewall_enable >= 2) {
+			// Block all private addresses:
+			// 16-bit block (/16 prefix, 256 × C) 	192.168.0.0 	192.168.255.255 	65536
+			firewall->add(inet_addr("192.168.0.0"),inet_addr("255.255.0.0"),"private");
+			// 20-bit block (/12 prefix, 16 × B) 	172.16.0.0 	172.31.255.255 	1048576
+			firewall->add(inet_addr("172.16.0.0"),inet_addr("255.240.0.0"),"private");
+			// 24-bit block (/8 prefix, 1 × A) 	10.0.0.0 	10.255.255.255 	16777216
+			firewall->add(inet_addr("10.0.0.0"),inet_addr("255.0.0.0"),"private");
+		}
+		// And whatever the operator lists.
+		if (gConfig.defines("GGSN.Firewall.Block")) {
+			std::istringstream ranges(gConfig.getStr("GGSN.Firewall.Block"));
+			std::string range;
+			while (ranges >> range) {
+				uint32_t basenl, masknl;
+				if (! ip_addr_crack(range.c_str(),&basenl,&masknl) || basenl == INADDR_NONE) {
+					MGWARN("ggsn: GGSN.Firewall.Block entry is not a valid ip address: %s",range.c_str());
+					continue;
+				}
+				if (range.find('/') == std::string::npos) { masknl = 0xffffffff; }	// A single host.
+				if (! firewall->add(basenl,masknl,"GGSN.Firewall.Block")) {
+					MGWARN("ggsn: GGSN.Firewall.Block entry has an invalid mask: %s",range.c_str());
+				}
+			}
+		}
+		firewall->compile();
+	}
+
+	GgsnFirewall *old = mg_firewall;
+	__atomic_store_n(&mg_firewall,firewall,__ATOMIC_RELEASE);
+	if (old) { mg_firewall_retired.retire(old); }
+	__atomic_store_n(&mg_firewall_pending,mg_firewall_retired.size(),__ATOMIC_RELAXED);
+	return firewall_enable;
+}
+
+// Delete the firewalls replaced by reloads that no check is using any more.
+// Called by the uplink writer between batches, so they do not wait for the next reload.
+static void mg_firewall_reclaim()
+{
+	if (__atomic_load_n(&mg_firewall_pending,__ATOMIC_RELAXED) == 0) { return; }
+	if (!mg_firewall_lock.trylock()) { return; }	// A reload is running, and reclaims itself.
+	mg_firewall_retired.reclaim();
+	__atomic_store_n(&mg_firewall_pending,mg_firewall_retired.size(),__ATOMIC_RELAXED);
+	mg_firewall_lock.unlock();
+}
+
+void miniggsn_firewall_dump(std::ostream &os)
+{
+	ScopedLock lock(mg_firewall_lock);
+	if (mg_firewall) {
+		mg_firewall->text(os);
+	} else {
+		os << "GGSN firewall disabled\n";
+	}
+}
+
 time_t gGgsnInitTime;
 
 bool miniggsn_init()
@@ -488,6 +906,18 @@ bool miniggsn_init()
 	ggConfig.mgMaxPduSize = gConfig.getNum("GGSN.IP.MaxPacketSize");
 	ggConfig.mgMaxConnections = gConfig.getNum("GGSN.MS.IP.MaxCount");
 	ggConfig.mgIpTossDup = gConfig.getBool("GGSN.IP.TossDuplicatePackets");
+	// The history is rounded up to whole buckets, a power of 2 of them.
+	unsigned dupHistory = gConfig.getNum("GGSN.IP.DuplicateHistory");
+	for (ggConfig.mgDupBuckets = 1; ggConfig.mgDupBuckets*sMgDupWays < dupHistory; ggConfig.mgDupBuckets *= 2) {}
+	ggConfig.mgDupTimeout = gConfig.getNum("GGSN.IP.DuplicateTimeout");
+	ggConfig.mgShaping = gConfig.getBool("GGSN.Shaping.Enable");
+	ggConfig.mgClampMss = gConfig.getNum("GGSN.IP.ClampTcpMss");
+	int tunQueues = gConfig.getNum("GGSN.TunQueues");
+	if (tunQueues < 1) { tunQueues = 1; }
+	if (tunQueues > sMgMaxTunQueues) { tunQueues = sMgMaxTunQueues; }
+	ggConfig.mgWriteBatch = gConfig.getNum("GGSN.TunWriteBatch");
+	if (ggConfig.mgWriteBatch < 1) { ggConfig.mgWriteBatch = 1; }
+	if (ggConfig.mgWriteBatch > sMgMaxWriteBatch) { ggConfig.mgWriteBatch = sMgMaxWriteBatch; }
 
 
 	string logfile = gConfig.getStr("GGSN.Logfile.Name");
@@ -507,12 +937,6 @@ bool miniggsn_init()
 		MGINFO("GGSN logging to file %s",logfile.c_str());
 	}
 
-	if (ggConfig.mgMaxConnections > 254) {
-		MGERROR("GGSN.MS.IP.MaxCount specifies too many connections (%d) specifed, using 254",
-			ggConfig.mgMaxConnections);
-		ggConfig.mgMaxConnections = 254;
-	}
-
 	// We need three IP things:
 	// 1. the route expressed using "/maskbits" notation,
 	// 2. the base ip address,
@@ -572,38 +996,23 @@ bool miniggsn_init()
 		route_str = route_buf;
 	}
 
-	// Firewall rules:
-	bool firewall_enable;
-	if ((firewall_enable = gConfig.getNum("GGSN.Firewall.Enable"))) {
-		// Block anything in the routed range:
-		addFirewallRule(route_basenl,route_masknl);
-		// Block local loopback:
-		uint32_t tmp_basenl,tmp_masknl;
-		if (ip_addr_crack("127.0.0.1/24",&tmp_basenl,&tmp_masknl)) {
-			addFirewallRule(tmp_basenl,tmp_masknl);
-		}
-		// Block the OpenBTS station itself:
-		uint32_t *myaddrs = ip_findmyaddr();
-		for ( ; *myaddrs != (unsigned)-1; myaddrs++) {
-			addFirewallRule(*myaddrs,0xffffffff);
-		}
-		if (firewall_enable >= 2) {
-			// Block all private addresses:
-			// 16-bit block (/16 prefix, 256 × C) 	192.168.0.0 	192.168.255.255 	65536
-			uint32_t private_addrnl = inet_addr("192.168.0.0");
-			uint32_t private_masknl = inet_addr("255.255.0.0");
-			addFirewallRule(private_addrnl,private_masknl);
-			// 20-bit block (/12 prefix, 16 × B) 	172.16.0.0 	172.31.255.255 	1048576
-			private_addrnl = inet_addr("172.16.0.0");
-			private_masknl = inet_addr("255.240.0.0");
-			addFirewallRule(private_addrnl,private_masknl);
-			// 24-bit block (/8 prefix, 1 × A) 	10.0.0.0 	10.255.255.255 	16777216
-			private_addrnl = inet_addr("10.0.0.0");
-			private_masknl = inet_addr("255.0.0.0");
-			addFirewallRule(private_addrnl,private_masknl);
+	// The MS addresses run from the base to the end of the route, less the broadcast address.
+	{
+		uint32_t first = ntohl(mgIpBasenl);
+		if ((first & 255) == 0) { first++; }	// As below.
+		uint32_t last = (ntohl(route_basenl) | ~ntohl(route_masknl)) - 1;
+		int room = last >= first ? last - first + 1 : 0;
+		if (ggConfig.mgMaxConnections > room) {
+			MGERROR("GGSN.MS.IP.MaxCount specifies too many connections (%d) for GGSN.MS.IP.Route %s, using %d",
+				ggConfig.mgMaxConnections,route_str,room);
+			ggConfig.mgMaxConnections = room;
 		}
 	}
 
+	mg_route_basenl = route_basenl;
+	mg_route_masknl = route_masknl;
+	int firewall_enable = miniggsn_firewall_reload();
+
 	MGINFO("GGSN Configuration:");
 		MGINFO("  GGSN.MS.IP.Base=%s", ip_ntoa(mgIpBasenl,NULL));
 		MGINFO("  GGSN.MS.IP.MaxCount=%d", ggConfig.mgMaxConnections);
@@ -612,11 +1021,16 @@ bool miniggsn_init()
 		MGINFO("  GGSN.IP.ReuseTimeout=%d", ggConfig.mgIpTimeout);
 		MGINFO("  GGSN.Firewall.Enable=%d", firewall_enable);
 		MGINFO("  GGSN.IP.TossDuplicatePackets=%d", ggConfig.mgIpTossDup);
+		MGINFO("  GGSN.IP.DuplicateHistory=%u", ggConfig.mgDupBuckets*sMgDupWays);
+		MGINFO("  GGSN.IP.DuplicateTimeout=%u", ggConfig.mgDupTimeout);
+		MGINFO("  GGSN.Shaping.Enable=%d", ggConfig.mgShaping);
+		MGINFO("  GGSN.IP.ClampTcpMss=%u", ggConfig.mgClampMss);
 	if (firewall_enable) {
 		MGINFO("GGSN Firewall Rules:");
-		for (GgsnFirewallRule *rp = gFirewallRules; rp; rp = rp->next) {
-			char buf1[40], buf2[40];
-			MGINFO("  block ip=%s mask=%s",ip_ntoa(rp->ipBasenl,buf1),ip_ntoa(rp->ipMasknl,buf2));
+		for (unsigned i = 0; i < mg_firewall->size(); i++) {
+			const GgsnFirewall::Rule &rule = mg_firewall->rule(i);
+			char buf[40];
+			MGINFO("  block ip=%s/%u %s",ip_ntoa(htonl(rule.mBase),buf),rule.mLength,rule.mWhy.c_str());
 		}
 	}
 	uint32_t dns[2];	// We dont use the result, we just want to print out the DNS servers now.
@@ -626,13 +1040,26 @@ bool miniggsn_init()
 
 	if (tun_fd == -1) {
 		ip_init();
-		tun_fd = ip_tun_open(tun_if_name,route_str);
-		if (tun_fd < 0) {
+		int fds[sMgMaxTunQueues];
+		mg_nreaders = ip_tun_open(tun_if_name,route_str,fds,tunQueues);
+		if (mg_nreaders <= 0) {
+			mg_nreaders = 0;
 			MGERROR("ggsn: ERROR: Could not open tun device %s",tun_if_name);
 			LOG(ALERT) << "Cound not open tun device:"<<tun_if_name;	// TEMPORARY MESSAGE
 			return false;
 		}
+		// Downlink packets are written on the first queue.
+		tun_fd = fds[0];
+		for (int q = 0; q < mg_nreaders; q++) {
+			MgReader &rd = mg_readers[q];
+			rd.mFd = fds[q];
+			rd.mBlocks = new ByteVector[sMgReadBatch];
+		}
+		MGINFO("  GGSN.TunQueues=%d, %d opened", tunQueues, mg_nreaders);
 	}
+	// A batch of one is written the old way.
+	if (ggConfig.mgWriteBatch > 1 && mg_uring == NULL) { mg_uring = ip_uring_open(ggConfig.mgWriteBatch); }
+	MGINFO("  GGSN.TunWriteBatch=%u, %s", ggConfig.mgWriteBatch, mg_uring ? "io_uring" : "write()");
 
 	// DEBUG: Try it again.
 	//printf("DEBUG: Opening tunnel again: %d\n",ip_tun_open(tun_if_name,route_str));
@@ -643,6 +1070,14 @@ bool miniggsn_init()
 		MGERROR("ggsn: ERROR: out of memory");
 		return false;
 	}
+	delete [] mg_con_locks;
+	mg_con_locks = new Mutex[ggConfig.mgMaxConnections];
+	memset(&mg_writer,0,sizeof(mg_writer));
+	// A turn is at least one packet of the largest size.
+	unsigned queueLimit = gConfig.getNum("GGSN.Shaping.QueueBytes");
+	unsigned burstMs = gConfig.getNum("GGSN.Shaping.BurstTime");
+	mg_downlink.init(ggConfig.mgMaxConnections,ggConfig.mgMaxPduSize,queueLimit,burstMs);
+	mg_uplink.init(ggConfig.mgMaxConnections,ggConfig.mgMaxPduSize,queueLimit,burstMs);
 	//memset(mg_cons,0,sizeof(mg_cons));
 
 	uint32_t base_iphl = ntohl(mgIpBasenl);
@@ -651,7 +1086,15 @@ bool miniggsn_init()
 	int i;
 	// If the last digit is 0 (192.168.99.0), change it to 1 for the first IP addr served.
 	if ((base_iphl & 255) == 0) { base_iphl++; }
+	mg_base_iphl = base_iphl;
+	{
+		ScopedLock lock(mg_con_index_lock);
+		mg_con_by_key.clear();
+		mg_con_free.clear();
+		mg_con_free_pos.assign(ggConfig.mgMaxConnections,mg_con_free.end());
+	}
 	for (i=0; i < ggConfig.mgMaxConnections; i++) {
+		mg_con_free_pos[i] = mg_con_free.insert(mg_con_free.end(),i);
 		mg_cons[i].mg_ip = htonl(base_iphl + i);
 		//mg_cons[i].mg_ip = htonl(base_iphl + 1 + i);
 		// DEBUG!!!!!  Use my own ip address.
@@ -16,6 +16,8 @@
 #define _MINIGGSN_H_
 #include <time.h>
 #include "Logger.h"
+#include "ByteVector.h"
+#include "Histogram.h"
 
 namespace SGSN {
 
@@ -31,31 +33,50 @@ struct PdpContext;
 // 		so those messages point to the permanet mg_con_s instead of the PdpContext.
 // o The IP address must remain reserved for a period of time after a PdpContext is deleted/deactivated.
 // Note: This was written in C originally.
+// One remembered tcp packet, by a hash of its addresses, ports, sequence number and length.
+struct mg_dup_slot {
+	uint32_t tag;			// Hash bits not used to pick the bucket; 0 if empty.
+	uint32_t when;			// When it was first seen, milliseconds.
+};
+
 typedef struct mg_con_s {
 	PdpContext *mg_pdp;		// Points back to the PDP context using this connection.
 	uint32_t mg_ptmsi;		// The ptmsi that is using this IP connection.
 	int mg_nsapi;			// The nsapi in this ptmsi that is using this IP connection.
 	uint32_t mg_ip;			// The IP address used for this connection, in network order.
-	// Keep track of the last few tcp packets received:
-#define MG_PACKET_HISTORY 60
-	struct mg_packets {
-		uint16_t source, dest;	// TCP source and dest ports.
-		uint16_t totlen;		// IP length, which includes headers.
-		uint32_t seq;			// TCP sequence number
-		uint32_t saddr, daddr;	// source and destination IP addr
-		uint16_t ipid, ipfragoff;	// Added 3-2012
-	} mg_packets[MG_PACKET_HISTORY];
-	int mg_oldest_packet;
+	// Keep track of the tcp packets received recently, to spot duplicates:
+	struct mg_dup_slot *mg_dups;	// Allocated with the first tcp packet.
+	unsigned long mg_dup_checked;	// TCP packets looked up.
+	unsigned long mg_dup_hits;		// Duplicates found.
+	unsigned long mg_dup_bytes;		// Bytes in duplicates found.
 	double mg_time_last_close;
+	// Data plane telemetry for the 'sgsn telemetry' command, since the PDP context was opened.
+	// These are counted with relaxed atomics outside the connection lock, and read without it.
+	uint64_t mg_dl_packets, mg_dl_bytes;	// Sent down to the PDP context.
+	uint64_t mg_dl_drops;					// Tossed as duplicates or because the shaper queue was full.
+	uint64_t mg_ul_packets, mg_ul_bytes;	// Written to the tunnel.
+	uint64_t mg_ul_drops;					// Refused by the checks or the shaper queue.
+	LatencyHistogram *mg_dl_delay;			// Time downlink packets waited in the shaper queue; only with shaping.
 } mg_con_t;
 #define MG_CON_DEFINED
 
-unsigned char *miniggsn_rcv_npdu(int *error, int *plen, uint32_t *dstaddr);
 int miniggsn_snd_npdu(PdpContext *pctx,unsigned char *npdu, unsigned len);
 int miniggsn_snd_npdu_by_mgc(mg_con_t *mgp,unsigned char *npdu, unsigned len);
-void miniggsn_handle_read();
+void miniggsn_handle_read(int queue);
+void miniggsn_handle_downlink(unsigned timeoutMs);
+void miniggsn_queue_npdu(mg_con_t *mgp, ByteVector &npdu);
+void miniggsn_handle_uplink(unsigned timeoutMs);
+bool miniggsn_shaping();
+void miniggsn_set_rates(mg_con_t *mgp, unsigned downlink, unsigned uplink);
+void miniggsn_shaper_dump(std::ostream &os);
+int miniggsn_tun_queues();
+int miniggsn_tun_fd(int queue);
+void miniggsn_dump(std::ostream &os);
+int miniggsn_firewall_reload();
+void miniggsn_firewall_dump(std::ostream &os);
 bool miniggsn_init();
 mg_con_t *mg_con_find_free(uint32_t ptmsi, int nsapi);
+mg_con_t *mg_con_find_by_ip(uint32_t addr);
 void mg_con_close(mg_con_t *mgp);
 void mg_con_open(mg_con_t *mgp,PdpContext *pdp);
 
@@ -70,9 +91,18 @@ char *ip_sockaddr2a(void * /*struct sockaddr * */ sap,char *buf);
 int ip_add_addr(char *ifname, int32_t ipaddr, int maskbits);
 const char *ip_proto_name(int ipproto);
 unsigned int ip_checksum(void *ptr, unsigned len, void *dummyhdr);
+uint16_t ip_sum(const void *ptr, unsigned len, uint32_t initial);
+uint16_t ip_csum_replace2(uint16_t check, uint16_t from, uint16_t to);
+uint16_t ip_csum_replace4(uint16_t check, uint32_t from, uint32_t to);
+int ip_tcp_clamp_mss(unsigned char *packet, unsigned len, unsigned mss);
 void ip_hdr_dump(unsigned char *packet, const char *msg);
 int runcmd(const char *path, ...);
-int ip_tun_open(const char *tname, const char *addrstr);
+int ip_tun_open(const char *tname, const char *addrstr, int *fds, int nqueues);
+int ip_tun_read_batch(int fd, unsigned char **buffers, unsigned bufsize, int *lens, int maxpackets);
+struct ip_uring;
+ip_uring *ip_uring_open(unsigned entries);
+void ip_uring_close(ip_uring *ring);
+int ip_tun_write_batch(int fd, ip_uring *ring, unsigned char **packets, const unsigned *lens, int npackets, unsigned *syscalls);
 void ip_init();
 int ip_finddns(uint32_t*);
 uint32_t *ip_findmyaddr();
@@ -96,6 +126,9 @@ extern time_t gGgsnInitTime;
 #define MGERROR(...) {MGLOGF(__VA_ARGS__) char *tmp;if (asprintf(&tmp,__VA_ARGS__)>0){LOG(ERR)<<tmp;free(tmp);}}
 #define MGWARN(...) {MGLOGF(__VA_ARGS__) char *tmp;if (asprintf(&tmp,__VA_ARGS__)>0){LOG(WARNING)<<tmp;free(tmp);}}
 #define MGINFO(...) {MGLOGF(__VA_ARGS__) char *tmp;if (asprintf(&tmp,__VA_ARGS__)>0){LOG(INFO)<<tmp;free(tmp);}}
+// Per-packet trace lines are only formatted when the GGSN log file is open;
+// formatting them for every packet otherwise would cost more than moving the packet.
+#define MGTRACING() (SGSN::mg_log_fp != NULL)
 #define MGINFO2(...) {MGINFO(__VA_ARGS__) \
 	printf(__VA_ARGS__);putchar('\n');fflush(stdout); }
 
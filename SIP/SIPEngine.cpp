@@ -110,7 +110,7 @@ SIPEngine::~SIPEngine()
 	if (mINVITE!=NULL) osip_message_free(mINVITE);
 	if (mLastResponse!=NULL) osip_message_free(mLastResponse);
 	if (mBYE!=NULL) osip_message_free(mBYE);
-	// FIXME -- Do we need to dispose of the RtpSesion *mSesison?
+	closeRTP();
 }
 
 
@@ -738,8 +738,10 @@ void SIPEngine::InitRTP(const osip_message_t * msg )
 		rtp_session_set_send_profile(mSession,profile);
 	}
 
-	rtp_session_set_blocking_mode(mSession, TRUE);
-	rtp_session_set_scheduling_mode(mSession, TRUE);
+	// The media engine paces all sessions from its own 20 ms tick,
+	// so reads and writes must not block on the oRTP scheduler.
+	rtp_session_set_blocking_mode(mSession, FALSE);
+	rtp_session_set_scheduling_mode(mSession, FALSE);
 	rtp_session_set_connected_mode(mSession, TRUE);
 	rtp_session_set_symmetric_rtp(mSession, TRUE);
 	// Hardcode RTP session type to GSM full rate (GSM 06.10).
@@ -843,6 +845,21 @@ int SIPEngine::rxFrame(unsigned char* frame)
 }
 
 
+int SIPEngine::RTPSocket() const
+{
+	if (mSession==NULL) return -1;
+	return rtp_session_get_rtp_socket(mSession);
+}
+
+
+void SIPEngine::closeRTP()
+{
+	if (mSession==NULL) return;
+	rtp_session_destroy(mSession);
+	mSession = NULL;
+}
+
+
 
 
 SIPState SIPEngine::MOSMSSendMESSAGE(const char * wCalledUsername, 
@@ -263,6 +263,12 @@ public:
 	*/
 	int  rxFrame(unsigned char* frame);
 
+	/** Return the RTP socket, or -1 if there is no RTP session yet. */
+	int RTPSocket() const;
+
+	/** Close the RTP session, if any, releasing its sockets. */
+	void closeRTP();
+
 	void MOCInitRTP();
 	void MTCInitRTP();
 
@@ -43,10 +43,21 @@ using namespace Control;
 
 // SIPMessageMap method definitions.
 
+OSIPMessageFIFOMap& SIPMessageMap::shard(const std::string& call_id)
+{
+	// FNV-1a.
+	uint32_t hash = 2166136261U;
+	for (size_t i=0; i<call_id.size(); i++) {
+		hash ^= (unsigned char)call_id[i];
+		hash *= 16777619U;
+	}
+	return mShards[hash % sShards];
+}
+
 void SIPMessageMap::write(const std::string& call_id, osip_message_t * msg)
 {
 	LOG(DEBUG) << "call_id=" << call_id << " msg=" << msg;
-	OSIPMessageFIFO * fifo = mMap.readNoBlock(call_id);
+	OSIPMessageFIFO * fifo = shard(call_id).readNoBlock(call_id);
 	if( fifo==NULL ) {
 		// FIXME -- If this write fails, send "call leg non-existent" response on SIP interface.
 		LOG(NOTICE) << "missing SIP FIFO "<<call_id;
@@ -59,7 +70,7 @@ void SIPMessageMap::write(const std::string& call_id, osip_message_t * msg)
 osip_message_t * SIPMessageMap::read(const std::string& call_id, unsigned readTimeout)
 { 
 	LOG(DEBUG) << "call_id=" << call_id;
-	OSIPMessageFIFO * fifo = mMap.readNoBlock(call_id);
+	OSIPMessageFIFO * fifo = shard(call_id).readNoBlock(call_id);
 	if (!fifo) {
 		LOG(NOTICE) << "missing SIP FIFO "<<call_id;
 		throw SIPError();
@@ -74,15 +85,15 @@ osip_message_t * SIPMessageMap::read(const std::string& call_id, unsigned readTi
 bool SIPMessageMap::add(const std::string& call_id, const struct sockaddr_in* returnAddress)
 {
 	OSIPMessageFIFO * fifo = new OSIPMessageFIFO(returnAddress);
-	mMap.write(call_id, fifo);
+	shard(call_id).write(call_id, fifo);
 	return true;
 }
 
 bool SIPMessageMap::remove(const std::string& call_id)
 {
-	OSIPMessageFIFO * fifo = mMap.readNoBlock(call_id);
+	OSIPMessageFIFO * fifo = shard(call_id).readNoBlock(call_id);
 	if(fifo == NULL) return false;
-	mMap.remove(call_id);
+	shard(call_id).remove(call_id);
 	return true;
 }
 
@@ -95,7 +106,7 @@ bool SIPMessageMap::remove(const std::string& call_id)
 bool SIPInterface::addCall(const string &call_id)
 {
 	LOG(INFO) << "creating SIP message FIFO callID " << call_id;
-	return mSIPMap.add(call_id,mSIPSocket.source());
+	return mSIPMap.add(call_id,&mSource);
 }
 
 
@@ -107,12 +118,22 @@ bool SIPInterface::removeCall(const string &call_id)
 
 int SIPInterface::fifoSize(const std::string& call_id )
 { 
-	OSIPMessageFIFO * fifo = mSIPMap.map().read(call_id,0);
+	OSIPMessageFIFO * fifo = mSIPMap.fifo(call_id);
 	if(fifo==NULL) return -1;
 	return fifo->size();
 }	
 
 
+void SIPInterface::text(ostream& os) const
+{
+	ScopedLock lock(mStatsLock);
+	os << "SIP interface: " << mMessages << " messages in " << mReads << " reads";
+	if (mReads) os << format(", %.2f per read", (double)mMessages/mReads);
+	os << ", max " << mMaxBatch << endl;
+	os << "  parse errors " << mParseErrors << ", dropped for no call ID or FIFO " << mDropped << endl;
+}
+
+
 
 
 
@@ -158,27 +179,92 @@ void SIPInterface::write(const struct sockaddr_in* dest, osip_message_t *msg)
 
 
 
+/**
+	Find the value following a "nonce" or "cnonce" parameter name.
+	@param name Points to the parameter name in the message.
+	@param nameLen Length of the name.
+	@return The alphanumeric run after the name and its '='.
+*/
+static string authValue(const char *name, size_t nameLen)
+{
+	const char *p = name + nameLen;
+	if (*p) p++;
+	const char *q = p;
+	while (isalnum(*q)) { q++; }
+	return string(p, q-p);
+}
+
+
+/**
+	Pick the nonce of a WWW-Authenticate header and the cnonce
+	of an Authentication-Info header out of a raw message in one pass.
+	Like the strcasestr searches this replaces, only the first of each counts,
+	and a first "nonce" that is the tail of a "cnonce" means there is no nonce.
+*/
+static void scanAuthFields(const char *buffer, bool &haveNonce, string &nonce, bool &haveCnonce, string &cnonce)
+{
+	bool nonceDone = false;
+	for (const char *p = buffer; *p; p++) {
+		char c = tolower(*p);
+		if (c=='c' && !haveCnonce && strncasecmp(p,"cnonce",6)==0) {
+			haveCnonce = true;
+			cnonce = authValue(p,6);
+			nonceDone = true;	// the first "nonce" was this one
+			p += 5;
+		} else if (c=='n' && !nonceDone && strncasecmp(p,"nonce",5)==0) {
+			nonceDone = true;
+			haveNonce = true;
+			nonce = authValue(p,5);
+			p += 4;
+		}
+		if (nonceDone && haveCnonce) break;
+	}
+}
+
+
 void SIPInterface::drive() 
 {
 	// All inbound SIP messages go here for processing.
+	// They come in bursts, registrations after a restart for instance,
+	// so take everything that is waiting with one system call.
 
 	LOG(DEBUG) << "blocking on socket";
-	int numRead = mSIPSocket.read(mReadBuffer);
+	char *buffers[sReadBatch];
+	for (unsigned i=0; i<sReadBatch; i++) buffers[i] = mReadBuffers[i];
+	int numRead = mSIPSocket.read(buffers, mReadLengths, mReadSources, sReadBatch);
 	if (numRead<0) {
 		LOG(ALERT) << "cannot read SIP socket.";
 		return;
 	}
-	// FIXME -- Is this +1 offset correct?  Check it.
-	mReadBuffer[numRead] = '\0';
+
+	mStatsLock.lock();
+	mReads++;
+	mMessages += numRead;
+	if ((unsigned)numRead>mMaxBatch) mMaxBatch = numRead;
+	mStatsLock.unlock();
+
+	for (int i=0; i<numRead; i++) {
+		memcpy(&mSource, &mReadSources[i], sizeof(mSource));
+		if (!dispatch(mReadBuffers[i], mReadLengths[i])) {
+			ScopedLock lock(mStatsLock);
+			mDropped++;
+		}
+	}
+}
+
+
+bool SIPInterface::dispatch(char *buffer, size_t length)
+{
+	buffer[length] = '\0';
 
 	// Get the proxy from the inbound message.
 #if 0
-	const struct sockaddr_in* sourceAddr = mSIPSocket.source();
+	const struct sockaddr_in* sourceAddr = &mSource;
 	char msgHost[256];
 	const char* msgHostRet = inet_ntop(AF_INET,&(sourceAddr->sin_addr),msgHost,255);
 	if (!msgHostRet) {
-		LOG(ALERT) << "cannot translate SIP source address for " << mReadBuffer;
-		return;
+		LOG(ALERT) << "cannot translate SIP source address for " << buffer;
+		return false;
 	}
 	unsigned msgPortNumber = sourceAddr->sin_port;
 	char msgPort[20];
@@ -186,10 +272,12 @@ void SIPInterface::drive()
 	string proxy = string(msgHost) + string(":") + string(msgPort);
 #endif
 
-	char firstLine[101];
-	sscanf(mReadBuffer,"%100[^\n]",firstLine);
-	LOG(INFO) << "read " << firstLine;
-	LOG(DEBUG) << "read " << mReadBuffer;
+	if (IS_LOG_LEVEL(INFO)) {
+		char firstLine[101];
+		sscanf(buffer,"%100[^\n]",firstLine);
+		LOG(INFO) << "read " << firstLine;
+		LOG(DEBUG) << "read " << buffer;
+	}
 
 
 	try {
@@ -197,20 +285,23 @@ void SIPInterface::drive()
 		// Parse the mesage.
 		osip_message_t * msg;
 		int i = osip_message_init(&msg);
-		LOG(INFO) << "osip_message_init " << i;
-		int j = osip_message_parse(msg, mReadBuffer, strlen(mReadBuffer));
+		LOG(DEBUG) << "osip_message_init " << i;
+		int j = osip_message_parse(msg, buffer, length);
 		// seems like it ought to do something more than display an error,
 		// but it used to not even do that.
-		LOG(INFO) << "osip_message_parse " << j;
+		if (j) {
+			LOG(INFO) << "osip_message_parse " << j;
+			ScopedLock lock(mStatsLock);
+			mParseErrors++;
+		}
+
+		bool haveNonce = false, haveCnonce = false;
+		string RAND, kc;
+		scanAuthFields(buffer, haveNonce, RAND, haveCnonce, kc);
 
 		// heroic efforts to get it to parse the www-authenticate header failed,
 		// so we'll just crowbar that sucker in.
-		char *p = strcasestr(mReadBuffer, "nonce");
-		if (p && p[-1] != 'c') { // nonce but not cnonce
-			p += 6;
-			char *q = p;
-			while (isalnum(*q)) { q++; }
-			string RAND = string(mReadBuffer, p-mReadBuffer, q-p);
+		if (haveNonce) {
 			LOG(INFO) << "crowbar www-authenticate " << RAND;
 			osip_www_authenticate_t *auth;
 			osip_www_authenticate_init(&auth);
@@ -223,12 +314,7 @@ void SIPInterface::drive()
 
 		// The parser doesn't seem to be interested in authentication info either.
 		// Get kc from there and put it in tmsi table.
-		char *pp = strcasestr(mReadBuffer, "cnonce");
-		if (pp) {
-			pp += 7;
-			char *qq = pp;
-			while (isalnum(*qq)) { qq++; } 
-			string kc = string(mReadBuffer, pp-mReadBuffer, qq-pp);
+		if (haveCnonce) {
 			LOG(INFO) << "storing kc in TMSI table";  // mustn't display kc in log
 			const char *imsi = osip_uri_get_username(msg->to->url);
 			if (imsi && strlen(imsi) > 0) {
@@ -267,9 +353,11 @@ void SIPInterface::drive()
 		string call_num(call_id_num);
 		// Don't free msg.  Whoever reads the FIFO will do that.
 		mSIPMap.write(call_num, msg);
+		return true;
 	}
 	catch(SIPException) {
-		LOG(WARNING) << "cannot parse SIP message: " << mReadBuffer;
+		LOG(WARNING) << "cannot parse SIP message: " << buffer;
+		return false;
 	}
 }
 
@@ -376,7 +464,7 @@ bool SIPInterface::checkInvite( osip_message_t * msg)
 	}
 
 	// Check SIP map.  Repeated entry?  Page again.
-	if (mSIPMap.map().readNoBlock(callIDNum) != NULL) { 
+	if (mSIPMap.fifo(callIDNum) != NULL) { 
 		TransactionEntry* transaction= gTransactionTable.find(mobileID,callIDNum);
 		// There's a FIFO but no trasnaction record?
 		if (!transaction) {
@@ -80,13 +80,20 @@ std::ostream& operator<<(std::ostream& os, const OSIPMessageFIFO& m);
 	A Map the keeps a SIP message FIFO for each active SIP transaction.
 	Keyed by SIP call ID string.
 	Overall map is thread-safe.  Each FIFO is also thread-safe.
+	The call IDs are hashed over several independently locked maps,
+	so the drive thread dispatching a message does not wait behind the
+	call control threads adding, reading and removing FIFOs for other calls.
 */
 class SIPMessageMap 
 {
 
 private:
 
-	OSIPMessageFIFOMap mMap;
+	static const unsigned sShards = 16;
+	OSIPMessageFIFOMap mShards[sShards];
+
+	/** The map that holds, or would hold, this call ID. */
+	OSIPMessageFIFOMap& shard(const std::string& call_id);
 
 public:
 
@@ -106,9 +113,9 @@ public:
 	*/
 	bool remove(const std::string& call_id);
 
-	/** Direct access to the map. */
-	// FIXME -- This should probably be replaced with more specific methods.
-	OSIPMessageFIFOMap& map() {return mMap;}
+	/** Return the FIFO for a call ID, or NULL if there is none. */
+	OSIPMessageFIFO* fifo(const std::string& call_id)
+		{ return shard(call_id).readNoBlock(call_id); }
 
 };
 
@@ -122,7 +129,12 @@ class SIPInterface
 
 private:
 
-	char mReadBuffer[2048];		///< buffer for UDP reads
+	static const unsigned sReadBatch = 16;		///< most datagrams taken per socket read
+
+	char mReadBuffers[sReadBatch][MAX_UDP_LENGTH+1];	///< buffers for UDP reads, +1 for the terminator
+	int mReadLengths[sReadBatch];
+	struct sockaddr_storage mReadSources[sReadBatch];
+	struct sockaddr_in mSource;		///< return address of the message being dispatched
 
 	UDPSocket mSIPSocket;
 
@@ -130,6 +142,19 @@ private:
 	Thread mDriveThread;	
 	SIPMessageMap mSIPMap;	
 
+	/**@name Statistics, guarded by mStatsLock. */
+	//@{
+	mutable Mutex mStatsLock;
+	unsigned long mReads;			///< socket reads that returned messages
+	unsigned long mMessages;
+	unsigned mMaxBatch;				///< most messages returned by one read
+	unsigned long mParseErrors;
+	unsigned long mDropped;			///< messages with no call ID or no FIFO for it
+	//@}
+
+	/** Parse and dispatch one SIP message; returns false if it was dropped. */
+	bool dispatch(char *buffer, size_t length);
+
 public:
 	// 2 ways to starte sip interface. 
 	// Ex 1.
@@ -145,14 +170,15 @@ public:
 		Create the SIP interface to watch for incoming SIP messages.
 	*/
 	SIPInterface()
-		:mSIPSocket(gConfig.getNum("SIP.Local.Port"))
-	{ }
+		:mSIPSocket(gConfig.getNum("SIP.Local.Port")),
+		mReads(0),mMessages(0),mMaxBatch(0),mParseErrors(0),mDropped(0)
+	{ memset(&mSource,0,sizeof(mSource)); }
 
 	
 	/** Start the SIP drive loop. */
 	void start();
 
-	/** Receive, parse and dispatch a single SIP message. */
+	/** Receive a batch of SIP messages, and parse and dispatch each one. */
 	void drive();
 
 	/**
@@ -185,6 +211,9 @@ public:
 
 	int fifoSize(const std::string& call_id );
 
+	/** Print the receive counters. */
+	void text(std::ostream&) const;
+
 };
 
 void driveLoop(SIPInterface*);
@@ -335,7 +335,8 @@ void asnLogMsg(unsigned rbid, ASN::asn_TYPE_descriptor_t *asnp, const void *stru
 	UEInfo *uep,		// Or NULL if none.
 	uint32_t urnti)		// If uep is NULL, put this in the log instead.
 {
-	int debug = gConfig.getNum("UMTS.Debug.Messages");
+	static const ConfigurationNum debugMessages(gConfig,"UMTS.Debug.Messages");
+	int debug = debugMessages.get();
 	if (debug || IS_LOG_LEVEL(INFO)) {
 		// This C++ IO paradigm is so crappy.
 		std::string readable = asn2string(asnp,struct_ptr);
@@ -348,6 +349,116 @@ void asnLogMsg(unsigned rbid, ASN::asn_TYPE_descriptor_t *asnp, const void *stru
 	}
 }
 
+// Copy len bits starting at bit from in src onto the end of dst.
+static void appendBits(ByteVector &dst, const ByteVector &src, unsigned from, unsigned len)
+{
+	for (; len >= 32; from += 32, len -= 32) { dst.appendField(src.getField(from,32),32); }
+	if (len) { dst.appendField(src.getField(from,len),len); }
+}
+
+static bool bitsEqual(const ByteVector &a, unsigned aoff, const ByteVector &b, unsigned boff, unsigned len)
+{
+	for (; len >= 32; aoff += 32, boff += 32, len -= 32) {
+		if (a.getField(aoff,32) != b.getField(boff,32)) { return false; }
+	}
+	return len == 0 || a.getField(aoff,len) == b.getField(boff,len);
+}
+
+static unsigned firstDiffBit(const ByteVector &a, const ByteVector &b)
+{
+	unsigned len = min(a.sizeBits(),b.sizeBits());
+	unsigned pos = 0;
+	for (; pos < len && a.getField(pos,1) == b.getField(pos,1); pos++) { continue; }
+	return pos;
+}
+
+bool AsnMsgTemplate::build(Builder &builder, unsigned numFields, const unsigned *widths)
+{
+	mValid = false;
+	if (numFields > sMaxFields) { return false; }
+	mNumFields = numFields;
+	uint32_t values[sMaxFields];
+	memset(values,0,sizeof(values));
+	const ByteVector *spliceRefs = builder.spliceRefs();	// First, the builder may need it for the probes.
+	mBits = ByteVector(1000);
+	if (!builder.encodeProbe(values,0,mBits)) { return false; }
+
+	if ((mSplice = (spliceRefs != NULL))) {
+		ByteVector alt(1000);
+		if (!builder.encodeProbe(values,1,alt)) { return false; }
+		unsigned lena = spliceRefs[0].sizeBits(), lenb = spliceRefs[1].sizeBits();
+		if (mBits.sizeBits() < lena || alt.sizeBits() < lenb) { return false; }
+		unsigned rest = mBits.sizeBits() - lena;
+		if (rest != alt.sizeBits() - lenb) { return false; }
+		// The two messages are identical before the splice, so it starts at or before the first difference.
+		unsigned matches = 0, limit = firstDiffBit(mBits,alt);
+		for (unsigned at = 0; at <= limit && at <= rest; at++) {
+			if (bitsEqual(mBits,at,spliceRefs[0],0,lena) && bitsEqual(alt,at,spliceRefs[1],0,lenb) &&
+				bitsEqual(mBits,at+lena,alt,at+lenb,rest-at)) {
+				matches++;
+				mSpliceAt = at;
+			}
+		}
+		if (matches != 1) { return false; }	// Not found or ambiguous.
+		mSpliceLen = lena;
+	}
+
+	for (unsigned f = 0; f < numFields; f++) {
+		unsigned width = widths[f];
+		if (width == 0 || width > 32) { return false; }
+		uint32_t ones = width == 32 ? 0xffffffff : (1u << width) - 1;
+		values[f] = ones;
+		ByteVector probe(1000);
+		bool ok = builder.encodeProbe(values,0,probe);
+		values[f] = 0;
+		if (!ok || probe.sizeBits() != mBits.sizeBits()) { return false; }
+		unsigned offset = firstDiffBit(mBits,probe);
+		if (offset + width > mBits.sizeBits()) { return false; }
+		if (mSplice && offset + width > mSpliceAt && offset < mSpliceAt + mSpliceLen) { return false; }
+		ByteVector expected;
+		expected.clone(mBits);	// Not a copy constructor, which would share the memory.
+		expected.setSizeBits(mBits.sizeBits());
+		expected.setField(offset,ones,width);
+		if (!expected.eql(probe)) { return false; }
+		mWidth[f] = width;
+		mOffset[f] = offset;
+	}
+	mValid = true;
+	return true;
+}
+
+bool AsnMsgTemplate::fill(const uint32_t *fieldValues, ByteVector &result, const ByteVector *splice) const
+{
+	assert(mValid && (splice != NULL) == mSplice);
+	int shift = 0;
+	if (!mSplice) {
+		if (mBits.size() > result.allocSize()) { return false; }
+		memcpy(result.begin(),mBits.begin(),mBits.size());
+		result.setSizeBits(mBits.sizeBits());
+	} else {
+		shift = (int)splice->sizeBits() - (int)mSpliceLen;
+		unsigned total = mBits.sizeBits() + shift;
+		if ((total+7)/8 > result.allocSize()) { return false; }
+		// Zero it first so the fill bits in the last byte are the same as the encoder would produce.
+		memset(result.begin(),0,(total+7)/8);
+		result.setAppendP(0);
+		appendBits(result,mBits,0,mSpliceAt);
+		appendBits(result,*splice,0,splice->sizeBits());
+		appendBits(result,mBits,mSpliceAt+mSpliceLen,mBits.sizeBits()-mSpliceAt-mSpliceLen);
+	}
+	for (unsigned f = 0; f < mNumFields; f++) {
+		unsigned offset = mOffset[f] < mSpliceAt ? mOffset[f] : mOffset[f] + shift;
+		result.setField(offset,fieldValues[f],mWidth[f]);
+	}
+	return true;
+}
+
+void AsnMsgTemplate::setField(ByteVector &result, unsigned field, uint32_t value) const
+{
+	assert(mValid && !mSplice && field < mNumFields);
+	result.setField(mOffset[field],value,mWidth[field]);
+}
+
 //void AsnBitString::finish(ASN::BIT_STRING_t *ptr)
 //{
 //	if (ptr->bits_unused) setSizeBits(ptr->size*8 - ptr->bits_unused);
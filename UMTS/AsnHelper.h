@@ -139,6 +139,47 @@ struct AsnSeqOfDigit2BV : public ByteVector {
 	AsnSeqOfDigit2BV(void*list); // The argument must be ASN::A_SEQUENCE_OF(Digit_t) or equivalent.
 };
 
+// A PER encoded message used as a template.  The message is encoded once, then the few fixed width
+// fields that vary per UE (transaction id, RNTIs, codes) are patched in at their bit offsets.
+// Optionally one variable length item, the InitialUE_Identity, is spliced in, moving everything after it.
+// The offsets are not computed from the ASN description, they are found by encoding the message with
+// each field set to all ones and checking that exactly those bits changed, so if a field does not have a
+// fixed position and width the template is marked invalid and the caller must encode from scratch.
+// Field values are encoded as-is, so the fields must be BIT STRINGs or INTEGERs with a lower bound of 0.
+class AsnMsgTemplate
+{
+	public:
+	static const unsigned sMaxFields = 8;
+
+	// The caller provides the encoder for the probes.  If the template has a splice,
+	// spliceRefs returns the stand-alone encodings of two reference values for the spliced item,
+	// and variant selects which one the probe uses.
+	struct Builder {
+		virtual bool encodeProbe(const uint32_t *fieldValues, unsigned variant, ByteVector &result) = 0;
+		virtual const ByteVector *spliceRefs() { return NULL; }
+		virtual ~Builder() {}
+	};
+
+	private:
+	ByteVector mBits;		// The message encoded with all fields 0 and splice reference 0.
+	unsigned mNumFields;
+	unsigned mWidth[sMaxFields];
+	unsigned mOffset[sMaxFields];
+	bool mSplice;
+	unsigned mSpliceAt, mSpliceLen;	// Position and size of the splice reference 0 in mBits.
+	bool mValid;
+
+	public:
+	AsnMsgTemplate() : mNumFields(0), mSplice(false), mSpliceAt(0), mSpliceLen(0), mValid(false) {}
+	bool build(Builder &builder, unsigned numFields, const unsigned *widths);
+	bool valid() const { return mValid; }
+	// Write the message with these field values and splice item into result, which must be large enough.
+	// Return false if it is not.
+	bool fill(const uint32_t *fieldValues, ByteVector &result, const ByteVector *splice = NULL) const;
+	// Patch one field of a message previously filled without a splice.
+	void setField(ByteVector &result, unsigned field, uint32_t value) const;
+};
+
 }; // namespace UMTS
 
 #endif
@@ -14,6 +14,7 @@
 
 #include <stdint.h>
 #include "ByteVector.h"
+#include "Kasumi.h"
 
 // This is the algorithm as defined in the spec.
 uint32_t AlgorithmF9( uint8_t *key, int count, int fresh, int dir, uint8_t *data, int length );
@@ -49,6 +50,16 @@ class IntegrityProtect
 
 	uint32_t mFresh;	// Yet another random number chosen by RRC.
 	uint32_t mStart;	// 20-bit init value for RRC HFN.
+
+	// Ciphering with UEA1, 33.102 6.6.  For GSM subscribers CK = Kc . Kc; see setKc().
+	// The RLC applies it to AM and UM pdus, each entity from its own activation SN,
+	// and MAC-d applies it to TM pdus on DCH from the activation CFN; see tmCipher().
+	KasumiF8 mCipher;
+	bool mCipheringStarted;
+	unsigned mTmActivationCfn;
+	bool mTmCipherActive[2];	// Indexed by direction, 1 = downlink.
+	uint32_t mTmHfn[2];			// 24 bit HFN for TM COUNT-C = HFN . CFN
+	unsigned mTmLastCfn[2];
 	public:
 	uint32_t getStart() { return mStart; }
 	uint32_t getFresh() { return mFresh; }
@@ -81,11 +92,23 @@ class IntegrityProtect
 	// are goint to set the integrityStarted variable immediately instead of waiting for the
 	// IntegrityModeComplete from the UE.  TODO: That may not be right, in case we have to rerun something.
 	void integrityStart() { initIntegrity(); mIntegrityStarted = true; }
-	void integrityStop() { mIntegrityStarted = false; }
+	void integrityStop() { mIntegrityStarted = false; cipheringStop(); }
 	bool isStarted() { return mIntegrityStarted; }	// Is security mode started?
 
+	// Ciphering is started when the SecurityModeCommand including the CipheringModeInfo is sent,
+	// and stopped with integrity protection.
+	void cipheringStart(unsigned tmActivationCfn);
+	void cipheringStop() { mCipheringStarted = false; }
+	bool isCipheringStarted() const { return mCipheringStarted; }
+	// Cipher or decipher length bits of an RLC pdu on radio bearer rbid.
+	void runF8(unsigned rbid, bool downlink, uint32_t count, uint8_t *data, unsigned length) const {
+		mCipher.run(count,rbid-1,downlink,data,length);	// 33.102 6.6.4.1: BEARER is the RB identity - 1.
+	}
+	void tmCipher(unsigned rbid, bool downlink, unsigned cfn, uint8_t *data, unsigned length);
+
 	protected: void _initIntegrityProtect() {
 		mIntegrityStarted = false;	// Not started yet.
+		mCipheringStarted = false;
 		mStart = 0;	// A fine place to start.
 		mFresh = 1;	// A fine random number.
 	}
@@ -0,0 +1,336 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "Kasumi.h"
+#include "Timeval.h"
+
+// 35.202 sec 4.5: S-boxes.
+static const uint16_t S7[128] = {
+	54, 50, 62, 56, 22, 34, 94, 96, 38, 6, 63, 93, 2, 18,123, 33,
+	55,113, 39,114, 21, 67, 65, 12, 47, 73, 46, 27, 25,111,124, 81,
+	53, 9,121, 79, 52, 60, 58, 48,101,127, 40,120,104, 70, 71, 43,
+	20,122, 72, 61, 23,109, 13,100, 77, 1, 16, 7, 82, 10,105, 98,
+	117,116, 76, 11, 89,106, 0,125,118, 99, 86, 69, 30, 57,126, 87,
+	112, 51, 17, 5, 95, 14, 90, 84, 91, 8, 35,103, 32, 97, 28, 66,
+	102, 31, 26, 45, 75, 4, 85, 92, 37, 74, 80, 49, 68, 29,115, 44,
+	64,107,108, 24,110, 83, 36, 78, 42, 19, 15, 41, 88,119, 59, 3};
+static const uint16_t S9[512] = {
+	167,239,161,379,391,334, 9,338, 38,226, 48,358,452,385, 90,397,
+	183,253,147,331,415,340, 51,362,306,500,262, 82,216,159,356,177,
+	175,241,489, 37,206, 17, 0,333, 44,254,378, 58,143,220, 81,400,
+	 95, 3,315,245, 54,235,218,405,472,264,172,494,371,290,399, 76,
+	165,197,395,121,257,480,423,212,240, 28,462,176,406,507,288,223,
+	501,407,249,265, 89,186,221,428,164, 74,440,196,458,421,350,163,
+	232,158,134,354, 13,250,491,142,191, 69,193,425,152,227,366,135,
+	344,300,276,242,437,320,113,278, 11,243, 87,317, 36, 93,496, 27,
+	487,446,482, 41, 68,156,457,131,326,403,339, 20, 39,115,442,124,
+	475,384,508, 53,112,170,479,151,126,169, 73,268,279,321,168,364,
+	363,292, 46,499,393,327,324, 24,456,267,157,460,488,426,309,229,
+	439,506,208,271,349,401,434,236, 16,209,359, 52, 56,120,199,277,
+	465,416,252,287,246, 6, 83,305,420,345,153,502, 65, 61,244,282,
+	173,222,418, 67,386,368,261,101,476,291,195,430, 49, 79,166,330,
+	280,383,373,128,382,408,155,495,367,388,274,107,459,417, 62,454,
+	132,225,203,316,234, 14,301, 91,503,286,424,211,347,307,140,374,
+	 35,103,125,427, 19,214,453,146,498,314,444,230,256,329,198,285,
+	 50,116, 78,410, 10,205,510,171,231, 45,139,467, 29, 86,505, 32,
+	 72, 26,342,150,313,490,431,238,411,325,149,473, 40,119,174,355,
+	185,233,389, 71,448,273,372, 55,110,178,322, 12,469,392,369,190,
+	  1,109,375,137,181, 88, 75,308,260,484, 98,272,370,275,412,111,
+	336,318, 4,504,492,259,304, 77,337,435, 21,357,303,332,483, 18,
+	 47, 85, 25,497,474,289,100,269,296,478,270,106, 31,104,433, 84,
+	414,486,394, 96, 99,154,511,148,413,361,409,255,162,215,302,201,
+	266,351,343,144,441,365,108,298,251, 34,182,509,138,210,335,133,
+	311,352,328,141,396,346,123,319,450,281,429,228,443,481, 92,404,
+	485,422,248,297, 23,213,130,466, 22,217,283, 70,294,360,419,127,
+	312,377, 7,468,194, 2,117,295,463,258,224,447,247,187, 80,398,
+	284,353,105,390,299,471,470,184, 57,200,348, 63,204,188, 33,451,
+	 97, 30,310,219, 94,160,129,493, 64,179,263,102,189,207,114,402,
+	438,477,387,122,192, 42,381, 5,145,118,180,449,293,323,136,380,
+	 43, 66, 60,455,341,445,202,432, 8,237, 15,376,436,464, 59,461};
+
+// FI (35.202 4.3.2) is two identical half rounds around the KI subkey xor:
+//		nine = S9[nine] ^ seven; seven = S7[seven] ^ (nine & 0x7f);
+// Keeping the 16 bit state as (nine<<7 | seven), which is the input layout, the subkey xor
+// becomes a single xor with the subkey rotated left 7, which is done once in the key schedule.
+// Fusing each half round into a 64K-entry table was tried and measured slower: the 256KB of
+// tables miss in cache on every lookup, whereas S7 and S9 fit in 1.25KB.
+static inline uint16_t rol16(uint16_t a, unsigned b) { return (uint16_t)((a << b) | (a >> (16-b))); }
+static inline uint16_t FI(uint16_t in, uint16_t subkey)
+{
+	unsigned nine = in >> 7, seven = in & 0x7f;
+	nine = S9[nine] ^ seven;
+	seven = S7[seven] ^ (nine & 0x7f);
+	unsigned x = ((nine << 7) | seven) ^ subkey;
+	nine = x >> 7; seven = x & 0x7f;
+	nine = S9[nine] ^ seven;
+	seven = S7[seven] ^ (nine & 0x7f);
+	return (uint16_t)((seven << 9) | nine);
+}
+
+static inline uint64_t load64(const uint8_t *p)
+{
+	return ((uint64_t)p[0]<<56) | ((uint64_t)p[1]<<48) | ((uint64_t)p[2]<<40) | ((uint64_t)p[3]<<32) |
+		((uint64_t)p[4]<<24) | ((uint64_t)p[5]<<16) | ((uint64_t)p[6]<<8) | (uint64_t)p[7];
+}
+static inline void store64(uint8_t *p, uint64_t v)
+{
+	for (int i = 7; i >= 0; i--) { p[i] = (uint8_t)v; v >>= 8; }
+}
+
+// 35.202 4.4: the key schedule.
+void Kasumi::setKey(const uint8_t *k)
+{
+	static const uint16_t C[8] = { 0x0123,0x4567,0x89AB,0xCDEF, 0xFEDC,0xBA98,0x7654,0x3210 };
+	uint16_t key[8], Kprime[8];
+	for (int n = 0; n < 8; n++) {
+		key[n] = (uint16_t)((k[2*n] << 8) | k[2*n+1]);
+		Kprime[n] = key[n] ^ C[n];
+	}
+	for (int n = 0; n < 8; n++) {
+		mKL1[n] = rol16(key[n],1);
+		mKL2[n] = Kprime[(n+2)&0x7];
+		mKO1[n] = rol16(key[(n+1)&0x7],5);
+		mKO2[n] = rol16(key[(n+5)&0x7],8);
+		mKO3[n] = rol16(key[(n+6)&0x7],13);
+		mKI1[n] = rol16(Kprime[(n+4)&0x7],7);
+		mKI2[n] = rol16(Kprime[(n+3)&0x7],7);
+		mKI3[n] = rol16(Kprime[(n+7)&0x7],7);
+	}
+}
+
+// 35.202 4.3.1
+inline uint32_t Kasumi::FO(uint32_t in, int index) const
+{
+	uint16_t left = (uint16_t)(in >> 16), right = (uint16_t)in;
+	left = FI(left ^ mKO1[index], mKI1[index]) ^ right;
+	right = FI(right ^ mKO2[index], mKI2[index]) ^ left;
+	left = FI(left ^ mKO3[index], mKI3[index]) ^ right;
+	return ((uint32_t)right << 16) | left;
+}
+
+// 35.202 4.3.3
+inline uint32_t Kasumi::FL(uint32_t in, int index) const
+{
+	uint16_t l = (uint16_t)(in >> 16), r = (uint16_t)in;
+	r ^= rol16(l & mKL1[index],1);
+	l ^= rol16(r | mKL2[index],1);
+	return ((uint32_t)l << 16) | r;
+}
+
+// 35.202 4.1: eight rounds, with FL and FO swapped in the even rounds.
+uint64_t Kasumi::encrypt(uint64_t block) const
+{
+	uint32_t left = (uint32_t)(block >> 32), right = (uint32_t)block;
+	for (int n = 0; n < 8; n += 2) {
+		right ^= FO(FL(left,n),n);
+		left ^= FL(FO(right,n+1),n+1);
+	}
+	return ((uint64_t)left << 32) | right;
+}
+
+void KasumiF8::setKey(const uint8_t *ck)
+{
+	uint8_t km[16];
+	for (int n = 0; n < 16; n++) { km[n] = ck[n] ^ 0x55; }
+	mK.setKey(ck);
+	mKM.setKey(km);
+}
+
+// 35.201 3.4: A = KASUMI[CK xor KM](COUNT . BEARER . DIRECTION . 0...), then
+// KSB[n] = KASUMI[CK](A xor BLKCNT xor KSB[n-1]) with BLKCNT = n-1 and KSB[0] = 0.
+void KasumiF8::run(uint32_t count, unsigned bearer, unsigned dir, uint8_t *data, unsigned length) const
+{
+	uint64_t A = mKM.encrypt(((uint64_t)count << 32) | ((uint64_t)(bearer & 0x1f) << 27) | ((uint64_t)(dir & 1) << 26));
+	uint64_t ksb = 0;
+	for (uint64_t blkcnt = 0; length; blkcnt++) {
+		ksb = mK.encrypt(A ^ blkcnt ^ ksb);
+		if (length >= 64) {
+			store64(data, load64(data) ^ ksb);
+			data += 8;
+			length -= 64;
+		} else {
+			for (unsigned n = 0; length; n++) {
+				uint8_t ks = (uint8_t)(ksb >> (56 - 8*n));
+				if (length < 8) { ks &= (uint8_t)(0xff << (8 - length)); length = 0; } else { length -= 8; }
+				data[n] ^= ks;
+			}
+		}
+	}
+}
+
+void kasumiF8(const uint8_t *ck, uint32_t count, unsigned bearer, unsigned dir, uint8_t *data, unsigned length)
+{
+	KasumiF8 f8;
+	f8.setKey(ck);
+	f8.run(count,bearer,dir,data,length);
+}
+
+// 35.201 4.4: KASUMI in CBC-MAC mode over COUNT . FRESH . MESSAGE . DIRECTION . 1 . 0-padding,
+// with the XOR of all the outputs run once more under IK xor 0xAAAA...  Result is the left 32 bits.
+uint32_t kasumiF9(const uint8_t *ik, uint32_t count, uint32_t fresh, unsigned dir, const uint8_t *data, unsigned length)
+{
+	Kasumi k(ik);
+	uint64_t A = k.encrypt(((uint64_t)count << 32) | fresh);
+	uint64_t B = A;
+	for (; length >= 64; length -= 64, data += 8) {
+		A = k.encrypt(A ^ load64(data));
+		B ^= A;
+	}
+
+	// The final block holds the remaining message bits followed by the direction bit and a 1 bit.
+	// If the message leaves room for only the direction bit, the 1 bit starts another block.
+	uint64_t last = 0;
+	for (unsigned n = 0; 8*n < length; n++) { last |= (uint64_t)data[n] << (56 - 8*n); }
+	if (length) { last &= ~(uint64_t)0 << (64 - length); }
+	last |= (uint64_t)(dir & 1) << (63 - length);
+	if (length == 63) {
+		A = k.encrypt(A ^ last);
+		B ^= A;
+		last = (uint64_t)1 << 63;
+	} else {
+		last |= (uint64_t)1 << (62 - length);
+	}
+	A = k.encrypt(A ^ last);
+	B ^= A;
+
+	uint8_t modkey[16];
+	for (int n = 0; n < 16; n++) { modkey[n] = ik[n] ^ 0xAA; }
+	Kasumi km(modkey);
+	return (uint32_t)(km.encrypt(B) >> 32);
+}
+
+static void kasumiHex(const char *hex, uint8_t *out)
+{
+	for (unsigned n = 0; hex[2*n]; n++) {
+		unsigned val;
+		sscanf(hex+2*n,"%2x",&val);
+		out[n] = val;
+	}
+}
+
+// 35.201 4.4 f9 taken literally, one bit at a time: PS = COUNT . FRESH . MESSAGE . DIRECTION . 1 . 0-padding
+// to a whole number of blocks, A = KASUMI[IK](A xor PS[i]), B = B xor A, MAC-I = left half of KASUMI[IK xor KM](B).
+// Shares only the KASUMI core with kasumiF9, which the 35.203 KASUMI set checks.
+static uint32_t kasumiF9Reference(const uint8_t *ik, uint32_t count, uint32_t fresh, unsigned dir, const uint8_t *data, unsigned length)
+{
+	uint8_t ps[80];
+	unsigned bits = 0;
+	memset(ps,0,sizeof(ps));
+	for (int i = 31; i >= 0; i--, bits++) { ps[bits/8] |= ((count >> i) & 1) << (7 - bits%8); }
+	for (int i = 31; i >= 0; i--, bits++) { ps[bits/8] |= ((fresh >> i) & 1) << (7 - bits%8); }
+	for (unsigned i = 0; i < length; i++, bits++) { ps[bits/8] |= ((data[i/8] >> (7 - i%8)) & 1) << (7 - bits%8); }
+	ps[bits/8] |= (dir & 1) << (7 - bits%8); bits++;
+	ps[bits/8] |= 1 << (7 - bits%8); bits++;
+	unsigned blocks = (bits + 63) / 64;
+
+	Kasumi k(ik);
+	uint64_t A = 0, B = 0;
+	for (unsigned i = 0; i < blocks; i++) {
+		A = k.encrypt(A ^ load64(ps + 8*i));
+		B ^= A;
+	}
+	uint8_t modkey[16];
+	for (int n = 0; n < 16; n++) { modkey[n] = ik[n] ^ 0xAA; }
+	return (uint32_t)(Kasumi(modkey).encrypt(B) >> 32);
+}
+
+// Run f8 on a 35.203 test set and compare the whole output; bits past the length are not compared.
+static bool kasumiF8Check(const char *key, uint32_t count, unsigned bearer, unsigned dir, unsigned length, const char *in, const char *out)
+{
+	uint8_t ck[16], data[128], want[128];
+	kasumiHex(key,ck);
+	kasumiHex(in,data);
+	kasumiHex(out,want);
+	kasumiF8(ck,count,bearer,dir,data,length);
+	unsigned whole = length / 8;
+	if (memcmp(data,want,whole)) { return false; }
+	uint8_t mask = (uint8_t)(0xff << (8 - length%8));
+	return length%8 == 0 || ((data[whole] ^ want[whole]) & mask) == 0;
+}
+
+unsigned kasumiSelfTest(std::ostream &os, unsigned benchBytes)
+{
+	unsigned failures = 0;
+	uint8_t key[16], buf[8];
+
+	// 35.203 KASUMI test set 1.
+	kasumiHex("2BD6459F82C5B300952C49104881FF48",key);
+	kasumiHex("EA024714AD5C4D84",buf);
+	uint64_t ct = Kasumi(key).encrypt(load64(buf));
+	bool ok = ct == 0xDF1F9B251C0BF45FULL;
+	os << "kasumi test set 1: " << (ok ? "ok" : "FAILED") << "\n";
+	failures += !ok;
+
+	// 35.203 f8 test sets 1 and 2, the whole message.
+	ok = kasumiF8Check("2BD6459F82C5B300952C49104881FF48",0x72A4F20F,0x0C,1,798,
+		"7EC61272743BF1614726446A6C38CED166F6CA76EB5430044286346CEF130F92"
+		"922B03450D3A9975E5BD2EA0EB55AD8E1B199E3EC4316020E9A1B285E7627953"
+		"59B7BDFD39BEF4B2484583D5AFE082AEE638BF5FD5A606193901A08F4AB41AAB"
+		"9B134880",
+		"D1E2DE70EEF86C6964FB542BC2D460AABFAA10A4A093262B7D199E706FC2D489"
+		"1553296910F3A973012682E41C4E2B02BE2017B7253BBF9309DE5819CB42E819"
+		"56F4C99BC9765CAF53B1D0BB8279826ADBBC5522E915C120A618A5A7F5E89708"
+		"9339650F");
+	os << "f8 test set 1: " << (ok ? "ok" : "FAILED") << "\n";
+	failures += !ok;
+	ok = kasumiF8Check("EFA8B2229E720C2A7C36EA55E9605695",0xE28BCF7B,0x18,0,510,
+		"10111231E060253A43FD3F57E37607AB2827B599B6B1BBDA37A8ABCC5A8C550D"
+		"1BFB2F494624FB50367FA36CE3BC68F11CF93B1510376B02130F812A9FA169D8",
+		"3DEACC7C15821CAA89EECADE9B5BD3614BD0C8419D710385DDBE5849EF1BAC5A"
+		"E8B14A5B0A6741521EB4E00BB9ECF3E9F7CCB9CAE74152D7F4E2A034B6EA00EC");
+	os << "f8 test set 2: " << (ok ? "ok" : "FAILED") << "\n";
+	failures += !ok;
+
+	// f9 against the bit serial reference at every length up to 8 blocks, which covers the
+	// n*64-1 case where the padding 1 bit starts its own block, and both directions.
+	uint8_t msg[64];
+	for (unsigned n = 0; n < sizeof(msg); n++) { msg[n] = (uint8_t)(0x33 + 7*n*n); }
+	unsigned f9bad = 0;
+	for (unsigned length = 1; length <= 8*sizeof(msg); length++) {
+		unsigned dir = length & 1;
+		if (kasumiF9(key,0x38A6F056,0x05D2EC49,dir,msg,length) != kasumiF9Reference(key,0x38A6F056,0x05D2EC49,dir,msg,length)) {
+			if (!f9bad) { os << "f9 length " << length << " differs from reference\n"; }
+			f9bad++;
+		}
+	}
+	os << "f9 lengths 1-" << 8*sizeof(msg) << ": " << (f9bad ? "FAILED" : "ok") << "\n";
+	failures += f9bad != 0;
+
+	// Benchmark f8 on 1500 byte PDUs and f9 on 100 byte RRC messages.
+	if (benchBytes) {
+		KasumiF8 f8;
+		f8.setKey(key);
+		uint8_t pdu[1500];
+		memset(pdu,0x5a,sizeof(pdu));
+		unsigned cnt = benchBytes / sizeof(pdu) + 1;
+		Timeval start;
+		for (unsigned n = 0; n < cnt; n++) { f8.run(n,5,1,pdu,8*sizeof(pdu)); }
+		long ms = start.elapsed();
+		os << "f8: " << cnt << " x " << sizeof(pdu) << " bytes in " << ms << "ms";
+		if (ms) { os << " = " << (8.0*cnt*sizeof(pdu)/ms/1000) << " Mbit/s"; }
+		os << "\n";
+
+		cnt = benchBytes / 100 + 1;
+		uint32_t sink = 0;
+		start.now();
+		for (unsigned n = 0; n < cnt; n++) { sink ^= kasumiF9(key,n,0x05D2EC49,1,pdu,800); }
+		ms = start.elapsed();
+		os << "f9: " << cnt << " x 100 bytes in " << ms << "ms";
+		if (ms) { os << " = " << (1.0*cnt/ms) << " kmsg/s"; }
+		os << " (" << sink << ")\n";
+	}
+	return failures;
+}
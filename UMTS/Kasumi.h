@@ -0,0 +1,58 @@
+/*
+ * OpenBTS provides an open source alternative to legacy telco protocols and
+ * traditionally complex, proprietary hardware systems.
+ *
+ * Copyright 2014 Range Networks, Inc.
+ *
+ * This software is distributed under the terms of the GNU Affero General
+ * Public License version 3. See the COPYING and NOTICE files in the main
+ * directory for licensing information.
+ *
+ * This use of this software may be subject to additional restrictions.
+ * See the LEGAL file in the main directory for details.
+ */
+
+#ifndef KASUMI_H
+#define KASUMI_H
+#include <stdint.h>
+#include <ostream>
+
+// KASUMI block cipher, 35.202, and the f8 (UEA1 ciphering) and f9 (UIA1 integrity)
+// modes built on it, 35.201.
+// This is the same algorithm as the 35.202 Annex 2 sample code, except that the key schedule
+// lives in the object instead of in globals, so it is safe to use from multiple threads,
+// blocks are handled as 64 bit integers, and the KI subkeys are pre-arranged for FI.
+class Kasumi
+{
+	uint16_t mKL1[8], mKL2[8];
+	uint16_t mKO1[8], mKO2[8], mKO3[8];
+	uint16_t mKI1[8], mKI2[8], mKI3[8];	// Pre-rotated left 7, see FI().
+
+	uint32_t FO(uint32_t in, int index) const;
+	uint32_t FL(uint32_t in, int index) const;
+
+	public:
+	Kasumi() {}
+	Kasumi(const uint8_t *key) { setKey(key); }
+	void setKey(const uint8_t *key);	// 128 bit key, first byte is most significant.
+	uint64_t encrypt(uint64_t block) const;
+};
+
+// f8 keystream generator, 35.201 sec 3.  The key schedules for CK and the modified key
+// are computed once when the key is set, not once per PDU.
+class KasumiF8
+{
+	Kasumi mK, mKM;
+	public:
+	void setKey(const uint8_t *ck);
+	// Cipher or decipher length bits of data in place.  Bits past length in the final byte are unchanged.
+	void run(uint32_t count, unsigned bearer, unsigned dir, uint8_t *data, unsigned length) const;
+};
+
+// These take the key each call, so they run the key schedule each time.
+uint32_t kasumiF9(const uint8_t *ik, uint32_t count, uint32_t fresh, unsigned dir, const uint8_t *data, unsigned length);
+void kasumiF8(const uint8_t *ck, uint32_t count, unsigned bearer, unsigned dir, uint8_t *data, unsigned length);
+
+// Run the 35.203 test vectors and a throughput benchmark; return the number of failures.
+unsigned kasumiSelfTest(std::ostream &os, unsigned benchBytes);
+#endif
@@ -294,6 +294,7 @@ MaccTbs::MaccTbs(UEInfo *uep, TfcMap &map) : MacTbs(map.mtfc)
 // so all we do is go get them from the RLCs and stick them in the TBS.
 MacdTbs::MacdTbs(UEInfo *uep, TfcMap &map) : MacTbs(map.mtfc)
 {
+	mTime = gNodeB.clock().get();
 	unsigned numTrCh = mTfc->getNumTrCh();
 	for (TrChId tcid = 0; tcid < numTrCh; tcid++) {
 		bool multiplexed = mTfc->getTrChInfo(tcid)->mTcIsMultiplexed;
@@ -307,6 +308,11 @@ MacdTbs::MacdTbs(UEInfo *uep, TfcMap &map) : MacTbs(map.mtfc)
 			ByteVector *vec = uep->ueReadLowSide(rbid);
                         //LOG(INFO) << "ueReadLowSide rb " << rbid << " done at time " << gNodeB.clock().get();
 			if (!vec) {continue;}
+			if (uep->getRlcDown(rbid)->mRlcMode == URlcModeTm) {
+				// 33.102 6.6.4: RLC-TM pdus are ciphered in MAC-d using the CFN of the TTI,
+				// which is mTime; sendDownstreamTbs stamps the TBs with it and L1 sends them then.
+				uep->integrity.tmCipher(rbid,true,mTime.FN(),vec->begin(),vec->sizeBits());
+			}
 			MacdTbDl *out = new MacdTbDl(tbSize,vec,rbid,multiplexed);
 			RN_MEMLOG(MaccTbDl,out);
 			addTb(out,tcid);
@@ -396,6 +402,19 @@ void MacdSimple::macWriteLowSideTb(const TransportBlock &tb, TrChId unused)
 }
 
 
+// Decipher an uplink RLC-TM pdu, which is ciphered in MAC-d using the CFN of the TTI it arrived in.
+// We use a frame offset of 0, so the CFN is the low 8 bits of the frame number.
+static void macdDecipherTm(UEInfo *uep, RbId rbid, BitVector &msg, const TransportBlock &tb)
+{
+	if (!uep->integrity.isCipheringStarted()) { return; }
+	URlcRecv *rlc = uep->getRlcUp(rbid,stCELL_DCH);
+	if (!rlc || rlc->mRlcMode != URlcModeTm) { return; }
+	ByteVector bytes((msg.size()+7)/8);
+	msg.pack(bytes.begin());
+	uep->integrity.tmCipher(rbid,false,tb.time().FN(),bytes.begin(),msg.size());
+	msg.unpack(bytes.begin());
+}
+
 // This transport block arrived on a DCHFEC for a specific UE.
 // We are also assuming there is only one trch, so no mapping.
 // Encoding is in 25.321 table 9.2.1.1
@@ -409,10 +428,13 @@ void MacdWithTfc::macWriteLowSideTb(const TransportBlock &tb, TrChId tcid)
 		RbId rbid = tb.readField(rp,4)+1;
 		BitVector msg(tb.tail(rp));
 		// This needs to be prepared for a garbage rbid.
+		if (rbid < gsMaxRB) { macdDecipherTm(uep,rbid,msg,tb); }
 		uep->ueWriteLowSide(rbid,msg,stCELL_DCH);
 	} else {
 		// This code path is not used.
-		uep->ueWriteLowSide(info->mTcRbId,tb,stCELL_DCH);
+		BitVector msg(tb);
+		macdDecipherTm(uep,info->mTcRbId,msg,tb);
+		uep->ueWriteLowSide(info->mTcRbId,msg,stCELL_DCH);
 	}
 }
 
@@ -539,8 +561,9 @@ void MacSimple::sendDownstreamTb(MacTbDl &tb)
 //	return rlctbsize;
 //}
 
-void MacWithTfc::sendDownstreamTbs(MacTbs &tbs)
+void MacWithTfc::sendDownstreamTbs(MacTbs &tbs, bool stamped)
 {
+   if (!stamped) { tbs.mTime = gNodeB.clock().get(); }
    unsigned numTrCh = tbs.mTfc->getNumTrCh();
    LOG(INFO) << "numTrCh: " << numTrCh;
    unsigned totalTb = 0;
@@ -550,14 +573,12 @@ void MacWithTfc::sendDownstreamTbs(MacTbs &tbs)
 	LOG(INFO) << "Sched. Tbs of " << numTb << " for time " << gNodeB.clock().get();
    	for (unsigned tbIx = 0; tbIx < numTb; tbIx++) {
 		TransportBlock *tb = tbs.getTB(tbIx,tcid);
-		UMTS::Time now = gNodeB.clock().get();       // (harvind) <<<<< add me
-   		tb->time(now);                                                   // (harvind) <<<<< add me
+   		tb->time(tbs.mTime);                                                   // (harvind) <<<<< add me
    		tb->mScheduled = true;
 		totalTb++;
 	}
    }
    //LOG(INFO) << "Sched writing high side at time " << gNodeB.clock().get();
-   tbs.mTime = gNodeB.clock().get();
    if (totalTb > 0) mccDownstream->l1WriteHighSide(tbs);
    //LOG(INFO) << "Sched done at time " << gNodeB.clock().get();
 }
@@ -851,7 +872,7 @@ bool MacdWithTfc::flushUE()
         //LOG(INFO) << "flushUE: Macdtbs at time " << gNodeB.clock().get();
 	MacdTbs tbs(mUep,map);	// This handles the logical channel multiplexing
         //LOG(INFO) << "flushUE: sendDownstreamTbs at time " << gNodeB.clock().get();
-	sendDownstreamTbs(tbs);
+	sendDownstreamTbs(tbs,true);
 	tbs.clear();
 	return true;
 }
@@ -179,6 +179,7 @@ class MacdTbs : public MacTbs
 {	public:
 	// Fill the TBS with data from this UE.
 	// The logical channel from which to send data is in the map.
+	// The TBS is stamped with the TTI it will go out in first, because RLC-TM pdus are ciphered with its CFN.
 	MacdTbs(UEInfo *uep, TfcMap &map);
 };
 
@@ -289,7 +290,8 @@ class MacWithTfc : public virtual MacEngine
 	public:
 	bool findTfcForUe(UEInfo *uep,TfcMap *result);
 	RrcTfc *findTfcOfTbSize(RrcTfcs *tfcs, TrChId tcid, unsigned tbsize);
-	void sendDownstreamTbs(MacTbs &tbs);
+	// If stamped, the TBS already has the time of its TTI in mTime.
+	void sendDownstreamTbs(MacTbs &tbs, bool stamped = false);
 };
 
 
@@ -20,8 +20,10 @@
 #include "URRCMessages.h"
 #include "URLC.h"
 #include "URRC.h"
+#include "Kasumi.h"
 ////#include "GPRSL3Messages.h"	// For SmQoS
 #include <stdlib.h>	// for rand
+#include <vector>
 
 #include "asn_system.h"
 namespace ASN {
@@ -105,10 +107,12 @@ static UEInfo *testCreateFakeUe()
 	return new UEInfo(&imsiId);
 }
 
-static const unsigned sMaxTestVectors = 100;
+static const unsigned sMaxTestVectors = 1000;
 static ByteVector *svectors[sMaxTestVectors];
 static unsigned sTestRecvVectorNum;
 static unsigned sTestFailCnt;
+static unsigned sTestRecvBytes;
+static unsigned sTestPduBytes;	// Total bytes of all pdus sent in either direction, including lost ones.
 static unsigned sseed;
 static unsigned sNumTestVectors;
 
@@ -142,6 +146,7 @@ void testRlcRecv(URlcUpSdu &sdu, RbId rbid)
 		//printf("testRlcRecv: test vector %d matched %s=%s\n",
 			//sTestRecvVectorNum,sdu.hexstr().c_str(),expect->hexstr().c_str());
 	}
+	sTestRecvBytes += sdu.size();
 	sTestRecvVectorNum++;
 }
 
@@ -166,6 +171,7 @@ static unsigned rlcTransfer(URlcTrans *trans, URlcRecv *recv, int percentloss,in
 	unsigned pducnt = 0;
 	while ((pdu = trans->rlcReadLowSide())) {
 		pducnt++;
+		sTestPduBytes += pdu->size();
 		if (percentloss && rangerand(1,100,&sseed) < percentloss) {
 			//URlcPdu *updu = dynamic_cast<URlcPdu*>(pdu);
 			//printf("Tossing pdu number %d %s\n",pducnt,updu->ByteVector::str().c_str());
@@ -205,6 +211,64 @@ static unsigned rlcRun(URlcPair *pair1,URlcPair *pair2,int percentloss, bool sta
 	return pducnt;
 }
 
+static void rlcStatusFillRecv(ByteVector &sdu, RbId rbid) {}	// Only the status pdus are checked.
+
+// Lose data pdus so the receiver has more holes than one status pdu can report, and check that
+// addAckNack fills each status pdu without overrunning it, which throws ByteVectorError.
+// The loss patterns vary the mix of LIST and BITMAP sufis, so the last sufi lands on
+// every possible number of bits left.  Return the number of failures.
+static int rlcStatusFillTest(unsigned seeds)
+{
+	int failures = 0;
+	unsigned statusPdus = 0;
+	UEInfo *uep = testCreateFakeUe();
+	RrcTfs *dltfs = gRrcDcchConfig->getDlTfs(0);
+	for (unsigned seed = 1; seed <= seeds; seed++) {
+		unsigned pseed = seed;
+		int percentloss = rangerand(2,60,&pseed);
+		int sdus = rangerand(50,400,&pseed);
+		RBInfo rb;
+		rb.defaultConfigRlcAmPs();
+		rb.rb_Identity(1);
+		URlcPair *pair1 = new URlcPair(&rb,dltfs,uep,0);
+		rb.rb_Identity(2);
+		URlcPair *pair2 = new URlcPair(&rb,dltfs,uep,0);
+		URlcTrans *trans1 = pair1->mDown, *trans2 = pair2->mDown;
+		URlcRecv *recv2 = pair2->mUp;
+		recv2->rlcSetHighSide(rlcStatusFillRecv);
+
+		ByteVector sdu(100);
+		sdu.fill(0x55);
+		for (int n = 0; n < sdus; n++) { trans1->rlcWriteHighSide(sdu,false,0,string("statusfill")); }
+		std::vector<ByteVector*> pdus;
+		while (ByteVector *pdu = trans1->rlcReadLowSide()) { pdus.push_back(pdu); }
+		for (unsigned i = 0; i < pdus.size(); i++) {
+			bool last = i + 1 == pdus.size();
+			if (!last && rangerand(1,100,&pseed) < percentloss) { delete pdus[i]; continue; }
+			BitVector bits(pdus[i]->sizeBits());
+			bits.unpack(pdus[i]->begin());
+			delete pdus[i];
+			// Poll on the last one, so the receiver reports everything at once.
+			if (last) { bits[URlcPdu::sPollBit] = 1; }
+			recv2->rlcWriteLowSide(bits);
+		}
+
+		try {
+			while (ByteVector *status = trans2->rlcReadLowSide()) {
+				statusPdus++;
+				delete status;
+			}
+		} catch (ByteVectorError) {
+			printf("statusfill: seed %u, loss %d%%: status pdu overrun\n",seed,percentloss);
+			failures++;
+		}
+		delete pair1;
+		delete pair2;
+	}
+	printf("statusfill: %u seeds, %u status pdus, %d failures\n",seeds,statusPdus,failures);
+	return failures;
+}
+
 //static void testRlc(const char*subcmd, int argc, char **argv)
 /**
  * `rlcTest`函数的功能是进行RLC测试。
@@ -267,11 +331,16 @@ int rlcTest(int argc, char** argv, ostream& os)
 			// Start a reset at the indicated sdu number.
 			reset2 = atoi(argv[argi+1]);
 			argi += 2;
+		} else if (0 == strcmp(argv[argi],"-statusfill")) {
+			int failures = rlcStatusFillTest(argi+1<argc ? atoi(argv[argi+1]) : 500);
+			os << (failures ? "FAILED" : "ok") << "\n";
+			return 0;
 		} else {
 			printf("unrecognized: %s\n",argv[argi]);
 			help:
 			printf("rlctest -am|-tm|-um -s -d -ps -n <numvectors> -loss <percentloss> -seed <randomseed> -reset[12] <pdunum>\n");
 			printf("note: -ps = packet-switched-config -d = debug; -s = lossless transmission for status\n");
+			printf("rlctest -statusfill [<seeds>] -- check that status pdus are filled without overrunning\n");
 			return 0;
 		}
 	}
@@ -331,6 +400,9 @@ int rlcTest(int argc, char** argv, ostream& os)
 	recv2->rlcSetHighSide(testRlcRecv);
 	sTestRecvVectorNum = 0;
 	sTestFailCnt = 0;
+	sTestRecvBytes = 0;
+	sTestPduBytes = 0;
+	Timeval start;
 
 	// We want to randomize: vector content, size, and how many incoming vectors per TTI.
 	int pducnt = 0;
@@ -397,6 +469,14 @@ int rlcTest(int argc, char** argv, ostream& os)
 
 	printf("testRlc: received %d sdus, %d pdus , expected=%d failed=%d\n",
 		sTestRecvVectorNum, pducnt, sNumTestVectors, sTestFailCnt);
+	// Goodput is the SDU payload delivered in order at the far end.  The elapsed time
+	// includes the sleeps waiting for Timer_Poll, so the efficiency figure, which is SDU bytes
+	// delivered per byte of PDU transmitted (including status and lost pdus), is the
+	// better one to compare ARQ changes at a given -loss rate.
+	long elapsed = start.elapsed();
+	printf("testRlc: loss=%d%% goodput=%u bytes in %ldms = %.1f kbit/s efficiency=%.3f\n",
+		percentloss, sTestRecvBytes, elapsed, elapsed ? 8.0*sTestRecvBytes/elapsed : 0.0,
+		sTestPduBytes ? (double)sTestRecvBytes/sTestPduBytes : 0.0);
 
 	os <<"\nTrans1:"; trans1->text(os);
 	os <<"\nRecv1:"; recv1->text(os);
@@ -407,6 +487,148 @@ int rlcTest(int argc, char** argv, ostream& os)
 }
 
 
+// Time the Rrc UE lookups with numUEs simulated UEs, and compare with a walk of the UE list.
+// The UEs go in a private Rrc, not gRrc, so the purge thread and the rest of the node never see them.
+static void rrcUeLookupBenchmark(unsigned numUEs, ostream &os)
+{
+	// Static so its Threads, which are never started, are zeroed like those of gRrc.
+	static Rrc rrc;
+	const unsigned reps = 10;
+	std::vector<UEInfo*> ues;
+	std::vector<AsnUeId> ids;
+	for (unsigned n = 0; n < numUEs; n++) {
+		ByteVector imsi(format("00101%010u",n).c_str());
+		AsnUeId uid(imsi);
+		ids.push_back(uid);
+		ues.push_back(new UEInfo(&uid,&rrc));
+	}
+
+	unsigned found = 0;
+	Timeval start;
+	for (unsigned rep = 0; rep < reps; rep++) {
+		for (unsigned n = 0; n < numUEs; n++) { found += rrc.findUeByUrnti(ues[n]->mURNTI) == ues[n]; }
+	}
+	long urntiMs = start.elapsed();
+	start.now();
+	for (unsigned rep = 0; rep < reps; rep++) {
+		for (unsigned n = 0; n < numUEs; n++) { found += rrc.findUe(true,ues[n]->mCRNTI) == ues[n]; }
+	}
+	long crntiMs = start.elapsed();
+	start.now();
+	for (unsigned rep = 0; rep < reps; rep++) {
+		for (unsigned n = 0; n < numUEs; n++) { found += rrc.findUeByAsnId(&ids[n]) == ues[n]; }
+	}
+	long asnMs = start.elapsed();
+	// This is what findUe used to do.
+	start.now();
+	{
+		ScopedLock lock(rrc.mUEListLock);
+		for (unsigned n = 0; n < numUEs; n++) {
+			UEInfo *uep;
+			RN_FOR_ALL(Rrc::UEList_t,rrc.mUEList,uep) {
+				if (uep->mURNTI == ues[n]->mURNTI) { found++; break; }
+			}
+		}
+	}
+	long linearMs = start.elapsed();
+
+	for (unsigned n = 0; n < numUEs; n++) { rrc.removeUE(ues[n]); }
+
+	double lookups = (double) reps * numUEs;
+	os << "UE lookup benchmark with " << numUEs << " UEs, found " << found << " of " << (unsigned)(3*lookups + numUEs) << "\n";
+	os << format("  by URNTI:    %8.0f lookups/sec\n", 1000.0 * lookups / RN_BOUND(urntiMs,1,urntiMs));
+	os << format("  by CRNTI:    %8.0f lookups/sec\n", 1000.0 * lookups / RN_BOUND(crntiMs,1,crntiMs));
+	os << format("  by UE id:    %8.0f lookups/sec\n", 1000.0 * lookups / RN_BOUND(asnMs,1,asnMs));
+	os << format("  list walk:   %8.0f lookups/sec\n", 1000.0 * numUEs / RN_BOUND(linearMs,1,linearMs));
+}
+
+// Time encoding the RRC Connection Setup and Radio Bearer Setup for a burst of numUEs UEs,
+// both from scratch and from the message templates, and check that the results are identical.
+// This is offline like the UE lookup benchmark: the UEs go in a private Rrc, and the DCH is made here
+// with no radio at the SF chChooseByBW(12000) would pick, so the ChannelTree is not touched.
+// The DCH is kept for good, as the ChannelTree's are; the L1 destructors do not expect to run.
+static void rrcMsgTemplateBenchmark(unsigned numUEs, ostream &os)
+{
+	static Rrc rrc;
+	static unsigned sf = ChannelTree::tier2sf(ChannelTree::bw2tier(12000,true));
+	static DCHFEC *dch = new DCHFEC(sf,sf-1,(sf==4) ? 4 : (sf/2),0,NULL);
+	std::vector<UEInfo*> ues;
+	std::vector<ASN::InitialUE_Identity_t> ids(numUEs);
+	for (unsigned n = 0; n < numUEs; n++) {
+		memset(&ids[n],0,sizeof(ids[n]));
+		ids[n].present = ASN::InitialUE_Identity_PR_imsi;
+		std::string digits = format("00101%010u",n);
+		setASN1SeqOfDigits((void*)&ids[n].choice.imsi.list,digits.c_str());
+		ByteVector imsi(digits.c_str());
+		AsnUeId uid(imsi);
+		UEInfo *uep = new UEInfo(&uid,&rrc);
+		uep->mUeDchConfig.rrcConfigDchPS(dch,5,true);
+		ues.push_back(uep);
+	}
+
+	long ms[2];
+	unsigned mismatches = 0;
+	ByteVector full(1000), fromTemplate(1000);
+	for (unsigned useTemplate = 0; useTemplate < 2; useTemplate++) {
+		Timeval start;
+		for (unsigned n = 0; n < numUEs; n++) {
+			ByteVector result(1000);
+			encodeRrcConnectionSetup(ues[n],&ids[n],n%4,result,useTemplate,false);
+			encodeRadioBearerSetup(ues[n],&ues[n]->mUeDchConfig,dch,true,n%4,result,useTemplate,false);
+		}
+		ms[useTemplate] = start.elapsed();
+	}
+	for (unsigned n = 0; n < numUEs; n++) {
+		encodeRrcConnectionSetup(ues[n],&ids[n],n%4,full,false,false);
+		encodeRrcConnectionSetup(ues[n],&ids[n],n%4,fromTemplate,true,false);
+		mismatches += full != fromTemplate;
+		encodeRadioBearerSetup(ues[n],&ues[n]->mUeDchConfig,dch,true,n%4,full,false,false);
+		encodeRadioBearerSetup(ues[n],&ues[n]->mUeDchConfig,dch,true,n%4,fromTemplate,true,false);
+		mismatches += full != fromTemplate;
+	}
+	for (unsigned n = 0; n < numUEs; n++) {
+		rrc.removeUE(ues[n]);
+		ASN_STRUCT_FREE_CONTENTS_ONLY(ASN::asn_DEF_InitialUE_Identity,&ids[n]);
+	}
+
+	os << "RRC message benchmark: Connection Setup + Radio Bearer Setup for " << numUEs << " UEs, "
+		<< mismatches << " template mismatches\n";
+	os << format("  full encode: %8.0f setups/sec\n", 1000.0 * numUEs / RN_BOUND(ms[0],1,ms[0]));
+	os << format("  template:    %8.0f setups/sec\n", 1000.0 * numUEs / RN_BOUND(ms[1],1,ms[1]));
+}
+
+// Print the downlink queue delay and AQM drop/mark counters for every RB of every UE.
+// With -t, print instead one line of key=value telemetry for each user data RB, for scripts;
+// -h adds the queue delay histogram buckets.
+int rlcStats(int argc, char** argv, ostream& os)
+{
+	bool telemetry = false, buckets = false;
+	for (int argi = 1; argi < argc; argi++) {
+		if (0==strcmp(argv[argi],"-t")) { telemetry = true; }
+		else if (0==strcmp(argv[argi],"-h")) { telemetry = buckets = true; }
+		else { return 1; }
+	}
+	ScopedLock lock(gRrc.mUEListLock);
+	UEInfo *uep;
+	RN_FOR_ALL(Rrc::UEList_t,gRrc.mUEList,uep) {
+		RN_UE_FOR_ALL_RLC_DOWN(uep,rbid,rlcp) {
+			if (telemetry) {
+				if (rbid < 5) { continue; }	// Only the user data RBs are counted.
+				os << "rab" <<LOGHEX2("urnti",uep->mURNTI) <<LOGVAR(rbid)
+					<<LOGVAR2("mode",URlcMode2Name(rlcp->mRlcMode));
+				rlcp->textTelemetry(os,buckets);
+				os << "\n";
+				continue;
+			}
+			os << uep->ueid() <<LOGVAR(rbid) <<LOGVAR2("mode",URlcMode2Name(rlcp->mRlcMode))
+				<<LOGVAR2("sduQBytes",rlcp->rlcGetBytesAvail());
+			rlcp->textAqm(os);
+			os << "\n";
+		}
+	}
+	return 0;
+}
+
 // This can be called by the OpenBTS-UMTS command line interface via the CLI module.
 int rrcTest(int argc, char** argv, ostream& os)
 {
@@ -427,6 +649,14 @@ int rrcTest(int argc, char** argv, ostream& os)
 		newConfig->rrcConfigDchPS(dch, rbid, useTurbo);
 		sendRadioBearerRelease(uep, 1<<rbid, false);
 		sendRadioBearerRelease(uep, 1<<rbid, true);
+	} else if (0==strcmp(subcmd,"uebench")) {
+		rrcUeLookupBenchmark(arg1 ? atoi(arg1) : 10000, os);
+	} else if (0==strcmp(subcmd,"msgbench")) {
+		rrcMsgTemplateBenchmark(arg1 ? atoi(arg1) : 1000, os);
+	} else if (0==strcmp(subcmd,"kasumi")) {
+		// Known answer tests for KASUMI f8/f9 followed by an f8 throughput measurement.
+		unsigned failures = kasumiSelfTest(os, arg1 ? atoi(arg1) : 10000000);
+		os << (failures ? "KASUMI self test FAILED" : "KASUMI self test passed") << endl;
 	} else if (0==strcmp(subcmd,"cc")) {
 		extern void testCCProgramming();
 		testCCProgramming();
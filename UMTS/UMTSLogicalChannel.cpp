@@ -96,3 +96,41 @@ void LogicalChannel::addTransaction(Control::TransactionEntry* transaction) {}
 void LogicalChannel::open() {}
 void LogicalChannel::connect() {}
 };	// namespace
+
+
+void DCCHLogicalChannelFIFO::write(UMTS::DCCHLogicalChannel *DCCH)
+{
+	mQ.write(new Entry(DCCH));
+	ScopedLock lock(mLock);
+	unsigned depth = mQ.size();
+	if (depth>mMaxDepth) mMaxDepth = depth;
+}
+
+
+UMTS::DCCHLogicalChannel *DCCHLogicalChannelFIFO::read(unsigned timeout)
+{
+	Entry *entry = mQ.read(timeout);
+	if (!entry) return NULL;
+	UMTS::DCCHLogicalChannel *DCCH = entry->mDCCH;
+	long latency = entry->mQueued.elapsed();
+	delete entry;
+
+	ScopedLock lock(mLock);
+	mReads++;
+	mTotalLatency += latency;
+	if (latency>mMaxLatency) mMaxLatency = latency;
+	unsigned bucket = 0;
+	for (long limit = 1; bucket<4 && latency>=limit; limit *= 10) bucket++;
+	mHistogram[bucket]++;
+	return DCCH;
+}
+
+
+void DCCHLogicalChannelFIFO::text(std::ostream& os) const
+{
+	ScopedLock lock(mLock);
+	os << "DCCH FIFO depth " << mQ.size() << ", max " << mMaxDepth << ", reads " << mReads << std::endl;
+	os << format("  queueing latency avg %.1f ms, max %ld ms", mReads ? (double)mTotalLatency/mReads : 0.0, mMaxLatency) << std::endl;
+	os << "  <1 ms " << mHistogram[0] << ", <10 ms " << mHistogram[1] << ", <100 ms " << mHistogram[2]
+		<< ", <1 s " << mHistogram[3] << ", >=1 s " << mHistogram[4] << std::endl;
+}
@@ -126,6 +126,8 @@ public:
 
 	/**@name Accessors. */
 	//@{
+	/** Return the number of received L3 frames that nobody has read yet. */
+	unsigned recvQSize() const { return mL3RxQ.size(); }
 	//@}
 
 	// Called from rrcRecvL3Msg() for protocol descriptors the GSM stack wants.
@@ -390,7 +392,50 @@ void *CCCHLogicalChannelServiceLoopAdapter(CCCHLogicalChannel*);
 
 }		// UMTS
 
-typedef InterthreadQueue<UMTS::DCCHLogicalChannel> DCCHLogicalChannelFIFO;
+/**
+	The channels that have received L3 frames, in arrival order, for the DCCH dispatchers.
+	A channel is written once for each frame, so it can be in the FIFO more than once.
+	Each entry is timestamped so we can see how long frames wait for a dispatcher.
+*/
+class DCCHLogicalChannelFIFO {
+
+	private:
+
+	struct Entry {
+		UMTS::DCCHLogicalChannel *mDCCH;
+		Timeval mQueued;
+		Entry(UMTS::DCCHLogicalChannel *wDCCH) :mDCCH(wDCCH) {}
+	};
+
+	InterthreadQueue<Entry> mQ;
+
+	/**@name Queueing latency statistics, guarded by mLock. */
+	//@{
+	mutable Mutex mLock;
+	unsigned long mReads;
+	unsigned long mTotalLatency;	///< sum of write-to-read times, ms
+	long mMaxLatency;
+	unsigned mMaxDepth;
+	unsigned long mHistogram[5];	///< reads by latency: <1, <10, <100, <1000, >=1000 ms
+	//@}
+
+	public:
+
+	DCCHLogicalChannelFIFO()
+		:mReads(0),mTotalLatency(0),mMaxLatency(0),mMaxDepth(0)
+	{ memset(mHistogram,0,sizeof(mHistogram)); }
+
+	/** Queue a channel with a new frame. */
+	void write(UMTS::DCCHLogicalChannel *DCCH);
+
+	/** Blocking read with timeout; return NULL on timeout. */
+	UMTS::DCCHLogicalChannel *read(unsigned timeout);
+
+	size_t size() const { return mQ.size(); }
+
+	/** Print queue depth and queueing latency. */
+	void text(std::ostream&) const;
+};
 
 extern DCCHLogicalChannelFIFO gDCCHLogicalChannelFIFO;
 
@@ -19,6 +19,8 @@
 #include "MACEngine.h"		// For macHeaderSize
 #include "Logger.h"
 #include "URLC.h"
+#include <math.h>
+#include <vector>
 
 //#define RLCLOG(stuff...) PATLOG(4, "RLC " << rlcid() <<":" << format(stuff) << mUep);
 #define RLCLOG(stuff...) LOG(DEBUG) << "RLC " << rlcid() <<":" << format(stuff) << mUep;
@@ -26,6 +28,9 @@
 
 namespace UMTS {
 
+// User data sdus, and the copies made of them into pdus; see PacketStage.
+static PacketStage sRlcStage("rlc");
+
 const char*URlcMode2Name(URlcMode mode)
 {
 	switch (mode) {
@@ -75,6 +80,15 @@ URlcSN URlcBase::maxSN(URlcSN sn1, URlcSN sn2)
 	return (deltaSN(sn1,sn2) >= 0) ? sn1 : sn2;
 }
 
+void URlcBase::rlcCipher(ByteVector &pdu, unsigned headerBytes, uint32_t count, bool downlink)
+{
+	if (!(downlink ? mDlCipherActive : mUlCipherActive)) { return; }
+	if (count < (downlink ? mDlCipherActCount : mUlCipherActCount)) { return; }
+	if (!mUep || !mUep->integrity.isCipheringStarted()) { return; }
+	if (pdu.sizeBits() <= 8*headerBytes) { return; }
+	mUep->integrity.runF8(mrbid,downlink,count,pdu.begin()+headerBytes,pdu.sizeBits()-8*headerBytes);
+}
+
 void URlcBase::incSN(URlcSN &psn)
 {
 	psn = addSN(psn,1);
@@ -248,6 +262,11 @@ void URlcTrans::rlcWriteHighSide(ByteVector &data, bool DiscardReq, unsigned MUI
 {
 	RLCLOG("rlcWriteHighSide sizebytes=%d rbid=%d descr=%s",
 		data.size(),mrbid,descr.c_str());
+	if (mrbid >= 5) {
+		sRlcStage.arrive(data);
+		__atomic_fetch_add(&mSdus,1,__ATOMIC_RELAXED);
+		__atomic_fetch_add(&mSduBytes,data.size(),__ATOMIC_RELAXED);
+	}
 
 	// pat 12-17: Changed the GGSN to pre-allocate this so we dont have to do it here.
 	//ByteVector cloneData;
@@ -259,7 +278,7 @@ void URlcTrans::rlcWriteHighSide(ByteVector &data, bool DiscardReq, unsigned MUI
 	//printf("pushing SDU of size: %u, addr: %0x, descr=%s\n",data.size(),sdu,descr.c_str());
 	mSduTxQ.push_back(sdu);
 
-                LOG(INFO) << "Bytes avail: " << rlcGetSduQBytesAvail();
+	RLCLOG("Bytes avail: %d",rlcGetSduQBytesAvail());
 	// Check for buffer overflow.
 	if (!mSplitSdu && rlcGetSduQBytesAvail() > mTransmissionBufferSizeBytes)
 	{
@@ -275,7 +294,7 @@ void URlcTrans::rlcWriteHighSide(ByteVector &data, bool DiscardReq, unsigned MUI
 			if (sdu) { sdu->free(); mVTSDU++; }
 			sdu = mSduTxQ.pop_front();
                         LOG(INFO) << "Discarding sdu %0x ," << sdu << " TxQ size: " << rlcGetSduQBytesAvail();
-			if (!sdu->mDiscarded) {informL3SduLoss(sdu);}
+			if (!sdu->mDiscarded) {informL3SduLoss(sdu); mOverflowDrops++;}
 		}
 
 		// Shove the last deleted sdu back in the queue to mark the spot.
@@ -289,6 +308,153 @@ void URlcTrans::rlcWriteHighSide(ByteVector &data, bool DiscardReq, unsigned MUI
 	}
 }
 
+// Set the ECN field of an IP packet to CE (Congestion Experienced.)
+// Return true if the packet is ECN-capable and is now marked, false if it must be dropped instead.
+static bool aqmMarkEcnCE(ByteVector *data)
+{
+	if (data->size() < 20) { return false; }
+	ByteType *ip = data->begin();
+	switch (ip[0] >> 4) {
+	case 4: {
+		unsigned ecn = ip[1] & 3;
+		if (ecn == 0) { return false; }	// Not-ECT.
+		if (ecn == 3) { return true; }	// Already CE.
+		// Update the header checksum incrementally as per RFC 1624: HC' = ~(~HC + ~m + m')
+		unsigned oldword = (ip[0]<<8) | ip[1];
+		ip[1] |= 3;
+		unsigned newword = (ip[0]<<8) | ip[1];
+		uint32_t sum = (~getntohs(&ip[10]) & 0xffff) + (~oldword & 0xffff) + newword;
+		sum = (sum & 0xffff) + (sum >> 16);
+		sum = (sum & 0xffff) + (sum >> 16);
+		sethtons(&ip[10],~sum & 0xffff);
+		return true;
+	}
+	case 6: {
+		// The ECN field is the bottom two bits of the Traffic Class, which straddles bytes 0 and 1.
+		// There is no header checksum in IPv6.
+		unsigned ecn = (ip[1] >> 4) & 3;
+		if (ecn == 0) { return false; }
+		ip[1] |= 0x30;
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+// Return the first sdu in the queue that has not already been discarded.
+URlcDownSdu *URlcTrans::aqmHead()
+{
+	for (URlcDownSdu *sdu = mSduTxQ.front(); sdu; sdu = sdu->next()) {
+		if (!sdu->mDiscarded) { return sdu; }
+	}
+	return NULL;
+}
+
+long URlcTrans::aqmControlLaw(long t)
+{
+	return t + (long) (mAqmIntervalMs / sqrt((double)mAqmCount));
+}
+
+// This is the CoDel dodequeue() function: update the statistics and the first-above-target state,
+// and return true if the delay has been above target for at least an interval.
+bool URlcTrans::aqmOkToDrop(URlcDownSdu *sdu, long now)
+{
+	long sojourn = sdu->mEnqueueTime.elapsed();
+	if (sojourn < 0) { sojourn = 0; }
+	mAqmLastDelayMs = sojourn;
+	if ((unsigned)sojourn > mAqmMaxDelayMs) { mAqmMaxDelayMs = sojourn; }
+	mAqmAvgDelayMs = 0.9 * mAqmAvgDelayMs + 0.1 * sojourn;
+
+	// Never drop the only sdu in the queue; there is no standing queue behind it.
+	if ((unsigned)sojourn < mAqmTargetMs || mSduTxQ.size() <= 1) {
+		mAqmAboveTarget = false;
+		return false;
+	}
+	if (!mAqmAboveTarget) {
+		mAqmAboveTarget = true;
+		mAqmFirstAboveTime = now + mAqmIntervalMs;
+		return false;
+	}
+	return now >= mAqmFirstAboveTime;
+}
+
+// Drop the sdu, or if ECN is enabled and the sdu is an ECN-capable IP packet, mark it instead.
+// Return true if it was marked, ie, it is still in the queue.
+bool URlcTrans::aqmDropOrMark(URlcDownSdu *sdu)
+{
+	if (mAqmEcn && aqmMarkEcnCE(sdu->sduData())) {
+		mAqmMarks++;
+		RLCLOG("aqm marked sdu sizebytes=%u delay=%d",(unsigned)sdu->size(),(int)mAqmLastDelayMs);
+		return true;
+	}
+	mAqmDrops++;
+	RLCLOG("aqm dropped sdu sizebytes=%u delay=%d",(unsigned)sdu->size(),(int)mAqmLastDelayMs);
+	// The sdu to be dropped is always aqmHead(), which is preceded only by discarded sdus.
+	// In UM mode fillPduData informs the peer of discards, so we leave the sdu in the
+	// queue as a discarded sdu, unless there is already one there to mark the spot.
+	std::vector<URlcDownSdu*> ahead;
+	while (mSduTxQ.front() != sdu) { ahead.push_back(mSduTxQ.pop_front()); }
+	mSduTxQ.pop_front();
+	if (mRlcMode == URlcModeUm && ahead.empty()) {
+		sdu->mDiscarded = true;
+		mSduTxQ.push_front(sdu);
+	} else {
+		mVTSDU++;
+		sdu->free();
+	}
+	while (ahead.size()) { mSduTxQ.push_front(ahead.back()); ahead.pop_back(); }
+	return false;
+}
+
+// This is the CoDel dequeue() function, called with mQLock held whenever we are about to
+// fill a pdu.  It evaluates each sdu once, when it reaches the head of the queue,
+// and drops or marks sdus from the head according to the CoDel control law.
+void URlcTrans::aqmDequeue()
+{
+	if (!mAqmEnabled) { return; }
+	URlcDownSdu *sdu = aqmHead();
+	if (sdu == NULL || sdu->mAqmChecked) { return; }
+	sdu->mAqmChecked = true;
+	long now = mAqmEpoch.elapsed();
+	bool okToDrop = aqmOkToDrop(sdu,now);
+
+	if (mAqmDropping) {
+		if (!okToDrop) {
+			mAqmDropping = false;	// Delay is below target; leave the dropping state.
+			return;
+		}
+		while (now >= mAqmDropNext && mAqmDropping) {
+			mAqmCount++;
+			if (aqmDropOrMark(sdu)) {
+				mAqmDropNext = aqmControlLaw(mAqmDropNext);
+				return;
+			}
+			sdu = aqmHead();
+			if (sdu) { sdu->mAqmChecked = true; }
+			if (sdu == NULL || !aqmOkToDrop(sdu,now)) {
+				mAqmDropping = false;
+			} else {
+				mAqmDropNext = aqmControlLaw(mAqmDropNext);
+			}
+		}
+	} else if (okToDrop) {
+		// Enter the dropping state.  If we were dropping recently, resume at the previous rate.
+		unsigned delta = mAqmCount - mAqmLastCount;
+		mAqmCount = (delta > 1 && now - mAqmDropNext < 16 * (long)mAqmIntervalMs) ? delta : 1;
+		mAqmLastCount = mAqmCount;
+		mAqmDropping = true;
+		mAqmDropNext = aqmControlLaw(now);
+		if (!aqmDropOrMark(sdu)) {
+			// The next sdu is now at the head, so check it too.
+			if ((sdu = aqmHead())) {
+				sdu->mAqmChecked = true;
+				if (!aqmOkToDrop(sdu,now)) { mAqmDropping = false; }
+			}
+		}
+	}
+}
+
 // About the LI Length Indicator field.
 // If the SDU exactly fills the PDU and there is no room for an LI field,
 // you set the LI in the subsequent PDU as follows:
@@ -316,6 +482,7 @@ bool URlcTransAmUm::fillPduData(URlcPdu *result,
 	bool *pNewSdu)	// Set if this pdu is the start of a new sdu.
 {
 	ScopedLock lock(mQLock);
+	aqmDequeue();
 
 	// Step one: how many sdus can we fit in this pdu?
 	// remaining = How many bytes left in output PDU.
@@ -490,6 +657,11 @@ bool URlcTransAmUm::fillPduData(URlcPdu *result,
 			sdu = mSplitSdu; mSplitSdu = NULL;
 		} else {
 			sdu = mSduTxQ.pop_front();
+			// The sdu is starting out, so its time in the SduTxQ is over.
+			if (sdu && mrbid >= 5) {
+				long delay = sdu->mEnqueueTime.elapsedUsecs();
+				mQueueDelay.record(delay > 0 ? delay : 0);
+			}
 		}
 
 		// Need these checks to assure the mSplitSdu didn't just get discarded b/c mSduTxQ is too big.
@@ -501,6 +673,7 @@ bool URlcTransAmUm::fillPduData(URlcPdu *result,
 			// Copy part of this sdu.
 			//LOG(INFO) << "sduData: " << *(sdu->sduData());
 			result->append(sdu->sduData()->begin(),sdufinalbytes);
+			if (mrbid >= 5) { sRlcStage.copy(sdufinalbytes); }
 			//printf("sdu->sduData(): %0x\n",sdu->sduData());
 			sdu->sduData()->trimLeft(sdufinalbytes);
 			mSplitSdu = sdu;
@@ -509,6 +682,7 @@ bool URlcTransAmUm::fillPduData(URlcPdu *result,
 		} else {
 			// Copy the entire SDU.
 			result->append(sdu->sduData());
+			if (mrbid >= 5) { sRlcStage.copy(sdu->sduData()->size()); }
 			RLCLOG("fillpdu appending %d sdu bytes, result=%d bytes",
 				sdu->sduData()->size(), result->size());
 			mVTSDU++;
@@ -599,14 +773,33 @@ URlcPdu *URlcTransUm::readLowSidePdu()
 	bool mSduDiscarded = fillPduData(result,1,&newSdu);
 	if (newSdu && mConfig.mIsSharedRlc) { mVTUS = 0; }
 	result->setUmSN(mVTUS);
+	rlcCipher(*result,1,(mDLHFN << 7) | mVTUS,true);
+	URlcSN prevVTUS = mVTUS;
 	incSN(mVTUS);
 	if (mSduDiscarded && mConfig.mRlcDiscard.mSduDiscardMode != TransmissionRlcDiscard::NotConfigured) {
 		incSN(mVTUS);	// Informs peer that a discard occurred.
 	}
+	if (mVTUS < prevVTUS) { mDLHFN++; }
 	RLCLOG("readLowSidePdu sizebytes=%d",result->size());
 	return result;
 }
 
+int URlcTransUm::rlcStartDlCiphering(unsigned margin)
+{
+	// The pdus already in mPduOutQ have their SNs, so count from the next one.
+	URlcSN sn = addSN(mVTUS,margin);
+	mDlCipherActCount = ((mDLHFN + (sn < mVTUS ? 1 : 0)) << 7) | sn;
+	mDlCipherActive = true;
+	return sn;
+}
+
+void URlcRecvUm::rlcStartUlCiphering(unsigned activationSN)
+{
+	URlcSN sn = activationSN % UmSNS;
+	mUlCipherActCount = ((mULHFN + (sn < mVRUS ? 1 : 0)) << 7) | sn;
+	mUlCipherActive = true;
+}
+
 URlcPdu *URlcTransAm::getDataPdu()
 {
 	if (pdusFinished()) { return NULL;	} // No data waiting in the queue.
@@ -630,9 +823,11 @@ URlcPdu *URlcTransAm::getDataPdu()
 	if (mPduTxQ[mVTS]) {
 		RLCERR("RLC-AM internal error: PduTxQ at %d not empty",(int)mVTS);
 		delete mPduTxQ[mVTS];
+		mNackMap.clear(mVTS);
 	}
 	mPduTxQ[mVTS] = result;
 	incSN(mVTS);
+	if (mVTS == 0) { parent()->mDLHFN++; }
 	return result;
 }
 
@@ -664,6 +859,20 @@ bool URlcRecvAm::isReceiverOk()
 	return true;
 }
 
+// Return the number of LIST sufi entries needed to report the PDUs missing in [sn,end),
+// and set last to the SN of the last missing one.
+unsigned URlcRecvAm::scanMissing(URlcSN sn, URlcSN end, URlcSN &last)
+{
+	unsigned runs = 0;
+	while ((sn = mRxMap.find(sn,end,false)) != end) {
+		URlcSN runEnd = mRxMap.find(sn,end,true);
+		runs += (deltaSN(runEnd,sn) + 15) / 16;	// A LIST entry covers at most 16 PDUs.
+		last = addSN(runEnd,-1);
+		sn = runEnd;
+	}
+	return runs;
+}
+
 // Return true if there are no more status pdus to report after this one.
 bool URlcRecvAm::addAckNack(URlcPdu *pdu)
 {
@@ -687,31 +896,62 @@ bool URlcRecvAm::addAckNack(URlcPdu *pdu)
 		// If this happens the RLC is hopelessly out of synchronization aka a bug.
 		// We catch this case out readLowSidePdu2() and reset the connection.
 
-		// Gather up ranges of blocks that have not been received.
-		// 9.2.2.11.4 List SUFI.  Each one can acknowledge up to 15 missing PDU ranges.
-		// The outer while loop stuffs as many of those into the PDU as will fit.
-		// Each range low[n] to low[n]+cnt[n] is a series of PDUs that have not been received.
+		// Gather up ranges of blocks that have not been received, using mRxMap
+		// to skip over received blocks a word at a time.
+		// For each region we emit either a LIST sufi (9.2.2.11.4), which costs 16 bits
+		// per range of up to 16 missing PDUs, or a BITMAP sufi (9.2.2.11.5), which costs
+		// one bit per SN over up to 128 SNs, whichever is smaller.  Under bursty loss
+		// LIST wins; under scattered loss BITMAP reports many more PDUs per status PDU.
+		// The outer while loop stuffs as many sufis into the PDU as will fit.
+		// Note that sufis are not byte aligned, so space is accounted for in bits.
 		int n, low[15], cnt[15];
 		bool found = false;
-		while (sn != end) {
-			// The final ACK needs 2 bytes and each LIST SUFI takes 1 + n*2 bytes.
-			int maxN = ((int)pdu->sizeRemaining() - 3)/2;
+		while ((sn = mRxMap.find(sn,end,false)) != end) {
+			// The final ACK sufi needs 16 bits.
+			int bitsLeft = 8*(int)pdu->allocSize() - (int)pdu->sizeBits() - 16;
+
+			// Try a bitmap over the window from sn to the last missing PDU within reach.
+			// Its header is 20 bits: type, length and the first SN.
+			int maxMapBits = (bitsLeft - 20) & ~7;
+			if (maxMapBits > 128) { maxMapBits = 128; }
+			if (maxMapBits >= 8) {
+				URlcSN wend = deltaSN(end,sn) > maxMapBits ? addSN(sn,maxMapBits) : end;
+				URlcSN last = sn;
+				unsigned runs = scanMissing(sn,wend,last);
+				int mapBits = (deltaSN(last,sn) + 8) & ~7;	// Rounded up to whole bytes.
+				int listBits = 8*((runs+14)/15) + 16*runs;
+				if (20 + mapBits < listBits) {
+					// SNs at or beyond VRH are reported as received, which is harmless
+					// because the bitmap does not advance the peer transmit window.
+					int span = deltaSN(end,sn);
+					pdu->appendField(SUFI_BITMAP,4);
+					pdu->appendField(mapBits/8 - 1,4);
+					pdu->appendField(sn,12);
+					for (int i = 0; i < mapBits; i++) {
+						pdu->appendField(i >= span || mRxMap.test(addSN(sn,i)),1);	// 1 means received.
+					}
+					RLCLOG("Ack Sufi mVRR=%d mVRH=%d bitmap sn=%d len=%d missing runs=%d",
+						(int)mVRR,(int)mVRH,(int)sn,mapBits,runs);
+					sn = mapBits >= span ? end : addSN(sn,mapBits);
+					found = true;
+					continue;
+				}
+			}
+
+			int maxN = (bitsLeft - 8)/16;	// Each LIST SUFI takes 8 + n*16 bits.
 			if (maxN > 15) { maxN = 15; } 	// Max number per LIST SUFI.
-			if (maxN == 0) {break;}
+			if (maxN <= 0) {break;}
 
-			//printf("START maxN=%d sizeBits=%d sizeRemaining=%d\n",maxN,pdu->sizeBits(),pdu->sizeRemaining());
 			for (n = 0; n < maxN && sn != end; n++) {
-				// Scan forward until we find an unreceived PDU, or are finished.
-				// We will already be sitting on an unreceived PDU the first time
-				// through this loop (because sn == mVRR) or if the max cnt was reached below.
-				for (; sn != end && mPduRxQ[sn]; incSN(sn)) { continue; }
+				// Find the next unreceived PDU.  We will already be sitting on one
+				// the first time through this loop.
+				sn = mRxMap.find(sn,end,false);
 				if (sn == end) { break; }
+				// Find the next received PDU, but a range is limited to 16 PDUs.
+				URlcSN limit = deltaSN(end,sn) > 16 ? addSN(sn,16) : end;
 				low[n] = sn;
-				cnt[n] = 1;
-				// Scan forward looking for a received PDU.
-				for (incSN(sn); sn != end && !mPduRxQ[sn] && cnt[n] < 16; incSN(sn)) {
-					cnt[n]++;	// sn is another adjacent unreceived PDU.
-				}
+				sn = mRxMap.find(sn,limit,true);
+				cnt[n] = deltaSN(sn,low[n]);
 			}
 			if (n) {
 				// Output the List SUFI.
@@ -719,7 +959,6 @@ bool URlcRecvAm::addAckNack(URlcPdu *pdu)
 				pdu->appendField(SUFI_LIST,4);
 				pdu->appendField(n,4);
 				char debugmsg[400], *cp = debugmsg;
-				//printf("BEFORE sizeBits=%d sizeRemaining=%d\n",pdu->sizeBits(),pdu->sizeRemaining());
 				cp += sprintf(cp,"Ack Sufi mVRR=%d mVRH=%d missing:",(int)mVRR,(int)mVRH);
 				for (int i = 0; i < n; i++) {
 					// The length field in the sufi is cnt-1, ie, 0 indicates
@@ -728,8 +967,6 @@ bool URlcRecvAm::addAckNack(URlcPdu *pdu)
 					pdu->appendField(cnt[i]-1,4);
 					cp += sprintf(cp," %d",low[i]);
 					if (cnt[i]>1) { cp += sprintf(cp,"-%d(%d pdus)",low[i]+cnt[i]-1,cnt[i]);}
-
-					//RLCLOG("AFTER i=%d sizeBits=%d sizeRemaining=%d\n",i,pdu->sizeBits(),pdu->sizeRemaining());
 				}
 				RLCLOG("%s",debugmsg);
 				found = true;
@@ -787,12 +1024,36 @@ URlcPdu *URlcTransAm::getStatusPdu()
 	return pdu;
 }
 
+// COUNT-C for a data pdu we are sending.  All the pdus in the transmit window precede VTS,
+// so if the SN is numerically at or above VTS it was sent before VTS wrapped.
+uint32_t URlcTransAm::dlCipherCount(URlcSN sn)
+{
+	return ((parent()->mDLHFN - (sn >= mVTS ? 1 : 0)) << 12) | sn;
+}
+
+int URlcTransAm::rlcStartDlCiphering(unsigned margin)
+{
+	ScopedLock lock(parent()->mAmLock);
+	URlcSN sn = addSN(mVTS,margin);
+	mDlCipherActCount = ((parent()->mDLHFN + (sn < mVTS ? 1 : 0)) << 12) | sn;
+	mDlCipherActive = true;
+	return sn;
+}
+
+void URlcRecvAm::rlcStartUlCiphering(unsigned activationSN)
+{
+	ScopedLock lock(parent()->mAmLock);
+	URlcSN sn = activationSN % AmSNS;
+	mUlCipherActCount = ((parent()->mULHFN + (sn < mVRR ? 1 : 0)) << 12) | sn;
+	mUlCipherActive = true;
+}
+
 // The SUFI received by the receiver advances VTA in the transmitter.
 // PDUs up to sn (or sn+1?) have been acknowledged by the peer entity.
 void URlcTransAm::advanceVTA(URlcSN newvta)
 {
 	for ( ; deltaSN(mVTA,newvta) < 0; incSN(mVTA)) {
-		if (mPduTxQ[mVTA]) { delete mPduTxQ[mVTA]; mPduTxQ[mVTA] = NULL; }
+		if (mPduTxQ[mVTA]) { delete mPduTxQ[mVTA]; mPduTxQ[mVTA] = NULL; mNackMap.clear(mVTA); }
 	}
 }
 
@@ -845,9 +1106,7 @@ void URlcTransAm::processSUFIs2(
 				sn = vec->readField(rp,12);
 				if (i == 0) { newva = minSN(newva,sn); newvaValid=true; }
 				unsigned nackcount = vec->readField(rp,4) + 1;
-				for (j = 0; j < nackcount; j++, incSN(sn)) {
-					setNAck(sn);
-				}
+				setNAckRange(sn,nackcount);
 			}
 			RLCLOG("received SUFI_LIST n=%d",numpairs);
 			continue;
@@ -863,13 +1122,15 @@ void URlcTransAm::processSUFIs2(
 			// to pay attention to the negative acks in the bitmap.
 			unsigned maplen = 8*(vec->readField(rp,4) + 1);	// Size of bitmap in bits
 			sn = vec->readField(rp,12);
-			for (i = 0; i < maplen; i++, incSN(sn)) {
-				int bit = vec->readField(rp,1);
-				if (bit == 0) {
-					newva = minSN(newva,sn);
-					newvaValid = true;
-					setNAck(sn);
-				}
+			// Take the bitmap 32 bits at a time and visit only the zero (nacked) bits.
+			for (i = 0; i < maplen; i += j) {
+				j = std::min(32u,maplen - i);
+				uint32_t nacks = ~(uint32_t)vec->readField(rp,j) & (0xffffffffu >> (32 - j));
+				if (nacks == 0) { continue; }
+				// The first nacked block is the most significant set bit.
+				newva = minSN(newva,addSN(sn,i + j - 1 - (31 - __builtin_clz(nacks))));
+				newvaValid = true;
+				setNAckBits(addSN(sn,i),nacks,j);
 			}
 			continue;
 		}
@@ -895,10 +1156,8 @@ void URlcTransAm::processSUFIs2(
 					accumulator = (accumulator << 3) | (cw>>1);
 					if (cw & 1) {
 						if (superSpecialErrorBurstIndicatorFlag) {
-							while (accumulator--) {
-								setNAck(sn);
-								incSN(sn);
-							}
+							setNAckRange(sn,accumulator);
+							sn = addSN(sn,accumulator);
 						} else {
 							// Gag me, the spec is not clear what the distance really is:
 							// "the number ... represents a distance between the previous indicated
@@ -983,10 +1242,11 @@ void URlcTransAm::advanceVS(bool fromScratch)
 	} else {
 		incSN(mVSNack);	// Skip nacked block we just sent.
 	}
-	for ( ; deltaSN(mVSNack,mVTS) < 0; incSN(mVSNack)) {
-		URlcPdu *pdu = mPduTxQ[mVSNack];
-		if (! pdu) { continue; } // block was acked and deleted.
-		if (pdu->mNacked) return;
+	// mNackMap only has bits for blocks still in mPduTxQ, so acked and deleted
+	// blocks are skipped along with the un-nacked ones.
+	if (deltaSN(mVSNack,mVTS) < 0) {
+		mVSNack = mNackMap.find(mVSNack,mVTS,true);
+		if (mVSNack != mVTS) return;
 	}
 	// No more negatively acknowledged blocks at the moment.
 	// But note there may be lots of blocks that are UnAcked.
@@ -1131,6 +1391,8 @@ URlcPdu *URlcTransAm::readLowSidePdu2()
 		// TODO: If we support piggy-backed status, that needs to be fixed here too.
 		pdu = mPduTxQ[mVSNack];
 		pdu->mNacked = false;
+		__atomic_fetch_add(&mRetransmits,1,__ATOMIC_RELAXED);
+		mNackMap.clear(mVSNack);
 		// Unset the poll bit in case it had been set on the previous transmission.
 		pdu->setAmP(false);
 		advanceVS(false);
@@ -1206,6 +1468,7 @@ URlcPdu *URlcTransAm::readLowSidePdu2()
 						RLCERR("internal error: pdu[mVTS-1] is missing");
 						return NULL;
 					}
+					__atomic_fetch_add(&mRetransmits,1,__ATOMIC_RELAXED);
 				} else {
 					return NULL;
 				}
@@ -1224,10 +1487,11 @@ URlcPdu *URlcTransAm::readLowSidePdu2()
 	}
 
 	// If sending a data pdu, it is saved in mPduTxQ, so we have to send a copy
-	// for the caller to delete.
+	// for the caller to delete.  The copy is what gets ciphered.
 	if (pdu) {
 		pdu = new URlcPdu(pdu);
 		RN_MEMLOG(URlcPdu,pdu);
+		rlcCipher(*pdu,2,dlCipherCount(pdu->getAmSN()),true);
 	}
 
 	return pdu;
@@ -1300,6 +1564,32 @@ void URlcTrans::textTrans(std::ostream &os)
 	os <<LOGVAR2("rlcGetPduCnt",rlcGetPduCnt());
 	os <<LOGVAR2("rlcGetFirstPduSizeBits",rlcGetFirstPduSizeBits());
 	os <<LOGVAR2("rlcGetDlPduSizeBytes",rlcGetDlPduSizeBytes());
+	textAqm(os);
+}
+
+// The queue delay and drop statistics, for the rlcstat CLI command.
+void URlcTrans::textAqm(std::ostream &os)
+{
+	os <<LOGVAR2("aqm",(mAqmEnabled ? (mAqmEcn ? "codel+ecn" : "codel") : "off"));
+	os <<LOGVAR2("delayMs",mAqmLastDelayMs) <<LOGVAR2("avgDelayMs",(int)mAqmAvgDelayMs)
+		<<LOGVAR2("maxDelayMs",mAqmMaxDelayMs);
+	os <<LOGVAR2("drops",mAqmDrops) <<LOGVAR2("marks",mAqmMarks) <<LOGVAR2("overflowDrops",mOverflowDrops);
+	if (mAqmDropping) { os <<" dropping"; }
+}
+
+// The counters for 'rlcstat -t', as key=value pairs following those the caller printed.
+// Overflow and AQM drops are counted separately; AQM drops are only those not ECN-marked instead.
+void URlcTrans::textTelemetry(std::ostream &os, bool buckets)
+{
+	os <<LOGVAR2("rlc_sdus",__atomic_load_n(&mSdus,__ATOMIC_RELAXED))
+		<<LOGVAR2("rlc_sdu_bytes",__atomic_load_n(&mSduBytes,__ATOMIC_RELAXED))
+		<<LOGVAR2("rlc_retransmits",__atomic_load_n(&mRetransmits,__ATOMIC_RELAXED))
+		<<LOGVAR2("rlc_drops_overflow",mOverflowDrops) <<LOGVAR2("rlc_drops_aqm",mAqmDrops);
+	mQueueDelay.text(os,"rlc_queue");
+	if (buckets) {
+		os << " rlc_queue_us=";
+		mQueueDelay.textBuckets(os);
+	}
 }
 
 void URlcTransAmUm::textAmUm(std::ostream &os)
@@ -1327,6 +1617,7 @@ void URlcTransAm::transAmReset()
 	for (int i = 0; i < AmSNS; i++) {
 		if (mPduTxQ[i]) { delete mPduTxQ[i]; mPduTxQ[i] = 0; }
 	}
+	mNackMap.clearAll();
 	// mResetTransRSN is explicitly not reset.
 	// mVTRST is explicitly not reset.
 	// mVTMRW = 0;	currently unused
@@ -1396,6 +1687,7 @@ void URlcTransAm::setNAck(URlcSN sn)
 	assert(sn >= 0 && sn < AmSNS);
 	if (URlcPdu *pdu = mPduTxQ[sn]) {
 		pdu->mNacked = true;
+		mNackMap.set(sn);
 		mNackedBlocksWaiting = true;
 		RLCLOG("setNack %d pdu->sn=%d",(int)sn,pdu->getAmSN());
 	} else {
@@ -1404,6 +1696,43 @@ void URlcTransAm::setNAck(URlcSN sn)
 }
 
 
+// Set the nack indicator for count queued blocks starting at sn, as for a LIST SUFI.
+// Return the number of blocks that were in the queue.
+unsigned URlcTransAm::setNAckRange(URlcSN sn, unsigned count)
+{
+	URlcSN first = sn;
+	unsigned nacked = 0;
+	for (unsigned i = 0; i < count; i++, incSN(sn)) {
+		if (URlcPdu *pdu = mPduTxQ[sn]) {
+			pdu->mNacked = true;
+			mNackMap.set(sn);
+			nacked++;
+		}
+	}
+	if (nacked) { mNackedBlocksWaiting = true; }
+	RLCLOG("setNAckRange sn=%d count=%u nacked=%u",(int)first,count,nacked);
+	return nacked;
+}
+
+// Set the nack indicator for the blocks whose bits are set in nacks, an nbits long piece of a BITMAP SUFI
+// in which the most significant bit is sn.  Only the set bits are visited.
+unsigned URlcTransAm::setNAckBits(URlcSN sn, uint32_t nacks, unsigned nbits)
+{
+	unsigned nacked = 0;
+	while (nacks) {
+		unsigned top = 31 - __builtin_clz(nacks);
+		nacks &= ~((uint32_t)1 << top);
+		URlcSN nsn = addSN(sn,nbits - 1 - top);
+		if (URlcPdu *pdu = mPduTxQ[nsn]) {
+			pdu->mNacked = true;
+			mNackMap.set(nsn);
+			nacked++;
+		}
+	}
+	if (nacked) { mNackedBlocksWaiting = true; }
+	return nacked;
+}
+
 // reset procedure goes both ways:
 // 1. we send reset, finish reset upon receipt of reset_ack.
 //		In this case, continue to send reset until we get reset_ack.
@@ -1483,6 +1812,7 @@ void URlcRecvAm::recvAmReset()
 	for (int i = 0; i < AmSNS; i++) {
 		if (mPduRxQ[i]) { delete mPduRxQ[i]; mPduRxQ[i] = 0; }
 	}
+	mRxMap.clearAll();
 }
 
 void URlcRecvUm::text(std::ostream &os)
@@ -1775,6 +2105,8 @@ void URlcRecvAm::rlcWriteLowSide(const BitVector &pdubits)
 
 		URlcPdu *pdu2 = new URlcPdu(pdubits,parent(),"ul am data");
 		RN_MEMLOG(URlcPdu,pdu2);
+		// sn is within the receive window, so if it is below VRR numerically it is in the next HFN.
+		rlcCipher(*pdu2,2,((parent()->mULHFN + (sn < mVRR ? 1 : 0)) << 12) | sn,false);
 
 		// Process piggy-backed status immediately.
 		parsePduData(*pdu2,2,pdu2->getAmHE() & 1,true);
@@ -1795,6 +2127,7 @@ void URlcRecvAm::rlcWriteLowSide(const BitVector &pdubits)
 		}
 
 		mPduRxQ[sn] = pdu2;
+		mRxMap.set(sn);
 
 		if (deltaSN(sn,mVRH) >= 0) {
 			if (mConfig->mStatusDetectionOfMissingPDU) {
@@ -1815,7 +2148,9 @@ void URlcRecvAm::rlcWriteLowSide(const BitVector &pdubits)
 				parsePduData(*pdu3,2,pdu3->getAmHE() & 1,false);
 				delete pdu3;
 				mPduRxQ[mVRR] = 0;
+				mRxMap.clear(mVRR);
 				incSN(mVRR);
+				if (mVRR == 0) { parent()->mULHFN++; }
 			}
 		} else {
 			// It is not possible for block mVRR to exist yet.
@@ -1831,6 +2166,8 @@ void URlcRecvUm::rlcWriteLowSide(const BitVector &pdubits)
 	URlcPdu pdu(pdubits,this,"ul um");
 
 	URlcSN sn = pdu.getSN();
+	// mULHFN applies to VRUS; an SN ahead of VRUS but numerically below it is in the next HFN.
+	rlcCipher(pdu,1,((mULHFN + (sn < mVRUS && deltaSN(sn,mVRUS) >= 0 ? 1 : 0)) << 7) | sn,false);
 #if RLC_OUT_OF_SEQ_OPTIONS	// not fully implemented
 	if (mConfig->mmConfigOSR) {
 		// 11.2.3.1 SDU discard and re-assembly
@@ -1845,6 +2182,7 @@ void URlcRecvUm::rlcWriteLowSide(const BitVector &pdubits)
 		// Set mLostPdu to continue to discard data until we find a certain start of a new sdu.
 		mLostPdu = true;
 	}
+	if (addSN(sn,1) < mVRUS && deltaSN(sn,mVRUS) >= 0) { mULHFN++; }
 	mVRUS = addSN(sn,1);
 
 	// Note: payload does not 'own' memory; must delete original pdu when finished.
@@ -1868,6 +2206,16 @@ unsigned computeDlRlcSize(RBInfo *rb, RrcTfs *dltfs)
 }
 
 
+// 33.102 6.6.4.1: RBs set up after ciphering has started are ciphered from their first pdu,
+// with the HFN starting from START, which is 0 for us.
+static void rlcInheritCiphering(URlcPair *pair, UEInfo *uep)
+{
+	if (uep && uep->integrity.isCipheringStarted()) {
+		pair->mDown->mDlCipherActive = true;
+		pair->mUp->mUlCipherActive = true;
+	}
+}
+
 // Allocate the uplink and downlink RLC entities for this rb.
 URlcPair::URlcPair(RBInfo *rb, RrcTfs *dltfs, UEInfo *uep, TrChId tcid)
 	: mTcid(tcid)
@@ -1893,6 +2241,7 @@ URlcPair::URlcPair(RBInfo *rb, RrcTfs *dltfs, UEInfo *uep, TrChId tcid)
 		URlcAm *amrlc = new URlcAm(rb,dltfs,uep,dlPduSizeBytes);	// Includes UrlcTransAm and UrlcRecvAm
 		mDown = amrlc;
 		mUp = amrlc;
+		rlcInheritCiphering(this,uep);
 		return;
 		}
 	case URlcModeUm:
@@ -1914,6 +2263,7 @@ URlcPair::URlcPair(RBInfo *rb, RrcTfs *dltfs, UEInfo *uep, TrChId tcid)
 		break;
 
 	}
+	rlcInheritCiphering(this,uep);
 }
 
 URlcPair::~URlcPair()
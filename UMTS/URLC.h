@@ -20,6 +20,7 @@
 #include "ScalarTypes.h"
 #include "Threads.h"
 #include "Interthread.h"
+#include "Histogram.h"
 #include "GSMCommon.h"
 #include "URRCTrCh.h"
 #include "URRCRB.h"
@@ -158,6 +159,44 @@ void l2RlcStart();
 static const int AmSNS = 4096;		// 12 bits wide
 static const int UmSNS = 128;		// 7 bits wide
 
+// One bit per AM sequence number.
+// The AM receiver and transmitter shadow their PDU arrays with one of these
+// so that runs of missing or nacked PDUs can be found a 64-bit word at a time
+// instead of walking the PDU pointer arrays one SN at a time.
+class URlcSNBitmap
+{
+	static const unsigned sNumWords = AmSNS/64;
+	uint64_t mWords[sNumWords];
+
+	public:
+	URlcSNBitmap() { clearAll(); }
+	void clearAll() { memset(mWords,0,sizeof(mWords)); }
+	void set(unsigned sn) { mWords[sn>>6] |= (uint64_t)1 << (sn&63); }
+	void clear(unsigned sn) { mWords[sn>>6] &= ~((uint64_t)1 << (sn&63)); }
+	bool test(unsigned sn) const { return (mWords[sn>>6] >> (sn&63)) & 1; }
+
+	// Return the first SN in the modulo range [from,end) whose bit equals val,
+	// or end if there is none.  from == end is an empty range.
+	unsigned find(unsigned from, unsigned end, bool val) const {
+		unsigned sn = from;
+		while (sn != end) {
+			unsigned remaining = (end - sn) & (AmSNS-1);
+			unsigned bit = sn & 63;
+			unsigned avail = 64 - bit;
+			uint64_t word = mWords[sn>>6];
+			if (!val) { word = ~word; }
+			word >>= bit;
+			if (word) {
+				unsigned off = __builtin_ctzll(word);
+				if (off < avail) { return off < remaining ? (sn + off) & (AmSNS-1) : end; }
+			}
+			if (avail >= remaining) { return end; }
+			sn = (sn + avail) & (AmSNS-1);
+		}
+		return end;
+	}
+};
+
 
 
 // This is the config as used by the URLC classes.
@@ -393,6 +432,16 @@ class URlcBase
 	URlcSN minSN(URlcSN sn1, URlcSN sn2);
 	URlcSN maxSN(URlcSN sn1, URlcSN sn2);
 	void incSN(URlcSN &psn);
+
+	// Ciphering of AM and UM pdus, 33.102 6.6; TM pdus are ciphered in MAC-d instead.
+	// Once ciphering is started in the UE, a pdu is ciphered if its COUNT-C is at or beyond
+	// the activation COUNT-C for its direction, which the RRC sets from the activation
+	// SNs exchanged in the SecurityModeCommand/Complete.  RLC entities created after
+	// ciphering has started cipher from the first pdu.
+	Bool_z mDlCipherActive, mUlCipherActive;
+	UInt_z mDlCipherActCount, mUlCipherActCount;
+	void rlcCipher(ByteVector &pdu, unsigned headerBytes, uint32_t count, bool downlink);
+
 	// Currently this is used only for debug messages:
 	virtual unsigned getRlcHeaderSize() { return 0; }	// If not over-ridden, return 0.
 };
@@ -440,6 +489,8 @@ struct URlcDownSdu : public URlcBasePdu
 	bool mDiscardReq;	// Discard request from upper layer.
 	unsigned mMUI;		// SDU identifier, aka Message Unit Identifier.
 	string mDescr;
+	Timeval mEnqueueTime;	// When the sdu entered the SduTxQ, for the AQM sojourn time.
+	bool mAqmChecked;	// Set once the AQM has looked at this sdu at the head of the queue.
 
 	URlcDownSdu *mNext;	// The SDU can be placed in a SingleLinkedList
 	URlcDownSdu *next() { return mNext; }
@@ -448,7 +499,7 @@ struct URlcDownSdu : public URlcBasePdu
 
 	URlcDownSdu(ByteVector &wData, bool wDR, unsigned wMUI, string wDescr) :
 		URlcBasePdu(wData,wDescr), mDiscarded(0), mDiscardReq(wDR),
-		mMUI(wMUI), mNext(0)
+		mMUI(wMUI), mAqmChecked(0), mNext(0)
 		{}
 
 	// This class is always used by pointer and manually deleted, so no copy constructor
@@ -643,6 +694,39 @@ class URlcTrans : public virtual URlcBase
 	unsigned mTransmissionBufferSizeBytes;
 	string mRlcid;
 
+	// Active Queue Management on the SduTxQ.  This is CoDel (RFC 8289) using the sojourn
+	// time of each sdu in the SduTxQ, which is evaluated once per sdu when it reaches the head
+	// of the queue.  It is only enabled on the user data RBs, never on the SRBs.
+	// If ECN is enabled, IP sdus that are ECN-capable are marked CE instead of being dropped.
+	Bool_z mAqmEnabled;
+	Bool_z mAqmEcn;
+	UInt_z mAqmTargetMs;		// Acceptable standing queue delay.
+	UInt_z mAqmIntervalMs;		// Sliding window over which the delay must stay above target.
+	Timeval mAqmEpoch;			// All AQM times are in msecs relative to this.
+	Bool_z mAqmDropping;		// In the dropping state.
+	Bool_z mAqmAboveTarget;		// The delay has been above target since mAqmFirstAboveTime.
+	long mAqmFirstAboveTime;
+	long mAqmDropNext;
+	UInt_z mAqmCount;			// Drops since entering dropping state.
+	UInt_z mAqmLastCount;
+	// Statistics, reported by the rlcstat CLI command.
+	UInt_z mAqmDrops;			// SDUs dropped by the AQM.
+	UInt_z mAqmMarks;			// SDUs marked ECN-CE by the AQM.
+	UInt_z mOverflowDrops;		// SDUs dropped because mTransmissionBufferSizeBytes was exceeded.
+	UInt_z mAqmLastDelayMs;		// Sojourn time of the most recent sdu to reach the head of the queue.
+	UInt_z mAqmMaxDelayMs;
+	Float_z mAqmAvgDelayMs;		// Smoothed sojourn time.
+	// Telemetry on the user data RBs, reported by 'rlcstat -t'.  Counted with relaxed atomics.
+	uint64_t mSdus, mSduBytes;	// SDUs given to us by the layer above.
+	uint64_t mRetransmits;		// AMD PDUs sent again, after a NACK or to carry a poll.
+	LatencyHistogram mQueueDelay;	// Time from rlcWriteHighSide until the SDU starts out in a PDU.
+
+	URlcDownSdu *aqmHead();
+	bool aqmOkToDrop(URlcDownSdu *sdu, long now);
+	bool aqmDropOrMark(URlcDownSdu *sdu);
+	long aqmControlLaw(long t);
+	void aqmDequeue();
+
 	public:
 	URlcTrans();
 
@@ -664,13 +748,29 @@ class URlcTrans : public virtual URlcBase
 	virtual unsigned rlcGetDlPduSizeBytes() { return 0; }	// Not defined for RLC-TM, so return 0.
 
 	virtual void triggerReset() { }
+	// Start ciphering at the pdu margin pdus from now, and return its SN, or -1 for RLC-TM.
+	virtual int rlcStartDlCiphering(unsigned margin) { return -1; }
 	void textTrans(std::ostream &os);
+	void textAqm(std::ostream &os);
+	void textTelemetry(std::ostream &os, bool buckets);
 	const char *rlcid() { return mRlcid.c_str(); }
 	virtual void text(std::ostream &os) = 0;
 };
 #if URLC_IMPLEMENTATION
-	URlcTrans::URlcTrans() : mSplitSdu(0), mVTSDU(0) {
-		mTransmissionBufferSizeBytes = gConfig.getNum("UMTS.RLC.TransmissionBufferSize");
+	URlcTrans::URlcTrans() : mSplitSdu(0), mVTSDU(0), mAqmFirstAboveTime(0), mAqmDropNext(0),
+		mSdus(0), mSduBytes(0), mRetransmits(0) {
+		static const ConfigurationNum transmissionBufferSize(gConfig,"UMTS.RLC.TransmissionBufferSize");
+		static const ConfigurationBool aqm(gConfig,"UMTS.RLC.AQM");
+		static const ConfigurationBool aqmEcn(gConfig,"UMTS.RLC.AQM.ECN");
+		static const ConfigurationNum aqmTarget(gConfig,"UMTS.RLC.AQM.Target");
+		static const ConfigurationNum aqmInterval(gConfig,"UMTS.RLC.AQM.Interval");
+		mQueueDelay.clear();
+		mTransmissionBufferSizeBytes = transmissionBufferSize.get();
+		// The SRBs carry signalling and must never be dropped, so AQM is only for data RBs.
+		mAqmEnabled = mrbid >= 5 && aqm.get();
+		mAqmEcn = aqmEcn.get();
+		mAqmTargetMs = aqmTarget.get();
+		mAqmIntervalMs = aqmInterval.get();
 	}
 	unsigned URlcTrans::rlcGetSduQBytesAvail() {
 		ScopedLock lock(mQLock);
@@ -808,6 +908,9 @@ class URlcRecv :
 	// This is used for testing.
 	void rlcSetHighSide(URlcHighSideFuncType wHighSideFunc) { mHighSideFunc = wHighSideFunc; }
 
+	// Start deciphering at the activation SN reported by the UE.  No-op for RLC-TM.
+	virtual void rlcStartUlCiphering(unsigned activationSN) {}
+
 	URlcRecv() : mHighSideFunc(0) {}
 	const char *rlcid() { return mRlcid.c_str(); }
 	virtual void text(std::ostream &os) = 0;
@@ -909,6 +1012,7 @@ class URlcTransAm :
 
 	URlcPdu* mPduTxQ[AmSNS];		// PDU array, saved for possible retransmission.
 									// Note that only data pdus go in here, not control.
+	URlcSNBitmap mNackMap;			// Bit set for each pdu in mPduTxQ with mNacked set.
 
 	// Variables pat added:
 	bool mNackedBlocksWaiting;	// True if mNackVS is valid.
@@ -937,9 +1041,12 @@ class URlcTransAm :
 
 	bool stalled();
 	void setNAck(URlcSN sn);	// Set the nack indicator for queued block with this sequence number.
+	unsigned setNAckRange(URlcSN sn, unsigned count);	// Same for count blocks starting at sn.
+	unsigned setNAckBits(URlcSN sn, uint32_t nacks, unsigned nbits);
 	URlcPdu *getDataPdu();
 	URlcPdu *getResetPdu(PduType type);
 	URlcPdu *getStatusPdu();
+	uint32_t dlCipherCount(URlcSN sn);
 	void advanceVTA(URlcSN newvta);
 	void advanceVS(bool);
 	void processSUFIs(ByteVector *vec);
@@ -957,6 +1064,7 @@ class URlcTransAm :
 		}
 	void text(std::ostream &os);
 	void triggerReset() { mResetTriggered = true; }	// for testing
+	int rlcStartDlCiphering(unsigned margin);
 };
 
 class URlcRecvAm : // UMTS RLC Acknowledged Mode Receiver
@@ -996,6 +1104,7 @@ class URlcRecvAm : // UMTS RLC Acknowledged Mode Receiver
 	}
 
 	URlcPdu *mPduRxQ[AmSNS];		// PDU array for reassembly.
+	URlcSNBitmap mRxMap;			// Bit set for each non-NULL entry in mPduRxQ.
 	// 11.4.3: Reception of RESET PDU resets all state variables to initial values except VTRST.
 	public:
 	void recvAmReset();	// Happens whenever we get a RESET PDU.
@@ -1004,6 +1113,7 @@ class URlcRecvAm : // UMTS RLC Acknowledged Mode Receiver
 	URlcAm*parent();
 	URlcTransAm*transmitter();
 	bool addAckNack(URlcPdu *pdu);
+	unsigned scanMissing(URlcSN sn, URlcSN end, URlcSN &last);
 	bool isReceiverOk();
 
 	public:
@@ -1012,6 +1122,7 @@ class URlcRecvAm : // UMTS RLC Acknowledged Mode Receiver
 	}
 
 	void rlcWriteLowSide(const BitVector &pdu);
+	void rlcStartUlCiphering(unsigned activationSN);
 	void text(std::ostream &os);
 };
 
@@ -1039,6 +1150,8 @@ class URlcAm : public URlcTransAm, public URlcRecvAm	// UMTS RLC Acknowledged Mo
 	URlcAm(RBInfo *rbInfo,RrcTfs *dltfs,UEInfo *uep,unsigned dlPduSize);
 	// See 9.2.1.7 and 9.2.2.14
 	// HFN defined in 25.331 8.5.8 - 8.5.10, for RRC Message Integrity Protection.
+	// For ciphering, COUNT-C = HFN . SN; the HFN is incremented each time VTS or VRR wraps,
+	// as well as by the reset procedure.
 	UInt_z mULHFN;	// Security stuff.
 	UInt_z mDLHFN;
 
@@ -1075,6 +1188,7 @@ class URlcTransUm : // UMTS RLC Unacknowledged Mode Transmitter
 	// UM Send State Variables
 	URlcSN mVTUS;	// SN of next UM PDU to be transmitted.
 			// Note: For utran side initial value may not be 0?
+	UInt_z mDLHFN;	// 25 bit HFN for COUNT-C = HFN . SN, incremented when VTUS wraps.
 
 	URlcPdu *readLowSidePdu();	// Return a PDU to lower layers, or NULL if queue empty.
 
@@ -1088,6 +1202,7 @@ class URlcTransUm : // UMTS RLC Unacknowledged Mode Transmitter
 		{mConfig.mIsSharedRlc = isShared;}
 	unsigned getRlcHeaderSize() { return 1; }
 	unsigned rlcGetDlPduSizeBytes() { return mConfig.mDlPduSizeBytes; }
+	int rlcStartDlCiphering(unsigned margin);
 	void text(std::ostream &os);
 };
 
@@ -1097,6 +1212,7 @@ class URlcRecvUm : // UMTS RLC Unacknowledged Mode Receiver
 {	public:
 	URlcConfigUm mConfig;
 	URlcSN mVRUS; 	// SN+1 of last UM PDU received
+	UInt_z mULHFN;	// 25 bit HFN for COUNT-C = HFN . SN, incremented when the received SN wraps.
 
 	URlcRecvUm(RBInfo *rbInfo, RrcTfs *dltfs, UEInfo *uep) :
 		URlcBase(URlcModeUm,uep,rbInfo),
@@ -1106,6 +1222,7 @@ class URlcRecvUm : // UMTS RLC Unacknowledged Mode Receiver
 		{}
 
 	void rlcWriteLowSide(const BitVector &pdu);
+	void rlcStartUlCiphering(unsigned activationSN);
 #if RLC_OUT_OF_SEQ_OPTIONS
 	//unsigned VRUDR;	// Expected next SN for DAR (duplicate avoidance and reordering.)
 	//unsigned VRUDH;	// Highest received SN for DAR
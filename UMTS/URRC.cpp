@@ -218,6 +218,9 @@
 namespace UMTS {
 
 Rrc gRrc;
+
+// User data on its way down from the SGSN; see PacketStage.
+static PacketStage sRrcStage("rrc");
 // These are the configs for CCCH and DCCH.
 // The message may be on the same FACH, distinguished by MAC header.
 RrcMasterChConfig gRrcCcchConfig_s;
@@ -319,6 +322,18 @@ void RBInfo::defaultConfigSrbRlcAm()
 	// rlc_OneSidedReEst(false);
 }
 
+void PdcpInfo::pdcpConfigRfc2507(unsigned contextSpace)
+{
+	mPdcpPduHeader = true;
+	mRfc2507 = true;
+	// The SGSN does not compress IP options or more than 40 bytes of TCP options,
+	// and a smaller MAX_HEADER leaves room in the UE for more contexts.
+	mMaxHeader = 80;
+	// Split the contexts evenly between TCP and non-TCP; 25.331 wants at least 4 of each.
+	unsigned contexts = contextSpace / mMaxHeader / 2;
+	mTcpSpace = mNonTcpSpace = RN_BOUND(contexts,4u,16u) - 1;
+}
+
 // Default config for a packet-switched data channel.
 // Pat just made this up from scratch.
 void RBInfo::defaultConfigRlcAmPs()
@@ -486,12 +501,67 @@ void UEInfo::ueRegisterActivity()
 	mActivityTime.now();
 }
 
+// The UE list is swept incrementally by this thread rather than on every addUE,
+// so a burst of RRC Connection Requests does not pay for a walk of the whole list each time.
+static const unsigned sPurgePeriodMs = 100;
+static const unsigned sPurgeBatch = 100;	// UEs examined per period.
+
+static void *rrcPurgeServiceLoop(void *arg)
+{
+	Rrc *rrc = (Rrc*)arg;
+	while (1) {
+		msleep(sPurgePeriodMs);
+		rrc->purgeUEs(sPurgeBatch);
+	}
+	return NULL;
+}
+
+void Rrc::rrcDoInit()
+{
+	if (inited) { return; }
+	inited = true;
+	mRrcRNTI = 0xffff&time(NULL);
+	mRrcPurgeThread.start(rrcPurgeServiceLoop,this);
+}
+
+void Rrc::indexUE(UEInfo *uep)
+{
+	mUeByUrnti[uep->mURNTI] = uep;
+	mUeByCrnti[uep->mCRNTI] = uep;
+	if (uep->mUid.defined()) {
+		mUeByAsnId.insert(UEDigestIndex_t::value_type(uep->mUid.digest(),uep));
+	}
+}
+
+void Rrc::unindexUE(UEInfo *uep)
+{
+	UEIndex_t::iterator it;
+	if ((it = mUeByUrnti.find(uep->mURNTI)) != mUeByUrnti.end() && it->second == uep) { mUeByUrnti.erase(it); }
+	if ((it = mUeByCrnti.find(uep->mCRNTI)) != mUeByCrnti.end() && it->second == uep) { mUeByCrnti.erase(it); }
+	if (uep->mUid.defined()) {
+		std::pair<UEDigestIndex_t::iterator,UEDigestIndex_t::iterator> range = mUeByAsnId.equal_range(uep->mUid.digest());
+		for (UEDigestIndex_t::iterator dit = range.first; dit != range.second; dit++) {
+			if (dit->second == uep) { mUeByAsnId.erase(dit); break; }
+		}
+	}
+}
+
+// Caller must hold mUEListLock.
+void Rrc::deleteUE(UEList_t::iterator itr)
+{
+	UEInfo *uep = *itr;
+	if (mPurgeNext == itr) { mPurgeNext++; }
+	unindexUE(uep);
+	mUEList.erase(itr);
+	delete uep;
+}
+
 // Throw away UEs that died.
+// This examines at most maxUEs UEs, resuming where the previous call left off.
 // TODO: This needs work.  The UE will go to CELL_FACH mode just to send
 // a cell_update message, but we dont want to count that as activity.
-void Rrc::purgeUEs()
+void Rrc::purgeUEs(unsigned maxUEs)
 {
-	time_t now; time(&now);
 	ScopedLock lock(mUEListLock);
 	// NOTE: The timers are described in 13.1 and default values are in 10.3.3.43 and 10.3.3.44
 	// T300 is the timer for the RRC connection setup.
@@ -499,10 +569,12 @@ void Rrc::purgeUEs()
 	//int t300 = gConfig.getNum("UMTS.Timers.T300",1000);
 	int tInactivity = 1000*gConfig.getNum("UMTS.Timers.Inactivity.Release");
 	int tDelete = 1000*gConfig.getNum("UMTS.Timers.Inactivity.Delete");
-	RN_FOR_ITR(UEList_t,mUEList,itr) {
+	unsigned cnt = std::min<unsigned>(maxUEs,mUEList.size());
+	for (unsigned n = 0; n < cnt; n++) {
+		if (mPurgeNext == mUEList.end()) { mPurgeNext = mUEList.begin(); }
+		UEList_t::iterator itr = mPurgeNext++;
 		UEInfo *uep = *itr;
 
-
 		// If the UE does not respond to an RRC message, do something, but what?.
 		// They are in RLC-AM mode, so no point in resending.
 		UeTransaction *last = uep->getLastTransaction();
@@ -535,8 +607,7 @@ void Rrc::purgeUEs()
 			if (elapsed > tDelete) {
 				// Temporarily add an alert for this:
 				LOG(ALERT) << "Deleting " << uep;
-				mUEList.erase(itr);
-				delete uep;
+				deleteUE(itr);
 			}
 			break;
 		case stCELL_FACH:
@@ -554,25 +625,27 @@ void Rrc::purgeUEs()
 
 void Rrc::addUE(UEInfo *ue)
 {
-	purgeUEs(); // Now is a fine time to purge the UE list of any dead UEs.
-
 	ScopedLock lock(mUEListLock);
 	mUEList.push_back(ue);
+	indexUE(ue);
+}
+
+// Remove the UE from the list and delete it.
+void Rrc::removeUE(UEInfo *ue)
+{
+	ScopedLock lock(mUEListLock);
+	RN_FOR_ITR(UEList_t,mUEList,itr) {
+		if (*itr == ue) { deleteUE(itr); return; }
+	}
 }
 
 // If ueidtype is 0, look for URNTI, else CRNTI
 UEInfo *Rrc::findUe(bool ueidtypeCRNTI,unsigned uehandle)
 {
-	//ScopedLock lock(mUEListLock);
-	UEInfo *uep;
-	RN_FOR_ALL(UEList_t,mUEList,uep) {
-		if (ueidtypeCRNTI) {
-			if (uehandle == uep->mCRNTI) {return uep;}
-		} else {
-			if (uehandle == uep->mURNTI) {return uep;}
-		}
-	}
-	return NULL;
+	ScopedLock lock(mUEListLock);
+	UEIndex_t &index = ueidtypeCRNTI ? mUeByCrnti : mUeByUrnti;
+	UEIndex_t::iterator it = index.find(uehandle);
+	return it == index.end() ? NULL : it->second;
 }
 
 // Interpreting 25.331 10.3.3.15 InitialUEIdentity.
@@ -585,15 +658,15 @@ UEInfo *Rrc::findUe(bool ueidtypeCRNTI,unsigned uehandle)
 UEInfo *Rrc::findUeByAsnId(AsnUeId *asnId)
 {
 	{ ScopedLock lock(mUEListLock);
-	  UEInfo *uep;
-	  RN_FOR_ALL(UEList_t,mUEList,uep) {
+	  std::pair<UEDigestIndex_t::iterator,UEDigestIndex_t::iterator> range = mUeByAsnId.equal_range(asnId->digest());
+	  for (UEDigestIndex_t::iterator it = range.first; it != range.second; it++) {
 		// If the whole thing matches just use it.
 		// The UE may identify itself one way (eg IMSI) on the first rrc connection request,
 		// then later use TMSI or P-TMSI.
 		// The UE may identify itself by P-TMSI using a P-TMSI that it obtained from us days ago.
 		// None of that matters; we are only trying to identify identical RRC Intial Connection Requests
 		// from the same UE.
-		if (asnId->eql(uep->mUid)) {return uep;}
+		if (asnId->eql(it->second->mUid)) {return it->second;}
 	  }
 	}
 
@@ -880,6 +953,7 @@ void UEInfo::msWriteHighSide(ByteVector &dlpdu, uint32_t rbid, const char *descr
 			delete result;
 		}
 	} else {
+		sRrcStage.arrive(dlpdu);
 		ueWriteHighSide((RbId) rbid, dlpdu, descr);
 	}
 }		
@@ -1235,6 +1309,7 @@ void RrcMasterChConfig::rrcConfigDchPS(DCHFEC *dch, int RABid, bool useTurbo)
 	// Define a simple multiplexed TrCh of width for dch.
 	if (this->mTrCh.dl()->getNumTrCh() == 0) {
 		this->mTrCh.configDchPS(dch, TTI10ms, 16, useTurbo, 340+40, 340);
+		mTemplateKey = mNumRB ? "" : format("PS sf=%u/%u turbo=%d",dch->getDlSF(),dch->getUlSF(),useTurbo);
 	} else {
 		// TrCh setup already configured.
 		// We may be defining a second RAB for a second PDPContext.
@@ -1254,12 +1329,36 @@ void RrcMasterChConfig::rrcConfigDchPS(DCHFEC *dch, int RABid, bool useTurbo)
 	//this->addRAB(rbid,CNDomainId)
 	// TODO: We may want to use RLC-UM for a PFT for TCP/UDP.  Clear?
 	this->setRB(RABid,PSDomain)->defaultConfigRlcAmPs();
+	this->getRB(RABid)->pdcpConfigNone();	// See rrcConfigPdcp.
 	//this->mTrCh.tcdump();
+	std::string rab = format(" rb%d",RABid);
+	if (!mTemplateKey.empty() && mTemplateKey.find(rab) == std::string::npos) { mTemplateKey += rab; }
+}
+
+// Use RFC 2507 header compression on the RAB if it is enabled and the UE says it can do it.
+// This goes in the Radio Bearer Setup, and the SGSN PDCP entity must be set up to match when the UE accepts it.
+// That is sgsnHandleRabSetupResponse calling msGetPdcpConfig, but for UMTS nothing calls it yet:
+// UEInfo is not an MSUEAdapter, and the call in the radio bearer setup completion is under #if 0.
+// Until it is, a UE told to compress would send headers the network cannot expand,
+// so every RAB is set up without compression whatever UMTS.PDCP.HeaderCompression says.
+void RrcMasterChConfig::rrcConfigPdcp(int RABid, ASN::UE_RadioAccessCapability *caps)
+{
+	RBInfo *rb = this->getRB(RABid);
+	rb->pdcpConfigNone();
+#if 0
+	if (!caps || !gConfig.getBool("UMTS.PDCP.HeaderCompression")) { return; }
+	ASN::PDCP_Capability &pdcp = caps->pdcp_Capability;
+	if (pdcp.supportForRfc2507.present != ASN::PDCP_Capability__supportForRfc2507_PR_supported) { return; }
+	long space = asnEnum2long(pdcp.supportForRfc2507.choice.supported);
+	if (space < ASN::MaxHcContextSpace_by1024) { return; }	// The spare value.
+	rb->pdcpConfigRfc2507(512 << space);	// by1024, by2048, ...
+#endif
 }
 
 // The DCH must be SF=128 or higher.
 void RrcMasterChConfig::rrcConfigDchCS(DCHFEC *dch)
 {
+	mTemplateKey = mNumRB ? "" : "CS";
 	this->mTrCh.defaultConfig3TrCh();
 	this->setSRB(1)->defaultConfig3Rb(1);
 	this->setSRB(2)->defaultConfig3Rb(2);
@@ -1351,6 +1450,7 @@ static SGSN::RabStatus rrcAllocateRabForPdp(uint32_t urnti,int rbid,ByteVector &
 	RrcMasterChConfig *newConfig = &uep->mUeDchConfig;
 	bool useTurbo = gConfig.getNum("UMTS.UseTurboCodes") != 0; 
 	newConfig->rrcConfigDchPS(dch, rbid, useTurbo);
+	newConfig->rrcConfigPdcp(rbid, uep->radioCapability);
 
 	// Configure dch.  Use turbo coding.
 #if USE_OLD_DCH
@@ -1402,7 +1502,8 @@ static SGSN::RabStatus rrcAllocateRabForPdp(uint32_t urnti,int rbid,ByteVector &
 	// Return the bps that the UE supplied, not the one we allocated,
 	// which may be a few % lower to better match the quantized QoS peak throughput.
 	// See comments at bw2tier()
-	rabstatus->mRateDownlink = rabstatus->mRateUplink = ops;
+	// RabStatus rates are KByte/sec; the GGSN holds the PDP context to this rate if it shapes traffic.
+	rabstatus->mRateDownlink = rabstatus->mRateUplink = (ops + 999) / 1000;
 	return *rabstatus;
 }
 #endif
@@ -23,6 +23,7 @@
 #include "asn_system.h"
 #include "URRCMessages.h"
 #include "IntegrityProtect.h"
+#include <map>
 namespace ASN {
 //#include "InitialUE-Identity.h"
 #include "UE-RadioAccessCapability.h"
@@ -97,6 +98,11 @@ class RrcMasterChConfig : public RrcDefs
 	// This is used just to limit the loops that look through them.
 	unsigned mNumRB;
 
+	// Describes how rrcConfigDchPS/CS built this config; it is the key for the RRC message template cache,
+	// so two configs with the same key must produce the same messages.  Configs built any other way
+	// leave it empty, and their messages are always encoded from scratch.
+	std::string mTemplateKey;
+
 	RrcMasterChConfig():
 		mNumRB(0)
 		{}
@@ -120,6 +126,8 @@ class RrcMasterChConfig : public RrcDefs
 
 	// Create a DCH channel with the a data channel on the specified RABid.
 	void rrcConfigDchPS(DCHFEC *dch, int RabId, bool useTurbo);
+	// Add header compression to the PS RAB set up by rrcConfigDchPS, if the UE supports it.
+	void rrcConfigPdcp(int RabId, ASN::UE_RadioAccessCapability *caps);
 
 	// Config DCH for CS (circuit-switched, ie, voice).
 	// FIXME: Finish this.  I set up the RBInfo and TrChInfo, but we still
@@ -147,27 +155,42 @@ class Rrc : public UEDefs
 
 
 	Bool_z inited;
+	Thread mRrcPurgeThread;		// Runs purgeUEs periodically.
 	public:
-	void rrcDoInit() {
-		if (inited) { return; }
-		inited = true;
-		mRrcRNTI = 0xffff&time(NULL);
-	}
+	void rrcDoInit();
 
 	// List of UE we have heard from.
 	Mutex mUEListLock;
 	typedef std::list<UEInfo*> UEList_t;
 	UEList_t mUEList;
 
+	// Indexes into mUEList, all protected by mUEListLock.
+	// Every RACH/CCCH message and every uplink DCH TB looks up the UE, so we dont walk the list.
+	// The CRNTI wraps around after 64K UEs so a stale UE may share a CRNTI with a new one;
+	// the index always points to the newest.
+	// The initial UE identity index is keyed by AsnUeId::digest(), so candidates must still be
+	// checked with AsnUeId::eql().
+	typedef std::map<uint32_t,UEInfo*> UEIndex_t;
+	typedef std::multimap<uint32_t,UEInfo*> UEDigestIndex_t;
+	UEIndex_t mUeByUrnti;
+	UEIndex_t mUeByCrnti;
+	UEDigestIndex_t mUeByAsnId;
+	UEList_t::iterator mPurgeNext;	// Where the incremental purgeUEs sweep resumes.
+
+	void indexUE(UEInfo *uep);
+	void unindexUE(UEInfo *uep);
+	void deleteUE(UEList_t::iterator itr);
+
 	// If ueidtype is 0, look for URNTI, else CRNTI
 	UEInfo *findUe(bool ueidtypeCRNTI,unsigned ueid);
 	UEInfo *findUeByUrnti(uint32_t urnti) {return findUe(false,urnti);}
 	UEInfo *findUeByAsnId(AsnUeId *ueid);
-	void purgeUEs();
+	void purgeUEs(unsigned maxUEs);
 	void addUE(UEInfo *ue);
+	void removeUE(UEInfo *ue);
 
 	// Dont init anything in the constructor to avoid an initialization race with UMTSConfig.
-	Rrc() { mUEListLock.unlock();}
+	Rrc() { mUEListLock.unlock(); mPurgeNext = mUEList.end(); }
 
 	// The crnti is 16 bits for UE id and the urnti is 12 bits for SRNC id and 20 bits for UE id.
 	// We will use the same UE id for both.
@@ -382,13 +405,14 @@ class UEInfo : public UEDefs
 	public:
 	DCCHLogicalChannel *allocateLogicalChannel();
 
-	UEInfo(AsnUeId *wUid) : mUid(*wUid)
+	// The rrc is only something other than gRrc for the rrctest benchmarks.
+	UEInfo(AsnUeId *wUid, Rrc *rrc = &gRrc) : mUid(*wUid)
 	{
 		_initUEInfo();
 		// Allocate a RNTI for this new UE.
-		gRrc.newRNTI(&mURNTI,&mCRNTI);
+		rrc->newRNTI(&mURNTI,&mCRNTI);
 		//connectUeRlc(gRrcCcchConfig);	// Not necessary
-		gRrc.addUE(this);
+		rrc->addUE(this);
 	}
 
 	UEInfo(uint32_t urnti) {
@@ -20,6 +20,7 @@
 ////#include "SgsnExport.h"
 #include "URRC.h"
 #include "UMTSLogicalChannel.h"
+#include "GSML3CommonElements.h"
 //#include "asn_system.h"	included from AsnHelper.h
 namespace ASN {
 //#include "BIT_STRING.h"
@@ -28,6 +29,10 @@ namespace ASN {
 #include "UL-DCCH-Message.h"
 #include "DL-DCCH-Message.h"
 #include "InitialUE-Identity.h"
+#include "PCCH-Message.h"
+#include "PagingRecord.h"
+#include "PagingRecordList.h"
+#include "HeaderCompressionInfo.h"
 #define PAT_SAMSUNG_TEST 1	// Try to get the samsung galaxy to accept this message.
 
 #include "asn_SEQUENCE_OF.h"
@@ -153,7 +158,7 @@ ASN::RRC_StateIndicator UEState2Asn(UEState state)
 
 // Run the Integrity Protection Algorithm and ASN encode the message.
 // Return result in &result.
-static bool encodeDcchMsg(UEInfo *uep, RbId rbid, ASN::DL_DCCH_Message_t *msg, ByteVector &result, string descr)
+static bool encodeDcchMsg(UEInfo *uep, RbId rbid, ASN::DL_DCCH_Message_t *msg, ByteVector &result, string descr, bool log = true)
 {
 	if (uep->integrity.isStarted()) {
 		// Step 1: Set the integrity check info to the values for encoding specified in 10.3.3.16.
@@ -187,8 +192,10 @@ static bool encodeDcchMsg(UEInfo *uep, RbId rbid, ASN::DL_DCCH_Message_t *msg, B
 	// Encode the message (again), completely oblivious to cpu cycles consumed.
 	if (!uperEncodeToBV(&ASN::asn_DEF_DL_DCCH_Message,msg,result,descr)) {return false;}
 
-	std::string comment = format("DL_DCCH %s message size=%d",descr.c_str(),result.size());
-	asnLogMsg(rbid, &ASN::asn_DEF_DL_DCCH_Message, msg,comment.c_str(),uep);
+	if (log) {
+		std::string comment = format("DL_DCCH %s message size=%u",descr.c_str(),(unsigned)result.size());
+		asnLogMsg(rbid, &ASN::asn_DEF_DL_DCCH_Message, msg,comment.c_str(),uep);
+	}
 
 	//if (gConfig.getNum("UMTS.Debug.Messages")) {
 	//	asn_fprint(stdout,&ASN::asn_DEF_DL_DCCH_Message, msg);
@@ -220,6 +227,84 @@ static bool encodeCcchMsg(ASN::DL_CCCH_Message_t *msg, ByteVector &result,
 	return stat;
 }
 
+// The messages produced from an AsnMsgTemplate have no asn structure to print, so decode them for the log.
+static void asnLogEncodedMsg(unsigned rbid, ASN::asn_TYPE_descriptor_t *asnp, ByteVector &encoded, const char *comment, UEInfo *uep)
+{
+	static const ConfigurationNum debugMessages(gConfig,"UMTS.Debug.Messages");
+	if (!debugMessages.get() && !IS_LOG_LEVEL(INFO)) { return; }
+	void *decoded = uperDecodeFromByteV(asnp,encoded);
+	if (decoded) {
+		asnLogMsg(rbid,asnp,decoded,comment,uep);
+		ASN_STRUCT_FREE(*asnp,decoded);
+	}
+}
+
+// The big messages sent during connection setup are identical for all UEs with the same
+// channel configuration except for a handful of fields, so we encode each one once
+// as an AsnMsgTemplate and patch the per-UE fields into a copy of it.
+// The key must describe everything that goes into the message except those fields;
+// if there is no such key the message is just encoded from scratch.
+// Templates are never deleted, so the returned pointer may be used after the lock is released.
+class RrcMsgTemplateCache
+{
+	static const unsigned sMaxTemplates = 64;	// Keys come from a few channel configs, so this is plenty.
+	Mutex mLock;
+	typedef std::map<std::string,AsnMsgTemplate*> TemplateMap;
+	TemplateMap mTemplates;
+
+	public:
+	// Return the template, building it on first use, or NULL if the message can not be made from one.
+	const AsnMsgTemplate *find(const std::string &key, AsnMsgTemplate::Builder &builder,
+		unsigned numFields, const unsigned *widths)
+	{
+		ScopedLock lock(mLock);
+		TemplateMap::iterator it = mTemplates.find(key);
+		if (it != mTemplates.end()) { return it->second->valid() ? it->second : NULL; }
+		if (mTemplates.size() >= sMaxTemplates) { return NULL; }
+		AsnMsgTemplate *tp = new AsnMsgTemplate;
+		if (!tp->build(builder,numFields,widths)) {
+			LOG(NOTICE) << "RRC message template unusable, messages will be encoded in full:"<<LOGVAR(key);
+		}
+		mTemplates[key] = tp;	// Even if invalid, so we dont try again.
+		return tp->valid() ? tp : NULL;
+	}
+};
+static RrcMsgTemplateCache gRrcMsgTemplates;
+
+// 10.3.3.16: The integrity check info goes at the very front of a DCCH message, so it is a template field too.
+static const unsigned sIntegrityFieldWidths[2] = { 32, 4 };	// MAC-I, RRC message sequence number.
+
+static void toAsnIntegrityCheckInfo(ASN::DL_DCCH_Message_t *msg, uint32_t maci, unsigned rrcSn)
+{
+	ASN::IntegrityCheckInfo *ici = RN_CALLOC(ASN::IntegrityCheckInfo);
+	msg->integrityCheckInfo = ici;
+	ici->messageAuthenticationCode = allocAsnBIT_STRING(32);
+	AsnBitString2BVTemp(ici->messageAuthenticationCode).setField(0,maci,32);
+	ici->rrc_MessageSequenceNumber = rrcSn;
+}
+
+// Same as encodeDcchMsg but for a message from a template whose last two fields are the integrity
+// check info if integrity protection is on.  The values array must have room for those.
+static bool encodeDcchFromTemplate(UEInfo *uep, RbId rbid, const AsnMsgTemplate *tp,
+	uint32_t *values, unsigned numFields, ByteVector &result)
+{
+	bool ip = uep->integrity.isStarted();
+	if (ip) {
+		// Same procedure as encodeDcchMsg: the MAC-I is computed over the message
+		// with the rbid in the MAC-I field and a 0 sequence number.
+		values[numFields-2] = rbid;
+		values[numFields-1] = 0;
+	}
+	if (!tp->fill(values,result)) { return false; }
+	if (ip) {
+		uint32_t maci = uep->integrity.runF9(rbid,1,result);
+		tp->setField(result,numFields-2,maci);
+		tp->setField(result,numFields-1,uep->integrity.getDlRrcSn(rbid));
+		uep->integrity.advanceDlRrcSn(rbid);
+	}
+	return true;
+}
+
 
 // Same as RB_InformationSetup but without PDCP info.
 // The list we put these things in may be either SRB_InformationSetupList or SRB_InformationSetupList2,
@@ -317,12 +402,31 @@ static ASN::RB_InformationSetup *toAsnRB_InformationSetup(RrcMasterChConfig *mas
 	rbie->rb_Identity = rbid;
 
 	// struct PDCP_Info    *pdcp_Info  /* OPTIONAL */;
-    // We dont use PDCP.  So why is it here at all?  Maybe it is mandatory for non-signalling RBs?
+    // Without header compression we dont use PDCP.  So why is it here at all?  Maybe it is mandatory for non-signalling RBs?
 	rbie->pdcp_Info = RN_CALLOC(ASN::PDCP_Info);
 	rbie->pdcp_Info->losslessSRNS_RelocSupport = RN_CALLOC(ASN::LosslessSRNS_RelocSupport);
 	rbie->pdcp_Info->losslessSRNS_RelocSupport->present = ASN::LosslessSRNS_RelocSupport_PR_notSupported;
 	//rbie->pdcpInfo->mLosslessSRNS_RelocSupport->choice = ASN::NULL;
-	rbie->pdcp_Info->pdcp_PDU_Header = toAsnEnumerated(ASN::PDCP_PDU_Header_absent);
+	rbie->pdcp_Info->pdcp_PDU_Header = toAsnEnumerated(
+		rb->mPdcpPduHeader ? ASN::PDCP_PDU_Header_present : ASN::PDCP_PDU_Header_absent);
+	if (rb->mRfc2507) {
+		// 10.3.4.2 Header compression information.  The fields with default values are left out if they have them.
+		ASN::HeaderCompressionInfo *hcInfo = RN_CALLOC(ASN::HeaderCompressionInfo);
+		hcInfo->algorithmSpecificInfo.present = ASN::AlgorithmSpecificInfo_PR_rfc2507_Info;
+		ASN::RFC2507_Info *rfc2507 = &hcInfo->algorithmSpecificInfo.choice.rfc2507_Info;
+		PdcpInfo defaults;
+#define RFC2507FIELD(field,value) if (rb->value != defaults.value) { rfc2507->field = RN_CALLOC(long); *rfc2507->field = rb->value; }
+		RFC2507FIELD(f_MAX_PERIOD,mFMaxPeriod)
+		RFC2507FIELD(f_MAX_TIME,mFMaxTime)
+		RFC2507FIELD(max_HEADER,mMaxHeader)
+		RFC2507FIELD(tcp_SPACE,mTcpSpace)
+		RFC2507FIELD(non_TCP_SPACE,mNonTcpSpace)
+#undef RFC2507FIELD
+		// RLC-AM delivers in sequence.
+		rfc2507->expectReordering = toAsnEnumerated(ASN::ExpectReordering_reorderingNotExpected);
+		rbie->pdcp_Info->headerCompressionInfoList = RN_CALLOC(ASN::HeaderCompressionInfoList);
+		ASN_SEQUENCE_ADD(&rbie->pdcp_Info->headerCompressionInfoList->list,hcInfo);
+	}
 	
 	// RLC_InfoChoice_t     rlc_InfoChoice;
 	rbie->rlc_InfoChoice.present = ASN::RLC_InfoChoice_PR_rlc_Info;
@@ -562,6 +666,171 @@ static ASN::C_RNTI_t *toAsnCRNTI(unsigned crnti)
 	return result;
 }
 
+// Release 3 version of the RRC Connection Setup.  The per-UE values are arguments so that
+// the template builder can probe the encoding with values of its own.
+// WARNING: The message has a shallow copy of ueInitialId, which must be zeroed before the message is freed.
+static void toAsnRrcConnectionSetupR3(ASN::DL_CCCH_Message &msg, ASN::InitialUE_Identity *ueInitialId,
+	unsigned transactionId, unsigned srncId, unsigned srnti, unsigned crnti)
+{
+	memset(&msg,0,sizeof(msg));
+	msg.message.present = ASN::DL_CCCH_MessageType_PR_rrcConnectionSetup;
+	ASN::RRCConnectionSetup *csp = &msg.message.choice.rrcConnectionSetup;
+
+	// struct RRCConnectionSetup_r3_IEs
+	csp->present = ASN::RRCConnectionSetup_PR_r3;	// Guessing we can use any of the variants.
+	ASN::RRCConnectionSetup_r3_IEs_t *iep = &csp->choice.r3.rrcConnectionSetup_r3;
+
+	// InitialUE_Identity_t     initialUE_Identity;
+	// WARNING: Now there are temporarily two pointers to the memory in UE_Identity.
+	iep->initialUE_Identity = *ueInitialId;
+
+	// RRC_TransactionIdentifier_t  rrc_TransactionIdentifier;
+	iep->rrc_TransactionIdentifier = transactionId;
+
+	// ActivationTime_t    *activationTime /* OPTIONAL */;
+
+	// U_RNTI_t     new_U_RNTI;
+	// U-RNTI is mandatory.
+	// They took apart the U_RNTI into its constituent parts, which was kinda dumb:
+	// the parts are 12 bit SRNC id and 20 bit S-RNTI.
+	toAsnURNTI(&iep->new_U_RNTI,srncId,srnti);
+	//setAsnBIT_STRING(&iep->new_U_RNTI.srnc_Identity,(uint8_t*)calloc(1,2),12);
+	//AsnBitString2BVTemp(iep->new_U_RNTI.srnc_Identity).setField(0,uep->getSrncId(),12);
+	//setAsnBIT_STRING(&iep->new_U_RNTI.s_RNTI,(uint8_t*)calloc(1,3),20);
+	//AsnBitString2BVTemp(iep->new_U_RNTI.s_RNTI).setField(0,uep->getSRNTI(),20);
+
+	// srnti = 0x12345;
+	//ByteVector tst(3);
+	//tst.setField(0,srnti,20);
+	//printf("SRNTI=0x%x bv=%s\n",srnti,tst.hexstr().c_str());
+
+	// C_RNTI_t    *new_c_RNTI /* OPTIONAL */;
+	// C-RNTI
+	iep->new_c_RNTI = toAsnCRNTI(crnti);
+	//iep->new_c_RNTI = RN_CALLOC(ASN::C_RNTI_t);
+	// new_c_RNTI is a BIT_STRING_t
+	//setAsnBIT_STRING(iep->new_c_RNTI,(uint8_t*)calloc(1,2),16);
+	//AsnBitString2BVTemp(iep->new_c_RNTI).setField(0,uep->mCRNTI,16);
+
+
+	// RRC_StateIndicator_t     rrc_StateIndicator;
+	asn_long2INTEGER(&iep->rrc_StateIndicator,ASN::RRC_StateIndicator_cell_FACH);
+
+	// UTRAN_DRX_CycleLengthCoefficient_t   utran_DRX_CycleLengthCoeff;
+	// 10.3.3.49: DRC mode.  "Refers to 'k' in the formula 25.304 Discontinous Reception".
+	iep->utran_DRX_CycleLengthCoeff = 3;	// Must be in range 3..9
+	// skip optional CapabilityUpdateRequirement
+
+	// struct CapabilityUpdateRequirement  *capabilityUpdateRequirement    /* OPTIONAL */;
+	iep->capabilityUpdateRequirement = RN_CALLOC(ASN::CapabilityUpdateRequirement);
+	iep->capabilityUpdateRequirement->ue_RadioCapabilityFDDUpdateRequirement = true;
+		iep->capabilityUpdateRequirement->ue_RadioCapabilityTDDUpdateRequirement = false;
+
+	// SRB_InformationSetupList2_t  srb_InformationSetupList;
+	toAsnSRB_InformationSetupList(gRrcDcchConfig, &iep->srb_InformationSetupList.list);
+
+	// struct UL_CommonTransChInfo *ul_CommonTransChInfo   /* OPTIONAL */;
+	// struct DL_CommonInformation *dl_CommonInformation   /* OPTIONAL */;
+	// UL_AddReconfTransChInfoList_t    ul_AddReconfTransChInfoList;
+	// DL_AddReconfTransChInfoList_t    dl_AddReconfTransChInfoList;
+
+	// All the TrCh info is optional, and not used in our case because we are
+	// defining RACH/FACH rather than DCH, BUT...
+	// For ul_ and dl_AddReconfTransChInfoList we are required to put in something anyway,
+	// and 8.1.3.4 recommends a single zero-sized TF.
+	// You can not use the "NOTHING" option - the ASN compiler just uses
+	// that to mark an uninitialized value and fails.
+	toAsnFakeUL_AddReconfTransChInfoList(&iep->ul_AddReconfTransChInfoList);
+	toAsnDL_AddReconfTransChInfoListSameAsUl(&iep->dl_AddReconfTransChInfoList,31,31);
+
+	// These IEs are all skipped, needed only for DCH:
+	// struct UL_ChannelRequirement    *ul_ChannelRequirement  /* OPTIONAL */;
+	// struct DL_InformationPerRL_List *dl_InformationPerRL_List   /* OPTIONAL */;
+	//PhCh *phch = new PhCh(DPDCHType,256,254,256,9999,NULL); 
+	//iep->ul_ChannelRequirement = phch->toAsnUL_ChannelRequirement();
+	//iep->dl_CommonInformation = phch->toAsnDL_CommonInformation();
+	//iep->dl_InformationPerRL_List = phch->toAsnDL_InformationPerRL_List(); 
+	/*ASN::DL_InformationPerRL_List *result2 = RN_CALLOC(ASN::DL_InformationPerRL_List);
+		ASN::DL_InformationPerRL *one = RN_CALLOC(ASN::DL_InformationPerRL);
+		one->modeSpecificInfo.present = ASN::DL_InformationPerRL__modeSpecificInfo_PR_fdd;
+		int primarySC = gConfig.getNum("UMTS.Downlink.ScramblingCode");
+		one->modeSpecificInfo.choice.fdd.primaryCPICH_Info.primaryScramblingCode = primarySC;
+		//one->dl_DPCH_InfoPerRL = toAsnDL_DPCH_InfoPerRL();
+		ASN_SEQUENCE_ADD(&result2->list,one);
+		iep->dl_InformationPerRL_List = result2;*/
+
+	// struct FrequencyInfo    *frequencyInfo  /* OPTIONAL */;
+
+	// TODO: Do we need this?
+	// MaxAllowedUL_TX_Power_t *maxAllowedUL_TX_Power  /* OPTIONAL */;
+}
+
+// Probes for the RRC Connection Setup template.  The InitialUE_Identity is spliced in,
+// using an IMSI and an ESN as the two references because their CHOICE tags differ in the first bit.
+struct RrcConnectionSetupBuilder : public AsnMsgTemplate::Builder
+{
+	ASN::InitialUE_Identity mRefs[2];
+	ByteVector mRefBits[2];
+	RrcConnectionSetupBuilder() { memset(mRefs,0,sizeof(mRefs)); }
+	~RrcConnectionSetupBuilder() {
+		for (unsigned i = 0; i < 2; i++) {
+			if (mRefs[i].present) { ASN_STRUCT_FREE_CONTENTS_ONLY(ASN::asn_DEF_InitialUE_Identity,&mRefs[i]); }
+		}
+	}
+	// This is only called when the template is built, so the references are set up here, not in the constructor.
+	const ByteVector *spliceRefs() {
+		mRefs[0].present = ASN::InitialUE_Identity_PR_imsi;
+		setASN1SeqOfDigits(&mRefs[0].choice.imsi.list,"001010123456789");
+		mRefs[1].present = ASN::InitialUE_Identity_PR_esn_DS_41;
+		setAsnBIT_STRING(&mRefs[1].choice.esn_DS_41,(uint8_t*)calloc(1,4),32);
+		for (unsigned i = 0; i < 2; i++) {
+			mRefBits[i] = ByteVector(100);
+			// On failure the probes must fail too, or the template would be built without the splice.
+			if (!uperEncodeToBV(&ASN::asn_DEF_InitialUE_Identity,&mRefs[i],mRefBits[i])) { mRefs[0].present = ASN::InitialUE_Identity_PR_NOTHING; }
+		}
+		return mRefBits;
+	}
+	bool encodeProbe(const uint32_t *values, unsigned variant, ByteVector &result) {
+		if (!mRefs[0].present) { return false; }
+		ASN::DL_CCCH_Message msg;
+		toAsnRrcConnectionSetupR3(msg,&mRefs[variant],values[0],values[1],values[2],values[3]);
+		return uperEncodeToBV(&ASN::asn_DEF_DL_CCCH_Message,&msg,result,descrRrcConnectionSetup);
+	}
+};
+
+// Encode the RRC Connection Setup for this UE into result, from the template if possible.
+bool encodeRrcConnectionSetup(UEInfo *uep, ASN::InitialUE_Identity *ueInitialId, unsigned transactionId,
+	ByteVector &result, bool useTemplate, bool log)
+{
+	if (useTemplate) {
+		// The message contents come from gRrcDcchConfig, which is set up once at startup, so the key is constant.
+		static const unsigned widths[4] = { 2, 12, 20, 16 };	// transaction id, SRNC id, S-RNTI, C-RNTI
+		RrcConnectionSetupBuilder builder;
+		const AsnMsgTemplate *tp = gRrcMsgTemplates.find("RrcConnectionSetup r3",builder,4,widths);
+		ByteVector ueid(100);
+		if (tp && uperEncodeToBV(&ASN::asn_DEF_InitialUE_Identity,ueInitialId,ueid)) {
+			uint32_t values[4] = { transactionId, uep->getSrncId(), uep->getSRNTI(), uep->mCRNTI };
+			if (tp->fill(values,result,&ueid)) {
+				if (log) {
+					string comment = format("DL_CCCH %s message size=%u",descrRrcConnectionSetup.c_str(),(unsigned)result.size());
+					asnLogEncodedMsg(0,&ASN::asn_DEF_DL_CCCH_Message,result,comment.c_str(),uep);
+				}
+				return true;
+			}
+		}
+	}
+
+	ASN::DL_CCCH_Message msg;
+	toAsnRrcConnectionSetupR3(msg,ueInitialId,transactionId,uep->getSrncId(),uep->getSRNTI(),uep->mCRNTI);
+	bool ok = log ? encodeCcchMsg(&msg,result,descrRrcConnectionSetup,uep,0) :
+		uperEncodeToBV(&ASN::asn_DEF_DL_CCCH_Message,&msg,result,descrRrcConnectionSetup);
+
+	// Zero out the initialUE_Identity that we copied so that there
+	// is only one copy of it and we dont try to free it twice.
+	memset(&msg.message.choice.rrcConnectionSetup.choice.r3.rrcConnectionSetup_r3.initialUE_Identity,0,sizeof(ASN::InitialUE_Identity_t));
+	return ok;
+}
+
 // NOTE: The RRC Connection Setup messages are defined as using CCCH and SRB0 which is TM
 // uplink and UM downlink.  That makes sense because uplink messages are small and the downlink
 // message is huge and may need to be segmented.
@@ -692,100 +961,7 @@ void sendRrcConnectionSetup(UEInfo *uep, ASN::InitialUE_Identity *ueInitialId)
 
 	} else {
 		// Version 3 of this message.
-
-		// struct RRCConnectionSetup_r3_IEs
-		csp->present = ASN::RRCConnectionSetup_PR_r3;	// Guessing we can use any of the variants.
-		ASN::RRCConnectionSetup_r3_IEs_t *iep = &csp->choice.r3.rrcConnectionSetup_r3;
-
-		// InitialUE_Identity_t     initialUE_Identity;
-		// WARNING: Now there are temporarily two pointers to the memory in UE_Identity.
-		iep->initialUE_Identity = *ueInitialId;
-
-		// RRC_TransactionIdentifier_t  rrc_TransactionIdentifier;
-		iep->rrc_TransactionIdentifier = transactionId;
-
-		// ActivationTime_t    *activationTime /* OPTIONAL */;
-
-		// U_RNTI_t     new_U_RNTI;
-		// U-RNTI is mandatory.
-		// They took apart the U_RNTI into its constituent parts, which was kinda dumb:
-		// the parts are 12 bit SRNC id and 20 bit S-RNTI.
-		toAsnURNTI(&iep->new_U_RNTI,uep->getSrncId(),uep->getSRNTI());
-		//setAsnBIT_STRING(&iep->new_U_RNTI.srnc_Identity,(uint8_t*)calloc(1,2),12);
-		//AsnBitString2BVTemp(iep->new_U_RNTI.srnc_Identity).setField(0,uep->getSrncId(),12);
-		//setAsnBIT_STRING(&iep->new_U_RNTI.s_RNTI,(uint8_t*)calloc(1,3),20);
-		//AsnBitString2BVTemp(iep->new_U_RNTI.s_RNTI).setField(0,uep->getSRNTI(),20);
-
-		// srnti = 0x12345;
-		//ByteVector tst(3);
-		//tst.setField(0,srnti,20);
-		//printf("SRNTI=0x%x bv=%s\n",srnti,tst.hexstr().c_str());
-
-		// C_RNTI_t    *new_c_RNTI /* OPTIONAL */;
-		// C-RNTI
-		iep->new_c_RNTI = toAsnCRNTI(uep->mCRNTI);
-		//iep->new_c_RNTI = RN_CALLOC(ASN::C_RNTI_t);
-		// new_c_RNTI is a BIT_STRING_t
-		//setAsnBIT_STRING(iep->new_c_RNTI,(uint8_t*)calloc(1,2),16);
-		//AsnBitString2BVTemp(iep->new_c_RNTI).setField(0,uep->mCRNTI,16);
-
-
-		// RRC_StateIndicator_t     rrc_StateIndicator;
-		asn_long2INTEGER(&iep->rrc_StateIndicator,ASN::RRC_StateIndicator_cell_FACH);
-
-		// UTRAN_DRX_CycleLengthCoefficient_t   utran_DRX_CycleLengthCoeff;
-		// 10.3.3.49: DRC mode.  "Refers to 'k' in the formula 25.304 Discontinous Reception".
-		iep->utran_DRX_CycleLengthCoeff = 3;	// Must be in range 3..9
-		// skip optional CapabilityUpdateRequirement
-
-		// struct CapabilityUpdateRequirement  *capabilityUpdateRequirement    /* OPTIONAL */;
-		iep->capabilityUpdateRequirement = RN_CALLOC(ASN::CapabilityUpdateRequirement);
-		iep->capabilityUpdateRequirement->ue_RadioCapabilityFDDUpdateRequirement = true;
-			iep->capabilityUpdateRequirement->ue_RadioCapabilityTDDUpdateRequirement = false;
-
-		// SRB_InformationSetupList2_t  srb_InformationSetupList;
-		toAsnSRB_InformationSetupList(gRrcDcchConfig, &iep->srb_InformationSetupList.list);
-
-		// struct UL_CommonTransChInfo *ul_CommonTransChInfo   /* OPTIONAL */;
-		// struct DL_CommonInformation *dl_CommonInformation   /* OPTIONAL */;
-		// UL_AddReconfTransChInfoList_t    ul_AddReconfTransChInfoList;
-		// DL_AddReconfTransChInfoList_t    dl_AddReconfTransChInfoList;
-
-		// All the TrCh info is optional, and not used in our case because we are
-		// defining RACH/FACH rather than DCH, BUT...
-		// For ul_ and dl_AddReconfTransChInfoList we are required to put in something anyway,
-		// and 8.1.3.4 recommends a single zero-sized TF.
-		// You can not use the "NOTHING" option - the ASN compiler just uses
-		// that to mark an uninitialized value and fails.
-		toAsnFakeUL_AddReconfTransChInfoList(&iep->ul_AddReconfTransChInfoList);
-		toAsnDL_AddReconfTransChInfoListSameAsUl(&iep->dl_AddReconfTransChInfoList,31,31);
-
-		// These IEs are all skipped, needed only for DCH:
-		// struct UL_ChannelRequirement    *ul_ChannelRequirement  /* OPTIONAL */;
-		// struct DL_InformationPerRL_List *dl_InformationPerRL_List   /* OPTIONAL */;
-		//PhCh *phch = new PhCh(DPDCHType,256,254,256,9999,NULL); 
-		//iep->ul_ChannelRequirement = phch->toAsnUL_ChannelRequirement();
-		//iep->dl_CommonInformation = phch->toAsnDL_CommonInformation();
-		//iep->dl_InformationPerRL_List = phch->toAsnDL_InformationPerRL_List(); 
-		/*ASN::DL_InformationPerRL_List *result2 = RN_CALLOC(ASN::DL_InformationPerRL_List);
-			ASN::DL_InformationPerRL *one = RN_CALLOC(ASN::DL_InformationPerRL);
-			one->modeSpecificInfo.present = ASN::DL_InformationPerRL__modeSpecificInfo_PR_fdd;
-			int primarySC = gConfig.getNum("UMTS.Downlink.ScramblingCode");
-			one->modeSpecificInfo.choice.fdd.primaryCPICH_Info.primaryScramblingCode = primarySC;
-			//one->dl_DPCH_InfoPerRL = toAsnDL_DPCH_InfoPerRL();
-			ASN_SEQUENCE_ADD(&result2->list,one);
-			iep->dl_InformationPerRL_List = result2;*/
-
-		// struct FrequencyInfo    *frequencyInfo  /* OPTIONAL */;
-
-		// TODO: Do we need this?
-		// MaxAllowedUL_TX_Power_t *maxAllowedUL_TX_Power  /* OPTIONAL */;
-
-		if (!encodeCcchMsg(&msg,result,descrRrcConnectionSetup,uep,0)) {return;}
-
-		// Zero out the initialUE_Identity that we copied above so that there
-		// is only one copy of it and we dont try to free it twice.
-		memset(&iep->initialUE_Identity,0,sizeof(ASN::InitialUE_Identity_t));
+		if (!encodeRrcConnectionSetup(uep,ueInitialId,transactionId,result,true,true)) {return;}
 	}
 
 	LOG(INFO) << "gNodeB: " << gNodeB.clock().get() << ", SCCPCH: " << result;
@@ -826,13 +1002,8 @@ static void sendRrcConnectionReleaseCcch(int32_t urnti)
 	gMacSwitch.writeHighSideCcch(result,descrRrcConnectionRelease);
 }
 
-// This puts the phone in idle mode.
-// 这个函数与GGSN或SGSN无关。它是一个用于将手机置于空闲模式的函数，用于发送RRC连接释放消息。
-// RRC连接是UE和eNodeB之间的连接，因此这个函数与UE和eNodeB之间的通信有关。
-void sendRrcConnectionRelease(UEInfo *uep) //, ASN::InitialUE_Identity *ueInitialId
+static void toAsnRrcConnectionRelease(ASN::DL_DCCH_Message_t &msg, unsigned transactionId)
 {
-	// Create the RB Setup Message.
-	ASN::DL_DCCH_Message_t msg;
 	memset(&msg,0,sizeof(msg));
 	msg.message.present = ASN::DL_DCCH_MessageType_PR_rrcConnectionRelease;
 	msg.message.choice.rrcConnectionRelease.present = ASN::RRCConnectionRelease_PR_r3;
@@ -845,7 +1016,6 @@ void sendRrcConnectionRelease(UEInfo *uep) //, ASN::InitialUE_Identity *ueInitia
 
 
     // RRC_TransactionIdentifier_t  rrc_TransactionIdentifier;
-	unsigned transactionId = uep->newTransactionId();
 	ies->rrc_TransactionIdentifier = transactionId;
 
 	// N_308_t *n_308  /* OPTIONAL */;
@@ -858,9 +1028,96 @@ void sendRrcConnectionRelease(UEInfo *uep) //, ASN::InitialUE_Identity *ueInitia
 	// Causes we might use are: normalEvent, userInactivity, pre_emptiveRelease.
 	ies->releaseCause = toAsnEnumerated(ASN::ReleaseCause_normalEvent);
 	// struct Rplmn_Information    *rplmn_information  /* OPTIONAL */;
+}
 
+// The RRC Connection Release has nothing per-UE but the transaction id, and the integrity check info.
+struct RrcConnectionReleaseBuilder : public AsnMsgTemplate::Builder
+{
+	bool mIntegrity;
+	RrcConnectionReleaseBuilder(bool integrity) : mIntegrity(integrity) {}
+	bool encodeProbe(const uint32_t *values, unsigned variant, ByteVector &result) {
+		ASN::DL_DCCH_Message_t msg;
+		toAsnRrcConnectionRelease(msg,values[0]);
+		if (mIntegrity) { toAsnIntegrityCheckInfo(&msg,values[1],values[2]); }
+		return uperEncodeToBV(&ASN::asn_DEF_DL_DCCH_Message,&msg,result,descrRrcConnectionRelease);
+	}
+};
+
+static void toAsnPagingRecord(ASN::PagingRecord *rec, const PagingRecordInfo &page)
+{
+	rec->present = ASN::PagingRecord_PR_cn_Identity;
+	ASN::PagingRecord::PagingRecord_u::PagingRecord__cn_Identity *cn = &rec->choice.cn_Identity;
+	cn->pagingCause = toAsnEnumerated(page.mCall ?
+		ASN::PagingCause_terminatingConversationalCall : ASN::PagingCause_terminatingLowPrioritySignalling);
+	cn->cn_DomainIdentity = toAsnEnumerated(ASN::CN_DomainIdentity_cs_domain);
+	if (page.mID->type()==GSM::TMSIType) {
+		cn->cn_pagedUE_Identity.present = ASN::CN_PagedUE_Identity_PR_tmsi_GSM_MAP;
+		uint32_t tmsi = page.mID->TMSI();
+		uint8_t *buf = (uint8_t*)calloc(1,4);
+		for (unsigned i=0; i<4; i++) { buf[i] = tmsi >> (24-8*i); }
+		setAsnBIT_STRING(&cn->cn_pagedUE_Identity.choice.tmsi_GSM_MAP,buf,32);
+	} else {
+		cn->cn_pagedUE_Identity.present = ASN::CN_PagedUE_Identity_PR_imsi_GSM_MAP;
+		setASN1SeqOfDigits((void*)&cn->cn_pagedUE_Identity.choice.imsi_GSM_MAP.list,page.mID->digits());
+	}
+}
+
+// 25.331 10.2.20 Paging Type 1, sent on PCCH, which has no MAC header when mapped on PCH.
+unsigned encodePagingType1(const std::vector<PagingRecordInfo> &pages, unsigned first, unsigned maxBits, ByteVector &result)
+{
+	// The pagingRecordList holds 1..maxPage1 records.
+	static const unsigned maxPage1 = 8;
+	ASN::PCCH_Message_t msg;
+	memset(&msg,0,sizeof(msg));
+	msg.message.present = ASN::PCCH_MessageType_PR_pagingType1;
+	ASN::PagingRecordList *list = RN_CALLOC(ASN::PagingRecordList);
+	msg.message.choice.pagingType1.pagingRecordList = list;
+
+	// Add records one at a time until the message no longer fits.
+	// An IMSI record is about 70 bits and a TMSI record about 40, so this stops after a few.
+	unsigned count = 0;
+	for (unsigned i=first; i<pages.size() && count<maxPage1; i++) {
+		ASN::PagingRecord *rec = RN_CALLOC(ASN::PagingRecord);
+		toAsnPagingRecord(rec,pages[i]);
+		ASN_SEQUENCE_ADD(&list->list,rec);
+		ByteVector trial(maxBits/8+32);
+		if (!uperEncodeToBV(&ASN::asn_DEF_PCCH_Message,&msg,trial,"PagingType1") || trial.sizeBits()>maxBits) {
+			ASN::asn_sequence_del(&list->list,list->list.count-1,0);
+			ASN_STRUCT_FREE(ASN::asn_DEF_PagingRecord,rec);
+			break;
+		}
+		count++;
+	}
+	if (count && !uperEncodeToBV(&ASN::asn_DEF_PCCH_Message,&msg,result,"PagingType1")) count = 0;
+	if (count) {
+		string comment = format("PCCH PagingType1 message records=%u size=%u",count,(unsigned)result.size());
+		asnLogMsg(0,&ASN::asn_DEF_PCCH_Message,&msg,comment.c_str());
+	}
+	ASN_STRUCT_FREE_CONTENTS_ONLY(ASN::asn_DEF_PCCH_Message,&msg);
+	return count;
+}
+
+
+// This puts the phone in idle mode.
+// 这个函数与GGSN或SGSN无关。它是一个用于将手机置于空闲模式的函数，用于发送RRC连接释放消息。
+// RRC连接是UE和eNodeB之间的连接，因此这个函数与UE和eNodeB之间的通信有关。
+void sendRrcConnectionRelease(UEInfo *uep) //, ASN::InitialUE_Identity *ueInitialId
+{
+	unsigned transactionId = uep->newTransactionId();
 	ByteVector result(1000);
-	if (!encodeDcchMsg(uep,SRB2,&msg,result,descrRrcConnectionRelease)) {return;}
+	bool ip = uep->integrity.isStarted();
+	const unsigned widths[3] = { 2, sIntegrityFieldWidths[0], sIntegrityFieldWidths[1] };
+	RrcConnectionReleaseBuilder builder(ip);
+	const AsnMsgTemplate *tp = gRrcMsgTemplates.find(ip ? "RrcConnectionRelease ip" : "RrcConnectionRelease",builder,ip?3:1,widths);
+	uint32_t values[3] = { transactionId, 0, 0 };
+	if (tp && encodeDcchFromTemplate(uep,SRB2,tp,values,ip?3:1,result)) {
+		std::string comment = format("DL_DCCH %s message size=%u",descrRrcConnectionRelease.c_str(),(unsigned)result.size());
+		asnLogEncodedMsg(SRB2,&ASN::asn_DEF_DL_DCCH_Message,result,comment.c_str(),uep);
+	} else {
+		ASN::DL_DCCH_Message_t msg;
+		toAsnRrcConnectionRelease(msg,transactionId);
+		if (!encodeDcchMsg(uep,SRB2,&msg,result,descrRrcConnectionRelease)) {return;}
+	}
 
 	// Prepare to receive the reply to this message:
 	UeTransaction(uep,UeTransaction::ttRrcConnectionRelease,0,transactionId,stIdleMode);
@@ -868,24 +1125,21 @@ void sendRrcConnectionRelease(UEInfo *uep) //, ASN::InitialUE_Identity *ueInitia
 	uep->ueWriteHighSide(SRB2, result, descrRrcConnectionRelease);
 }
 
-// 3GPP 25.331 10.2.33
-// This is the main message to create DCH channels.
-// It is invoked by the SGSN to create a RAB for an internet connection.
-// It will also be invoked by GMM L3 to create CS connections.
-// In both cases a state machine in the caller must wait for the phones
-// response before proceeding.
-// 
-// We are sending a setup for a DCH and moving the UE to CELL_DCH state.
-// The masterConfig indicates the DCH L2 setup, for example, how many TrCh.
-// Return non-zero on error.
+// The UE is allowed to request a PS channel on any of RBs 5..15, so check them all.
+// Return the first data channel defined by the config, or mNumRB if none.
+static unsigned firstDataRb(RrcMasterChConfig *masterConfig)
+{
+	RBInfo *rb;  unsigned rbid;
+	for (rbid = 5; rbid < masterConfig->mNumRB; rbid++) {
+		if (!(rb = masterConfig->getRB(rbid)) || !rb->valid()) { continue; }
+		break;
+	}
+	return rbid;
+}
 
-// 这个函数与GGSN或SGSN有关。
-// 它是用于在SGSN或GMM L3中创建RAB（Radio Access Bearer）的主要消息，以便为Internet连接创建RAB。
-// RAB是数据传输的逻辑通道，它需要在GGSN和SGSN之间建立。因此，这个函数与GGSN和SGSN之间的通信有关。
-bool sendRadioBearerSetup(UEInfo *uep, RrcMasterChConfig *masterConfig, PhCh *phch, bool srbstoo)
+static void toAsnRadioBearerSetup(ASN::DL_DCCH_Message_t &msg, RrcMasterChConfig *masterConfig, PhCh *phch,
+	bool srbstoo, unsigned transactionId)
 {
-	// Create the RB Setup Message.
-	ASN::DL_DCCH_Message_t msg;
 	memset(&msg,0,sizeof(msg));
 	msg.message.present = ASN::DL_DCCH_MessageType_PR_radioBearerSetup;
 	ASN::RadioBearerSetup_t &rbstop = msg.message.choice.radioBearerSetup;
@@ -897,7 +1151,6 @@ bool sendRadioBearerSetup(UEInfo *uep, RrcMasterChConfig *masterConfig, PhCh *ph
 
 	// Comments are directly from the ASN::RadioBearerSetup_r3_IEs_t
 	// RRC_TransactionIdentifier_t  rrc_TransactionIdentifier;
-	unsigned transactionId = uep->newTransactionId();
 	rbs.rrc_TransactionIdentifier = transactionId;
 
 	// struct IntegrityProtectionModeInfo  *integrityProtectionModeInfo    /* OPTIONAL */;
@@ -929,15 +1182,7 @@ bool sendRadioBearerSetup(UEInfo *uep, RrcMasterChConfig *masterConfig, PhCh *ph
 	// struct RAB_InformationSetupList *rab_InformationSetupList   /* OPTIONAL */;
 
 
-	// The UE is allowed to request a PS channel on any of RBs 5..15, so check them all.
-	bool haveDataCh = false; // Does the config define any data channels?
-	RBInfo *rb;  unsigned rbid;
-	for (rbid = 5; rbid < masterConfig->mNumRB; rbid++) {
-		if (!(rb = masterConfig->getRB(rbid)) || !rb->valid()) { continue; }
-		haveDataCh = true;
-		break;
-	}
-	if (haveDataCh) {
+	if (firstDataRb(masterConfig) < masterConfig->mNumRB) {
 		// 3GPP 25.331 10.3.4.10 RAB Information for Setup.
 		// TODO: AMR rate defaults to "t7" - what is that?
 		rbs.rab_InformationSetupList = RN_CALLOC(ASN::RAB_InformationSetupList);
@@ -1002,17 +1247,109 @@ bool sendRadioBearerSetup(UEInfo *uep, RrcMasterChConfig *masterConfig, PhCh *ph
 
 	// struct DL_InformationPerRL_List *dl_InformationPerRL_List   /* OPTIONAL */;
 	rbs.dl_InformationPerRL_List = phch->toAsnDL_InformationPerRL_List();
+}
+
+
+
+// Probes for the Radio Bearer Setup template.  The per-UE fields are the transaction id and the
+// uplink scrambling and downlink channelisation codes, which toAsnRadioBearerSetup takes from phch,
+// so we overwrite them in the asn structure.
+struct RadioBearerSetupBuilder : public AsnMsgTemplate::Builder
+{
+	RrcMasterChConfig *mConfig; PhCh *mPhCh; bool mSrbsToo, mIntegrity;
+	RadioBearerSetupBuilder(RrcMasterChConfig *config, PhCh *phch, bool srbstoo, bool integrity) :
+		mConfig(config), mPhCh(phch), mSrbsToo(srbstoo), mIntegrity(integrity) {}
+	bool encodeProbe(const uint32_t *values, unsigned variant, ByteVector &result) {
+		ASN::DL_DCCH_Message_t msg;
+		toAsnRadioBearerSetup(msg,mConfig,mPhCh,mSrbsToo,values[0]);
+		ASN::RadioBearerSetup_r3_IEs_t &rbs = msg.message.choice.radioBearerSetup.choice.r3.radioBearerSetup_r3;
+		rbs.ul_ChannelRequirement->choice.ul_DPCH_Info.modeSpecificInfo.choice.fdd.scramblingCode = values[1];
+		ASN::SF512_AndCodeNumber *sfcode = &rbs.dl_InformationPerRL_List->list.array[0]->dl_DPCH_InfoPerRL->
+			choice.fdd.dl_ChannelisationCodeList.list.array[0]->sf_AndCodeNumber;
+#define SETCODE(spf) case ASN::SF512_AndCodeNumber_PR_sf##spf: sfcode->choice.sf##spf = values[2]; break;
+		switch (sfcode->present) {
+			SETCODE(4) SETCODE(8) SETCODE(16) SETCODE(32) SETCODE(64) SETCODE(128) SETCODE(256) SETCODE(512)
+			default: return false;
+		}
+#undef SETCODE
+		if (mIntegrity) { toAsnIntegrityCheckInfo(&msg,values[3],values[4]); }
+		return uperEncodeToBV(&ASN::asn_DEF_DL_DCCH_Message,&msg,result,descrRadioBearerSetup);
+	}
+};
+
+// The part of the Radio Bearer Setup template key for the PDCP info, which rrcConfigPdcp sets per UE.
+static std::string pdcpTemplateKey(RrcMasterChConfig *masterConfig)
+{
+	std::string key;
+	for (unsigned rbid = 5; rbid < masterConfig->mNumRB; rbid++) {
+		RBInfo *rb = masterConfig->getRB(rbid);
+		if (rb->valid() && rb->mRfc2507) {
+			key += format(" hc%u=%u/%u/%u",rbid,rb->mMaxHeader,rb->mTcpSpace,rb->mNonTcpSpace);
+		}
+	}
+	return key;
+}
 
-		// note: encodeDcchMsg dumps the message to the log file.
-        //asn_fprint(stdout,&ASN::asn_DEF_DL_DCCH_Message, &msg);  // Dump it all.
-		//fflush(stdout);
+// Encode the Radio Bearer Setup for this UE into result, from a template if possible.
+// This runs the integrity protection, so it advances the RRC sequence number.
+bool encodeRadioBearerSetup(UEInfo *uep, RrcMasterChConfig *masterConfig, PhCh *phch, bool srbstoo,
+	unsigned transactionId, ByteVector &result, bool useTemplate, bool log)
+{
+	// The template key is everything that goes into the message except the per-UE fields.
+	// Configs that were not built by rrcConfigDchPS/CS have no key and are always encoded in full.
+	if (useTemplate && !masterConfig->mTemplateKey.empty() && phch->isDch()) {
+		bool ip = uep->integrity.isStarted();
+		std::string key = format("RadioBearerSetup %s%s sf=%u/%u pilot=%d punct=%d srbs=%d ip=%d dpch=%d cpich=%d psc=%d",
+			masterConfig->mTemplateKey.c_str(), pdcpTemplateKey(masterConfig).c_str(),
+			phch->getDlSF(), phch->getUlSF(), phch->getDlSlot()->mNPilot,
+			phch->getUlPuncturingLimit(), srbstoo, ip, (int)gConfig.getNum("UMTS.DPCHFrameOffset"),
+			(int)gConfig.getNum("UMTS.PCPICHUsageForChannelEst"), (int)gConfig.getNum("UMTS.Downlink.ScramblingCode"));
+		unsigned widths[5] = { 2, 24, phch->getDlSFLog2(), sIntegrityFieldWidths[0], sIntegrityFieldWidths[1] };
+		unsigned numFields = ip ? 5 : 3;
+		RadioBearerSetupBuilder builder(masterConfig,phch,srbstoo,ip);
+		const AsnMsgTemplate *tp = gRrcMsgTemplates.find(key,builder,numFields,widths);
+		uint32_t values[5] = { transactionId, phch->getSrCode(), phch->getSpCode(), 0, 0 };
+		if (tp && encodeDcchFromTemplate(uep,SRB2,tp,values,numFields,result)) {
+			if (log) {
+				std::string comment = format("DL_DCCH %s message size=%u",descrRadioBearerSetup.c_str(),(unsigned)result.size());
+				asnLogEncodedMsg(SRB2,&ASN::asn_DEF_DL_DCCH_Message,result,comment.c_str(),uep);
+			}
+			return true;
+		}
+	}
 
+	ASN::DL_DCCH_Message_t msg;
+	toAsnRadioBearerSetup(msg,masterConfig,phch,srbstoo,transactionId);
+	// note: encodeDcchMsg dumps the message to the log file.
+	//asn_fprint(stdout,&ASN::asn_DEF_DL_DCCH_Message, &msg);  // Dump it all.
+	//fflush(stdout);
+	return encodeDcchMsg(uep,SRB2,&msg,result,descrRadioBearerSetup,log);
+}
 
+// 3GPP 25.331 10.2.33
+// This is the main message to create DCH channels.
+// It is invoked by the SGSN to create a RAB for an internet connection.
+// It will also be invoked by GMM L3 to create CS connections.
+// In both cases a state machine in the caller must wait for the phones
+// response before proceeding.
+// 
+// We are sending a setup for a DCH and moving the UE to CELL_DCH state.
+// The masterConfig indicates the DCH L2 setup, for example, how many TrCh.
+// Return non-zero on error.
+
+// 这个函数与GGSN或SGSN有关。
+// 它是用于在SGSN或GMM L3中创建RAB（Radio Access Bearer）的主要消息，以便为Internet连接创建RAB。
+// RAB是数据传输的逻辑通道，它需要在GGSN和SGSN之间建立。因此，这个函数与GGSN和SGSN之间的通信有关。
+bool sendRadioBearerSetup(UEInfo *uep, RrcMasterChConfig *masterConfig, PhCh *phch, bool srbstoo)
+{
+	unsigned transactionId = uep->newTransactionId();
 	ByteVector result(1000);
-	if (!encodeDcchMsg(uep,SRB2,&msg,result,descrRadioBearerSetup)) {return 1;}
+	if (!encodeRadioBearerSetup(uep,masterConfig,phch,srbstoo,transactionId,result,true,true)) {return 1;}
 
         LOG(INFO) << "gNodeB: " << gNodeB.clock().get() << ", RadioBearerSetup: " << result;
 
+	unsigned rbid = firstDataRb(masterConfig);
+
 	// Prepare to receive the reply to this message:
 	UeTransaction(uep,UeTransaction::ttRadioBearerSetup, 1<<rbid, transactionId,stCELL_DCH);
 
@@ -1378,13 +1715,33 @@ void sendSecurityModeCommand(UEInfo *uep)
 		ASN::SecurityCapability__integrityProtectionAlgorithmCap_uia1,1,1); // FIXME: 10.3.3.7 of 25.331 doesn't follow this
 	}	
 
-	// Not doing ciphering
 	// struct CipheringModeInfo    *cipheringModeInfo  /* OPTIONAL */;
-        /*ASN::CipheringModeInfo *cmi = RN_CALLOC(ASN::CipheringModeInfo);
-        ies->cipheringModeInfo = cmi;
-	cmi->cipheringModeCommand.present = ASN::CipheringModeCommand_PR_startRestart;
-	cmi->cipheringModeCommand.choice.startRestart = toAsnEnumerated(ASN::CipheringAlgorithm_uea0);
-	*/
+	// 25.331 8.1.12.3: The activation time for the RLC-TM bearers is a CFN, and for each
+	// AM/UM bearer an RLC sequence number, both in the downlink direction; the UE gives us
+	// the uplink activation SNs in the SecurityModeComplete.
+	if (gConfig.getBool("UMTS.Ciphering")) {
+		ASN::CipheringModeInfo *cmi = RN_CALLOC(ASN::CipheringModeInfo);
+		ies->cipheringModeInfo = cmi;
+		cmi->cipheringModeCommand.present = ASN::CipheringModeCommand_PR_startRestart;
+		cmi->cipheringModeCommand.choice.startRestart = toAsnEnumerated(ASN::CipheringAlgorithm_uea1);
+		// Leave enough frames for the message to get to the UE.  The CFN assumes DPCH frame offset 0.
+		unsigned activationCfn = (gNodeB.clock().get().FN() + 32) & 0xff;
+		cmi->activationTimeForDPCH = RN_CALLOC(ASN::ActivationTime_t);
+		*cmi->activationTimeForDPCH = activationCfn;
+		cmi->rb_DL_CiphActivationTimeInfo = RN_CALLOC(ASN::RB_ActivationTimeInfoList);
+		RN_UE_FOR_ALL_RLC_DOWN(uep,rbid,rlcp) {
+			// The SecurityModeCommand itself goes on SRB2 so it must stay in the clear;
+			// push the activation point past it and anything else already queued.
+			if (rbid == 0) { continue; }	// SRB0 is on CCCH, which is never ciphered.
+			int sn = rlcp->rlcStartDlCiphering(rbid == SRB2 ? 16 : 0);
+			if (sn < 0) { continue; }	// RLC-TM, ciphered in MAC-d.
+			ASN::RB_ActivationTimeInfo *rbat = RN_CALLOC(ASN::RB_ActivationTimeInfo);
+			rbat->rb_Identity = rbid;
+			rbat->rlc_SequenceNumber = sn;
+			ASN_SEQUENCE_ADD(&cmi->rb_DL_CiphActivationTimeInfo->list,rbat);
+		}
+		uep->integrity.cipheringStart(activationCfn);
+	}
 
 	// Since we are setting up Integrity Protection (and not just ciphering)
 	// we need to include this optional IE.
@@ -1998,6 +2355,15 @@ void UEInfo::ueRecvDcchMessage(ByteVector &bv,unsigned rbNum)
 		transId = secmsg->rrc_TransactionIdentifier;
 		////handleSecurityModeComplete(uep,secmsg);
 		UeTransaction *tr = getTransaction(transId,ttSecurityModeCommand,"SecurityModeComplete");
+		if (secmsg->rb_UL_CiphActivationTimeInfo && uep->integrity.isCipheringStarted()) {
+			// Uplink ciphering starts at the RLC sequence numbers chosen by the UE.
+			ASN::RB_ActivationTimeInfoList *list = secmsg->rb_UL_CiphActivationTimeInfo;
+			for (int i = 0; i < list->list.count; i++) {
+				ASN::RB_ActivationTimeInfo *rbat = list->list.array[i];
+				URlcRecv *rlc = uep->getRlcUp(rbat->rb_Identity,uep->ueGetState());
+				if (rlc) { rlc->rlcStartUlCiphering(rbat->rlc_SequenceNumber); }
+			}
+		}
 		// The security mode was started when we sent the command, not when we receive the response,
 		// so there is nothing special to do here.  If we changed the Kc by re-running the Layer3
 		// Authentication procedure while a connection was running, then we would have to apply the
@@ -2035,6 +2401,31 @@ bool AsnUeId::eql(AsnUeId &other)
 	return true;
 }
 
+// FNV-1a over everything compared by eql(), so identical identities always have the same digest.
+static uint32_t digestBytes(uint32_t hash, const ByteType *cp, unsigned len)
+{
+	for (unsigned i = 0; i < len; i++) { hash = (hash ^ cp[i]) * 16777619u; }
+	return hash;
+}
+static uint32_t digestWord(uint32_t hash, uint32_t word)
+{
+	ByteType bytes[4] = { (ByteType)(word>>24), (ByteType)(word>>16), (ByteType)(word>>8), (ByteType)word };
+	return digestBytes(hash,bytes,4);
+}
+
+uint32_t AsnUeId::digest() const
+{
+	uint32_t hash = 2166136261u;
+	hash = digestWord(hash,idType);
+	hash = digestWord(hash,mImsi.size()); hash = digestBytes(hash,mImsi.begin(),mImsi.size());
+	hash = digestWord(hash,mImei.size()); hash = digestBytes(hash,mImei.begin(),mImei.size());
+	hash = digestWord(hash,mTmsiDS41.size()); hash = digestBytes(hash,mTmsiDS41.begin(),mTmsiDS41.size());
+	hash = digestWord(hash,mMcc); hash = digestWord(hash,mMnc);
+	hash = digestWord(hash,mTmsi); hash = digestWord(hash,mPtmsi); hash = digestWord(hash,mEsn);
+	hash = digestWord(hash,(mLac<<8) | mRac);
+	return hash;
+}
+
 
 /**
  * asnParse函数的功能是将ASN::InitialUE_Identity类型的参数解析为`AsnUeId`对象的各个字段，
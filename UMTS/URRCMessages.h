@@ -16,6 +16,7 @@
 #define URRCMESSAGES_H 1
 //#include "URRC.h"
 #include "ByteVector.h"
+#include <vector>
 
 #include "asn_system.h"	// Dont let other includes land in namespace ASN.
 namespace ASN {
@@ -23,6 +24,8 @@ namespace ASN {
 #include "InitialUE-Identity.h"
 };
 
+namespace GSM { class L3MobileIdentity; };
+
 namespace UMTS {
 class PhCh;
 class RrcMasterChConfig;
@@ -44,6 +47,22 @@ void sendRadioBearerRelease(UEInfo *uep, unsigned rabMask, bool finished);
 void sendRrcConnectionRelease(UEInfo *uep);
 void sendCellUpdateConfirm(UEInfo *uep);
 void sendSecurityModeCommand(UEInfo *uep);
+// These encode the messages sent during connection setup, patching the per-UE fields into a cached
+// encoding of the message if useTemplate, otherwise encoding the whole thing.  Exposed for rrctest msgbench.
+bool encodeRrcConnectionSetup(UEInfo *uep, ASN::InitialUE_Identity *ueInitialId, unsigned transactionId,
+	ByteVector &result, bool useTemplate, bool log);
+bool encodeRadioBearerSetup(UEInfo *uep, RrcMasterChConfig *masterConfig, PhCh *phch, bool srbstoo,
+	unsigned transactionId, ByteVector &result, bool useTemplate, bool log);
+
+// One UE to page in a Paging Type 1 message.
+struct PagingRecordInfo {
+	const GSM::L3MobileIdentity *mID;
+	bool mCall;		// Paging for a call, rather than for signalling such as SMS.
+	PagingRecordInfo(const GSM::L3MobileIdentity *wID, bool wCall) :mID(wID),mCall(wCall) {}
+};
+// Encode a Paging Type 1 PCCH message with records for pages[first...], as many as fit in maxBits.
+// Return the number of records in the message, 0 if not even one fits.
+unsigned encodePagingType1(const std::vector<PagingRecordInfo> &pages, unsigned first, unsigned maxBits, ByteVector &result);
 
 // The UE initially sends its identity in the RRC Connection Request Message.
 // We dont really care what it is, we just need to copy the exact
@@ -64,6 +83,8 @@ class AsnUeId {
 	AsnUeId(ASN::InitialUE_Identity &uid) { asnParse(uid); }
 	bool RaiMatches();
 	bool eql(AsnUeId &other);
+	bool defined() const { return idType != ASN::InitialUE_Identity_PR_NOTHING; }
+	uint32_t digest() const;	// Hash of all the fields compared by eql().
 	void asnParse(ASN::InitialUE_Identity &uid);
 };
 
@@ -401,12 +401,23 @@ struct URlcInfo 	// 10.3.4.23
 // 3GPP 24.331 10.3.4.2 PDCP Info.
 // It is most likely included in 10.3.4.18 RB Information to Reconfigure,
 // which is most likely included in 10.2.33 Radio Bearer Setup Message.
-// There does not need to be anything in this structure if we dont support compression.
+// The only header compression we support is RFC 2507, which needs the PDCP PDU header for the PID.
+// The SGSN PDCP entity for the RB is configured from this, so they must agree.
 struct PdcpInfo
 {
 	static const bool mSrnsSupport = false;
-	static const bool mPdcpPduHeader = false;	// absent;
-	static const unsigned mAlgorithmType = 0;	// No compression.
+	bool mPdcpPduHeader;	// present
+	bool mRfc2507;
+	// The RFC 2507 parameters of 10.3.4.2, defaulted as in the ASN.
+	unsigned mFMaxPeriod, mFMaxTime, mMaxHeader, mTcpSpace, mNonTcpSpace;
+
+	PdcpInfo() { pdcpConfigNone(); }
+	void pdcpConfigNone() {
+		mPdcpPduHeader = mRfc2507 = false;
+		mFMaxPeriod = 256; mFMaxTime = 5; mMaxHeader = 168; mTcpSpace = 15; mNonTcpSpace = 15;
+	}
+	// Turn on RFC 2507 with as many contexts as fit in the UE's context space, in bytes.
+	void pdcpConfigRfc2507(unsigned contextSpace);
 };
 
 
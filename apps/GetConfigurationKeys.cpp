@@ -122,6 +122,18 @@ ConfigurationKeyMap getConfigurationKeys()
 	map[tmp->getName()] = *tmp;
 	delete tmp;
 
+	tmp = new ConfigurationKey("Control.DCCH.Dispatchers","8",
+		"threads",
+		ConfigurationKey::CUSTOMERTUNE,
+		ConfigurationKey::VALRANGE,
+		"1:64",
+		true,
+		"Number of threads running L3 procedures (location updating, SMS, CM service) on the dedicated control channels.  "
+			"Each thread serves one UE at a time, so this many procedures can wait on the HLR or SIP at once."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
 	tmp = new ConfigurationKey("Control.LUR.AttachDetach","1",
 		"",
 		ConfigurationKey::CUSTOMER,
@@ -298,6 +310,31 @@ ConfigurationKeyMap getConfigurationKeys()
 	map[tmp->getName()] = *tmp;
 	delete tmp;
 
+	tmp = new ConfigurationKey("Control.Reporting.TMSITable.CacheMaxAge","604800",
+		"seconds",
+		ConfigurationKey::CUSTOMERTUNE,
+		ConfigurationKey::VALRANGE,
+		"3600:31536000",// 1 hour to 1 year
+		false,
+		"Subscribers not seen for this long are dropped from the in-memory copy of the TMSI table.  "
+			"They stay in the database and are reloaded when seen again."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Control.Reporting.TMSITable.CacheSize","100000",
+		"entries",
+		ConfigurationKey::CUSTOMERTUNE,
+		ConfigurationKey::VALRANGE,
+		"0:10000000",
+		true,
+		"Maximum number of TMSI table entries kept in memory, least recently seen dropped first.  "
+			"Cached lookups do not access the database and their access times are written in batches.  "
+			"0 disables the cache so every lookup reads and writes the database."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
 	tmp = new ConfigurationKey("Control.Reporting.TransactionTable","/var/run/OpenBTS-UMTS-TransactionTable.db",
 		"",
 		ConfigurationKey::CUSTOMERWARN,
@@ -309,6 +346,31 @@ ConfigurationKeyMap getConfigurationKeys()
 	map[tmp->getName()] = *tmp;
 	delete tmp;
 
+	tmp = new ConfigurationKey("Control.Reporting.TransactionTable.WriteBehind","1",
+		"",
+		ConfigurationKey::CUSTOMERTUNE,
+		ConfigurationKey::BOOLEAN,
+		"",
+		true,
+		"Write the transaction table database from a separate thread, merging queued updates to each transaction and committing them in batches.  "
+			"The database then lags the live table by a fraction of a second.  "
+			"If disabled, each state change is written before call processing continues."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("Control.Reporting.WAL","1",
+		"",
+		ConfigurationKey::CUSTOMERTUNE,
+		ConfigurationKey::BOOLEAN,
+		"",
+		true,
+		"Use write-ahead logging for the TMSI and transaction table databases, so that external readers do not block the BTS writing them.  "
+			"The configuration database is not affected."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
 	// TODO : this setting doesn't exist in C3.1, SMSCB incomplete: INSERT OR IGNORE INTO "CONFIG" VALUES('Control.SMSCB','1',0,1,'If not NULL, enable SMSCB.  If defined, ControlSMSCB.Table must also be defined.');
 	// TODO : no reference to this table yet, SMSCB incomplete: INSERT OR IGNORE INTO "CONFIG" VALUES('Control.SMSCB.Table','/var/run/OpenBTS-UMTS-SMSCB.db',1,1,'File path for SMSCB scheduling database.  Static.');
 
@@ -341,6 +403,19 @@ ConfigurationKeyMap getConfigurationKeys()
 	map[tmp->getName()] = *tmp;
 	delete tmp;
 
+	tmp = new ConfigurationKey("GGSN.Firewall.Block","",
+		"",
+		ConfigurationKey::CUSTOMERWARN,
+		ConfigurationKey::STRING_OPT,
+		"^[0-9./ ]+$",
+		false,
+		"Space-separated list of further IP addresses or ranges, like 203.0.113.0/24, that MS may not send to.  "
+			"Used when GGSN.Firewall.Enable is not 0.  "
+			"Takes effect on 'sgsn firewall reload'."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
 	tmp = new ConfigurationKey("GGSN.Firewall.Enable","1",
 		"",
 		ConfigurationKey::CUSTOMERWARN,
@@ -354,6 +429,45 @@ ConfigurationKeyMap getConfigurationKeys()
 	map[tmp->getName()] = *tmp;
 	delete tmp;
 
+	tmp = new ConfigurationKey("GGSN.IP.ClampTcpMss","0",
+		"bytes",
+		ConfigurationKey::CUSTOMERTUNE,
+		ConfigurationKey::VALRANGE,
+		"0:1460",
+		true,
+		"If not 0, the largest TCP maximum segment size the GGSN lets through in a TCP SYN, in either direction.  "
+			"A larger MSS option is lowered to this, so neither end sends segments that must be fragmented "
+			"on the way to or from the MS; set it to the MS IP MTU less 40, e.g. 1360.  "
+			"0 leaves the SYNs alone."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("GGSN.IP.DuplicateHistory","1024",
+		"packets",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"16:4096",
+		true,
+		"How many downlink TCP packets are remembered per connection to find duplicates.  "
+			"Rounded up to a power of 2."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("GGSN.IP.DuplicateTimeout","500",
+		"milliseconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"50:5000",
+		true,
+		"How long after a downlink TCP packet is first seen copies of it are counted as duplicates.  "
+			"Keep it short: once a packet has been lost beyond the GGSN, the server's retransmissions of it "
+			"are tossed until this runs out."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
 	tmp = new ConfigurationKey("GGSN.IP.MaxPacketSize","1520",
 		"bytes",
 		ConfigurationKey::DEVELOPER,
@@ -414,9 +528,10 @@ ConfigurationKeyMap getConfigurationKeys()
 		"addresses",
 		ConfigurationKey::CUSTOMERTUNE,
 		ConfigurationKey::VALRANGE,
-		"1:254",// educated guess
+		"1:65534",
 		true,
-		"Number of IP addresses to use for MS."
+		"Number of IP addresses to use for MS.  "
+			"They run up from GGSN.MS.IP.Base and are limited to those in GGSN.MS.IP.Route."
 	);
 	map[tmp->getName()] = *tmp;
 	delete tmp;
@@ -436,6 +551,45 @@ ConfigurationKeyMap getConfigurationKeys()
 	map[tmp->getName()] = *tmp;
 	delete tmp;
 
+	tmp = new ConfigurationKey("GGSN.Shaping.BurstTime","100",
+		"milliseconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"10:2000",
+		true,
+		"When GGSN.Shaping.Enable is set, how long a PDP context may send at more than its rate after being idle, "
+			"as time at its rate.  "
+			"The burst is at least one packet of GGSN.IP.MaxPacketSize."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("GGSN.Shaping.Enable","0",
+		"",
+		ConfigurationKey::CUSTOMERTUNE,
+		ConfigurationKey::BOOLEAN,
+		"",
+		true,
+		"Queue the downlink packets of each PDP context in the GGSN and send the queues in turn, "
+			"holding each PDP context to the peak throughput of its QoS in both directions.  "
+			"In UMTS the QoS then advertises the rate of the allocated RAB rather than the fixed maximum.  "
+			"Without this, uplink packets are still sent from the PDP contexts in turn but not rate limited, "
+			"and downlink packets go straight to the radio."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("GGSN.Shaping.QueueBytes","65536",
+		"bytes",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"4096:1048576",
+		true,
+		"How many bytes may wait in the GGSN for each PDP context in each direction before packets are dropped."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
 	tmp = new ConfigurationKey("GGSN.ShellScript","",
 		"",
 		ConfigurationKey::CUSTOMERTUNE,
@@ -461,6 +615,33 @@ ConfigurationKeyMap getConfigurationKeys()
 	map[tmp->getName()] = *tmp;
 	delete tmp;
 
+	tmp = new ConfigurationKey("GGSN.TunQueues","1",
+		"queues",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"1:16",
+		true,
+		"Number of queues the GGSN tunnel device is opened with, each read by its own thread.  "
+			"More than 1 opens the tunnel multi-queue so downlink packets are read on several cores; "
+			"a persistent tunnel created single-queue stays single-queue until it is deleted.  "
+			"Should not exceed the number of CPU cores."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("GGSN.TunWriteBatch","32",
+		"packets",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"1:256",
+		true,
+		"Most uplink packets the GGSN takes from its queues, checks and writes to the tunnel at once.  "
+			"A tunnel takes one packet per write, so when the kernel has io_uring a batch is submitted "
+			"with one system call; otherwise, or with 1, each packet is a write()."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
 	tmp = new ConfigurationKey("GPRS.Multislot.Max.Downlink","1",
 		"channels",
 		ConfigurationKey::CUSTOMERTUNE,
@@ -1229,12 +1410,26 @@ ConfigurationKeyMap getConfigurationKeys()
     	dsi2->cn_DRX_CycleLengthCoeff = gConfig.getNum("UMTS.CN-DSI.CycleLengthCoeff");        // FIXME -- What does this mean?!
 	*/
 	tmp = new ConfigurationKey("UMTS.CN-DSI.CycleLengthCoeff","6",//DEFAULT INLINE WAS 8
-		"????",
+		"",
 		ConfigurationKey::FACTORY,
 		ConfigurationKey::VALRANGE,
-		"0:100",//??????
+		"6:9",
 		false,
-		"Have no idea."
+		"CN domain specific DRX cycle length coefficient k, 3GPP 25.331 10.3.3.6.  "
+			"Idle phones read the PCH once every 2^k radio frames, in a paging occasion computed from the IMSI, 3GPP 25.304 8.3.  "
+			"The pager sends each paging request only in the paging occasions of that phone."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("UMTS.Ciphering","0",
+		"",
+		ConfigurationKey::CUSTOMERWARN,
+		ConfigurationKey::BOOLEAN,
+		"",
+		false,
+		"Enable UEA1 (KASUMI f8) ciphering of the radio bearers in the Security Mode Command.  "
+			"Integrity protection is always on; this only controls ciphering."
 	);
 	map[tmp->getName()] = *tmp;
 	delete tmp;
@@ -1403,6 +1598,20 @@ ConfigurationKeyMap getConfigurationKeys()
 	map[tmp->getName()] = *tmp;
 	delete tmp;
 
+	tmp = new ConfigurationKey("UMTS.PDCP.HeaderCompression","0",
+		"",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::BOOLEAN,
+		"",
+		false,
+		"Experimental, and has no effect yet.  "
+			"Use RFC 2507 TCP/IP and UDP/IP header compression in the PDCP of PS radio bearers, for UEs that support it.  "
+			"RFC 2507 is not negotiated with the UE until the SGSN PDCP is told the radio bearer configuration, "
+			"so radio bearers are set up without compression whatever this says."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
 	tmp = new ConfigurationKey("UMTS.PICH.PICH-PowerOffset","-10",// DEFAULT INLINE WAS 0
 		"dB",
 		ConfigurationKey::FACTORY,
@@ -1611,6 +1820,53 @@ ConfigurationKeyMap getConfigurationKeys()
 	map[tmp->getName()] = *tmp;
 	delete tmp;
 
+	tmp = new ConfigurationKey("UMTS.RLC.AQM","0",
+		"",
+		ConfigurationKey::CUSTOMERTUNE,
+		ConfigurationKey::BOOLEAN,
+		"",
+		false,
+		"Use CoDel active queue management on the RLC transmission buffer of user data radio bearers.  "
+			"SDUs that have waited in the buffer longer than UMTS.RLC.AQM.Target for a full UMTS.RLC.AQM.Interval are dropped, "
+			"which keeps bulk downloads from adding seconds of latency to interactive traffic on the same UE.  "
+			"Off by default, so the buffer behaves as it always has until this is turned on."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("UMTS.RLC.AQM.ECN","0",
+		"",
+		ConfigurationKey::CUSTOMERTUNE,
+		ConfigurationKey::BOOLEAN,
+		"",
+		false,
+		"When the RLC active queue management would drop an ECN-capable IP packet, mark it Congestion Experienced instead."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("UMTS.RLC.AQM.Interval","500",
+		"milliseconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"100:5000(10)",
+		false,
+		"The RLC queue delay must stay above UMTS.RLC.AQM.Target for this long before the active queue management starts dropping."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
+	tmp = new ConfigurationKey("UMTS.RLC.AQM.Target","50",
+		"milliseconds",
+		ConfigurationKey::DEVELOPER,
+		ConfigurationKey::VALRANGE,
+		"5:1000(5)",
+		false,
+		"Acceptable standing queue delay in the RLC transmission buffer for the active queue management."
+	);
+	map[tmp->getName()] = *tmp;
+	delete tmp;
+
 	tmp = new ConfigurationKey("UMTS.RLC.TransmissionBufferSize","1000000", // used sql default, hardcoded fallback was 10000
 		"bytes",
 		ConfigurationKey::FACTORY,
@@ -213,8 +213,7 @@ int main(int argc, char *argv[])
 		//
 		// Configure the radio.
 		//
-		Thread DCCHControlThread;
-		DCCHControlThread.start((void *(*)(void *))Control::DCCHDispatcher, NULL);
+		Control::DCCHDispatcherStart();
 
 		// Set up the interface to the radio.
 		// Get a handle to the C0 transceiver interface.